@@ -0,0 +1,861 @@
+#define _DEFAULT_SOURCE // MSG_DONTWAIT
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "sham.h"
+
+// Benchmark suite: runs client and server ends in one process over loopback
+// and writes one CSV row per scenario and parameter combination. Loss and
+// round-trip time come from the impairment emulator: each end loses
+// incoming datagrams at the loss rate and delays outgoing ones by half the
+// round trip, drawing from --seed so a rerun sees the same losses.
+
+#define BENCH_PORT 47000      // Server port
+#define BENCH_CHUNK (64 * 1024) // Bytes per send or receive call
+// A run with no progress this long fails. It outlasts the retries of a
+// connection backing off to SHAM_MAX_RTO_MS, so the protocol reports its own
+// failures and a connection still recovering is not counted as failed.
+#define BENCH_STALL_MS ((long)SHAM_MAX_RTO_MS * (SHAM_MAX_RETRIES + 1))
+#define MAX_SWEEP 16          // Values per swept parameter
+#define MAX_CLIENTS 64        // Upper bound for --clients
+
+// What to run (command line)
+static double g_losses[MAX_SWEEP] = {0.0, 0.01, 0.05};
+static int g_loss_count = 3;
+static double g_rtts[MAX_SWEEP] = {0, 20};
+static int g_rtt_count = 2;
+static double g_windows[MAX_SWEEP] = {SHAM_WINDOW_SIZE, 64};
+static int g_window_count = 2;
+static double g_client_counts[MAX_SWEEP] = {1, 4, 16};
+static int g_client_count = 3;
+static uint64_t g_bulk_bytes = 8 * 1024 * 1024;
+static uint64_t g_scale_bytes = 1024 * 1024; // Per client
+static int g_messages = 200;
+static int g_message_size = 64;
+static int g_handshakes = 50;
+static int g_port = BENCH_PORT;
+static uint64_t g_seed = 1;
+static int g_fec = 0; // Parity block size for senders (sham_set_fec)
+
+// One combination of the swept parameters
+struct bench_params
+{
+    double loss;
+    int rtt_ms;
+    int window;
+    int clients;
+};
+
+struct bench_result
+{
+    int ok;             // Operations completed: connections, messages or handshakes
+    int failed;
+    uint64_t bytes;     // Payload the receiving end got
+    double seconds;
+    long *samples_us;   // Per-operation latency, for the latency scenarios
+    int sample_count;
+    uint64_t retransmits; // Sending ends' counters, summed
+    uint64_t fast_retransmits;
+    uint64_t timeouts;
+};
+
+// State shared between a scenario's client side and its server thread
+struct bench_run
+{
+    const struct bench_params *params;
+    struct sham_connection *listener;
+    struct bench_result *result;
+    int expected; // Connections the server serves before it stops
+    volatile bool stop;
+};
+
+// Impair conn as the run asks. The server's connections take their seeds
+// from the listener's; a client's is set apart from theirs by its index.
+static int bench_impair(struct sham_connection *conn, const struct bench_params *params, uint64_t seed)
+{
+    struct sham_netem_config in;
+    struct sham_netem_config out;
+
+    memset(&in, 0, sizeof(in));
+    memset(&out, 0, sizeof(out));
+    in.loss = params->loss;
+    out.delay_ms = params->rtt_ms / 2;
+    return (sham_netem_seed(conn, seed) < 0 || sham_netem_set(conn, SHAM_NETEM_IN, &in) < 0 ||
+            sham_netem_set(conn, SHAM_NETEM_OUT, &out) < 0)
+               ? -1
+               : 0;
+}
+
+// Listening end with the run's impairments and window. A polling listener
+// serves its connections side by side.
+static struct sham_connection *bench_listen(const struct bench_params *params, bool bulk, bool polling)
+{
+    struct sham_connection *conn = sham_create_connection();
+
+    if (!conn)
+    {
+        return NULL;
+    }
+    conn->offload = bulk;
+    if (polling)
+    {
+        conn->recv_timeout_ms = 0;
+    }
+    if (bench_impair(conn, params, g_seed) < 0 || sham_set_window_slots(conn, params->window, params->window) < 0 ||
+        sham_listen(conn, g_port) < 0)
+    {
+        sham_free_connection(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+// Connecting end; index numbers the connections of a run
+static struct sham_connection *bench_connect(const struct bench_params *params, bool bulk, int index)
+{
+    struct sham_connection *conn = sham_create_connection();
+
+    if (!conn)
+    {
+        return NULL;
+    }
+    conn->offload = bulk;
+    if (bench_impair(conn, params, g_seed + ((uint64_t)(index + 1) << 32)) < 0 || sham_set_fec(conn, g_fec) < 0 ||
+        sham_set_window_slots(conn, params->window, params->window) < 0 ||
+        sham_connect(conn, "127.0.0.1", g_port) < 0)
+    {
+        sham_free_connection(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+static void add_sender_stats(struct bench_result *result, struct sham_connection *conn)
+{
+    struct sham_stats stats;
+
+    sham_get_stats(conn, &stats);
+    result->retransmits += stats.retransmits;
+    result->fast_retransmits += stats.fast_retransmits;
+    result->timeouts += stats.timeouts;
+}
+
+// Wait for the next client of a blocking listener; NULL once the run stops
+static struct sham_connection *bench_accept(struct bench_run *run)
+{
+    struct sham_connection *listener = run->listener;
+
+    while (!run->stop)
+    {
+        fd_set read_fds;
+        struct timeval tick = {0, 10000};
+        int held_ms = sham_next_timeout_ms(listener);
+
+        // A SYN the emulator is delaying is due no later than this
+        if (held_ms >= 0 && held_ms < 10)
+        {
+            tick.tv_usec = held_ms * 1000;
+        }
+
+        // A SYN routed here while the last connection was being served
+        // is already off the socket
+        FD_ZERO(&read_fds);
+        FD_SET(listener->sockfd, &read_fds);
+        if (!sham_has_pending_packets(listener) && select(listener->sockfd + 1, &read_fds, NULL, NULL, &tick) <= 0)
+        {
+            continue;
+        }
+
+        // Late datagrams of a finished connection go to its backlog, not here
+        sham_demux_dispatch(listener);
+        while (sham_has_pending_packets(listener))
+        {
+            struct sham_connection *conn = sham_accept(listener);
+            if (conn)
+            {
+                return conn;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Read until the peer's FIN, counting bytes, and close
+static void bench_drain(struct sham_connection *conn, struct bench_result *result, bool echo)
+{
+    static uint8_t buffer[BENCH_CHUNK]; // Only the server thread reads
+    long last_ms = sham_get_time_ms();
+
+    while (conn->state != SHAM_CLOSE_WAIT && sham_get_time_ms() - last_ms < BENCH_STALL_MS)
+    {
+        int n = sham_recv(conn, buffer, echo ? (size_t)g_message_size : sizeof(buffer));
+        if (n < 0)
+        {
+            break;
+        }
+        if (n == 0)
+        {
+            continue;
+        }
+        last_ms = sham_get_time_ms();
+        if (result)
+        {
+            result->bytes += (uint64_t)n;
+        }
+        if (echo && sham_send(conn, buffer, (size_t)n) < 0)
+        {
+            break;
+        }
+    }
+    sham_close(conn);
+    sham_free_connection(conn);
+}
+
+static void *bulk_server(void *arg)
+{
+    struct bench_run *run = arg;
+    struct sham_connection *conn = bench_accept(run);
+
+    if (conn)
+    {
+        bench_drain(conn, run->result, false);
+    }
+    return NULL;
+}
+
+static void *echo_server(void *arg)
+{
+    struct bench_run *run = arg;
+    struct sham_connection *conn = bench_accept(run);
+
+    if (conn)
+    {
+        bench_drain(conn, NULL, true);
+    }
+    return NULL;
+}
+
+// Accept and close connections until the run stops
+static void *handshake_server(void *arg)
+{
+    struct bench_run *run = arg;
+    struct sham_connection *conn;
+
+    while ((conn = bench_accept(run)) != NULL)
+    {
+        bench_drain(conn, NULL, false);
+    }
+    return NULL;
+}
+
+// Payload for every sender; filled once in main
+static uint8_t g_pattern[BENCH_CHUNK];
+
+// Send len bytes of the pattern without waiting for each write's ACKs
+static int send_pattern(struct sham_connection *conn, uint64_t len)
+{
+    uint64_t sent = 0;
+
+    while (sent < len)
+    {
+        size_t chunk = (len - sent > sizeof(g_pattern)) ? sizeof(g_pattern) : (size_t)(len - sent);
+        int n = sham_send_stream(conn, g_pattern, chunk);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        sent += (uint64_t)n;
+    }
+    return 0;
+}
+
+// One connection streaming g_bulk_bytes
+static void run_bulk(struct bench_run *run)
+{
+    struct bench_result *result = run->result;
+    struct sham_connection *conn = bench_connect(run->params, true, 0);
+
+    if (!conn)
+    {
+        result->failed++;
+        return;
+    }
+    if (send_pattern(conn, g_bulk_bytes) < 0 || sham_close(conn) < 0)
+    {
+        result->failed++;
+    }
+    else
+    {
+        result->ok++;
+    }
+    add_sender_stats(result, conn);
+    sham_free_connection(conn);
+}
+
+// Chat-style round trips: a small message and its echo, one at a time
+static void run_latency(struct bench_run *run)
+{
+    struct bench_result *result = run->result;
+    struct sham_connection *conn = bench_connect(run->params, false, 0);
+    uint8_t *message = calloc(1, (size_t)g_message_size);
+    int i;
+
+    if (!conn || !message)
+    {
+        result->failed++;
+        free(message);
+        if (conn)
+        {
+            sham_free_connection(conn);
+        }
+        return;
+    }
+
+    for (i = 0; i < g_messages; i++)
+    {
+        uint64_t start_us = sham_now_us();
+        int got = 0;
+
+        if (sham_send(conn, message, (size_t)g_message_size) != g_message_size)
+        {
+            break;
+        }
+
+        // A read can come back empty while the echo is retransmitted
+        while (got < g_message_size && sham_elapsed_us(start_us) < BENCH_STALL_MS * 1000L)
+        {
+            int n = sham_recv(conn, message + got, (size_t)(g_message_size - got));
+            if (n < 0 || (n == 0 && conn->state != SHAM_ESTABLISHED))
+            {
+                break;
+            }
+            got += n;
+        }
+        if (got < g_message_size)
+        {
+            break;
+        }
+        result->samples_us[result->sample_count++] = sham_elapsed_us(start_us);
+        result->bytes += (uint64_t)g_message_size;
+        result->ok++;
+    }
+    result->failed += g_messages - result->ok;
+
+    sham_close(conn);
+    add_sender_stats(result, conn);
+    sham_free_connection(conn);
+    free(message);
+}
+
+// Connection setup and teardown, one after another. Teardown includes the
+// TIME_WAIT sham_close spends as the end that closes first.
+static void run_handshake(struct bench_run *run)
+{
+    struct bench_result *result = run->result;
+    int i;
+
+    for (i = 0; i < g_handshakes; i++)
+    {
+        uint64_t start_us = sham_now_us();
+        struct sham_connection *conn = bench_connect(run->params, false, i);
+
+        if (!conn)
+        {
+            result->failed++;
+            continue;
+        }
+        if (sham_close(conn) < 0)
+        {
+            result->failed++;
+        }
+        else
+        {
+            result->samples_us[result->sample_count++] = sham_elapsed_us(start_us);
+            result->ok++;
+        }
+        sham_free_connection(conn);
+    }
+}
+
+// A connection being served by scale_server
+struct scale_conn
+{
+    struct sham_connection *conn;
+    bool closing;
+};
+
+// Serve every client on the polling listener at once, as the file server does
+static void *scale_server(void *arg)
+{
+    struct bench_run *run = arg;
+    struct sham_connection *listener = run->listener;
+    struct scale_conn conns[MAX_CLIENTS];
+    static uint8_t buffer[BENCH_CHUNK];
+    long last_ms = sham_get_time_ms();
+    int served = 0;
+    int count = 0;
+    int i;
+
+    while (served < run->expected && !run->stop && sham_get_time_ms() - last_ms < BENCH_STALL_MS)
+    {
+        bool pending = false;
+        int wait_ms = 10;
+
+        for (i = 0; i < count && !pending; i++)
+        {
+            int timer_ms = sham_next_timeout_ms(conns[i].conn);
+
+            pending = sham_has_pending_packets(conns[i].conn);
+            if (timer_ms >= 0 && timer_ms < wait_ms)
+            {
+                wait_ms = timer_ms;
+            }
+        }
+        if (!pending)
+        {
+            fd_set read_fds;
+            struct timeval tick = {0, wait_ms * 1000};
+
+            FD_ZERO(&read_fds);
+            FD_SET(listener->sockfd, &read_fds);
+            select(listener->sockfd + 1, &read_fds, NULL, NULL, &tick);
+        }
+        sham_demux_dispatch(listener);
+
+        while (sham_has_pending_packets(listener))
+        {
+            struct sham_connection *conn = sham_accept(listener);
+            if (!conn)
+            {
+                continue;
+            }
+            if (count == MAX_CLIENTS)
+            {
+                sham_free_connection(conn);
+                continue;
+            }
+            conns[count].conn = conn;
+            conns[count++].closing = false;
+        }
+
+        for (i = 0; i < count;)
+        {
+            struct scale_conn *c = &conns[i];
+
+            if (!c->closing)
+            {
+                int n;
+
+                while ((n = sham_read(c->conn, buffer, sizeof(buffer))) > 0)
+                {
+                    run->result->bytes += (uint64_t)n;
+                    last_ms = sham_get_time_ms();
+                }
+
+                // End of stream, or the connection failed
+                c->closing = (n == 0 || errno != EAGAIN);
+            }
+
+            if (!c->closing || (sham_close(c->conn) < 0 && errno == EAGAIN))
+            {
+                i++;
+                continue;
+            }
+            sham_free_connection(c->conn);
+            conns[i] = conns[--count];
+            served++;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        sham_free_connection(conns[i].conn);
+    }
+    return NULL;
+}
+
+struct scale_client
+{
+    const struct bench_params *params;
+    int index;
+    struct bench_result result;
+    pthread_t thread;
+};
+
+static void *scale_client_main(void *arg)
+{
+    struct scale_client *client = arg;
+    struct sham_connection *conn = bench_connect(client->params, true, client->index);
+
+    if (!conn)
+    {
+        client->result.failed++;
+        return NULL;
+    }
+    if (send_pattern(conn, g_scale_bytes) < 0 || sham_close(conn) < 0)
+    {
+        client->result.failed++;
+    }
+    else
+    {
+        client->result.ok++;
+    }
+    add_sender_stats(&client->result, conn);
+    sham_free_connection(conn);
+    return NULL;
+}
+
+// Several clients uploading to one server thread at once
+static void run_scale(struct bench_run *run)
+{
+    struct scale_client clients[MAX_CLIENTS];
+    int started;
+    int i;
+
+    memset(clients, 0, sizeof(clients));
+    for (started = 0; started < run->params->clients; started++)
+    {
+        clients[started].params = run->params;
+        clients[started].index = started;
+        if (pthread_create(&clients[started].thread, NULL, scale_client_main, &clients[started]) != 0)
+        {
+            break;
+        }
+    }
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        run->result->ok += clients[i].result.ok;
+        run->result->failed += clients[i].result.failed;
+        run->result->retransmits += clients[i].result.retransmits;
+        run->result->fast_retransmits += clients[i].result.fast_retransmits;
+        run->result->timeouts += clients[i].result.timeouts;
+    }
+    run->result->failed += run->params->clients - started;
+}
+
+struct scenario
+{
+    const char *name;
+    bool bulk;       // Offload on, as for file transfers
+    bool polling;    // Server serves several connections from one thread
+    bool per_client; // Swept over --clients as well
+    void *(*server)(void *arg);
+    void (*client)(struct bench_run *run);
+};
+
+static const struct scenario g_scenarios[] = {
+    {"bulk", true, false, false, bulk_server, run_bulk},
+    {"latency", false, false, false, echo_server, run_latency},
+    {"handshake", false, false, false, handshake_server, run_handshake},
+    {"scale", true, true, true, scale_server, run_scale},
+};
+#define SCENARIO_COUNT (int)(sizeof(g_scenarios) / sizeof(g_scenarios[0]))
+static bool g_enabled[SCENARIO_COUNT] = {true, true, true, true};
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static long percentile(const long *sorted, int count, int pct)
+{
+    return count > 0 ? sorted[(count - 1) * pct / 100] : 0;
+}
+
+static void write_header(FILE *out)
+{
+    fprintf(out, "scenario,loss,rtt_ms,window,clients,ok,failed,bytes,seconds,mbps,ops_per_sec,"
+                 "mean_us,p50_us,p99_us,retransmits,fast_retransmits,timeouts\n");
+    fflush(out);
+}
+
+static void write_row(FILE *out, const struct scenario *scenario, const struct bench_params *params,
+                      struct bench_result *result)
+{
+    double mbps = result->seconds > 0 ? (double)result->bytes * 8 / result->seconds / 1e6 : 0;
+    double ops = result->seconds > 0 ? result->ok / result->seconds : 0;
+    double mean_us = 0;
+    int i;
+
+    qsort(result->samples_us, (size_t)result->sample_count, sizeof(long), compare_long);
+    for (i = 0; i < result->sample_count; i++)
+    {
+        mean_us += (double)result->samples_us[i] / result->sample_count;
+    }
+
+    fprintf(out, "%s,%.4f,%d,%d,%d,%d,%d,%llu,%.6f,%.3f,%.3f,%.1f,%ld,%ld,%llu,%llu,%llu\n", scenario->name,
+            params->loss, params->rtt_ms, params->window, params->clients, result->ok, result->failed,
+            (unsigned long long)result->bytes, result->seconds, mbps, ops, mean_us,
+            percentile(result->samples_us, result->sample_count, 50),
+            percentile(result->samples_us, result->sample_count, 99), (unsigned long long)result->retransmits,
+            (unsigned long long)result->fast_retransmits, (unsigned long long)result->timeouts);
+    fflush(out);
+
+    fprintf(stderr, "%-9s loss=%.3f rtt=%dms window=%d clients=%d: ok=%d failed=%d %.2f Mbit/s p50=%ldus\n",
+            scenario->name, params->loss, params->rtt_ms, params->window, params->clients, result->ok,
+            result->failed, mbps, percentile(result->samples_us, result->sample_count, 50));
+}
+
+// Run one scenario with one set of parameters and report it
+static int run_scenario(FILE *out, const struct scenario *scenario, const struct bench_params *params)
+{
+    struct bench_result result;
+    struct bench_run run;
+    pthread_t server;
+    int samples = (g_messages > g_handshakes) ? g_messages : g_handshakes;
+    uint64_t start_us;
+
+    memset(&result, 0, sizeof(result));
+    memset(&run, 0, sizeof(run));
+    result.samples_us = calloc((size_t)samples, sizeof(long));
+    run.params = params;
+    run.result = &result;
+    run.expected = params->clients;
+
+    // The server is listening before any client starts
+    run.listener = bench_listen(params, scenario->bulk, scenario->polling);
+    if (!result.samples_us || !run.listener)
+    {
+        fprintf(stderr, "Cannot listen on port %d\n", g_port);
+        free(result.samples_us);
+        if (run.listener)
+        {
+            sham_free_connection(run.listener);
+        }
+        return -1;
+    }
+    if (pthread_create(&server, NULL, scenario->server, &run) != 0)
+    {
+        free(result.samples_us);
+        sham_free_connection(run.listener);
+        return -1;
+    }
+
+    start_us = sham_now_us();
+    scenario->client(&run);
+
+    // A server still waiting on a client that never came stops here
+    if (!scenario->polling)
+    {
+        run.stop = true;
+    }
+    pthread_join(server, NULL);
+    result.seconds = (double)sham_elapsed_us(start_us) / 1e6;
+
+    sham_free_connection(run.listener);
+
+    write_row(out, scenario, params, &result);
+    free(result.samples_us);
+    return 0;
+}
+
+// Comma-separated numbers into values; returns how many, or -1
+static int parse_list(const char *text, double *values, double min, double max)
+{
+    int count = 0;
+
+    while (*text)
+    {
+        char *end;
+        double value = strtod(text, &end);
+
+        if (end == text || value < min || value > max || count == MAX_SWEEP || (*end && *end != ','))
+        {
+            return -1;
+        }
+        values[count++] = value;
+        text = *end ? end + 1 : end;
+    }
+    return count > 0 ? count : -1;
+}
+
+static int parse_scenarios(const char *text)
+{
+    char copy[256];
+    char *name;
+    int i;
+
+    snprintf(copy, sizeof(copy), "%s", text);
+    for (i = 0; i < SCENARIO_COUNT; i++)
+    {
+        g_enabled[i] = false;
+    }
+    for (name = strtok(copy, ","); name; name = strtok(NULL, ","))
+    {
+        for (i = 0; i < SCENARIO_COUNT && strcmp(name, g_scenarios[i].name) != 0; i++)
+        {
+        }
+        if (i == SCENARIO_COUNT)
+        {
+            return -1;
+        }
+        g_enabled[i] = true;
+    }
+    return 0;
+}
+
+static void print_usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --out FILE          CSV results (default stdout)\n"
+            "  --scenarios LIST    bulk,latency,handshake,scale (default all)\n"
+            "  --loss LIST         Loss rates to sweep (default 0,0.01,0.05)\n"
+            "  --rtt LIST          Round-trip times in ms (default 0,20)\n"
+            "  --window LIST       Window sizes in segments (default %d,64)\n"
+            "  --clients LIST      Concurrent clients for scale (default 1,4,16)\n"
+            "  --bytes N           Bytes per bulk transfer (default %llu)\n"
+            "  --scale-bytes N     Bytes per scale client (default %llu)\n"
+            "  --messages N        Round trips per latency run (default %d)\n"
+            "  --message-size N    Bytes per message (default %d)\n"
+            "  --handshakes N      Connections per handshake run (default %d)\n"
+            "  --port N            Server port (default %d)\n"
+            "  --seed N            Seed for the emulated losses and delays (default 1)\n"
+            "  --fec K             Parity after every K segments, or auto (default 0, none)\n",
+            prog, SHAM_WINDOW_SIZE, (unsigned long long)g_bulk_bytes, (unsigned long long)g_scale_bytes,
+            g_messages, g_message_size, g_handshakes, BENCH_PORT);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *out_path = NULL;
+    FILE *out = stdout;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        int ok = value != NULL;
+
+        if (ok && strcmp(argv[i], "--out") == 0)
+        {
+            out_path = value;
+        }
+        else if (ok && strcmp(argv[i], "--scenarios") == 0)
+        {
+            ok = parse_scenarios(value) == 0;
+        }
+        else if (ok && strcmp(argv[i], "--loss") == 0)
+        {
+            ok = (g_loss_count = parse_list(value, g_losses, 0.0, 1.0)) > 0;
+        }
+        else if (ok && strcmp(argv[i], "--rtt") == 0)
+        {
+            ok = (g_rtt_count = parse_list(value, g_rtts, 0, 10000)) > 0;
+        }
+        else if (ok && strcmp(argv[i], "--window") == 0)
+        {
+            ok = (g_window_count = parse_list(value, g_windows, 1, SHAM_MAX_WINDOW_SLOTS)) > 0;
+        }
+        else if (ok && strcmp(argv[i], "--clients") == 0)
+        {
+            ok = (g_client_count = parse_list(value, g_client_counts, 1, MAX_CLIENTS)) > 0;
+        }
+        else if (ok && strcmp(argv[i], "--bytes") == 0)
+        {
+            g_bulk_bytes = strtoull(value, NULL, 10);
+        }
+        else if (ok && strcmp(argv[i], "--scale-bytes") == 0)
+        {
+            g_scale_bytes = strtoull(value, NULL, 10);
+        }
+        else if (ok && strcmp(argv[i], "--messages") == 0)
+        {
+            ok = (g_messages = atoi(value)) > 0;
+        }
+        else if (ok && strcmp(argv[i], "--message-size") == 0)
+        {
+            g_message_size = atoi(value);
+            ok = g_message_size > 0 && g_message_size <= BENCH_CHUNK;
+        }
+        else if (ok && strcmp(argv[i], "--handshakes") == 0)
+        {
+            ok = (g_handshakes = atoi(value)) > 0;
+        }
+        else if (ok && strcmp(argv[i], "--port") == 0)
+        {
+            g_port = atoi(value);
+            ok = g_port > 0 && g_port < 65535;
+        }
+        else if (ok && strcmp(argv[i], "--seed") == 0)
+        {
+            g_seed = strtoull(value, NULL, 0);
+        }
+        else if (ok && strcmp(argv[i], "--fec") == 0)
+        {
+            ok = sham_fec_parse(value, &g_fec) == 0;
+        }
+        else
+        {
+            ok = 0;
+        }
+
+        if (!ok)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+
+    if (out_path)
+    {
+        out = fopen(out_path, "w");
+        if (!out)
+        {
+            perror(out_path);
+            return 1;
+        }
+    }
+    write_header(out);
+    memset(g_pattern, 0xa5, sizeof(g_pattern));
+
+    for (i = 0; i < SCENARIO_COUNT; i++)
+    {
+        const struct scenario *scenario = &g_scenarios[i];
+        int l, r, w, c;
+
+        if (!g_enabled[i])
+        {
+            continue;
+        }
+        for (l = 0; l < g_loss_count; l++)
+        {
+            for (r = 0; r < g_rtt_count; r++)
+            {
+                for (w = 0; w < g_window_count; w++)
+                {
+                    for (c = 0; c < (scenario->per_client ? g_client_count : 1); c++)
+                    {
+                        struct bench_params params;
+
+                        params.loss = g_losses[l];
+                        params.rtt_ms = (int)g_rtts[r];
+                        params.window = (int)g_windows[w];
+                        params.clients = scenario->per_client ? (int)g_client_counts[c] : 1;
+                        if (run_scenario(out, scenario, &params) < 0)
+                        {
+                            if (out != stdout)
+                            {
+                                fclose(out);
+                            }
+                            return 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return 0;
+}
@@ -2,51 +2,556 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/select.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "sham.h"
 
 #define BUFFER_SIZE 4096
+#define MAX_STRIPES 16 // Upper bound for --streams, the connections a file is striped across
+#define MAX_PREAMBLE (2 + 255) // Delta marker, filename length, filename
 
-// Global variables for packet loss simulation
+// Impairments emulated on each direction (loss rate argument, --netem-in,
+// --netem-out), drawn from --seed
+struct sham_netem_config g_netem[2];
+uint64_t g_seed = 1;
 
-float g_loss_rate = 0.0f;
+// Largest segment offered to the server (--mss)
+int g_mss = SHAM_DEFAULT_MSS;
+
+// Checksum sent after the file for the server to verify (--digest)
+int g_digest = SHAM_DIGEST_MD5;
+
+// Connections a file is striped across (--streams)
+int g_streams = 1;
+
+// Send only the blocks the server's copy lacks (--delta)
+bool g_delta = false;
+
+// Compress file data for servers that can expand it (--compress)
+int g_compress = SHAM_COMPRESS_NONE;
+
+// Send every file named over one connection, a multiplexed stream each (--mux)
+bool g_mux = false;
+
+// Parity after every this many segments, or SHAM_FEC_ADAPTIVE (--fec)
+int g_fec = 0;
+
+// Fast open cookies kept between runs, a line per server (--fastopen)
+const char *g_cookie_file = NULL;
+pthread_mutex_t g_cookie_lock = PTHREAD_MUTEX_INITIALIZER; // Stripes connect at once
+
+// Look up the fast open cookie a server issued us. Returns its length, 0 if none.
+size_t load_cookie(const char *server_ip, int server_port, uint8_t *cookie)
+{
+    char host[256];
+    char hex[2 * SHAM_FASTOPEN_COOKIE_LEN + 1];
+    int port;
+    size_t len = 0;
+    FILE *file;
+
+    pthread_mutex_lock(&g_cookie_lock);
+    file = fopen(g_cookie_file, "r");
+    while (file && len == 0 && fscanf(file, "%255s %d %16s", host, &port, hex) == 3)
+    {
+        if (strcmp(host, server_ip) != 0 || port != server_port || strlen(hex) != sizeof(hex) - 1)
+        {
+            continue;
+        }
+        for (len = 0; len < SHAM_FASTOPEN_COOKIE_LEN; len++)
+        {
+            if (sscanf(hex + 2 * len, "%2hhx", &cookie[len]) != 1)
+            {
+                break;
+            }
+        }
+        if (len < SHAM_FASTOPEN_COOKIE_LEN)
+        {
+            len = 0;
+        }
+    }
+    if (file)
+    {
+        fclose(file);
+    }
+    pthread_mutex_unlock(&g_cookie_lock);
+    return len;
+}
+
+// Record a server's cookie, replacing the line it had
+void save_cookie(const char *server_ip, int server_port, const uint8_t *cookie)
+{
+    char lines[64][300];
+    char host[256];
+    char hex[2 * SHAM_FASTOPEN_COOKIE_LEN + 1];
+    int count = 0;
+    int port;
+    int i;
+    FILE *file;
+
+    pthread_mutex_lock(&g_cookie_lock);
+    file = fopen(g_cookie_file, "r");
+    while (file && count < 63 && fscanf(file, "%255s %d %16s", host, &port, hex) == 3)
+    {
+        if (strcmp(host, server_ip) != 0 || port != server_port)
+        {
+            snprintf(lines[count++], sizeof(lines[0]), "%s %d %s\n", host, port, hex);
+        }
+    }
+    if (file)
+    {
+        fclose(file);
+    }
+
+    sham_digest_hex(cookie, SHAM_FASTOPEN_COOKIE_LEN, hex);
+    snprintf(lines[count++], sizeof(lines[0]), "%s %d %s\n", server_ip, server_port, hex);
+    file = fopen(g_cookie_file, "w");
+    if (!file)
+    {
+        perror("Failed to save fast open cookie");
+    }
+    for (i = 0; file && i < count; i++)
+    {
+        fputs(lines[i], file);
+    }
+    if (file)
+    {
+        fclose(file);
+    }
+    pthread_mutex_unlock(&g_cookie_lock);
+}
+
+// Create a connection with the command-line options and connect it,
+// sending the preamble (in the SYN if we hold a fast open cookie).
+// Connections of one run draw their impairments from seeds in index order.
+struct sham_connection *open_connection(const char *server_ip, int server_port, bool chat_mode, FILE *verbose_log,
+                                        int index, const uint8_t *preamble, size_t preamble_len)
+{
+    uint8_t cookie[SHAM_FASTOPEN_COOKIE_LEN];
+    size_t cookie_len = 0;
+
+    struct sham_connection *conn = sham_create_connection();
+    if (!conn)
+    {
+        fprintf(stderr, "Failed to create connection\n");
+        return NULL;
+    }
+
+    // Emulated network conditions
+    sham_netem_seed(conn, g_seed + (uint64_t)index);
+    sham_netem_set(conn, SHAM_NETEM_IN, &g_netem[SHAM_NETEM_IN]);
+    sham_netem_set(conn, SHAM_NETEM_OUT, &g_netem[SHAM_NETEM_OUT]);
+    sham_set_mss(conn, (uint32_t)g_mss);
+    conn->file_digest = g_digest;
+    conn->file_compress = g_compress;
+    conn->streams_enabled = g_mux;
+    sham_set_fec(conn, g_fec);
+
+    // Chat lines go out as typed rather than wait to fill a segment
+    conn->nodelay = chat_mode;
+
+    // File transfers are bulk; let the kernel segment and coalesce datagrams
+    conn->offload = !chat_mode;
+    conn->verbose_log_file = verbose_log;
+
+    // Present the cookie this server gave us last time, or ask for one
+    if (g_cookie_file)
+    {
+        cookie_len = load_cookie(server_ip, server_port, cookie);
+        sham_fastopen_set_cookie(conn, cookie_len > 0 ? cookie : NULL, cookie_len);
+    }
+
+    // Connect to server
+    if (sham_connect_data(conn, server_ip, server_port, preamble, preamble_len) < 0)
+    {
+        fprintf(stderr, "Failed to connect to server\n");
+        conn->verbose_log_file = NULL;
+        sham_free_connection(conn);
+        return NULL;
+    }
+
+    // Keep a cookie the server issued for the next run
+    if (g_cookie_file)
+    {
+        uint8_t issued[SHAM_FASTOPEN_COOKIE_LEN];
+
+        if (sham_fastopen_get_cookie(conn, issued) == SHAM_FASTOPEN_COOKIE_LEN &&
+            (cookie_len == 0 || memcmp(issued, cookie, SHAM_FASTOPEN_COOKIE_LEN) != 0))
+        {
+            save_cookie(server_ip, server_port, issued);
+        }
+    }
+    return conn;
+}
+
+// The upload preamble: the filename length (1 byte) and the output
+// filename. A 0 length byte ahead of it asks the server for its manifest.
+// It goes out with the connection, so it can ride in the SYN. Returns its
+// length, or 0 if the name cannot be sent.
+size_t build_preamble(const char *output_file, bool delta, uint8_t *preamble)
+{
+    size_t name_len = strlen(output_file);
+    size_t len = 0;
+
+    if (name_len == 0 || name_len > 255)
+    {
+        fprintf(stderr, "Filename empty or too long (max 255 bytes)\n");
+        return 0;
+    }
+
+    if (delta)
+    {
+        preamble[len++] = 0;
+    }
+    preamble[len++] = (uint8_t)name_len;
+    memcpy(preamble + len, output_file, name_len);
+    return len + name_len;
+}
+
+// Send the file (or just one stripe of it) after the preamble
+int send_upload(struct sham_connection *conn, const char *input_file, const struct sham_stripe *stripe)
+{
+    // Send the file content, or just the blocks the server's copy lacks
+    int result;
+    if (g_delta && !stripe)
+    {
+        struct sham_manifest manifest;
+
+        result = sham_manifest_recv(&manifest, conn);
+        if (result == 0)
+        {
+            result = sham_send_file_delta(conn, input_file, &manifest);
+            sham_manifest_free(&manifest);
+        }
+    }
+    else
+    {
+        result = sham_send_file_stripe(conn, input_file, stripe);
+    }
+    if (result < 0)
+    {
+        fprintf(stderr, "Failed to send file\n");
+        return -1;
+    }
+
+    return 0;
+}
 
 int run_file_transfer_mode(struct sham_connection *conn, const char *input_file, const char *output_file)
 {
     printf("\n=== S.H.A.M. File Transfer Mode ===\n");
     printf("Sending file '%s' to be saved as '%s' on server\n", input_file, output_file);
 
-    // First, send the filename length (1 byte)
-    uint8_t filename_len = (uint8_t)strlen(output_file);
-    if (filename_len != strlen(output_file))
+    return send_upload(conn, input_file, NULL);
+}
+
+// One connection of a striped upload
+struct stripe_sender
+{
+    pthread_t thread;
+    const char *server_ip;
+    int server_port;
+    const char *input_file;
+    const char *output_file;
+    struct sham_stripe stripe;
+    FILE *verbose_log;
+    int result;
+};
+
+void *stripe_sender_main(void *arg)
+{
+    struct stripe_sender *s = arg;
+    uint8_t preamble[MAX_PREAMBLE];
+    size_t preamble_len = build_preamble(s->output_file, false, preamble);
+    struct sham_connection *conn = NULL;
+
+    if (preamble_len > 0)
     {
-        fprintf(stderr, "Filename too long (max 255 bytes)\n");
-        return -1;
+        conn = open_connection(s->server_ip, s->server_port, false, s->verbose_log, s->stripe.index, preamble,
+                               preamble_len);
     }
 
-    if (sham_send(conn, &filename_len, 1) != 1)
+    s->result = -1;
+    if (conn)
     {
-        fprintf(stderr, "Failed to send filename length to server\n");
-        return -1;
+        s->result = send_upload(conn, s->input_file, &s->stripe);
+        sham_close(conn);
+        conn->verbose_log_file = NULL;
+        sham_free_connection(conn);
     }
+    return NULL;
+}
+
+// Id the server groups this upload's stripes by
+static uint64_t new_stripe_id(void)
+{
+    uint64_t id = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
 
-    // Then send the output filename to server
-    int sent = sham_send(conn, output_file, strlen(output_file));
-    if (sent < 0)
+    if (fd < 0 || read(fd, &id, sizeof(id)) != (ssize_t)sizeof(id))
     {
-        fprintf(stderr, "Failed to send filename to server\n");
-        return -1;
+        id = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
     }
+    return id;
+}
 
-    // Send the file content
-    int result = sham_send_file(conn, input_file);
-    if (result < 0)
+// Send a file over g_streams connections at once, each carrying an equal
+// range of it; a single congestion window no longer caps the transfer
+int run_striped_transfer(const char *server_ip, int server_port, const char *input_file, const char *output_file)
+{
+    struct stripe_sender senders[MAX_STRIPES];
+    FILE *verbose_log = sham_open_verbose_log("client");
+    uint64_t id = new_stripe_id();
+    uint64_t share;
+    struct stat st;
+    int started = 0;
+    int result = 0;
+    int i;
+
+    printf("\n=== S.H.A.M. File Transfer Mode ===\n");
+    printf("Sending file '%s' to be saved as '%s' on server over %d connections\n", input_file, output_file,
+           g_streams);
+
+    if (stat(input_file, &st) < 0)
     {
-        fprintf(stderr, "Failed to send file\n");
+        perror("Failed to open file");
+        if (verbose_log)
+        {
+            sham_close_verbose_log(verbose_log);
+        }
         return -1;
     }
+    share = (uint64_t)st.st_size / (uint64_t)g_streams;
+
+    for (i = 0; i < g_streams; i++)
+    {
+        struct stripe_sender *s = &senders[i];
+
+        s->server_ip = server_ip;
+        s->server_port = server_port;
+        s->input_file = input_file;
+        s->output_file = output_file;
+        s->stripe.id = id;
+        s->stripe.index = (uint16_t)i;
+        s->stripe.count = (uint16_t)g_streams;
+        s->stripe.offset = share * (uint64_t)i;
+        // The last stripe takes the remainder
+        s->stripe.length = (i == g_streams - 1) ? (uint64_t)st.st_size - s->stripe.offset : share;
+        s->verbose_log = verbose_log;
+        if (pthread_create(&s->thread, NULL, stripe_sender_main, s) != 0)
+        {
+            fprintf(stderr, "Failed to start stripe %d\n", i);
+            result = -1;
+            break;
+        }
+        started++;
+    }
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(senders[i].thread, NULL);
+        if (senders[i].result < 0)
+        {
+            fprintf(stderr, "Stripe %d failed\n", i);
+            result = -1;
+        }
+    }
+
+    if (verbose_log)
+    {
+        sham_close_verbose_log(verbose_log);
+    }
+    return result;
+}
+
+// One file of a multiplexed upload: its preamble and then its bytes on a
+// stream of its own. The server's FIN on the stream confirms the file.
+struct mux_upload
+{
+    const char *input_file;
+    const char *output_file;
+    int fd;
+    int id;
+    uint8_t chunk[SHAM_STREAM_FRAME_MAX]; // Read from the file, not yet taken by the stream
+    size_t chunk_len;
+    size_t chunk_sent;
+    bool read_done; // The file is read to its end
+    bool shut;      // Our FIN is queued
+    bool finished;
+    bool ok;
+};
+
+// Give an upload its next frame's worth. Returns true if anything moved.
+static bool mux_upload_step(struct sham_mux *mux, struct mux_upload *u)
+{
+    uint8_t reply[64];
+    int n;
+
+    if (!u->read_done && u->chunk_sent == u->chunk_len)
+    {
+        ssize_t r = read(u->fd, u->chunk, sizeof(u->chunk));
+        if (r < 0)
+        {
+            perror("Failed to read file");
+            u->finished = true;
+            sham_stream_close(mux, (uint32_t)u->id);
+            return true;
+        }
+        u->read_done = (r == 0);
+        u->chunk_len = (size_t)r;
+        u->chunk_sent = 0;
+    }
+
+    if (u->chunk_sent < u->chunk_len)
+    {
+        n = sham_stream_write(mux, (uint32_t)u->id, u->chunk + u->chunk_sent, u->chunk_len - u->chunk_sent);
+        if (n > 0)
+        {
+            u->chunk_sent += (size_t)n;
+            return true;
+        }
+    }
+    else if (!u->shut)
+    {
+        n = sham_stream_shutdown(mux, (uint32_t)u->id);
+        u->shut = true;
+        return true;
+    }
+    else
+    {
+        n = sham_stream_read(mux, (uint32_t)u->id, reply, sizeof(reply));
+        if (n == 0)
+        {
+            printf("Sent '%s' as '%s' on stream %d\n", u->input_file, u->output_file, u->id);
+            u->ok = true;
+            u->finished = true;
+            sham_stream_close(mux, (uint32_t)u->id);
+            return true;
+        }
+    }
+
+    if (n < 0 && errno != EAGAIN)
+    {
+        fprintf(stderr, "Failed to send '%s': %s\n", u->input_file, strerror(errno));
+        u->finished = true;
+        sham_stream_close(mux, (uint32_t)u->id);
+        return true;
+    }
+    return false;
+}
+
+// Send several files over one connection at once (--mux): each rides a
+// stream of its own, taking turns a frame at a time, so a file the server
+// is slow to take holds up none of the others
+int run_mux_transfer(struct sham_connection *conn, char **files, int count)
+{
+    struct mux_upload *uploads = calloc((size_t)count, sizeof(*uploads));
+    struct sham_mux *mux = sham_mux_create(conn, true);
+    struct sham_poller *poller = sham_poller_create();
+    int remaining = 0;
+    int failed = 0;
+    int i;
+
+    printf("\n=== S.H.A.M. File Transfer Mode ===\n");
+    printf("Sending %d files over one connection\n", count);
+
+    if (!uploads || !mux || !poller || sham_poller_add(poller, conn, -1, SHAM_POLLIN) < 0)
+    {
+        fprintf(stderr, "Failed to set up multiplexed streams\n");
+        count = 0;
+        failed = 1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        struct mux_upload *u = &uploads[i];
+
+        u->input_file = files[2 * i];
+        u->output_file = files[2 * i + 1];
+        u->fd = open(u->input_file, O_RDONLY);
+        u->chunk_len = build_preamble(u->output_file, false, u->chunk);
+        u->id = (u->fd >= 0 && u->chunk_len > 0) ? sham_stream_open(mux) : -1;
+        if (u->id < 0)
+        {
+            fprintf(stderr, "Failed to start '%s'\n", u->input_file);
+            u->finished = true;
+            continue;
+        }
+        remaining++;
+    }
+
+    while (remaining > 0)
+    {
+        bool progress = false;
+
+        if (sham_mux_service(mux) < 0)
+        {
+            fprintf(stderr, "Connection failed\n");
+            break;
+        }
+
+        remaining = 0;
+        for (i = 0; i < count; i++)
+        {
+            if (!uploads[i].finished)
+            {
+                progress = mux_upload_step(mux, &uploads[i]) || progress;
+                remaining += !uploads[i].finished;
+            }
+        }
+
+        // Wait for the peer's frames, or for room to send ours
+        if (remaining > 0 && !progress)
+        {
+            struct sham_poll_event event;
+
+            sham_poller_modify(poller, conn, -1, sham_mux_pending(mux) > 0 ? SHAM_POLLIN | SHAM_POLLOUT : SHAM_POLLIN);
+            if (sham_poll(poller, &event, 1, -1) < 0 && errno != EINTR)
+            {
+                perror("sham_poll error");
+                break;
+            }
+        }
+    }
+
+    // Whatever stays queued goes out before sham_close's FIN
+    while (mux && sham_mux_pending(mux) > 0 && sham_mux_service(mux) == 0)
+    {
+        sham_flush(conn);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        failed += !uploads[i].ok;
+        if (uploads[i].fd >= 0)
+        {
+            close(uploads[i].fd);
+        }
+    }
+    sham_poller_free(poller);
+    sham_mux_free(mux);
+    free(uploads);
+    return failed ? -1 : 0;
+}
 
+// Queue as much pending output as the window takes; -1 if the connection failed
+static int send_pending(struct sham_connection *conn, char *out, size_t *out_len)
+{
+    while (*out_len > 0)
+    {
+        int sent = sham_write(conn, out, *out_len);
+        if (sent < 0)
+        {
+            return (errno == EAGAIN) ? 0 : -1;
+        }
+        memmove(out, out + sent, *out_len - (size_t)sent);
+        *out_len -= (size_t)sent;
+    }
     return 0;
 }
 
@@ -57,36 +562,50 @@ int run_chat_mode(struct sham_connection *conn)
 
     char buffer[BUFFER_SIZE];
     char input_buffer[BUFFER_SIZE];
-
-    while (1)
+    char output[BUFFER_SIZE]; // Typed but not yet taken by the send window
+    size_t output_len = 0;
+    bool quitting = false;
+    bool stdin_open = true;
+    bool done = false;
+
+    // One event loop for stdin and the connection; retransmissions run
+    // from its timer while we wait for either
+    struct sham_poller *poller = sham_poller_create();
+    if (!poller || sham_poller_add(poller, conn, -1, SHAM_POLLIN) < 0 ||
+        sham_poller_add(poller, NULL, STDIN_FILENO, SHAM_POLLIN) < 0)
     {
-        fd_set read_fds;
-        int max_fd;
-
-        FD_ZERO(&read_fds);
-        FD_SET(STDIN_FILENO, &read_fds); // stdin
-        FD_SET(conn->sockfd, &read_fds); // socket
-
-        max_fd = (STDIN_FILENO > conn->sockfd) ? STDIN_FILENO : conn->sockfd;
-
-        // Use select to monitor both stdin and socket
+        perror("chat poller");
+        sham_poller_free(poller);
+        return -1;
+    }
 
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+    while (!done)
+    {
+        struct sham_poll_event events[2];
+        int n = sham_poll(poller, events, 2, -1);
+        int i;
 
-        if (activity < 0)
+        if (n < 0)
         {
             if (errno == EINTR)
                 continue; // Interrupted by signal
-            perror("select error");
+            perror("sham_poll error");
             break;
         }
 
-        // Check if there's input from stdin
-
-        if (FD_ISSET(STDIN_FILENO, &read_fds))
+        for (i = 0; i < n && !done; i++)
         {
-            if (fgets(input_buffer, sizeof(input_buffer), stdin) != NULL)
+            // Check if there's input from stdin
+            if (!events[i].conn)
             {
+                if (fgets(input_buffer, sizeof(input_buffer), stdin) == NULL)
+                {
+                    // End of input; keep receiving until the server leaves
+                    sham_poller_remove(poller, NULL, STDIN_FILENO);
+                    stdin_open = false;
+                    continue;
+                }
+
                 // Remove newline
                 input_buffer[strcspn(input_buffer, "\n")] = 0;
 
@@ -94,40 +613,66 @@ int run_chat_mode(struct sham_connection *conn)
                 {
                     printf("[CHAT] Initiating chat termination...\n");
                     // Send /quit to server to trigger FIN handshake
-                    sham_send(conn, "/quit", strlen("/quit"));
-                    return 0;
+                    strcpy(output, "/quit");
+                    output_len = strlen(output);
+                    quitting = true;
                 }
-
-                if (strlen(input_buffer) > 0)
+                else if (strlen(input_buffer) > 0)
                 {
                     printf("[YOU]: %s\n", input_buffer);
-
-                    // Send message to server
-                    int sent = sham_send(conn, input_buffer, strlen(input_buffer));
-                    if (sent < 0)
-                    {
-                        fprintf(stderr, "Failed to send message to server\n");
-                        break;
-                    }
+                    output_len = strlen(input_buffer);
+                    memcpy(output, input_buffer, output_len);
                 }
+                continue;
             }
-        }
 
-        // Check if there's data from the socket
-        if (FD_ISSET(conn->sockfd, &read_fds))
-        {
-            int received = sham_recv(conn, buffer, sizeof(buffer) - 1);
-            if (received <= 0)
+            if (events[i].revents & SHAM_POLLERR)
             {
                 printf("[CHAT] Server disconnected\n");
-                break;
+                done = true;
+                continue;
             }
 
-            buffer[received] = '\0';
-            printf("[Server]: %s\n", buffer);
+            // Check if there's data from the socket
+            if (events[i].revents & SHAM_POLLIN)
+            {
+                int received = sham_read(conn, buffer, sizeof(buffer) - 1);
+                if (received < 0 && errno == EAGAIN)
+                {
+                    continue;
+                }
+                if (received <= 0)
+                {
+                    printf("[CHAT] Server disconnected\n");
+                    done = true;
+                    continue;
+                }
+
+                buffer[received] = '\0';
+                printf("[Server]: %s\n", buffer);
+            }
+        }
+
+        // Send what the window takes; the rest goes out on SHAM_POLLOUT
+        if (!done && send_pending(conn, output, &output_len) < 0)
+        {
+            fprintf(stderr, "Failed to send message to server\n");
+            break;
+        }
+        if (quitting && output_len == 0)
+        {
+            break;
+        }
+
+        // Stdin waits while a message is still queued
+        sham_poller_modify(poller, conn, -1, output_len > 0 ? SHAM_POLLIN | SHAM_POLLOUT : SHAM_POLLIN);
+        if (stdin_open)
+        {
+            sham_poller_modify(poller, NULL, STDIN_FILENO, output_len > 0 ? 0 : SHAM_POLLIN);
         }
     }
 
+    sham_poller_free(poller);
     return 0;
 }
 
@@ -145,11 +690,130 @@ int main(int argc, char *argv[])
     const char *input_file = NULL;
     const char *output_file = NULL;
 
+    // --mss, --digest, --compress, --streams, --delta, --mux, --fec,
+    // --netem-in, --netem-out, --seed and --fastopen may appear anywhere;
+    // take them out before the positional arguments
+    {
+        int i = 1;
+        while (i < argc)
+        {
+            int taken = 2;
+
+            if (strcmp(argv[i], "--delta") == 0)
+            {
+                g_delta = true;
+                taken = 1;
+            }
+            else if (strcmp(argv[i], "--mux") == 0)
+            {
+                g_mux = true;
+                taken = 1;
+            }
+            else if (i + 1 == argc)
+            {
+                break;
+            }
+            else if (strcmp(argv[i], "--mss") == 0)
+            {
+                g_mss = atoi(argv[i + 1]);
+                if (g_mss < SHAM_MIN_MSS || g_mss > SHAM_MAX_MSS)
+                {
+                    fprintf(stderr, "Invalid segment size: %s (must be %d-%d)\n", argv[i + 1], SHAM_MIN_MSS, SHAM_MAX_MSS);
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "--digest") == 0)
+            {
+                g_digest = sham_digest_parse(argv[i + 1]);
+                if (g_digest < 0)
+                {
+                    fprintf(stderr, "Invalid digest: %s (must be md5, sha256, crc32c or none)\n", argv[i + 1]);
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "--compress") == 0)
+            {
+                g_compress = sham_compress_parse(argv[i + 1]);
+                if (g_compress < 0)
+                {
+                    fprintf(stderr, "Invalid compression: %s (must be deflate or none)\n", argv[i + 1]);
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "--netem-in") == 0 || strcmp(argv[i], "--netem-out") == 0)
+            {
+                int dir = (strcmp(argv[i], "--netem-in") == 0) ? SHAM_NETEM_IN : SHAM_NETEM_OUT;
+                if (sham_netem_parse(argv[i + 1], &g_netem[dir]) < 0)
+                {
+                    fprintf(stderr, "Invalid impairment: %s (e.g. loss=0.01,delay=20,jitter=5,rate=10M)\n", argv[i + 1]);
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "--seed") == 0)
+            {
+                g_seed = strtoull(argv[i + 1], NULL, 0);
+            }
+            else if (strcmp(argv[i], "--fastopen") == 0)
+            {
+                g_cookie_file = argv[i + 1];
+            }
+            else if (strcmp(argv[i], "--fec") == 0)
+            {
+                if (sham_fec_parse(argv[i + 1], &g_fec) < 0)
+                {
+                    fprintf(stderr, "Invalid FEC block size: %s (must be 0-%d or auto)\n", argv[i + 1], SHAM_FEC_MAX_K);
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "--streams") == 0)
+            {
+                g_streams = atoi(argv[i + 1]);
+                if (g_streams < 1 || g_streams > MAX_STRIPES)
+                {
+                    fprintf(stderr, "Invalid stripe count: %s (connections, must be 1-%d)\n", argv[i + 1],
+                            MAX_STRIPES);
+                    return 1;
+                }
+            }
+            else
+            {
+                i++;
+                continue;
+            }
+            memmove(&argv[i], &argv[i + taken], (size_t)(argc - i - taken + 1) * sizeof(argv[0]));
+            argc -= taken;
+        }
+        if (argc < 3)
+        {
+            return 1;
+        }
+    }
+
     server_ip = argv[1];
     server_port = atoi(argv[2]);
 
     // Parse command line arguments
-    if (argc >= 4)
+    if (g_mux)
+    {
+        // Pairs of input file and output file name, a multiplexed stream each
+        if (argc < 5 || (argc - 3) % 2 != 0)
+        {
+            fprintf(stderr, "--mux takes pairs of input_file and output_file_name\n");
+            return 1;
+        }
+        if ((argc - 3) / 2 > SHAM_MAX_STREAMS)
+        {
+            fprintf(stderr, "--mux sends at most %d files, one multiplexed stream each\n", SHAM_MAX_STREAMS);
+            return 1;
+        }
+        if (g_delta || g_streams > 1)
+        {
+            fprintf(stderr, "--mux sends whole files as streams of one connection; drop --delta, and --streams "
+                            "(striping over several connections)\n");
+            return 1;
+        }
+    }
+    else if (argc >= 4)
     {
         if (strcmp(argv[3], "--chat") == 0)
         {
@@ -161,7 +825,7 @@ int main(int argc, char *argv[])
                 float loss_rate = atof(argv[4]);
                 if (loss_rate >= 0.0f && loss_rate <= 1.0f)
                 {
-                    g_loss_rate = loss_rate;
+                    g_netem[SHAM_NETEM_IN].loss = loss_rate;
                 }
                 else
                 {
@@ -189,7 +853,7 @@ int main(int argc, char *argv[])
                 float loss_rate = atof(argv[5]);
                 if (loss_rate >= 0.0f && loss_rate <= 1.0f)
                 {
-                    g_loss_rate = loss_rate;
+                    g_netem[SHAM_NETEM_IN].loss = loss_rate;
                 }
                 else
                 {
@@ -206,25 +870,35 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    // Create connection
-    struct sham_connection *conn = sham_create_connection();
-    if (!conn)
+    // A striped upload runs a connection per stripe
+    if (!chat_mode && g_streams > 1)
     {
-        fprintf(stderr, "Failed to create connection\n");
-        return 1;
+        if (g_delta)
+        {
+            fprintf(stderr, "--delta sends over one connection; drop --streams\n");
+            return 1;
+        }
+        return (run_striped_transfer(server_ip, server_port, input_file, output_file) < 0) ? 1 : 0;
     }
 
-    // Set loss rate for the connection
-    conn->loss_rate = g_loss_rate;
-
-    // Initialize verbose logging
-    conn->verbose_log_file = sham_open_verbose_log("client");
+    // The preamble goes with the connection; chat has none, and each stream
+    // of a multiplexed upload has its own
+    uint8_t preamble[MAX_PREAMBLE];
+    size_t preamble_len = 0;
+    if (!chat_mode && !g_mux)
+    {
+        preamble_len = build_preamble(output_file, g_delta, preamble);
+        if (preamble_len == 0)
+        {
+            return 1;
+        }
+    }
 
-    // Connect to server
-    if (sham_connect(conn, server_ip, server_port) < 0)
+    // Create connection, with verbose logging if enabled
+    struct sham_connection *conn = open_connection(server_ip, server_port, chat_mode, sham_open_verbose_log("client"), 0,
+                                                   preamble, preamble_len);
+    if (!conn)
     {
-        fprintf(stderr, "Failed to connect to server\n");
-        sham_free_connection(conn);
         return 1;
     }
 
@@ -235,6 +909,10 @@ int main(int argc, char *argv[])
     {
         result = run_chat_mode(conn);
     }
+    else if (g_mux)
+    {
+        result = run_mux_transfer(conn, &argv[3], (argc - 3) / 2);
+    }
     else
     {
         result = run_file_transfer_mode(conn, input_file, output_file);
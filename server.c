@@ -4,16 +4,64 @@
 #include <unistd.h>
 #include <sys/select.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include "sham.h"
 
 #define BUFFER_SIZE 4096
 #define DEFAULT_PORT 8080
+#define MAX_TRANSFERS 64     // Uploads served at once
+#define POLL_INTERVAL_MS 100 // Longest sleep between stall checks
+#define MAX_WORKERS 64       // Upper bound for --workers
 
-// Global variables for packet loss simulation
+// Impairments emulated on each direction (loss rate argument, --netem-in,
+// --netem-out), drawn from --seed
+struct sham_netem_config g_netem[2];
+uint64_t g_seed = 1;
 
-float g_loss_rate = 0.0f;
+// Largest segment offered to clients (--mss)
+int g_mss = SHAM_DEFAULT_MSS;
 
-// Calculate MD5 checksum of a file using modern OpenSSL EVP interface
+// Issue fast open cookies and take the upload preamble from the SYN (--fastopen)
+bool g_fastopen = false;
+
+// Bumped by SIGUSR1; every serving loop that sees it change dumps the
+// statistics of the connections it owns
+static volatile sig_atomic_t g_stats_requests = 0;
+
+static void request_stats(int sig)
+{
+    (void)sig;
+    g_stats_requests++;
+}
+
+// One line per connection on stderr, keeping stdout for checksums
+void print_stats(struct sham_connection *conn, const char *filename)
+{
+    struct sham_stats stats;
+    char addr[INET_ADDRSTRLEN];
+    char line[512];
+
+    sham_get_stats(conn, &stats);
+    sham_format_stats(&stats, line, sizeof(line));
+    inet_ntop(AF_INET, &conn->peer_addr.sin_addr, addr, sizeof(addr));
+    fprintf(stderr, "[STATS] peer=%s:%d file=%s %s\n", addr, ntohs(conn->peer_addr.sin_port),
+            (filename && filename[0]) ? filename : "-", line);
+}
+
+// Print a checksum in the required format, as one write so lines from
+// concurrent workers never interleave
+void print_digest(int type, const uint8_t *digest, size_t len)
+{
+    char hex[2 * SHAM_DIGEST_MAX_LEN + 1];
+
+    sham_digest_hex(digest, len, hex);
+    printf("%s: %s\n", sham_digest_name(type), hex);
+    fflush(stdout);
+}
+
+// Calculate MD5 checksum of a file using modern OpenSSL EVP interface; for
+// senders that send no digest of their own
 void calculate_file_md5(const char *filename)
 {
     FILE *file = fopen(filename, "rb");
@@ -67,48 +115,630 @@ void calculate_file_md5(const char *filename)
     EVP_MD_CTX_free(md_ctx);
     fclose(file);
 
-    // Print MD5 in the required format
-    unsigned int i;
-    printf("MD5: ");
-    for (i = 0; i < digest_len; i++)
+    print_digest(SHAM_DIGEST_MD5, digest, digest_len);
+}
+
+// Stripes of one upload still arriving. Workers may each get some of them,
+// so the table is shared and locked.
+struct stripe_group
+{
+    uint64_t id;
+    char filename[256];
+    unsigned finished;
+    bool failed;
+    struct stripe_group *next;
+};
+
+static struct stripe_group *g_stripe_groups = NULL;
+static pthread_mutex_t g_stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Record the end of one stripe of a striped upload. Returns true when it was
+// the last of them and all succeeded, so the whole file can be checked.
+bool stripe_finished(const struct sham_stripe *stripe, const char *filename, bool ok)
+{
+    struct stripe_group **link;
+    struct stripe_group *group;
+    bool complete = false;
+
+    pthread_mutex_lock(&g_stripe_lock);
+    for (link = &g_stripe_groups; *link; link = &(*link)->next)
     {
-        printf("%02x", digest[i]);
+        if ((*link)->id == stripe->id && strcmp((*link)->filename, filename) == 0)
+        {
+            break;
+        }
     }
-    printf("\n");
-    fflush(stdout);
+    group = *link;
+    if (!group)
+    {
+        group = calloc(1, sizeof(*group));
+        if (!group)
+        {
+            pthread_mutex_unlock(&g_stripe_lock);
+            return false;
+        }
+        group->id = stripe->id;
+        snprintf(group->filename, sizeof(group->filename), "%s", filename);
+        group->next = g_stripe_groups;
+        g_stripe_groups = group;
+        link = &g_stripe_groups;
+    }
+
+    group->finished++;
+    group->failed = group->failed || !ok;
+    if (group->finished >= stripe->count)
+    {
+        complete = !group->failed;
+        *link = group->next;
+        free(group);
+    }
+    pthread_mutex_unlock(&g_stripe_lock);
+    return complete;
 }
 
-int handle_file_transfer(struct sham_connection *conn)
+// An upload in progress: a 1-byte filename length, the filename, then the
+// file. A delta upload starts with a 0 length byte; we answer its filename
+// with the manifest of our copy, and the file comes as a run of stripes.
+struct transfer
 {
+    struct sham_connection *conn;
+    bool have_name_len;
+    uint8_t filename_len;
+    size_t name_received;
+    char filename[256];
+    bool delta;
+    bool sending_manifest;
+    struct sham_manifest manifest;
+    bool receiving_file;
+    struct sham_file_rx rx;
+    long started_ms;
+    bool closing; // File done (or failed); FIN exchange under way
+    // A multiplexed upload (SHAM_OPT_STREAMS): files on streams of their own
+    struct sham_mux *mux;
+    struct stream_upload *uploads[SHAM_MAX_STREAMS];
+    int upload_count;
+    long progress_ms; // When a stream last moved, for the no-progress timeout
+};
 
-    // First, receive the filename length (1 byte)
+// A file arriving on one stream: the preamble of a plain upload (length
+// byte and filename), then the file's bytes up to the stream's FIN. Our
+// FIN back says it is stored; a reset says it is not.
+struct stream_upload
+{
+    uint32_t id;
     uint8_t filename_len;
-    if (sham_recv(conn, &filename_len, 1) != 1)
+    size_t name_received; // Length byte included
+    char filename[256];
+    int fd;
+    struct sham_digest digest;
+};
+
+// Advance a transfer's upload with whatever has arrived. Returns 1 when the
+// file is complete, 0 while more is expected, or -1 on failure.
+int transfer_receive(struct transfer *t)
+{
+    int n;
+
+    if (!t->receiving_file)
+    {
+        if (!t->have_name_len)
+        {
+            n = sham_recv(t->conn, &t->filename_len, 1);
+            t->have_name_len = (n == 1);
+            if (t->have_name_len && t->filename_len == 0 && !t->delta)
+            {
+                t->delta = true;
+                t->have_name_len = false; // The real length follows
+            }
+        }
+        else
+        {
+            n = sham_recv(t->conn, t->filename + t->name_received, t->filename_len - t->name_received);
+            if (n > 0)
+            {
+                t->name_received += (size_t)n;
+            }
+        }
+
+        if (!t->have_name_len || t->name_received < t->filename_len)
+        {
+            // Give up on a client that never sends its header
+            return (sham_get_time_ms() - t->started_ms > SHAM_FILE_STALL_MS) ? -1 : 0;
+        }
+
+        // filename_len is uint8_t (0-255), so it always fits with its terminator
+        t->filename[t->filename_len] = '\0';
+        if (t->delta && sham_manifest_start(&t->manifest, t->filename) < 0)
+        {
+            return -1;
+        }
+        t->sending_manifest = t->delta;
+        sham_recv_file_start(&t->rx, t->conn, t->filename);
+        t->rx.in_place = t->delta;
+        t->receiving_file = true;
+    }
+
+    if (t->sending_manifest)
+    {
+        n = sham_manifest_continue(&t->manifest, t->conn);
+        if (n <= 0)
+        {
+            return n;
+        }
+        sham_manifest_free(&t->manifest);
+        t->sending_manifest = false;
+        t->rx.last_progress_ms = sham_get_time_ms();
+    }
+
+    n = sham_recv_file_continue(&t->rx);
+
+    // A delta upload's stripes come one after another on this connection
+    if (n > 0 && t->delta && t->rx.stripe.index + 1 < t->rx.stripe.count)
+    {
+        sham_recv_file_start(&t->rx, t->conn, t->filename);
+        t->rx.in_place = true;
+        return 0;
+    }
+    return n;
+}
+
+// Take what has arrived on one stream. Returns 1 when the file is stored,
+// 0 while more is expected, or -1 on failure.
+int stream_upload_receive(struct sham_mux *mux, struct stream_upload *u)
+{
+    uint8_t buffer[SHAM_STREAM_FRAME_MAX];
+    int n;
+
+    while ((n = sham_stream_read(mux, u->id, buffer, sizeof(buffer))) > 0)
+    {
+        const uint8_t *data = buffer;
+        size_t len = (size_t)n;
+
+        // The preamble comes first; the file is opened once it is in
+        while (len > 0 && (u->name_received == 0 || u->name_received <= u->filename_len))
+        {
+            if (u->name_received == 0)
+            {
+                u->filename_len = *data;
+            }
+            else
+            {
+                u->filename[u->name_received - 1] = (char)*data;
+            }
+            u->name_received++;
+            data++;
+            len--;
+
+            if (u->name_received == (size_t)u->filename_len + 1)
+            {
+                u->filename[u->filename_len] = '\0';
+                u->fd = (u->filename_len > 0) ? open(u->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+                if (u->fd < 0 || sham_digest_init(&u->digest, SHAM_DIGEST_MD5) < 0)
+                {
+                    fprintf(stderr, "Cannot store stream %u as '%s'\n", u->id, u->filename);
+                    return -1;
+                }
+            }
+        }
+
+        sham_digest_update(&u->digest, data, len);
+        while (len > 0)
+        {
+            ssize_t w = write(u->fd, data, len);
+            if (w < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                perror("Failed to write file");
+                return -1;
+            }
+            data += w;
+            len -= (size_t)w;
+        }
+    }
+
+    if (n < 0)
+    {
+        return (errno == EAGAIN) ? 0 : -1;
+    }
+
+    // The stream ended; the file is complete if its name was
+    if (u->fd < 0)
     {
         return -1;
     }
+    {
+        uint8_t digest[SHAM_DIGEST_MAX_LEN];
+        size_t digest_len = sham_digest_final(&u->digest, digest);
+
+        print_digest(SHAM_DIGEST_MD5, digest, digest_len);
+    }
+    return 1;
+}
 
-    // Then receive the filename of exact length
-    char filename[256];
-    // filename_len is uint8_t (0-255), sizeof(filename) is 256, so check is unnecessary
+void free_stream_upload(struct stream_upload *u)
+{
+    if (u->fd >= 0)
+    {
+        close(u->fd);
+        sham_digest_free(&u->digest);
+    }
+    free(u);
+}
 
-    int name_received = sham_recv(conn, filename, filename_len);
-    if (name_received != filename_len)
+// Advance a multiplexed upload: take new streams, and give every stream
+// what has arrived for it. Returns 1 once the client has closed the
+// connection with every file in, 0 while it is running, -1 on failure.
+int mux_transfer_receive(struct transfer *t)
+{
+    long now = sham_get_time_ms();
+    int i;
+
+    if (!t->mux)
+    {
+        t->mux = sham_mux_create(t->conn, false);
+        t->progress_ms = now;
+        if (!t->mux)
+        {
+            return -1;
+        }
+    }
+    if (sham_mux_service(t->mux) < 0)
     {
         return -1;
     }
-    filename[filename_len] = '\0';
 
-    // Receive the file
-    int result = sham_recv_file(conn, filename);
-    if (result < 0)
+    for (;;)
+    {
+        int id = sham_stream_accept(t->mux);
+        struct stream_upload *u;
+
+        if (id < 0)
+        {
+            break;
+        }
+        u = calloc(1, sizeof(*u));
+        if (!u)
+        {
+            sham_stream_close(t->mux, (uint32_t)id);
+            continue;
+        }
+        u->id = (uint32_t)id;
+        u->fd = -1;
+        t->uploads[t->upload_count++] = u;
+    }
+
+    for (i = 0; i < t->upload_count;)
+    {
+        struct stream_upload *u = t->uploads[i];
+        int result;
+
+        if (!sham_stream_readable(t->mux, u->id))
+        {
+            i++;
+            continue;
+        }
+        t->progress_ms = now;
+        result = stream_upload_receive(t->mux, u);
+        if (result == 0)
+        {
+            i++;
+            continue;
+        }
+
+        // Our FIN confirms the file; a reset refuses it
+        sham_stream_close(t->mux, u->id);
+        free_stream_upload(u);
+        t->uploads[i] = t->uploads[--t->upload_count];
+    }
+
+    // The client closes the connection once every file is confirmed
+    if (sham_mux_eof(t->mux))
+    {
+        return (t->upload_count == 0) ? 1 : -1;
+    }
+    if (sham_mux_service(t->mux) < 0)
     {
         return -1;
     }
+    return (now - t->progress_ms > SHAM_FILE_STALL_MS) ? -1 : 0;
+}
+
+// Advance a transfer. Returns 0 while it is running, or 1 once its
+// connection is closed and it can be freed.
+int transfer_step(struct transfer *t)
+{
+    if (!t->closing && t->conn->streams_ok)
+    {
+        if (mux_transfer_receive(t) == 0)
+        {
+            return 0;
+        }
+        t->closing = true;
+    }
 
-    // Calculate and print MD5 checksum
-    calculate_file_md5(filename);
+    if (!t->closing)
+    {
+        int result = transfer_receive(t);
+        if (result == 0)
+        {
+            return 0;
+        }
 
+        // A stripe's digest covers only its range; once the last stripe is
+        // in, read the whole file back for its MD5
+        if (t->delta)
+        {
+            if (result > 0)
+            {
+                calculate_file_md5(t->filename);
+            }
+        }
+        else if (t->rx.stripe.count > 1)
+        {
+            if (stripe_finished(&t->rx.stripe, t->filename, result > 0))
+            {
+                calculate_file_md5(t->filename);
+            }
+        }
+        // Print the checksum verified as the file came in, or MD5 of the
+        // file read back when the sender sent none
+        else if (result > 0)
+        {
+            if (t->rx.result_len > 0)
+            {
+                print_digest(t->rx.digest.type, t->rx.result, t->rx.result_len);
+            }
+            else
+            {
+                calculate_file_md5(t->filename);
+            }
+        }
+        t->closing = true;
+    }
+
+    // Close client connection; this connection polls, so it may take several steps
+    return (sham_close(t->conn) < 0 && errno == EAGAIN) ? 0 : 1;
+}
+
+void free_transfer(struct transfer *t)
+{
+    int i;
+
+    if (t->sending_manifest)
+    {
+        sham_manifest_free(&t->manifest);
+    }
+    for (i = 0; i < t->upload_count; i++)
+    {
+        free_stream_upload(t->uploads[i]);
+    }
+    sham_mux_free(t->mux);
+    t->conn->verbose_log_file = NULL;
+    sham_free_connection(t->conn);
+    free(t);
+}
+
+// Serve up to MAX_TRANSFERS uploads at once. Every client shares the listening
+// socket; each pass routes what has arrived and steps every transfer.
+void serve_transfers(struct sham_connection *listen_conn)
+{
+    struct transfer *transfers[MAX_TRANSFERS];
+    sig_atomic_t stats_seen = g_stats_requests;
+    int count = 0;
+    int i;
+
+    while (listen_conn->sockfd >= 0)
+    {
+        bool pending = false;
+        int wait_ms = POLL_INTERVAL_MS;
+
+        // Sleep until the socket is readable unless a backlog is waiting,
+        // waking for the earliest retransmission or delayed ACK
+        for (i = 0; i < count && !pending; i++)
+        {
+            int timer_ms = sham_next_timeout_ms(transfers[i]->conn);
+
+            pending = sham_has_pending_packets(transfers[i]->conn);
+            if (timer_ms >= 0 && timer_ms < wait_ms)
+            {
+                wait_ms = timer_ms;
+            }
+        }
+        if (!pending)
+        {
+            fd_set read_fds;
+            struct timeval tick = {wait_ms / 1000, (wait_ms % 1000) * 1000};
+
+            FD_ZERO(&read_fds);
+            FD_SET(listen_conn->sockfd, &read_fds);
+            if (select(listen_conn->sockfd + 1, &read_fds, NULL, NULL, &tick) < 0 && errno != EINTR)
+            {
+                perror("select error");
+                break;
+            }
+        }
+
+        if (sham_demux_dispatch(listen_conn) < 0 && listen_conn->sockfd < 0)
+        {
+            break;
+        }
+
+        if (g_stats_requests != stats_seen)
+        {
+            stats_seen = g_stats_requests;
+            for (i = 0; i < count; i++)
+            {
+                print_stats(transfers[i]->conn, transfers[i]->filename);
+            }
+        }
+
+        // New clients: SYNs from unknown peers wait on the listener
+        while (sham_has_pending_packets(listen_conn))
+        {
+            struct sham_connection *client_conn = sham_accept(listen_conn);
+            if (!client_conn)
+            {
+                continue;
+            }
+
+            struct transfer *t = (count < MAX_TRANSFERS) ? calloc(1, sizeof(*t)) : NULL;
+            if (!t)
+            {
+                fprintf(stderr, "Too many transfers, dropping client\n");
+                client_conn->verbose_log_file = NULL;
+                sham_free_connection(client_conn);
+                continue;
+            }
+
+            t->conn = client_conn;
+            t->started_ms = sham_get_time_ms();
+            transfers[count++] = t;
+        }
+
+        for (i = 0; i < count;)
+        {
+            if (transfer_step(transfers[i]) == 0)
+            {
+                i++;
+                continue;
+            }
+            free_transfer(transfers[i]);
+            transfers[i] = transfers[--count];
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        free_transfer(transfers[i]);
+    }
+}
+
+// Create a listening connection. Workers each bind their own SO_REUSEPORT
+// socket on the same port and share only the verbose log; index numbers
+// them so each draws its impairments from a seed of its own.
+struct sham_connection *open_listener(int port, bool chat_mode, bool shared, FILE *verbose_log, int index)
+{
+    struct sham_connection *listen_conn = sham_create_connection();
+    if (!listen_conn)
+    {
+        fprintf(stderr, "Failed to create listening connection\n");
+        return NULL;
+    }
+
+    // Emulated network conditions, inherited by accepted connections
+    sham_netem_seed(listen_conn, g_seed + (uint64_t)index);
+    sham_netem_set(listen_conn, SHAM_NETEM_IN, &g_netem[SHAM_NETEM_IN]);
+    sham_netem_set(listen_conn, SHAM_NETEM_OUT, &g_netem[SHAM_NETEM_OUT]);
+    sham_set_mss(listen_conn, (uint32_t)g_mss);
+
+    // Chat lines go out as typed rather than wait to fill a segment
+    listen_conn->nodelay = chat_mode;
+
+    // File transfers are bulk; let the kernel segment and coalesce datagrams
+    listen_conn->offload = !chat_mode;
+    listen_conn->reuseport = shared;
+    listen_conn->fastopen = g_fastopen;
+    listen_conn->streams_enabled = !chat_mode;
+
+    // Start listening
+    if (sham_listen(listen_conn, port) < 0)
+    {
+        fprintf(stderr, "Failed to start listening on port %d\n", port);
+        sham_free_connection(listen_conn);
+        return NULL;
+    }
+
+    listen_conn->verbose_log_file = verbose_log;
+    return listen_conn;
+}
+
+void *worker_main(void *arg)
+{
+    serve_transfers(arg);
+    return NULL;
+}
+
+// Serve uploads on one listener per worker. The kernel hashes each client's
+// address to one of the sockets, so a worker owns its connections outright
+// and the threads share no connection state.
+int serve_workers(struct sham_connection *first, int port, int workers)
+{
+    struct sham_connection *listeners[MAX_WORKERS];
+    pthread_t threads[MAX_WORKERS];
+    int started = 0;
+    int failed = 0;
+    int w;
+
+    // Bind every socket before any traffic, so flows are never rehashed
+    listeners[0] = first;
+    for (w = 1; w < workers; w++)
+    {
+        listeners[w] = open_listener(port, false, true, first->verbose_log_file, w);
+        if (!listeners[w])
+        {
+            failed = 1;
+            break;
+        }
+    }
+    workers = w;
+
+    // Never block on one client while the others have data waiting
+    // (accepted connections inherit this)
+    for (w = 0; w < workers; w++)
+    {
+        listeners[w]->recv_timeout_ms = 0;
+    }
+
+    if (!failed)
+    {
+        for (started = 1; started < workers; started++)
+        {
+            if (pthread_create(&threads[started], NULL, worker_main, listeners[started]) != 0)
+            {
+                fprintf(stderr, "Failed to start worker %d\n", started);
+                break;
+            }
+        }
+        serve_transfers(first);
+        if (first->sockfd < 0)
+        {
+            fprintf(stderr, "ERROR: Listening socket failed, server shutting down\n");
+        }
+    }
+
+    for (w = 1; w < started; w++)
+    {
+        pthread_join(threads[w], NULL);
+    }
+
+    // Only the first listener closes the shared verbose log
+    for (w = workers - 1; w >= 0; w--)
+    {
+        if (w > 0)
+        {
+            listeners[w]->verbose_log_file = NULL;
+        }
+        sham_free_connection(listeners[w]);
+    }
+    return failed;
+}
+
+// Queue as much pending output as the window takes; -1 if the connection failed
+static int send_pending(struct sham_connection *conn, char *out, size_t *out_len)
+{
+    while (*out_len > 0)
+    {
+        int sent = sham_write(conn, out, *out_len);
+        if (sent < 0)
+        {
+            return (errno == EAGAIN) ? 0 : -1;
+        }
+        memmove(out, out + sent, *out_len - (size_t)sent);
+        *out_len -= (size_t)sent;
+    }
     return 0;
 }
 
@@ -118,78 +748,126 @@ int handle_chat_mode(struct sham_connection *conn)
 
     char buffer[BUFFER_SIZE];
     char input_buffer[BUFFER_SIZE];
+    char output[BUFFER_SIZE]; // Typed but not yet taken by the send window
+    size_t output_len = 0;
+    sig_atomic_t stats_seen = g_stats_requests;
+    bool stdin_open = true;
+    bool done = false;
 
-    while (1)
+    // One event loop for stdin and the connection; retransmissions run
+    // from its timer while we wait for either
+    struct sham_poller *poller = sham_poller_create();
+    if (!poller || sham_poller_add(poller, conn, -1, SHAM_POLLIN) < 0 ||
+        sham_poller_add(poller, NULL, STDIN_FILENO, SHAM_POLLIN) < 0)
     {
-        fd_set read_fds;
-        int max_fd;
-
-        FD_ZERO(&read_fds);
-        FD_SET(STDIN_FILENO, &read_fds); // stdin
-        FD_SET(conn->sockfd, &read_fds); // socket
+        perror("chat poller");
+        sham_poller_free(poller);
+        return -1;
+    }
 
-        max_fd = (STDIN_FILENO > conn->sockfd) ? STDIN_FILENO : conn->sockfd;
+    while (!done)
+    {
+        struct sham_poll_event events[2];
+        int n = sham_poll(poller, events, 2, -1);
+        int i;
 
-        // Use select to monitor both stdin and socket
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+        if (g_stats_requests != stats_seen)
+        {
+            stats_seen = g_stats_requests;
+            print_stats(conn, NULL);
+        }
 
-        if (activity < 0)
+        if (n < 0)
         {
             if (errno == EINTR)
                 continue; // Interrupted by signal
-            perror("select error");
+            perror("sham_poll error");
             break;
         }
 
-        // Check if there's input from stdin
-        if (FD_ISSET(STDIN_FILENO, &read_fds))
+        for (i = 0; i < n && !done; i++)
         {
-            if (fgets(input_buffer, sizeof(input_buffer), stdin) != NULL)
+            // Check if there's input from stdin
+            if (!events[i].conn)
             {
+                if (fgets(input_buffer, sizeof(input_buffer), stdin) == NULL)
+                {
+                    // End of input; keep receiving until the client leaves
+                    sham_poller_remove(poller, NULL, STDIN_FILENO);
+                    stdin_open = false;
+                    continue;
+                }
+
                 // Remove newline
                 input_buffer[strcspn(input_buffer, "\n")] = 0;
 
                 if (strcmp(input_buffer, "/quit") == 0)
                 {
                     printf("[CHAT] Server initiating chat termination...\n");
-                    return 0; // This will trigger connection close
+                    done = true; // This will trigger connection close
+                    continue;
                 }
 
                 if (strlen(input_buffer) > 0)
                 {
-                    int sent = sham_send(conn, input_buffer, strlen(input_buffer));
-                    if (sent < 0)
-                    {
-                        printf("[CHAT] Failed to send message to client\n");
-                        break;
-                    }
+                    output_len = strlen(input_buffer);
+                    memcpy(output, input_buffer, output_len);
                 }
+                continue;
             }
-        }
 
-        // Check if there's data from the socket
-        if (FD_ISSET(conn->sockfd, &read_fds))
-        {
-            int received = sham_recv(conn, buffer, sizeof(buffer) - 1);
-            if (received <= 0)
+            if (events[i].revents & SHAM_POLLERR)
             {
                 printf("[CHAT] Client disconnected\n");
-                break;
+                done = true;
+                continue;
             }
 
-            buffer[received] = '\0';
-
-            // Check if client sent /quit
-            if (strcmp(buffer, "/quit") == 0)
+            // Check if there's data from the socket
+            if (events[i].revents & SHAM_POLLIN)
             {
-                printf("[CHAT] Client requested to quit\n");
-                break;
+                int received = sham_read(conn, buffer, sizeof(buffer) - 1);
+                if (received < 0 && errno == EAGAIN)
+                {
+                    continue;
+                }
+                if (received <= 0)
+                {
+                    printf("[CHAT] Client disconnected\n");
+                    done = true;
+                    continue;
+                }
+
+                buffer[received] = '\0';
+
+                // Check if client sent /quit
+                if (strcmp(buffer, "/quit") == 0)
+                {
+                    printf("[CHAT] Client requested to quit\n");
+                    done = true;
+                    continue;
+                }
+
+                printf("[Client]: %s\n", buffer);
             }
+        }
+
+        // Send what the window takes; the rest goes out on SHAM_POLLOUT
+        if (!done && send_pending(conn, output, &output_len) < 0)
+        {
+            printf("[CHAT] Failed to send message to client\n");
+            break;
+        }
 
-            printf("[Client]: %s\n", buffer);
+        // Stdin waits while a message is still queued
+        sham_poller_modify(poller, conn, -1, output_len > 0 ? SHAM_POLLIN | SHAM_POLLOUT : SHAM_POLLIN);
+        if (stdin_open)
+        {
+            sham_poller_modify(poller, NULL, STDIN_FILENO, output_len > 0 ? 0 : SHAM_POLLIN);
         }
     }
 
+    sham_poller_free(poller);
     printf("[CHAT] Chat session ended\n");
     return 0;
 }
@@ -204,6 +882,7 @@ int main(int argc, char *argv[])
 
     int port;
     bool chat_mode = false;
+    int workers = 1;
 
     // Parse command line arguments
     if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
@@ -230,13 +909,48 @@ int main(int argc, char *argv[])
             {
                 chat_mode = true;
             }
+            else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            {
+                workers = atoi(argv[++i]);
+                if (workers < 1 || workers > MAX_WORKERS)
+                {
+                    fprintf(stderr, "Invalid worker count: %s (must be 1-%d)\n", argv[i], MAX_WORKERS);
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "--mss") == 0 && i + 1 < argc)
+            {
+                g_mss = atoi(argv[++i]);
+                if (g_mss < SHAM_MIN_MSS || g_mss > SHAM_MAX_MSS)
+                {
+                    fprintf(stderr, "Invalid segment size: %s (must be %d-%d)\n", argv[i], SHAM_MIN_MSS, SHAM_MAX_MSS);
+                    return 1;
+                }
+            }
+            else if ((strcmp(argv[i], "--netem-in") == 0 || strcmp(argv[i], "--netem-out") == 0) && i + 1 < argc)
+            {
+                int dir = (strcmp(argv[i], "--netem-in") == 0) ? SHAM_NETEM_IN : SHAM_NETEM_OUT;
+                if (sham_netem_parse(argv[++i], &g_netem[dir]) < 0)
+                {
+                    fprintf(stderr, "Invalid impairment: %s (e.g. loss=0.01,delay=20,jitter=5,rate=10M)\n", argv[i]);
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            {
+                g_seed = strtoull(argv[++i], NULL, 0);
+            }
+            else if (strcmp(argv[i], "--fastopen") == 0)
+            {
+                g_fastopen = true;
+            }
             else
             {
                 // Try to parse as loss rate
                 float loss_rate = atof(argv[i]);
                 if (loss_rate >= 0.0f && loss_rate <= 1.0f)
                 {
-                    g_loss_rate = loss_rate;
+                    g_netem[SHAM_NETEM_IN].loss = loss_rate;
                 }
                 else
                 {
@@ -247,29 +961,41 @@ int main(int argc, char *argv[])
         }
     }
 
-    // Create listening connection
-    struct sham_connection *listen_conn = sham_create_connection();
-    if (!listen_conn)
+    if (chat_mode && workers > 1)
     {
-        fprintf(stderr, "Failed to create listening connection\n");
+        fprintf(stderr, "--workers applies to file transfers only\n");
         return 1;
     }
 
-    // Set loss rate for the connection
-    listen_conn->loss_rate = g_loss_rate;
+    // kill -USR1 dumps per-connection statistics
+    struct sigaction stats_action;
+    memset(&stats_action, 0, sizeof(stats_action));
+    stats_action.sa_handler = request_stats;
+    sigemptyset(&stats_action.sa_mask);
+    stats_action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &stats_action, NULL);
 
     // Initialize verbose logging if enabled
-    listen_conn->verbose_log_file = sham_open_verbose_log("server");
+    FILE *verbose_log = sham_open_verbose_log("server");
 
-    // Start listening
-    if (sham_listen(listen_conn, port) < 0)
+    // Create listening connection
+    struct sham_connection *listen_conn = open_listener(port, chat_mode, workers > 1, verbose_log, 0);
+    if (!listen_conn)
     {
-        fprintf(stderr, "Failed to start listening on port %d\n", port);
-        sham_free_connection(listen_conn);
+        if (verbose_log)
+        {
+            sham_close_verbose_log(verbose_log);
+        }
         return 1;
     }
 
-    // Accept and handle clients
+    // Uploads are served side by side
+    if (!chat_mode)
+    {
+        return serve_workers(listen_conn, port, workers);
+    }
+
+    // Chat sessions hold the terminal, so clients are served one at a time
     int client_count = 0;
 
     while (1)
@@ -293,29 +1019,17 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        // Set loss rate for client connection
-        client_conn->loss_rate = g_loss_rate;
-
         // Copy verbose log file from listening connection
         client_conn->verbose_log_file = listen_conn->verbose_log_file;
 
         client_count++;
 
-        // Handle client based on mode
-        if (chat_mode)
-        {
-            handle_chat_mode(client_conn);
-        }
-        else
-        {
-            handle_file_transfer(client_conn);
-        }
+        handle_chat_mode(client_conn);
 
         // Close client connection
         sham_close(client_conn);
 
         client_conn->verbose_log_file = NULL;
-        client_conn->sockfd = -1;
         sham_free_connection(client_conn);
     }
     sham_free_connection(listen_conn);
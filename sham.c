@@ -1,10 +1,13 @@
 #ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 200112L
 #endif
+#define _DEFAULT_SOURCE // SO_REUSEPORT
 #include "sham.h"
 #include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Create a new S.H.A.M. connection
 struct sham_connection *sham_create_connection(void)
@@ -17,6 +20,7 @@ struct sham_connection *sham_create_connection(void)
 
     memset(conn, 0, sizeof(struct sham_connection));
     conn->sockfd = -1;
+    conn->sink_fd = -1;
     conn->state = SHAM_CLOSED;
     conn->send_seq = sham_generate_isn();
     conn->send_base = conn->send_seq;
@@ -29,28 +33,209 @@ struct sham_connection *sham_create_connection(void)
     conn->recv_buffer_size = SHAM_DEFAULT_RECV_BUFFER_SIZE;
     conn->recv_buffer_used = 0;
 
-    // Initialize packet loss simulation
-    conn->loss_rate = 0.0f;
+    // No RTT sample yet
+    conn->rto_ms = SHAM_RTO_MS;
+    conn->recv_timeout_ms = SHAM_RTO_MS;
+
+    // ACK every other full-sized segment
+    conn->ack_every = SHAM_ACK_EVERY;
+    conn->ack_delay_ms = SHAM_ACK_DELAY_MS;
+
+    // Offer selective ACKs by default, and to rebuild from parity
+    conn->sack_enabled = true;
+    conn->fec_enabled = true;
+
+    // Files carry an MD5 trailer
+    conn->file_digest = SHAM_DIGEST_MD5;
+    conn->file_compress = SHAM_COMPRESS_NONE;
+
+    // Offer jumbo-sized segments and find out what the path carries
+    conn->pmtud = true;
+    sham_set_mss(conn, SHAM_DEFAULT_MSS);
+
+    // Default congestion control, paced
+    sham_set_congestion_control(conn, NULL);
+    conn->pacing = true;
 
     // Initialize verbose logging
     conn->verbose_log_file = NULL;
 
+    // Default-sized send and receive rings
+    conn->txq = sham_io_queue_create();
+    conn->rxq = sham_io_queue_create();
+    if (!conn->txq || !conn->rxq || sham_set_window_slots(conn, SHAM_WINDOW_SIZE, SHAM_WINDOW_SIZE) < 0)
+    {
+        sham_free_connection(conn);
+        return NULL;
+    }
+
     return conn;
 }
 
+// Advertise no more than the reassembly ring can hold in the largest
+// segments; the receive queue is that big too, allocated on first use
+static void sham_size_recv_buffer(struct sham_connection *conn)
+{
+    free(conn->recv_queue);
+    conn->recv_queue = NULL;
+    conn->recv_queue_head = 0;
+    conn->recv_buffer_used = 0;
+
+    conn->recv_buffer_size = (uint32_t)conn->recv_window_slots * conn->mss_limit;
+    if (conn->recv_buffer_size < SHAM_DEFAULT_RECV_BUFFER_SIZE)
+    {
+        conn->recv_buffer_size = SHAM_DEFAULT_RECV_BUFFER_SIZE;
+    }
+
+    // Smallest shift that lets the whole buffer fit in the 16-bit header field
+    conn->rcv_wscale = 0;
+    while ((conn->recv_buffer_size >> conn->rcv_wscale) > 0xFFFF && conn->rcv_wscale < SHAM_MAX_WSCALE)
+    {
+        conn->rcv_wscale++;
+    }
+}
+
+// Size the send and receive rings; only allowed before the handshake starts
+int sham_set_window_slots(struct sham_connection *conn, int send_slots, int recv_slots)
+{
+    struct sham_window_entry *send_window;
+    struct sham_ooo_entry *ooo_buffer;
+    struct sham_packet *held;
+
+    if (conn->state != SHAM_CLOSED && conn->state != SHAM_LISTEN)
+    {
+        return -1;
+    }
+
+    if (send_slots < 1 || send_slots > SHAM_MAX_WINDOW_SLOTS ||
+        recv_slots < 1 || recv_slots > SHAM_MAX_WINDOW_SLOTS)
+    {
+        return -1;
+    }
+
+    send_window = calloc((size_t)send_slots, sizeof(*send_window));
+    ooo_buffer = calloc((size_t)recv_slots, sizeof(*ooo_buffer));
+    held = calloc((size_t)recv_slots + 1, sizeof(*held)); // A window of data plus the FIN
+    if (!send_window || !ooo_buffer || !held)
+    {
+        free(send_window);
+        free(ooo_buffer);
+        free(held);
+        return -1;
+    }
+
+    free(conn->send_window);
+    free(conn->ooo_buffer);
+    free(conn->held);
+    conn->send_window = send_window;
+    conn->send_window_slots = send_slots;
+    conn->window_start = 0;
+    conn->window_count = 0;
+    sham_timer_clear(&conn->rtx_timers);
+    conn->ooo_buffer = ooo_buffer;
+    conn->recv_window_slots = recv_slots;
+    conn->ooo_count = 0;
+    conn->held = held;
+    conn->held_head = 0;
+    conn->held_count = 0;
+
+    // Keep enough free buffers for a full window each way plus the I/O batches
+    conn->pool.limit = send_slots + recv_slots + 2 * SHAM_IO_BATCH;
+
+    sham_size_recv_buffer(conn);
+    return 0;
+}
+
+// Set the largest segment this end sends or accepts, offered to the peer as
+// SHAM_OPT_MSS; packet buffers are sized to match. Only allowed before the
+// handshake starts.
+int sham_set_mss(struct sham_connection *conn, uint32_t mss_limit)
+{
+    if (conn->state != SHAM_CLOSED && conn->state != SHAM_LISTEN)
+    {
+        return -1;
+    }
+
+    if (mss_limit < SHAM_MIN_MSS || mss_limit > SHAM_MAX_MSS)
+    {
+        return -1;
+    }
+
+    // Cached buffers have the old size; buffers still in use are freed when put
+    sham_pool_free(&conn->pool);
+    conn->pool.buf_size = SHAM_HEADER_SIZE + mss_limit;
+    conn->mss_limit = mss_limit;
+
+    // Until the handshake says otherwise, segments are the base size
+    conn->mss = (mss_limit < SHAM_BASE_MSS) ? mss_limit : SHAM_BASE_MSS;
+    conn->rcv_mss = conn->mss;
+    conn->ooo_unit = conn->mss;
+
+    sham_size_recv_buffer(conn);
+    return 0;
+}
+
+// Drop the buffer references held by the send window, reassembly slots and hold queue
+static void sham_release_buffers(struct sham_connection *conn)
+{
+    int i;
+
+    for (i = 0; conn->send_window && i < conn->window_count; i++)
+    {
+        struct sham_window_entry *entry = &conn->send_window[(conn->window_start + i) % conn->send_window_slots];
+        sham_buf_put(&conn->pool, entry->buf);
+        entry->buf = NULL;
+    }
+    for (i = 0; conn->ooo_buffer && i < conn->recv_window_slots; i++)
+    {
+        if (conn->ooo_buffer[i].valid)
+        {
+            sham_buf_put(&conn->pool, conn->ooo_buffer[i].buf);
+            conn->ooo_buffer[i].valid = false;
+        }
+    }
+    conn->ooo_count = 0;
+    while (conn->held && conn->held_count > 0)
+    {
+        sham_buf_put(&conn->pool, conn->held[conn->held_head].buf);
+        conn->held_head = (conn->held_head + 1) % (conn->recv_window_slots + 1);
+        conn->held_count--;
+    }
+    sham_buf_put(&conn->pool, conn->held_current);
+    conn->held_current = NULL;
+}
+
 // Free S.H.A.M. connection
 void sham_free_connection(struct sham_connection *conn)
 {
     if (conn)
     {
-        if (conn->sockfd >= 0)
+        // An accepted connection shares the listener's socket
+        bool shared = conn->demux && conn->demux->listener != conn;
+
+        // Datagrams on the emulated wire still reach the peer
+        sham_netem_drain(conn);
+        if (conn->sockfd >= 0 && !shared)
         {
             close(conn->sockfd);
         }
         if (conn->verbose_log_file)
         {
-            fclose(conn->verbose_log_file);
+            sham_close_verbose_log(conn->verbose_log_file);
         }
+        sham_netem_free(conn);
+        sham_release_buffers(conn);
+        sham_demux_remove(conn);
+        free(conn->send_window);
+        free(conn->ooo_buffer);
+        free(conn->held);
+        free(conn->recv_queue);
+        free(conn->coalesce);
+        sham_fec_free(conn);
+        sham_timer_free(&conn->rtx_timers);
+        sham_io_queue_free(conn->txq, &conn->pool);
+        sham_io_queue_free(conn->rxq, &conn->pool);
+        sham_pool_free(&conn->pool);
         free(conn);
     }
 }
@@ -67,10 +252,19 @@ int sham_socket(void)
     return sockfd;
 }
 
-// Bind socket to port
-int sham_bind(int sockfd, int port)
+// Bind socket to port. With reuseport, several sockets may bind the same
+// port and the kernel spreads flows across them by address hash.
+int sham_bind(int sockfd, int port, bool reuseport)
 {
     struct sockaddr_in addr;
+    int on = 1;
+
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        perror("SO_REUSEPORT failed");
+        return -1;
+    }
+
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
@@ -84,106 +278,183 @@ int sham_bind(int sockfd, int port)
     return 0;
 }
 
-// Create a packet
-struct sham_packet sham_create_packet(uint32_t seq, uint32_t ack, uint16_t flags,
-                                      const void *data, size_t data_len)
+// Ask the kernel for socket buffers that can hold a full window of datagrams
+static void sham_size_socket_buffers(struct sham_connection *conn)
 {
-    struct sham_packet packet;
-    memset(&packet, 0, sizeof(packet));
+    int rcvbuf = conn->recv_window_slots * (int)conn->pool.buf_size * 2;
+    int sndbuf = conn->send_window_slots * (int)conn->pool.buf_size * 2;
+
+    // Best effort: the kernel clamps these to its configured maximum
+    setsockopt(conn->sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(conn->sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+}
+
+// Build a packet in place in a pool buffer, advertising our receive window.
+// The caller owns the returned reference.
+struct sham_buf *sham_build_packet(struct sham_connection *conn, uint32_t seq, uint32_t ack, uint16_t flags,
+                                   const void *data, size_t data_len)
+{
+    struct sham_buf *buf;
+    struct sham_header *header;
+
+    if (data_len > conn->pool.buf_size - SHAM_HEADER_SIZE)
+    {
+        return NULL;
+    }
+
+    buf = sham_buf_get(&conn->pool);
+    if (!buf)
+    {
+        return NULL;
+    }
+
+    // SYN segments are never scaled; everything after the handshake is
+    uint32_t advertised_window = sham_calculate_advertised_window(conn);
+    if (conn->wscale_ok && !(flags & SHAM_SYN))
+    {
+        advertised_window >>= conn->rcv_wscale;
+    }
+    if (advertised_window > 0xFFFF)
+    {
+        advertised_window = 0xFFFF;
+    }
 
-    packet.header.seq_num = htonl(seq);
-    packet.header.ack_num = htonl(ack);
-    packet.header.flags = htons(flags);
-    packet.header.window_size = htons(SHAM_DEFAULT_ADVERTISED_WINDOW); // Will be overridden by connection-specific value
+    header = SHAM_BUF_HEADER(buf);
+    header->seq_num = htonl(seq);
+    header->ack_num = htonl(ack);
+    header->flags = htons(flags);
+    header->window_size = htons((uint16_t)advertised_window);
 
-    if (data && data_len > 0 && data_len <= SHAM_MAX_DATA_SIZE)
+    if (data && data_len > 0)
     {
-        memcpy(packet.data, data, data_len);
-        packet.data_len = data_len;
+        memcpy(SHAM_BUF_DATA(buf), data, data_len);
     }
     else
     {
-        packet.data_len = 0;
+        data_len = 0;
     }
+    buf->len = SHAM_HEADER_SIZE + data_len;
 
-    return packet;
+    return buf;
 }
 
-// Create a packet with connection-specific window size
-struct sham_packet sham_create_packet_with_conn(struct sham_connection *conn, uint32_t seq, uint32_t ack, uint16_t flags,
-                                                const void *data, size_t data_len)
+// Send a packet now, behind any segments already queued. The caller keeps its reference.
+int sham_send_packet(struct sham_connection *conn, struct sham_buf *buf)
 {
-    struct sham_packet packet = sham_create_packet(seq, ack, flags, data, data_len);
+    int sent = sham_queue_packet(conn, buf);
 
-    // Override with connection-specific advertised window
-    uint16_t advertised_window = sham_calculate_advertised_window(conn);
-    packet.header.window_size = htons(advertised_window);
+    if (sent < 0 || sham_flush_packets(conn) < 0)
+    {
+        return -1;
+    }
 
-    return packet;
+    return sent;
 }
 
-// Send a packet
-int sham_send_packet(struct sham_connection *conn, const struct sham_packet *packet)
+// Build, send and release a packet that is never retransmitted
+static int sham_send_control(struct sham_connection *conn, uint32_t seq, uint32_t ack, uint16_t flags,
+                             const void *data, size_t data_len)
 {
-    uint8_t buffer[SHAM_MAX_PACKET_SIZE];
-    size_t packet_size = SHAM_HEADER_SIZE + packet->data_len;
+    struct sham_buf *buf = sham_build_packet(conn, seq, ack, flags, data, data_len);
+    int sent;
 
-    // Copy header and data to buffer
-    memcpy(buffer, &packet->header, SHAM_HEADER_SIZE);
-    if (packet->data_len > 0)
+    if (!buf)
     {
-        memcpy(buffer + SHAM_HEADER_SIZE, packet->data, packet->data_len);
+        return -1;
     }
+    sent = sham_send_packet(conn, buf);
+    sham_buf_put(&conn->pool, buf);
+    return sent;
+}
 
-    ssize_t sent = sendto(conn->sockfd, (const char *)buffer, packet_size, 0,
-                          (struct sockaddr *)&conn->peer_addr, conn->peer_len);
+// Block until the socket is readable or until_us, whichever comes first
+static void sham_wait_readable(struct sham_connection *conn, uint64_t until_us)
+{
+    uint64_t now_us = sham_now_us();
+    struct timeval timeout;
+    fd_set read_fds;
 
-    if (sent < 0)
+    if (until_us <= now_us)
     {
-        perror("sendto failed");
-        return -1;
+        return;
     }
-
-    return sent;
+    timeout.tv_sec = (long)((until_us - now_us) / 1000000);
+    timeout.tv_usec = (long)((until_us - now_us) % 1000000);
+    FD_ZERO(&read_fds);
+    FD_SET(conn->sockfd, &read_fds);
+    select(conn->sockfd + 1, &read_fds, NULL, NULL, &timeout);
 }
 
-// Receive a packet
-int sham_recv_packet(struct sham_connection *conn, struct sham_packet *packet)
+// Decode one received datagram, blocking for it if none is waiting.
+// Returns 0 when non-blocking and nothing has arrived, or all that had
+// was lost or delayed by the impairment emulator.
+static int sham_recv_datagram(struct sham_connection *conn, struct sham_packet *packet, bool blocking)
 {
-    uint8_t buffer[SHAM_MAX_PACKET_SIZE];
+    const uint8_t *buffer;
+    struct sham_buf *buf;
     struct sockaddr_in from_addr;
-    socklen_t from_len = sizeof(from_addr);
+    socklen_t from_len;
+    int received;
 
-    ssize_t received = recvfrom(conn->sockfd, (char *)buffer, sizeof(buffer), 0,
-                                (struct sockaddr *)&from_addr, &from_len);
-    if (received < 0)
+    for (;;)
     {
-        // For fatal socket errors (like EBADF), mark socket as invalid
-        if (errno == EBADF || errno == ENOTSOCK)
+        uint64_t held_us;
+
+        // A connection that only polls flushes nothing, so delayed sends leave here
+        if (sham_flush_due_packets(conn) < 0)
         {
-            conn->sockfd = -1;
+            return -1;
         }
-        return -1;
-    }
 
-    if (received < (ssize_t)SHAM_HEADER_SIZE)
-    {
-        return -1; // Packet too small
-    }
+        // A datagram the impairment emulator delayed, once its time is up
+        if ((received = sham_netem_recv(conn, &buffer, &buf, &from_addr, &from_len)) > 0)
+        {
+            break;
+        }
 
-    // Simulate packet loss by randomly dropping incoming packets
-    if (sham_should_drop_packet(conn->loss_rate))
-    {
-        struct sham_header temp_header;
-        memcpy(&temp_header, buffer, SHAM_HEADER_SIZE);
-        temp_header.seq_num = ntohl(temp_header.seq_num);
+        // Blocking on the socket would sleep through a delayed datagram's release
+        held_us = sham_netem_deadline_us(conn);
+        if (blocking && held_us != 0)
+        {
+            sham_wait_readable(conn, held_us);
+        }
+
+        received = conn->demux ? sham_demux_recv(conn, &buffer, &buf, &from_addr, &from_len, blocking && !held_us)
+                               : sham_io_recv(conn, &buffer, &buf, &from_addr, &from_len, blocking && !held_us);
+        if (received == 0)
+        {
+            if (blocking && held_us)
+            {
+                continue;
+            }
+            return 0;
+        }
+        if (received < 0)
+        {
+            // For fatal socket errors (like EBADF), mark socket as invalid
+            if (errno == EBADF || errno == ENOTSOCK)
+            {
+                conn->sockfd = -1;
+            }
+            return -1;
+        }
+
+        if (received < (int)SHAM_HEADER_SIZE || (size_t)received > conn->pool.buf_size)
+        {
+            return -1; // Packet too small, or larger than we accept
+        }
 
-        sham_verbose_log(conn, "DROP DATA SEQ=%u\n", temp_header.seq_num);
-        return -1; // Pretend packet was never received
+        // Emulated loss or delay; a lost datagram was never here, so only
+        // one already waiting is taken in its place
+        if (sham_netem_input(conn, buffer, buf, received, &from_addr, from_len) == 0)
+        {
+            break;
+        }
+        blocking = false;
     }
 
-    // Update peer address if not set
-    if (conn->peer_len == 0)
+    // Update peer address if not set; a listener tracks the latest sender
+    if (conn->peer_len == 0 || conn->state == SHAM_LISTEN)
     {
         conn->peer_addr = from_addr;
         conn->peer_len = from_len;
@@ -198,771 +469,3219 @@ int sham_recv_packet(struct sham_connection *conn, struct sham_packet *packet)
     packet->header.flags = ntohs(packet->header.flags);
     packet->header.window_size = ntohs(packet->header.window_size);
 
-    // Copy data
+    // The payload stays where recvmmsg put it
+    packet->data = buffer + SHAM_HEADER_SIZE;
     packet->data_len = received - SHAM_HEADER_SIZE;
-    if (packet->data_len > 0)
+    packet->buf = buf;
+
+    // Decode and strip the SACK extension so callers only see payload
+    packet->sack_count = 0;
+    if (packet->header.flags & SHAM_SACK)
     {
-        memcpy(packet->data, buffer + SHAM_HEADER_SIZE, packet->data_len);
+        const struct sham_sack_option *opt = (const struct sham_sack_option *)packet->data;
+        size_t opt_len;
+        int i;
+
+        if (packet->data_len < SHAM_SACK_OPTION_SIZE(0) || opt->count > SHAM_MAX_SACK_BLOCKS ||
+            packet->data_len < SHAM_SACK_OPTION_SIZE(opt->count))
+        {
+            return -1; // Malformed extension
+        }
+
+        for (i = 0; i < opt->count; i++)
+        {
+            packet->sack[i].start = ntohl(opt->blocks[i].start);
+            packet->sack[i].end = ntohl(opt->blocks[i].end);
+        }
+        packet->sack_count = opt->count;
+
+        opt_len = SHAM_SACK_OPTION_SIZE(opt->count);
+        packet->data += opt_len;
+        packet->data_len -= opt_len;
     }
 
     return received;
 }
 
-// Wait for a packet with timeout
-static int sham_recv_packet_timeout(struct sham_connection *conn,
-                                    struct sham_packet *packet, int timeout_ms)
+// Append our handshake options to a SYN, or to a SYN-ACK answering one:
+// that echoes only the extensions the SYN offered, plus our segment size
+static size_t sham_build_syn_options(struct sham_connection *conn, uint8_t *opts, bool reply)
 {
-    fd_set read_fds;
-    struct timeval timeout;
-
-    FD_ZERO(&read_fds);
-    FD_SET(conn->sockfd, &read_fds);
+    size_t len = 0;
 
-    timeout.tv_sec = timeout_ms / 1000;
-    timeout.tv_usec = (timeout_ms % 1000) * 1000;
-
-    int result = select(conn->sockfd + 1, &read_fds, NULL, NULL, &timeout);
-    if (result <= 0)
+    if (!reply || conn->wscale_ok)
     {
-        return result; // Timeout or error
+        opts[len++] = SHAM_OPT_WSCALE;
+        opts[len++] = 3;
+        opts[len++] = conn->rcv_wscale;
     }
 
-    return sham_recv_packet(conn, packet);
-}
-// ############## LLM Generated Code Begins ##############
-// Three-way handshake - client side
-int sham_connect(struct sham_connection *conn, const char *host, int port)
-{
-    if (conn->state != SHAM_CLOSED)
+    if (reply ? conn->sack_ok : conn->sack_enabled)
     {
-        fprintf(stderr, "Connection not in CLOSED state\n");
-        return -1;
+        opts[len++] = SHAM_OPT_SACK_PERM;
+        opts[len++] = 2;
     }
 
-    // Create socket if not already created
-    if (conn->sockfd < 0)
-    {
-        conn->sockfd = sham_socket();
-        if (conn->sockfd < 0)
-        {
-            return -1;
-        }
-    }
+    opts[len++] = SHAM_OPT_MSS;
+    opts[len++] = 4;
+    opts[len++] = (uint8_t)(conn->mss_limit >> 8);
+    opts[len++] = (uint8_t)(conn->mss_limit & 0xFF);
 
-    // Resolve hostname
-    struct hostent *he = gethostbyname(host);
-    if (!he)
+    if (!reply || conn->peer_compress)
     {
-        return -1;
+        opts[len++] = SHAM_OPT_COMPRESS;
+        opts[len++] = 3;
+        opts[len++] = SHAM_COMPRESS_SUPPORTED;
     }
 
-    // Set up peer address
-    memset(&conn->peer_addr, 0, sizeof(conn->peer_addr));
-    conn->peer_addr.sin_family = AF_INET;
-    conn->peer_addr.sin_port = htons(port);
-    memcpy(&conn->peer_addr.sin_addr, he->h_addr_list[0], he->h_length);
-    conn->peer_len = sizeof(conn->peer_addr);
-
-    // Step 1: Send SYN
-    struct sham_packet syn = sham_create_packet_with_conn(conn, conn->send_seq, 0, SHAM_SYN, NULL, 0);
-    if (sham_send_packet(conn, &syn) < 0)
+    if (reply ? conn->streams_ok : conn->streams_enabled)
     {
-        return -1;
+        opts[len++] = SHAM_OPT_STREAMS;
+        opts[len++] = 2;
     }
-    sham_verbose_log(conn, "SND SYN SEQ=%u\n", conn->send_seq);
-    conn->state = SHAM_SYN_SENT;
 
-    // Step 2: Wait for SYN-ACK
-    struct sham_packet syn_ack;
-    int recv_result = sham_recv_packet_timeout(conn, &syn_ack, SHAM_RTO_MS);
-    if (recv_result <= 0)
+    if (reply ? conn->fec_ok : conn->fec_enabled)
     {
-        conn->state = SHAM_CLOSED;
-        return -1;
+        opts[len++] = SHAM_OPT_FEC;
+        opts[len++] = 2;
     }
 
-    if ((syn_ack.header.flags & (SHAM_SYN | SHAM_ACK)) != (SHAM_SYN | SHAM_ACK) ||
-        syn_ack.header.ack_num != conn->send_seq + 1)
+    // A client asks for a fast open cookie or presents the one it holds; a
+    // server hands one over when the client's was missing or stale
+    if (reply ? conn->fastopen_offer : conn->fastopen)
     {
-        conn->state = SHAM_CLOSED;
-        return -1;
+        size_t cookie_len = reply ? SHAM_FASTOPEN_COOKIE_LEN : conn->fastopen_cookie_len;
+
+        opts[len++] = SHAM_OPT_COOKIE;
+        opts[len++] = (uint8_t)(2 + cookie_len);
+        memcpy(opts + len, conn->fastopen_cookie, cookie_len);
+        len += cookie_len;
     }
 
-    sham_verbose_log(conn, "RCV SYN-ACK SEQ=%u ACK=%u\n",
-                     syn_ack.header.seq_num, syn_ack.header.ack_num);
+    return len;
+}
 
-    // Update sequence numbers
-    conn->recv_seq = syn_ack.header.seq_num + 1;
-    conn->send_seq++;
+// Apply the options the peer put in its SYN or SYN-ACK; unknown kinds are
+// skipped. Returns where fast open data starts: after SHAM_OPT_END, if any.
+static size_t sham_parse_syn_options(struct sham_connection *conn, const struct sham_packet *packet)
+{
+    size_t pos = 0;
 
-    // Step 3: Send ACK
-    struct sham_packet ack = sham_create_packet_with_conn(conn, conn->send_seq, conn->recv_seq, SHAM_ACK, NULL, 0);
-    if (sham_send_packet(conn, &ack) < 0)
+    while (pos + 2 <= packet->data_len)
     {
-        conn->state = SHAM_CLOSED;
-        return -1;
-    }
+        uint8_t kind = packet->data[pos];
+        uint8_t opt_len = packet->data[pos + 1];
 
-    sham_verbose_log(conn, "SND ACK=%u\n", conn->recv_seq);
+        if (kind == SHAM_OPT_END)
+        {
+            return pos + 1;
+        }
+        if (opt_len < 2 || pos + opt_len > packet->data_len)
+        {
+            break;
+        }
 
-    conn->state = SHAM_ESTABLISHED;
-    conn->send_base = conn->send_seq;
+        if (kind == SHAM_OPT_WSCALE && opt_len == 3)
+        {
+            conn->snd_wscale = packet->data[pos + 2];
+            if (conn->snd_wscale > SHAM_MAX_WSCALE)
+            {
+                conn->snd_wscale = SHAM_MAX_WSCALE;
+            }
+            conn->wscale_ok = true;
+        }
+        else if (kind == SHAM_OPT_SACK_PERM && opt_len == 2)
+        {
+            conn->sack_ok = conn->sack_enabled;
+        }
+        else if (kind == SHAM_OPT_MSS && opt_len == 4)
+        {
+            conn->peer_mss = ((uint32_t)packet->data[pos + 2] << 8) | packet->data[pos + 3];
+        }
+        else if (kind == SHAM_OPT_COMPRESS && opt_len == 3)
+        {
+            conn->peer_compress = packet->data[pos + 2];
+        }
+        else if (kind == SHAM_OPT_STREAMS && opt_len == 2)
+        {
+            conn->streams_ok = conn->streams_enabled;
+        }
+        else if (kind == SHAM_OPT_FEC && opt_len == 2)
+        {
+            conn->fec_ok = conn->fec_enabled;
+        }
+        else if (kind == SHAM_OPT_COOKIE && (opt_len == 2 || opt_len == 2 + SHAM_FASTOPEN_COOKIE_LEN))
+        {
+            conn->fastopen = true;
+            if (opt_len > 2)
+            {
+                memcpy(conn->fastopen_cookie, packet->data + pos + 2, SHAM_FASTOPEN_COOKIE_LEN);
+                conn->fastopen_cookie_len = SHAM_FASTOPEN_COOKIE_LEN;
+            }
+        }
 
-    return 0;
+        pos += opt_len;
+    }
+    return packet->data_len;
 }
-// ############## LLM Generated Code Ends ##############
-// Listen for connections
-int sham_listen(struct sham_connection *conn, int port)
+
+// Send our SYN-ACK, or send it again: it answers the options the client
+// offered and acknowledges the SYN along with any of its data we took
+static int sham_send_syn_ack(struct sham_connection *conn)
 {
-    if (conn->state != SHAM_CLOSED)
+    uint8_t opts[SHAM_MAX_SYN_OPTIONS];
+    size_t len = sham_build_syn_options(conn, opts, true);
+
+    if (sham_send_control(conn, conn->syn_seq, conn->peer_syn_seq + 1 + conn->syn_data_len,
+                          SHAM_SYN | SHAM_ACK, opts, len) < 0)
     {
-        fprintf(stderr, "Connection not in CLOSED state\n");
         return -1;
     }
+    conn->syn_ack_time_us = sham_now_us();
+    return 0;
+}
 
-    // Create and bind socket
-    conn->sockfd = sham_socket();
-    if (conn->sockfd < 0)
+// Resend our SYN-ACK once an RTO has passed without the final ACK, backing
+// off each time. Fails with ETIMEDOUT once SHAM_MAX_RETRIES went unanswered.
+static int sham_syn_ack_if_due(struct sham_connection *conn)
+{
+    if (conn->state != SHAM_SYN_RECEIVED ||
+        sham_now_us() - conn->syn_ack_time_us < (uint64_t)conn->rto_ms * 1000)
     {
-        return -1;
+        return 0;
     }
 
-    if (sham_bind(conn->sockfd, port) < 0)
+    if (conn->syn_retries >= SHAM_MAX_RETRIES)
     {
+        sham_log_warn(conn->log_file, "[SERVER] No ACK for our SYN-ACK after %d retries\n", conn->syn_retries);
+        errno = ETIMEDOUT;
         return -1;
     }
 
-    conn->state = SHAM_LISTEN;
-    sham_log(conn->log_file, "[SERVER] Listening on port %d\n", port);
+    sham_rto_backoff(conn);
+    conn->syn_retries++;
+    conn->stats.timeouts++;
+    conn->stats.retransmits++;
+    sham_trace(conn, SHAM_TRACE_RETX_SYN_ACK, conn->syn_seq, conn->peer_syn_seq + 1 + conn->syn_data_len);
+    return sham_send_syn_ack(conn);
+}
 
+// Send our FIN, which takes the sequence number just before send_seq. Like
+// data it acknowledges what we hold, so a FIN crossing the peer's answers it.
+static int sham_send_fin(struct sham_connection *conn)
+{
+    if (sham_send_control(conn, conn->send_seq - 1, conn->recv_seq, SHAM_FIN | SHAM_ACK, NULL, 0) < 0)
+    {
+        return -1;
+    }
+    conn->fin_time_us = sham_now_us();
     return 0;
 }
-// ############## LLM Generated Code Begins ##############
-// Accept a connection
-struct sham_connection *sham_accept(struct sham_connection *listen_conn)
+
+// Resend our FIN once an RTO has passed without its ACK, backing off each
+// time. Fails with ETIMEDOUT once SHAM_MAX_RETRIES went unanswered.
+static int sham_fin_if_due(struct sham_connection *conn)
 {
-    if (listen_conn->state != SHAM_LISTEN)
+    if ((conn->state != SHAM_FIN_WAIT_1 && conn->state != SHAM_CLOSING && conn->state != SHAM_LAST_ACK) ||
+        sham_now_us() - conn->fin_time_us < (uint64_t)conn->rto_ms * 1000)
     {
-        fprintf(stderr, "Connection not in LISTEN state\n");
-        return NULL;
+        return 0;
     }
 
-    // If listening socket is invalid, abort accept and signal caller
-    if (listen_conn->sockfd < 0)
+    if (conn->fin_retries >= SHAM_MAX_RETRIES)
     {
-        sham_log(listen_conn->log_file, "[SERVER] Listening socket invalid, cannot accept\n");
-        return NULL;
+        sham_log_warn(conn->log_file, "[CLOSE] No ACK for our FIN after %d retries\n", conn->fin_retries);
+        errno = ETIMEDOUT;
+        return -1;
     }
 
-    // Wait for SYN
+    sham_rto_backoff(conn);
+    conn->fin_retries++;
+    conn->stats.timeouts++;
+    conn->stats.retransmits++;
+    sham_trace(conn, SHAM_TRACE_RETX_FIN, conn->send_seq - 1, 0);
+    return sham_send_fin(conn);
+}
+
+// A SYN or SYN-ACK the peer sent again because our answer was lost gets
+// that answer again; one from an older connection is dropped. Returns true
+// if the packet was either and needs nothing more.
+static bool sham_handshake_repeat(struct sham_connection *conn, const struct sham_packet *packet)
+{
+    if (!(packet->header.flags & SHAM_SYN) || conn->state == SHAM_CLOSED || conn->state == SHAM_LISTEN ||
+        conn->state == SHAM_SYN_SENT)
+    {
+        return false;
+    }
+
+    if (packet->header.seq_num == conn->peer_syn_seq)
+    {
+        if (packet->header.flags & SHAM_ACK)
+        {
+            sham_send_control(conn, conn->send_seq, conn->recv_seq, SHAM_ACK, NULL, 0);
+            sham_trace(conn, SHAM_TRACE_SND_ACK, conn->recv_seq, 0);
+        }
+        else
+        {
+            sham_send_syn_ack(conn);
+            sham_trace(conn, SHAM_TRACE_SND_SYN_ACK, conn->syn_seq, conn->peer_syn_seq + 1 + conn->syn_data_len);
+        }
+    }
+    return true;
+}
+
+static void sham_hold_packet(struct sham_connection *conn, const struct sham_packet *packet, bool front);
+
+// Receive the next packet for the caller. Path MTU probes and their
+// answers, FEC parity, and handshake packets the peer repeated, are dealt
+// with here and never returned; after one, only a datagram already waiting
+// is taken. A segment rebuilt from parity is held for the next read.
+static int sham_recv_packet_mode(struct sham_connection *conn, struct sham_packet *packet, bool blocking)
+{
+    struct sham_packet rebuilt;
+
+    for (;;)
+    {
+        int received = sham_recv_datagram(conn, packet, blocking);
+
+        if (received > 0 && (packet->header.flags & SHAM_PROBE))
+        {
+            sham_pmtu_input(conn, packet);
+        }
+        else if (received > 0 && (packet->header.flags & SHAM_FEC))
+        {
+            if (sham_fec_input(conn, packet, &rebuilt))
+            {
+                sham_hold_packet(conn, &rebuilt, false);
+            }
+        }
+        else if (received <= 0 || !sham_handshake_repeat(conn, packet))
+        {
+            // Reassembly slots and delayed ACKs go by the peer's segment size
+            if (received > 0 && !(packet->header.flags & SHAM_SYN) && packet->data_len > conn->rcv_mss)
+            {
+                conn->rcv_mss = (uint32_t)packet->data_len;
+            }
+            if (received > 0 && (packet->header.flags >> SHAM_FEC_TAG_SHIFT) && sham_fec_input(conn, packet, &rebuilt))
+            {
+                sham_hold_packet(conn, &rebuilt, false);
+            }
+            return received;
+        }
+        blocking = false;
+    }
+}
+
+// Receive a packet
+int sham_recv_packet(struct sham_connection *conn, struct sham_packet *packet)
+{
+    return sham_recv_packet_mode(conn, packet, true);
+}
+
+// Reassembly slot for a sequence number. Slots are counted in whole segments
+// (of ooo_unit bytes) from ooo_base, so consecutive full-sized segments land
+// in consecutive slots.
+static int sham_ooo_slot(const struct sham_connection *conn, uint32_t seq)
+{
+    return (int)(((seq - conn->ooo_base) / conn->ooo_unit) % (uint32_t)conn->recv_window_slots);
+}
+
+// Describe the out-of-order buffer as merged [start, end) ranges, lowest first.
+// Walking the ring from recv_seq's slot visits segments in sequence order.
+static int sham_build_sack_option(struct sham_connection *conn, struct sham_sack_option *opt)
+{
+    int nblocks = 0;
+    int first;
+    int k;
+    int i;
+
+    if (conn->ooo_count == 0)
+    {
+        return 0;
+    }
+
+    first = sham_ooo_slot(conn, conn->recv_seq);
+    for (k = 0; k < conn->recv_window_slots; k++)
+    {
+        const struct sham_ooo_entry *e = &conn->ooo_buffer[(first + k) % conn->recv_window_slots];
+        uint32_t end;
+
+        if (!e->valid || SHAM_SEQ_LEQ(e->seq, conn->recv_seq))
+        {
+            continue;
+        }
+        end = e->seq + (uint32_t)e->data_len;
+        if (nblocks > 0 && e->seq == opt->blocks[nblocks - 1].end)
+        {
+            opt->blocks[nblocks - 1].end = end;
+            continue;
+        }
+        if (nblocks == SHAM_MAX_SACK_BLOCKS)
+        {
+            break;
+        }
+        opt->blocks[nblocks].start = e->seq;
+        opt->blocks[nblocks].end = end;
+        nblocks++;
+    }
+
+    for (i = 0; i < nblocks; i++)
+    {
+        opt->blocks[i].start = htonl(opt->blocks[i].start);
+        opt->blocks[i].end = htonl(opt->blocks[i].end);
+    }
+    opt->count = (uint8_t)nblocks;
+    memset(opt->reserved, 0, sizeof(opt->reserved));
+
+    return nblocks;
+}
+
+// Send a pure ACK carrying our current advertised window
+static void sham_send_ack(struct sham_connection *conn)
+{
+    struct sham_sack_option sack;
+    struct sham_buf *ack;
+
+    // Report buffered out-of-order data so the sender can skip it
+    if (conn->sack_ok && sham_build_sack_option(conn, &sack) > 0)
+    {
+        ack = sham_build_packet(conn, conn->send_seq, conn->recv_seq, SHAM_ACK | SHAM_SACK,
+                                &sack, SHAM_SACK_OPTION_SIZE(sack.count));
+    }
+    else
+    {
+        ack = sham_build_packet(conn, conn->send_seq, conn->recv_seq, SHAM_ACK, NULL, 0);
+    }
+    if (!ack)
+    {
+        return;
+    }
+
+    // This covers anything a delayed ACK was holding
+    conn->unacked_segments = 0;
+    conn->ack_deadline_us = 0;
+    conn->acked_window = (uint32_t)ntohs(SHAM_BUF_HEADER(ack)->window_size) << (conn->wscale_ok ? conn->rcv_wscale : 0);
+
+    sham_send_packet(conn, ack);
+    sham_trace(conn, SHAM_TRACE_SND_ACK_WIN, conn->recv_seq, conn->acked_window);
+    sham_buf_put(&conn->pool, ack);
+}
+
+// Count an in-order segment; ACK once ack_every are owed, else start the delay
+static void sham_ack_delayed(struct sham_connection *conn)
+{
+    conn->unacked_segments++;
+    if (conn->unacked_segments >= conn->ack_every)
+    {
+        sham_send_ack(conn);
+    }
+    else if (conn->ack_deadline_us == 0)
+    {
+        conn->ack_deadline_us = sham_now_us() + (uint64_t)conn->ack_delay_ms * 1000;
+    }
+}
+
+// Send the held ACK if its delay has run out
+static void sham_ack_if_due(struct sham_connection *conn)
+{
+    if (conn->ack_deadline_us != 0 && sham_now_us() >= conn->ack_deadline_us)
+    {
+        sham_send_ack(conn);
+    }
+}
+
+// Tell the sender as soon as reading has opened the window well past what
+// it last saw (half the buffer or two segments, as in RFC 1122)
+static void sham_ack_window_update(struct sham_connection *conn)
+{
+    uint32_t step = conn->recv_buffer_size / 2;
+    uint32_t window;
+
+    if (step > 2 * conn->rcv_mss)
+    {
+        step = 2 * conn->rcv_mss;
+    }
+    window = sham_calculate_advertised_window(conn);
+    if (window >= conn->acked_window + step)
+    {
+        sham_send_ack(conn);
+    }
+}
+
+// Wait for a packet with timeout
+static int sham_recv_packet_timeout(struct sham_connection *conn,
+                                    struct sham_packet *packet, int timeout_ms)
+{
+    fd_set read_fds;
+    struct timeval timeout;
+    uint64_t deadline_us;
+    int result;
+
+    // A shared socket may hold only other connections' datagrams, so its
+    // reads never block; they route those and return 0
+    bool blocking = !conn->demux;
+
+    // Datagrams left over from the last batch need no wait
+    if (sham_has_pending_packets(conn))
+    {
+        result = sham_recv_packet_mode(conn, packet, blocking);
+        if (result != 0 || timeout_ms == 0)
+        {
+            return result;
+        }
+    }
+    else if (timeout_ms == 0)
+    {
+        return sham_recv_packet_mode(conn, packet, false);
+    }
+
+    // Queued segments must leave before we block for an answer
+    if (sham_flush_packets(conn) < 0)
+    {
+        return -1;
+    }
+
+    deadline_us = sham_now_us() + (uint64_t)timeout_ms * 1000;
+    do
+    {
+        uint64_t now_us = sham_now_us();
+        uint64_t wake_us = deadline_us;
+        uint64_t held_us = sham_netem_deadline_us(conn);
+        long remaining_us;
+
+        if (held_us != 0 && held_us < wake_us)
+        {
+            wake_us = held_us;
+        }
+        remaining_us = (now_us < wake_us) ? (long)(wake_us - now_us) : 0;
+
+        FD_ZERO(&read_fds);
+        FD_SET(conn->sockfd, &read_fds);
+
+        timeout.tv_sec = remaining_us / 1000000;
+        timeout.tv_usec = remaining_us % 1000000;
+
+        result = select(conn->sockfd + 1, &read_fds, NULL, NULL, &timeout);
+        if (result < 0)
+        {
+            return result;
+        }
+        if (result == 0)
+        {
+            // The emulator's delay may have run out rather than the wait:
+            // send what it held, and take what it let in
+            if (sham_flush_packets(conn) < 0)
+            {
+                return -1;
+            }
+            if (!sham_has_pending_packets(conn))
+            {
+                if (sham_now_us() >= deadline_us)
+                {
+                    return 0; // Timeout
+                }
+                continue;
+            }
+        }
+
+        result = sham_recv_packet_mode(conn, packet, blocking);
+    } while (result == 0);
+
+    return result;
+}
+// Wait up to one RTO for the SYN-ACK answering our SYN; anything else is
+// ignored. Returns 1 with it in syn_ack, 0 on timeout or -1 on error.
+static int sham_wait_syn_ack(struct sham_connection *conn, struct sham_packet *syn_ack)
+{
+    uint64_t deadline_us = sham_now_us() + (uint64_t)conn->rto_ms * 1000;
+
+    for (;;)
+    {
+        uint64_t now_us = sham_now_us();
+        int result;
+
+        if (now_us >= deadline_us)
+        {
+            return 0;
+        }
+        result = sham_recv_packet_timeout(conn, syn_ack, (int)((deadline_us - now_us + 999) / 1000));
+        if (result <= 0)
+        {
+            return result;
+        }
+
+        // It acknowledges the SYN and at most the data that rode on it
+        if ((syn_ack->header.flags & (SHAM_SYN | SHAM_ACK)) == (SHAM_SYN | SHAM_ACK) &&
+            SHAM_SEQ_GT(syn_ack->header.ack_num, conn->syn_seq) &&
+            SHAM_SEQ_LEQ(syn_ack->header.ack_num, conn->syn_seq + 1 + conn->syn_data_len))
+        {
+            return 1;
+        }
+    }
+}
+
+// ############## LLM Generated Code Begins ##############
+// Three-way handshake - client side. The first len bytes of data ride in
+// the SYN when we hold a fast open cookie; whatever the server does not
+// take from it is sent once the connection is up.
+int sham_connect_data(struct sham_connection *conn, const char *host, int port, const void *data, size_t len)
+{
+    if (conn->state != SHAM_CLOSED)
+    {
+        fprintf(stderr, "Connection not in CLOSED state\n");
+        return -1;
+    }
+
+    // Create socket if not already created
+    if (conn->sockfd < 0)
+    {
+        conn->sockfd = sham_socket();
+        if (conn->sockfd < 0)
+        {
+            return -1;
+        }
+    }
+    sham_size_socket_buffers(conn);
+    sham_io_setup_offload(conn);
+    sham_pmtu_setup_socket(conn);
+
+    // Resolve hostname
+    struct hostent *he = gethostbyname(host);
+    if (!he)
+    {
+        return -1;
+    }
+
+    // Set up peer address
+    memset(&conn->peer_addr, 0, sizeof(conn->peer_addr));
+    conn->peer_addr.sin_family = AF_INET;
+    conn->peer_addr.sin_port = htons(port);
+    memcpy(&conn->peer_addr.sin_addr, he->h_addr_list[0], he->h_length);
+    conn->peer_len = sizeof(conn->peer_addr);
+
+    // Step 1: Build the SYN: our handshake options, then with a cookie as
+    // much of the data as fits a segment any path carries
+    uint8_t syn[SHAM_BASE_MSS];
+    size_t syn_len = sham_build_syn_options(conn, syn, false);
+    conn->syn_data_len = 0;
+    if (conn->fastopen && conn->fastopen_cookie_len > 0 && len > 0)
+    {
+        size_t room = sizeof(syn) - syn_len - 1;
+
+        conn->syn_data_len = (uint32_t)(len < room ? len : room);
+        syn[syn_len++] = SHAM_OPT_END;
+        memcpy(syn + syn_len, data, conn->syn_data_len);
+        syn_len += conn->syn_data_len;
+    }
+    conn->syn_seq = conn->send_seq;
+    conn->syn_retries = 0;
+    conn->state = SHAM_SYN_SENT;
+
+    // Step 2: Send it and wait for the SYN-ACK, sending it again with the
+    // RTO backed off while none comes
+    struct sham_packet syn_ack;
+    uint64_t syn_time_us;
+    int recv_result;
+    for (;;)
+    {
+        if (sham_send_control(conn, conn->syn_seq, 0, SHAM_SYN, syn, syn_len) < 0)
+        {
+            conn->state = SHAM_CLOSED;
+            return -1;
+        }
+        sham_trace(conn, (conn->syn_retries == 0) ? SHAM_TRACE_SND_SYN : SHAM_TRACE_RETX_SYN, conn->syn_seq, 0);
+        syn_time_us = sham_now_us();
+
+        recv_result = sham_wait_syn_ack(conn, &syn_ack);
+        if (recv_result != 0)
+        {
+            break;
+        }
+        if (conn->syn_retries >= SHAM_MAX_RETRIES)
+        {
+            sham_log_warn(conn->log_file, "[CLIENT] No SYN-ACK after %d retries\n", conn->syn_retries);
+            errno = ETIMEDOUT;
+            recv_result = -1;
+            break;
+        }
+        sham_rto_backoff(conn);
+        conn->syn_retries++;
+        conn->stats.timeouts++;
+        conn->stats.retransmits++;
+    }
+    if (recv_result < 0)
+    {
+        conn->state = SHAM_CLOSED;
+        return -1;
+    }
+
+    sham_trace(conn, SHAM_TRACE_RCV_SYN_ACK, syn_ack.header.seq_num, syn_ack.header.ack_num);
+
+    // Only a SYN sent once gives a valid first sample (Karn); after a resend
+    // the backoff is dropped and the first data segment measures the path
+    if (conn->syn_retries == 0)
+    {
+        sham_rtt_sample(conn, sham_elapsed_us(syn_time_us));
+    }
+    else
+    {
+        conn->rto_ms = SHAM_RTO_MS;
+    }
+
+    // Scaling is only used when the server echoed the option. A server
+    // issuing a cookie puts it in fastopen_cookie for us to keep.
+    sham_parse_syn_options(conn, &syn_ack);
+    if (!conn->wscale_ok)
+    {
+        conn->snd_wscale = 0;
+        conn->rcv_wscale = 0;
+    }
+    conn->peer_window_size = syn_ack.header.window_size;
+
+    // Update sequence numbers, past any data the server took from the SYN
+    conn->syn_data_len = syn_ack.header.ack_num - (conn->syn_seq + 1);
+    conn->peer_syn_seq = syn_ack.header.seq_num;
+    conn->recv_seq = syn_ack.header.seq_num + 1;
+    conn->send_seq = syn_ack.header.ack_num;
+    if (conn->syn_data_len > 0)
+    {
+        sham_log_info(conn->log_file, "[CLIENT] Server took %u bytes from the SYN\n", conn->syn_data_len);
+        conn->stats.bytes_sent += conn->syn_data_len;
+        conn->last_byte_sent = conn->send_seq;
+        conn->last_byte_acked = conn->send_seq;
+    }
+
+    // Step 3: Send ACK
+    if (sham_send_control(conn, conn->send_seq, conn->recv_seq, SHAM_ACK, NULL, 0) < 0)
+    {
+        conn->state = SHAM_CLOSED;
+        return -1;
+    }
+
+    sham_trace(conn, SHAM_TRACE_SND_ACK, conn->recv_seq, 0);
+
+    conn->state = SHAM_ESTABLISHED;
+    conn->send_base = conn->send_seq;
+    sham_pmtu_init(conn);
+
+    // Send what the SYN did not carry
+    if (len > conn->syn_data_len &&
+        sham_send(conn, (const uint8_t *)data + conn->syn_data_len, len - conn->syn_data_len) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+// ############## LLM Generated Code Ends ##############
+
+int sham_connect(struct sham_connection *conn, const char *host, int port)
+{
+    return sham_connect_data(conn, host, port, NULL, 0);
+}
+
+// Listen for connections
+int sham_listen(struct sham_connection *conn, int port)
+{
+    if (conn->state != SHAM_CLOSED)
+    {
+        fprintf(stderr, "Connection not in CLOSED state\n");
+        return -1;
+    }
+
+    // Create and bind socket
+    conn->sockfd = sham_socket();
+    if (conn->sockfd < 0)
+    {
+        return -1;
+    }
+
+    if (sham_bind(conn->sockfd, port, conn->reuseport) < 0)
+    {
+        return -1;
+    }
+    sham_size_socket_buffers(conn);
+    sham_io_setup_offload(conn);
+    sham_pmtu_setup_socket(conn);
+
+    // Accepted connections share this socket; the table routes their datagrams
+    if (sham_demux_init(conn) < 0)
+    {
+        return -1;
+    }
+
+    conn->state = SHAM_LISTEN;
+    sham_log_info(conn->log_file, "[SERVER] Listening on port %d\n", port);
+
+    return 0;
+}
+// Complete a passive open on the ACK of our SYN-ACK. A data segment carries
+// the same acknowledgement, so it also completes it if the ACK was lost, and
+// so does reading the data of a fast open SYN. Returns -1 for anything else.
+static int sham_finish_accept(struct sham_connection *conn, const struct sham_packet *ack)
+{
+    if (!(ack->header.flags & SHAM_ACK) && ack->data_len == 0)
+    {
+        return -1;
+    }
+    if ((ack->header.flags & SHAM_SYN) || ack->header.ack_num != conn->send_seq)
+    {
+        return -1;
+    }
+
+    sham_log_info(conn->log_file, "[SERVER] Received final ACK, connection established\n");
+
+    // Only an ACK of a SYN-ACK sent once gives a valid sample (Karn)
+    if ((ack->header.flags & SHAM_ACK) && conn->syn_retries == 0)
+    {
+        sham_rtt_sample(conn, sham_elapsed_us(conn->syn_ack_time_us));
+    }
+    else if (conn->syn_retries > 0)
+    {
+        conn->rto_ms = SHAM_RTO_MS;
+    }
+    if (conn->verbose_log_file)
+    {
+        sham_trace(conn, SHAM_TRACE_RCV_ACK_FOR_SYN, 0, 0);
+    }
+
+    conn->state = SHAM_ESTABLISHED;
+    conn->send_base = conn->send_seq;
+    conn->peer_window_size = (uint32_t)ack->header.window_size << conn->snd_wscale;
+    sham_pmtu_init(conn);
+    return 0;
+}
+
+// Set a data segment or FIN aside for the next read, at the back of the
+// queue or (for one a read handed back) the front. A full queue drops it;
+// the peer retransmits what we never acknowledged.
+static void sham_hold_packet(struct sham_connection *conn, const struct sham_packet *packet, bool front)
+{
+    int capacity = conn->recv_window_slots + 1;
+    int idx = front ? (conn->held_head + capacity - 1) % capacity : (conn->held_head + conn->held_count) % capacity;
+    struct sham_packet *slot;
+
+    if (conn->held_count == capacity)
+    {
+        sham_log_warn(conn->log_file, "[RECV] Hold queue full, dropping seq=%u\n", packet->header.seq_num);
+        conn->stats.dropped++;
+        return;
+    }
+
+    slot = &conn->held[idx];
+    *slot = *packet;
+    if (packet->buf)
+    {
+        slot->buf = sham_buf_ref(packet->buf);
+    }
+    else
+    {
+        // Segment of a coalesced receive; it needs a buffer of its own
+        slot->buf = sham_buf_get(&conn->pool);
+        if (!slot->buf)
+        {
+            return;
+        }
+        memcpy(slot->buf->wire, packet->data, packet->data_len);
+        slot->buf->len = packet->data_len;
+        slot->data = slot->buf->wire;
+    }
+    if (front)
+    {
+        conn->held_head = idx;
+    }
+    conn->held_count++;
+}
+
+// Take the oldest held packet; its payload stays valid until the next call
+static bool sham_take_held(struct sham_connection *conn, struct sham_packet *packet)
+{
+    if (conn->held_count == 0)
+    {
+        return false;
+    }
+
+    sham_buf_put(&conn->pool, conn->held_current);
+    *packet = conn->held[conn->held_head];
+    conn->held_current = packet->buf;
+    conn->held_head = (conn->held_head + 1) % (conn->recv_window_slots + 1);
+    conn->held_count--;
+    return true;
+}
+
+// Wait up to timeout_ms for a packet on behalf of the send path and apply
+// its ACK. Data and FINs are held for the next read instead of dropped.
+static int sham_wait_ack(struct sham_connection *conn, int timeout_ms)
+{
+    struct sham_packet packet;
+    int result = sham_recv_packet_timeout(conn, &packet, timeout_ms);
+
+    if (result <= 0)
+    {
+        return result;
+    }
+
+    if (conn->state == SHAM_SYN_RECEIVED)
+    {
+        if (sham_finish_accept(conn, &packet) < 0)
+        {
+            return result;
+        }
+    }
+    else if (packet.header.flags & SHAM_ACK)
+    {
+        sham_process_ack(conn, &packet);
+    }
+
+    if (packet.data_len > 0 || (packet.header.flags & SHAM_FIN))
+    {
+        sham_hold_packet(conn, &packet, false);
+    }
+    return result;
+}
+
+// Next packet for a reader: one held earlier (its ACK already applied), or
+// a fresh one whose ACK is applied here. Returns as sham_recv_packet_timeout.
+static int sham_next_input(struct sham_connection *conn, struct sham_packet *packet, int timeout_ms)
+{
+    int result;
+
+    if (sham_take_held(conn, packet))
+    {
+        return 1;
+    }
+
+    result = sham_recv_packet_timeout(conn, packet, timeout_ms);
+    if (result > 0 && conn->state != SHAM_SYN_RECEIVED && (packet->header.flags & SHAM_ACK))
+    {
+        sham_process_ack(conn, packet);
+    }
+    return result;
+}
+
+// ############## LLM Generated Code Begins ##############
+// Accept a connection
+struct sham_connection *sham_accept(struct sham_connection *listen_conn)
+{
+    if (listen_conn->state != SHAM_LISTEN)
+    {
+        fprintf(stderr, "Connection not in LISTEN state\n");
+        return NULL;
+    }
+
+    // If listening socket is invalid, abort accept and signal caller
+    if (listen_conn->sockfd < 0)
+    {
+        sham_log_warn(listen_conn->log_file, "[SERVER] Listening socket invalid, cannot accept\n");
+        return NULL;
+    }
+
+    // Wait for SYN
     struct sham_packet syn;
     int recv_result = sham_recv_packet(listen_conn, &syn);
     if (recv_result <= 0)
     {
-        // If socket became invalid, tell caller
-        if (listen_conn->sockfd < 0)
+        // If socket became invalid, tell caller
+        if (listen_conn->sockfd < 0)
+        {
+            sham_log_warn(listen_conn->log_file, "[SERVER] Listening socket failed, shutting down accept\n");
+        }
+        return NULL;
+    }
+
+    if (!(syn.header.flags & SHAM_SYN))
+    {
+        sham_log(listen_conn->log_file, "[SERVER] Expected SYN, got flags=0x%x\n", syn.header.flags);
+        return NULL;
+    }
+
+    // A peer with a connection has its datagrams routed there, so this is a
+    // SYN repeated before its first one was accepted
+    if (sham_demux_lookup(listen_conn->demux, &listen_conn->peer_addr))
+    {
+        sham_log(listen_conn->log_file, "[SERVER] Duplicate SYN, seq=%u\n", syn.header.seq_num);
+        return NULL;
+    }
+
+    sham_log(listen_conn->log_file, "[SERVER] Received SYN, seq=%u\n", syn.header.seq_num);
+    if (listen_conn->verbose_log_file)
+    {
+        sham_trace(listen_conn, SHAM_TRACE_RCV_SYN, syn.header.seq_num, 0);
+    }
+
+    // Create new connection for client
+    struct sham_connection *new_conn = sham_create_connection();
+    if (!new_conn)
+    {
+        return NULL;
+    }
+
+    // Rings and buffers are sized like the listener's
+    if (sham_set_window_slots(new_conn, listen_conn->send_window_slots, listen_conn->recv_window_slots) < 0 ||
+        sham_set_mss(new_conn, listen_conn->mss_limit) < 0)
+    {
+        sham_free_connection(new_conn);
+        return NULL;
+    }
+
+    new_conn->peer_addr = listen_conn->peer_addr; // Copy peer address set by sham_recv_packet
+    new_conn->peer_len = listen_conn->peer_len;   // Copy peer length set by sham_recv_packet
+
+    // The socket is shared; from here on the peer's datagrams are routed to us
+    if (sham_demux_add(listen_conn->demux, new_conn) < 0)
+    {
+        sham_free_connection(new_conn);
+        return NULL;
+    }
+    new_conn->sockfd = listen_conn->sockfd;
+    new_conn->peer_syn_seq = syn.header.seq_num;
+    new_conn->recv_seq = syn.header.seq_num + 1;
+    new_conn->state = SHAM_SYN_RECEIVED;
+
+    // Copy impairments and verbose logging from listening connection
+    if (sham_netem_inherit(new_conn, listen_conn) < 0)
+    {
+        sham_free_connection(new_conn);
+        return NULL;
+    }
+    new_conn->verbose_log_file = listen_conn->verbose_log_file;
+    new_conn->sack_enabled = listen_conn->sack_enabled;
+    new_conn->streams_enabled = listen_conn->streams_enabled;
+    new_conn->fec_enabled = listen_conn->fec_enabled;
+    new_conn->fec_k = listen_conn->fec_k;
+    new_conn->fec_adaptive = listen_conn->fec_adaptive;
+    new_conn->offload = listen_conn->offload;
+    new_conn->pacing = listen_conn->pacing;
+    new_conn->nodelay = listen_conn->nodelay;
+    new_conn->file_digest = listen_conn->file_digest;
+    new_conn->file_compress = listen_conn->file_compress;
+    new_conn->pmtud = listen_conn->pmtud;
+    new_conn->gro_enabled = listen_conn->gro_enabled;
+    new_conn->recv_timeout_ms = listen_conn->recv_timeout_ms;
+    new_conn->ack_every = listen_conn->ack_every;
+    new_conn->ack_delay_ms = listen_conn->ack_delay_ms;
+    sham_set_congestion_control(new_conn, listen_conn->cc->name);
+
+    // Answer the options the client offered
+    size_t syn_data_at = sham_parse_syn_options(new_conn, &syn);
+    if (!new_conn->wscale_ok)
+    {
+        new_conn->rcv_wscale = 0;
+    }
+    new_conn->peer_window_size = syn.header.window_size;
+
+    // Fast open: the data of a SYN with a valid cookie is taken now, and a
+    // client that asked without one is issued one for next time
+    if (listen_conn->fastopen && new_conn->fastopen)
+    {
+        if (sham_fastopen_check(&new_conn->peer_addr, new_conn->fastopen_cookie, new_conn->fastopen_cookie_len))
+        {
+            new_conn->syn_data_len = (uint32_t)(syn.data_len - syn_data_at);
+        }
+        else
+        {
+            sham_fastopen_cookie(&new_conn->peer_addr, new_conn->fastopen_cookie);
+            new_conn->fastopen_cookie_len = SHAM_FASTOPEN_COOKIE_LEN;
+            new_conn->fastopen_offer = true;
+        }
+    }
+
+    // Send SYN-ACK
+    new_conn->syn_seq = new_conn->send_seq;
+    if (sham_send_syn_ack(new_conn) < 0)
+    {
+        sham_free_connection(new_conn);
+        return NULL;
+    }
+
+    sham_log(listen_conn->log_file, "[SERVER] Sent SYN-ACK, seq=%u, ack=%u\n",
+             new_conn->syn_seq, new_conn->recv_seq + new_conn->syn_data_len);
+    if (new_conn->verbose_log_file)
+    {
+        sham_trace(new_conn, SHAM_TRACE_SND_SYN_ACK, new_conn->syn_seq, new_conn->recv_seq + new_conn->syn_data_len);
+    }
+
+    new_conn->send_seq++;
+
+    // The SYN's data waits for the first read like any early segment. Its
+    // reading completes the open, as the client may already be sending more.
+    if (new_conn->syn_data_len > 0)
+    {
+        struct sham_packet syn_data = syn;
+
+        sham_log_info(listen_conn->log_file, "[SERVER] Took %u bytes from a fast open SYN\n", new_conn->syn_data_len);
+        syn_data.header.flags = 0;
+        syn_data.header.seq_num = new_conn->recv_seq;
+        syn_data.header.ack_num = new_conn->send_seq;
+        syn_data.data += syn_data_at;
+        syn_data.data_len = new_conn->syn_data_len;
+        sham_hold_packet(new_conn, &syn_data, false);
+    }
+
+    // A polling listener must not stall on one handshake; the peer's first
+    // packet completes it in sham_recv instead
+    if (new_conn->recv_timeout_ms == 0)
+    {
+        return new_conn;
+    }
+
+    // Wait for final ACK, sending the SYN-ACK again as its timer runs out.
+    // A data segment that completes the open is kept for the first read.
+    struct sham_packet final_ack;
+    while (new_conn->state == SHAM_SYN_RECEIVED)
+    {
+        int wait_ms = sham_next_timeout_ms(new_conn);
+        int result = sham_recv_packet_timeout(new_conn, &final_ack, wait_ms);
+
+        if (result == 0 && sham_handle_timeout(new_conn) == 0)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            sham_log_warn(listen_conn->log_file, "[SERVER] Timeout waiting for final ACK\n");
+            sham_free_connection(new_conn);
+            return NULL;
+        }
+
+        if (sham_finish_accept(new_conn, &final_ack) == 0 && final_ack.data_len > 0)
+        {
+            sham_hold_packet(new_conn, &final_ack, false);
+        }
+    }
+
+    return new_conn;
+}
+
+// Is this heap entry still the armed deadline of an unacknowledged segment?
+// A SACKed segment keeps its timer only at the head of the window, where it
+// guards against the cumulative ACK for it being lost.
+static bool sham_rtx_timer_live(struct sham_connection *conn, const struct sham_timer *timer)
+{
+    int offset = (timer->slot - conn->window_start + conn->send_window_slots) % conn->send_window_slots;
+    struct sham_window_entry *entry = &conn->send_window[timer->slot];
+
+    return offset < conn->window_count && !entry->acked && (!entry->sacked || offset == 0) &&
+           entry->seq == timer->seq && entry->deadline_us == timer->deadline_us;
+}
+
+// Drop stale heap entries by re-arming only the segments still in flight
+static void sham_rebuild_rtx_timers(struct sham_connection *conn)
+{
+    int i;
+
+    sham_timer_clear(&conn->rtx_timers);
+    for (i = 0; i < conn->window_count; i++)
+    {
+        int idx = (conn->window_start + i) % conn->send_window_slots;
+        struct sham_window_entry *entry = &conn->send_window[idx];
+
+        if (!entry->acked && (!entry->sacked || i == 0))
+        {
+            sham_timer_push(&conn->rtx_timers, entry->deadline_us, idx, entry->seq);
+        }
+    }
+}
+
+// Arm a window slot's retransmission deadline from its last send time
+static void sham_arm_rtx_timer(struct sham_connection *conn, int idx)
+{
+    struct sham_window_entry *entry = &conn->send_window[idx];
+
+    // Acknowledged segments leave their entries behind; compact when they pile up
+    if (conn->rtx_timers.count > 2 * conn->send_window_slots + SHAM_TIMER_SLACK)
+    {
+        sham_rebuild_rtx_timers(conn);
+    }
+
+    entry->deadline_us = entry->send_time_us + (uint64_t)conn->rto_ms * 1000;
+    sham_timer_push(&conn->rtx_timers, entry->deadline_us, idx, entry->seq);
+}
+
+// Retransmit a window entry. One cut before the segment size last dropped
+// goes out in pieces of the current size; the receiver takes them in order.
+static int sham_resend_segment(struct sham_connection *conn, const struct sham_window_entry *entry)
+{
+    const uint8_t *payload = SHAM_BUF_DATA(entry->buf) + entry->offset;
+    size_t off;
+
+    if (entry->offset == 0 && entry->data_len <= conn->mss)
+    {
+        return sham_send_packet(conn, entry->buf);
+    }
+
+    for (off = 0; off < entry->data_len; off += conn->mss)
+    {
+        size_t piece_len = (entry->data_len - off > conn->mss) ? conn->mss : entry->data_len - off;
+        struct sham_buf *piece = sham_build_packet(conn, entry->seq + (uint32_t)off, conn->recv_seq, SHAM_ACK,
+                                                   payload + off, piece_len);
+        int queued;
+
+        if (!piece)
+        {
+            return -1;
+        }
+        queued = sham_queue_packet(conn, piece);
+        sham_buf_put(&conn->pool, piece);
+        if (queued < 0)
+        {
+            return -1;
+        }
+    }
+    return sham_flush_packets(conn);
+}
+
+// How long the send path may block: until the next deadline, or one RTO if none
+static int sham_send_wait_ms(struct sham_connection *conn)
+{
+    int wait_ms = sham_next_timeout_ms(conn);
+    return (wait_ms < 0) ? conn->rto_ms : wait_ms;
+}
+
+// Queue data into the sliding window without waiting for it to be acknowledged.
+// When blocking, waits while the window or flow control is full; otherwise
+// stops there. Returns bytes queued.
+static int sham_send_segments(struct sham_connection *conn, const void *data, size_t len, bool blocking)
+{
+    const uint8_t *send_data;
+    size_t bytes_sent;
+    size_t chunk_size;
+    struct sham_buf *data_buf;
+    int window_idx;
+    long pace_us;
+    uint16_t fec_flags;
+
+    // After the peer's FIN we may still send until we close
+    if (conn->state != SHAM_ESTABLISHED && conn->state != SHAM_CLOSE_WAIT)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    send_data = (const uint8_t *)data;
+    bytes_sent = 0;
+
+    while (bytes_sent < len)
+    {
+        // Process any incoming ACKs, once per flushed batch
+        while (sham_queued_packets(conn) == 0 && sham_wait_ack(conn, 0) > 0)
+        {
+            // Applied by sham_wait_ack
+        }
+
+        // Handle timeouts and retransmissions
+        if (sham_handle_timeout(conn) < 0)
+        {
+            return -1;
+        }
+
+        // Check if packet window is full; block until an ACK frees a slot
+        if (conn->window_count >= conn->send_window_slots)
+        {
+            if (!blocking)
+            {
+                break;
+            }
+            sham_wait_ack(conn, sham_send_wait_ms(conn));
+            continue;
+        }
+
+        // Calculate chunk size
+        chunk_size = (len - bytes_sent > conn->mss) ? conn->mss : (len - bytes_sent);
+
+        // Check flow and congestion control - can we send this much data?
+        if (!sham_can_send_data(conn, chunk_size))
+        {
+            sham_log(conn->log_file, "[FLOW] Cannot send %zu bytes due to flow control, waiting...\n", chunk_size);
+            sham_stats_stall_begin(conn);
+            if (!blocking)
+            {
+                break;
+            }
+
+            // The next ACK or window update opens the window
+            sham_wait_ack(conn, sham_send_wait_ms(conn));
+            continue;
+        }
+        sham_stats_stall_end(conn);
+
+        // Pacing: send what is queued and wait for the bucket to cover
+        // this segment, applying ACKs in the meantime
+        pace_us = sham_pace_delay_us(conn, chunk_size);
+        if (pace_us > 0)
+        {
+            if (!blocking)
+            {
+                break;
+            }
+            if (sham_flush_packets(conn) < 0)
+            {
+                return -1;
+            }
+            sham_wait_ack(conn, (int)((pace_us + 999) / 1000));
+            continue;
+        }
+
+        // Build the segment in place; the window slot owns the buffer. It
+        // acknowledges what we hold, so a lost pure ACK does not leave both
+        // ends waiting when each is sending
+        fec_flags = sham_fec_data_flags(conn);
+        data_buf = sham_build_packet(conn, conn->send_seq, conn->recv_seq, SHAM_ACK | fec_flags,
+                                     send_data + bytes_sent, chunk_size);
+        if (!data_buf)
+        {
+            return -1;
+        }
+
+        // Leaves with the rest of the batch, or before the next blocking wait.
+        // The segment that completes an FEC block takes its parity along.
+        if (sham_queue_packet(conn, data_buf) < 0 ||
+            (fec_flags && sham_fec_add(conn, conn->send_seq, send_data + bytes_sent, chunk_size) < 0) ||
+            (sham_queued_packets(conn) == SHAM_IO_BATCH && sham_flush_packets(conn) < 0))
+        {
+            sham_buf_put(&conn->pool, data_buf);
+            return -1;
+        }
+
+        // Update flow control tracking
+        sham_update_flow_control(conn, chunk_size);
+        sham_pace_consume(conn, chunk_size);
+
+        // Add to sliding window
+        window_idx = (conn->window_start + conn->window_count) % conn->send_window_slots;
+        conn->send_window[window_idx].buf = data_buf;
+        conn->send_window[window_idx].seq = conn->send_seq;
+        conn->send_window[window_idx].data_len = chunk_size;
+        conn->send_window[window_idx].offset = 0;
+        conn->send_window[window_idx].acked = false;
+        conn->send_window[window_idx].sacked = false;
+        conn->send_window[window_idx].recovery_retx = false;
+        conn->send_window[window_idx].retries = 0;
+        conn->send_window[window_idx].send_time_us = sham_now_us();
+        sham_arm_rtx_timer(conn, window_idx);
+
+        conn->window_count++;
+        conn->send_seq += chunk_size;
+        bytes_sent += chunk_size;
+        conn->stats.bytes_sent += chunk_size;
+        conn->stats.segments_sent++;
+
+        sham_log(conn->log_file, "[SEND] Packet sent, seq=%u, len=%zu\n",
+                 conn->send_seq - chunk_size, chunk_size);
+        sham_trace(conn, SHAM_TRACE_SND_DATA, (uint32_t)(conn->send_seq - chunk_size), (uint32_t)chunk_size);
+    }
+
+    if (sham_flush_packets(conn) < 0)
+    {
+        return -1;
+    }
+
+    return bytes_sent;
+}
+
+// Should the bytes held back from earlier writes leave now?
+static bool sham_coalesce_due(const struct sham_connection *conn)
+{
+    return conn->coalesce_len > 0 &&
+           (conn->nodelay || conn->window_count == 0 || sham_now_us() >= conn->coalesce_deadline_us);
+}
+
+// Send the bytes held back from earlier writes, as many as the windows take
+// when not blocking. Returns -1 on error.
+static int sham_coalesce_push(struct sham_connection *conn, bool blocking)
+{
+    size_t len = conn->coalesce_len;
+    int sent;
+
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    // Timer work while they are being sent must not send them again
+    conn->coalesce_len = 0;
+    sent = sham_send_segments(conn, conn->coalesce, len, blocking);
+    if (sent < 0)
+    {
+        conn->coalesce_len = len;
+        return -1;
+    }
+    memmove(conn->coalesce, conn->coalesce + sent, len - (size_t)sent);
+    conn->coalesce_len = len - (size_t)sent;
+    return 0;
+}
+
+// Queue a write, holding back its partial last segment while earlier data is
+// unacknowledged (Nagle's algorithm) unless the connection is nodelay. Held
+// bytes go once later writes fill the segment, once nothing is in flight, or
+// after SHAM_COALESCE_DELAY_MS, so a delayed ACK cannot stall them for long;
+// sham_flush sends them at once. Returns bytes taken, held ones included.
+static int sham_send_coalesced(struct sham_connection *conn, const uint8_t *data, size_t len, bool blocking)
+{
+    size_t taken = 0;
+    size_t send_len;
+    size_t tail;
+    int sent;
+
+    if (conn->state != SHAM_ESTABLISHED && conn->state != SHAM_CLOSE_WAIT)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    // Earlier bytes come first: top them up, and send them if they are due
+    if (conn->coalesce_len > 0)
+    {
+        size_t room = (conn->mss > conn->coalesce_len) ? conn->mss - conn->coalesce_len : 0;
+
+        taken = (len < room) ? len : room;
+        memcpy(conn->coalesce + conn->coalesce_len, data, taken);
+        conn->coalesce_len += taken;
+        if (conn->coalesce_len < conn->mss && !sham_coalesce_due(conn))
+        {
+            return (int)taken;
+        }
+        if (sham_coalesce_push(conn, blocking) < 0)
+        {
+            return -1;
+        }
+        if (conn->coalesce_len > 0)
+        {
+            return (int)taken; // The window is full
+        }
+    }
+
+    // Whole segments go now, and so does a partial one with nothing in flight
+    send_len = len - taken;
+    tail = send_len % conn->mss;
+    if (!conn->nodelay && tail > 0 && (send_len > tail || conn->window_count > 0))
+    {
+        send_len -= tail;
+    }
+    if (send_len > 0)
+    {
+        sent = sham_send_segments(conn, data + taken, send_len, blocking);
+        if (sent < 0)
+        {
+            return -1;
+        }
+        taken += (size_t)sent;
+        if ((size_t)sent < send_len)
+        {
+            return (int)taken;
+        }
+    }
+
+    // Hold the rest for the next write
+    if (taken < len)
+    {
+        if (!conn->coalesce && !(conn->coalesce = malloc(conn->mss_limit)))
+        {
+            return taken > 0 ? (int)taken : -1;
+        }
+        memcpy(conn->coalesce, data + taken, len - taken);
+        conn->coalesce_len = len - taken;
+        conn->coalesce_deadline_us = sham_now_us() + (uint64_t)SHAM_COALESCE_DELAY_MS * 1000;
+    }
+    return (int)len;
+}
+
+// Wait until every packet in the send window has been acknowledged
+int sham_flush(struct sham_connection *conn)
+{
+    // Held bytes go first, then the parity of the last FEC block
+    if (sham_coalesce_push(conn, true) < 0 || sham_fec_flush(conn) < 0 || sham_flush_packets(conn) < 0)
+    {
+        return -1;
+    }
+
+    while (conn->window_count > 0)
+    {
+        sham_wait_ack(conn, sham_send_wait_ms(conn));
+        if (sham_handle_timeout(conn) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Send data reliably with sliding window
+int sham_send(struct sham_connection *conn, const void *data, size_t len)
+{
+    int bytes_sent = sham_send_coalesced(conn, data, len, true);
+    if (bytes_sent < 0)
+    {
+        return -1;
+    }
+
+    // Wait for all packets to be acknowledged
+    if (sham_flush(conn) < 0)
+    {
+        return -1;
+    }
+
+    sham_log(conn->log_file, "[SEND] All data sent and acknowledged: %d bytes\n", bytes_sent);
+    return bytes_sent;
+}
+
+// Send data without draining the window; later writes keep the pipe full.
+// Call sham_flush (or sham_close) to wait for the acknowledgments.
+int sham_send_stream(struct sham_connection *conn, const void *data, size_t len)
+{
+    return sham_send_coalesced(conn, data, len, true);
+}
+
+// Queue as much of data as the windows allow and return without waiting.
+// Returns bytes queued, or -1 with errno EAGAIN when nothing fits yet.
+int sham_write(struct sham_connection *conn, const void *data, size_t len)
+{
+    int queued;
+
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    queued = sham_send_coalesced(conn, data, len, false);
+    if (queued == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return queued;
+}
+// ############## LLM Generated Code Ends ##############
+
+// Bytes at the front of an in-order segment of len that belong in the file sink
+static size_t sham_sink_room(const struct sham_connection *conn, size_t len)
+{
+    uint64_t left;
+
+    if (conn->sink_fd < 0 || conn->sink_pos >= conn->sink_end)
+    {
+        return 0;
+    }
+    left = conn->sink_end - conn->sink_pos;
+    return (len < left) ? len : (size_t)left;
+}
+
+// Write segment (or expanded) data into the file at offset pos
+static int sham_sink_write(struct sham_connection *conn, int fd, const uint8_t *data, size_t len, uint64_t pos)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, data, len, (off_t)pos);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            sham_log_warn(conn->log_file, "[FILE] Write at offset %llu failed: %s\n",
+                     (unsigned long long)pos, strerror(errno));
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+        pos += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Pass the sink its next in-order bytes: write them, unless they went out
+// when they arrived early, and feed the digest
+static int sham_sink_deliver(struct sham_connection *conn, const uint8_t *data, size_t len, bool written)
+{
+    if (len == 0)
+    {
+        return 0;
+    }
+    if (!written && sham_sink_write(conn, conn->sink_fd, data, len, conn->sink_pos) < 0)
+    {
+        return -1;
+    }
+    if (conn->sink_digest)
+    {
+        sham_digest_update(conn->sink_digest, data, len);
+    }
+    conn->sink_pos += len;
+    return 0;
+}
+
+// Append in-order bytes to the receive queue. Returns how many fit.
+static size_t sham_queue_push(struct sham_connection *conn, const uint8_t *data, size_t len)
+{
+    size_t room = conn->recv_buffer_size - conn->recv_buffer_used;
+    size_t tail;
+    size_t first;
+
+    if (len > room)
+    {
+        len = room;
+    }
+    if (len == 0 || (!conn->recv_queue && !(conn->recv_queue = malloc(conn->recv_buffer_size))))
+    {
+        return 0;
+    }
+
+    tail = (conn->recv_queue_head + conn->recv_buffer_used) % conn->recv_buffer_size;
+    first = conn->recv_buffer_size - tail;
+    if (first > len)
+    {
+        first = len;
+    }
+    memcpy(conn->recv_queue + tail, data, first);
+    memcpy(conn->recv_queue, data + first, len - first);
+    conn->recv_buffer_used += (uint32_t)len;
+    return len;
+}
+
+// Take up to len bytes off the front of the receive queue into out, or into
+// the file sink when out is NULL. Returns bytes taken, -1 if the sink fails.
+static int sham_queue_pop(struct sham_connection *conn, uint8_t *out, size_t len)
+{
+    size_t done = 0;
+
+    if (len > conn->recv_buffer_used)
+    {
+        len = conn->recv_buffer_used;
+    }
+    while (done < len)
+    {
+        const uint8_t *data = conn->recv_queue + conn->recv_queue_head;
+        size_t piece = conn->recv_buffer_size - conn->recv_queue_head;
+
+        if (piece > len - done)
         {
-            sham_log(listen_conn->log_file, "[SERVER] Listening socket failed, shutting down accept\n");
+            piece = len - done;
         }
-        return NULL;
+        if (out)
+        {
+            memcpy(out + done, data, piece);
+        }
+        else if (sham_sink_deliver(conn, data, piece, false) < 0)
+        {
+            return -1;
+        }
+        conn->recv_queue_head = (conn->recv_queue_head + piece) % conn->recv_buffer_size;
+        conn->recv_buffer_used -= (uint32_t)piece;
+        done += piece;
     }
+    return (int)done;
+}
 
-    if (!(syn.header.flags & SHAM_SYN))
+// Take in-order data at recv_seq: the file sink's share, then what the read
+// has room for, then the rest into the receive queue. Data already written
+// to the file only moves the sink on. Returns bytes taken, short when the
+// queue is full, or -1 if the sink cannot be written.
+static int sham_recv_take(struct sham_connection *conn, const uint8_t *data, size_t len, bool written,
+                          uint8_t *buffer, size_t *buffer_pos, size_t buffer_size)
+{
+    size_t to_sink = written ? len : sham_sink_room(conn, len);
+    size_t copy_len = (len - to_sink > buffer_size - *buffer_pos) ? buffer_size - *buffer_pos : len - to_sink;
+    size_t taken;
+
+    if (sham_sink_deliver(conn, data, to_sink, written) < 0)
     {
-        sham_log(listen_conn->log_file, "[SERVER] Expected SYN, got flags=0x%x\n", syn.header.flags);
-        return NULL;
+        return -1;
+    }
+    if (copy_len > 0)
+    {
+        memcpy(buffer + *buffer_pos, data + to_sink, copy_len);
+        *buffer_pos += copy_len;
+    }
+    taken = to_sink + copy_len;
+    if (taken < len)
+    {
+        taken += sham_queue_push(conn, data + taken, len - taken);
     }
 
-    sham_log(listen_conn->log_file, "[SERVER] Received SYN, seq=%u\n", syn.header.seq_num);
-    if (listen_conn->verbose_log_file)
+    conn->recv_seq += (uint32_t)taken;
+    conn->stats.bytes_received += taken;
+    return (int)taken;
+}
+
+// Receive data with out-of-order handling, waiting up to timeout_ms for each segment
+static int sham_recv_timeout(struct sham_connection *conn, void *buffer, size_t len, int timeout_ms)
+{
+    uint8_t *recv_buffer = (uint8_t *)buffer;
+    size_t bytes_received = 0;
+    bool sinking = sham_sink_room(conn, 1) > 0;
+
+    // Queued bytes come first: file data among them goes to the sink, which
+    // may have been set up since they arrived. A read they fill is done.
+    if (sinking && sham_queue_pop(conn, NULL, sham_sink_room(conn, conn->recv_buffer_used)) < 0)
+    {
+        return -1;
+    }
+    bytes_received = (size_t)sham_queue_pop(conn, recv_buffer, len);
+
+    if (conn->state != SHAM_ESTABLISHED && conn->state != SHAM_SYN_RECEIVED)
+    {
+        return (bytes_received > 0 || conn->state == SHAM_CLOSE_WAIT) ? (int)bytes_received : -1;
+    }
+    if (conn->recv_buffer_used > 0)
+    {
+        sham_ack_window_update(conn);
+        return (int)bytes_received;
+    }
+
+    // A polling server reads before the final ACK is in; its SYN-ACK may be due
+    // again, and so may bytes held back from its last write
+    sham_ack_if_due(conn);
+    if (sham_syn_ack_if_due(conn) < 0 || (sham_coalesce_due(conn) && sham_coalesce_push(conn, false) < 0))
+    {
+        return -1;
+    }
+
+    // Segments left buffered by an earlier call may be deliverable now
+    uint32_t prev_recv_seq = conn->recv_seq;
+    if (sham_deliver_ooo_packets(conn, recv_buffer, &bytes_received, len) < 0)
+    {
+        return -1;
+    }
+    if (conn->recv_seq != prev_recv_seq)
+    {
+        sham_send_ack(conn);
+    }
+
+    // A file read may take no bytes itself and only fill the sink
+    while (bytes_received < len || (sinking && sham_sink_room(conn, 1) > 0))
+    {
+        struct sham_packet packet;
+        int wait_ms = timeout_ms;
+        int result;
+        int taken;
+        bool ack_now;
+
+        // A held ACK bounds the wait
+        if (conn->ack_deadline_us != 0)
+        {
+            uint64_t now_us = sham_now_us();
+            int ack_ms = (conn->ack_deadline_us > now_us) ? (int)((conn->ack_deadline_us - now_us + 999) / 1000) : 0;
+            if (ack_ms < wait_ms)
+            {
+                wait_ms = ack_ms;
+            }
+        }
+
+        result = sham_next_input(conn, &packet, wait_ms);
+        if (result == 0 && wait_ms < timeout_ms)
+        {
+            sham_send_ack(conn); // The delay ran out first; keep waiting for data
+            continue;
+        }
+        if (result <= 0)
+        {
+            break; // Timeout or error
+        }
+
+        // Accepted without waiting: the first ACK of our SYN-ACK establishes us
+        if (conn->state == SHAM_SYN_RECEIVED && sham_finish_accept(conn, &packet) < 0)
+        {
+            continue;
+        }
+
+        if (packet.data_len > 0)
+        {
+            // Out-of-order data and duplicates are ACKed at once so the
+            // sender's loss detection is not slowed down
+            ack_now = true;
+            conn->stats.segments_received++;
+
+            if (packet.header.seq_num == conn->recv_seq)
+            {
+                // A filled gap is reported at once too, and so is a short
+                // segment: it ends a write whose sender may be waiting on us
+                ack_now = conn->ooo_count > 0 || packet.data_len < conn->rcv_mss || conn->ack_every <= 1;
+
+                // In-order packet: file data to the sink, then the caller's
+                // buffer; what the read has no room for waits in the queue
+                taken = sham_recv_take(conn, packet.data, packet.data_len, false, recv_buffer, &bytes_received, len);
+                if (taken < 0)
+                {
+                    return -1;
+                }
+
+                // Only a full queue leaves some over; it is read again later
+                if ((size_t)taken < packet.data_len)
+                {
+                    struct sham_packet rest = packet;
+
+                    rest.header.seq_num += (uint32_t)taken;
+                    rest.data += taken;
+                    rest.data_len -= (size_t)taken;
+                    sham_hold_packet(conn, &rest, true);
+                }
+
+                // Check for buffered out-of-order packets
+                if (sham_deliver_ooo_packets(conn, recv_buffer, &bytes_received, len) < 0)
+                {
+                    return -1;
+                }
+
+                sham_log(conn->log_file, "[RECV] In-order packet, seq=%u, len=%zu\n",
+                         packet.header.seq_num, packet.data_len);
+                sham_trace(conn, SHAM_TRACE_RCV_DATA, packet.header.seq_num, (uint32_t)packet.data_len);
+            }
+            else if (SHAM_SEQ_LT(packet.header.seq_num, conn->recv_seq))
+            {
+                conn->stats.dup_segments++; // Retransmitted after we had it
+            }
+            else if (sham_buffer_ooo_packet(conn, &packet) == 0)
+            {
+                // Out-of-order packet, held until the gap before it fills
+                sham_log(conn->log_file, "[RECV] Out-of-order packet buffered, seq=%u\n",
+                         packet.header.seq_num);
+                conn->stats.ooo_segments++;
+            }
+
+            // Send ACK with proper window advertisement
+            if (ack_now)
+            {
+                sham_send_ack(conn);
+            }
+            else
+            {
+                sham_ack_delayed(conn);
+            }
+        }
+
+        // The stream ends once everything before the peer's FIN is in
+        if ((packet.header.flags & SHAM_FIN) && packet.header.seq_num == conn->recv_seq)
+        {
+            conn->recv_seq++;
+            conn->state = SHAM_CLOSE_WAIT;
+            sham_log_info(conn->log_file, "[CLOSE] Peer closed the connection\n");
+            sham_trace(conn, SHAM_TRACE_RCV_FIN, packet.header.seq_num, 0);
+
+            sham_send_control(conn, conn->send_seq, conn->recv_seq, SHAM_ACK, NULL, 0);
+            sham_trace(conn, SHAM_TRACE_SND_ACK_FOR_FIN, 0, 0);
+            conn->ack_deadline_us = 0;
+            break;
+        }
+
+        // The file is in; whatever follows it is for the next read
+        if (sinking && sham_sink_room(conn, 1) == 0)
+        {
+            break;
+        }
+    }
+
+    sham_ack_window_update(conn);
+    return bytes_received;
+}
+
+int sham_recv(struct sham_connection *conn, void *buffer, size_t len)
+{
+    return sham_recv_timeout(conn, buffer, len, conn->recv_timeout_ms);
+}
+
+// Copy out whatever has arrived without waiting. Returns bytes read, 0 once
+// the peer's FIN has been reached, or -1 with errno EAGAIN when nothing is ready.
+int sham_read(struct sham_connection *conn, void *buffer, size_t len)
+{
+    int received;
+
+    if (conn->state != SHAM_ESTABLISHED && conn->state != SHAM_SYN_RECEIVED && conn->state != SHAM_CLOSE_WAIT)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (sham_service(conn) < 0)
+    {
+        return -1;
+    }
+
+    received = sham_recv_timeout(conn, buffer, len, 0);
+    if (received == 0 && conn->state != SHAM_CLOSE_WAIT)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return received;
+}
+
+// Apply the ACKs that have arrived and fire due retransmissions without
+// blocking; data and FINs are held for sham_read. Returns -1 if the
+// connection has failed.
+int sham_service(struct sham_connection *conn)
+{
+    int reads = conn->recv_window_slots + SHAM_IO_BATCH; // Bound the work per call
+
+    if (conn->sockfd < 0 || sham_flush_packets(conn) < 0)
+    {
+        return -1;
+    }
+
+    // Stop once the hold queue is full rather than drop what the peer sent
+    while (reads-- > 0 && conn->held_count <= conn->recv_window_slots && sham_wait_ack(conn, 0) != 0)
+    {
+        if (conn->sockfd < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (sham_handle_timeout(conn) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Would sham_read return something other than EAGAIN?
+bool sham_readable(const struct sham_connection *conn)
+{
+    const struct sham_ooo_entry *next;
+
+    if (conn->recv_buffer_used > 0 || conn->held_count > 0 || conn->state == SHAM_CLOSE_WAIT)
+    {
+        return true;
+    }
+    next = &conn->ooo_buffer[sham_ooo_slot(conn, conn->recv_seq)];
+    return conn->ooo_count > 0 && next->valid && next->seq == conn->recv_seq;
+}
+
+// Would sham_write queue at least a byte?
+bool sham_writable(struct sham_connection *conn)
+{
+    return (conn->state == SHAM_ESTABLISHED || conn->state == SHAM_CLOSE_WAIT) &&
+           conn->window_count < conn->send_window_slots && sham_can_send_data(conn, conn->mss) &&
+           sham_pace_delay_us(conn, conn->mss) == 0;
+}
+
+// Process ACK packet
+int sham_process_ack(struct sham_connection *conn, const struct sham_packet *ack_packet)
+{
+    uint32_t ack_num = ack_packet->header.ack_num;
+    uint32_t peer_window = (uint32_t)ack_packet->header.window_size << conn->snd_wscale;
+
+    sham_log(conn->log_file, "[ACK] Processing ACK=%u, peer window=%u\n", ack_num, peer_window);
+    sham_trace(conn, SHAM_TRACE_RCV_ACK, ack_num, 0);
+
+    // Update peer's advertised window size
+    conn->peer_window_size = peer_window;
+
+    // Update flow control - bytes acknowledged
+    if (SHAM_SEQ_GT(ack_num, conn->last_byte_acked))
+    {
+        uint32_t newly_acked = ack_num - conn->last_byte_acked;
+        conn->last_byte_acked = ack_num;
+        sham_log(conn->log_file, "[FLOW] %u bytes newly acknowledged, last_byte_acked now %u\n",
+                 newly_acked, conn->last_byte_acked);
+    }
+
+    // Cumulative acknowledgment
+    uint32_t prev_send_base = conn->send_base;
+    bool advanced;
+    int i;
+    struct sham_window_entry *rtt_entry = NULL;
+    bool rtt_ambiguous = false;
+    while (conn->window_count > 0)
+    {
+        struct sham_window_entry *entry = &conn->send_window[conn->window_start];
+        uint32_t packet_end = entry->seq + (uint32_t)entry->data_len;
+
+        if (SHAM_SEQ_LEQ(packet_end, ack_num))
+        {
+            // Karn's rule: an ACK covering a retransmitted segment is ambiguous,
+            // and one held back behind a hole (SACKed earlier) is inflated
+            rtt_entry = entry;
+            if (entry->retries > 0 || entry->sacked)
+            {
+                rtt_ambiguous = true;
+            }
+            entry->acked = true;
+            sham_buf_put(&conn->pool, entry->buf);
+            entry->buf = NULL;
+            conn->send_base = packet_end;
+            conn->window_start = (conn->window_start + 1) % conn->send_window_slots;
+            conn->window_count--;
+
+            sham_log(conn->log_file, "[ACK] Packet acknowledged, seq=%u\n", entry->seq);
+        }
+        else
+        {
+            // Part of a segment resent in pieces: keep only the rest, so the
+            // next resend starts there and its retry count starts over
+            if (SHAM_SEQ_LT(entry->seq, ack_num) && SHAM_SEQ_LT(ack_num, packet_end))
+            {
+                uint32_t acked = ack_num - entry->seq;
+
+                entry->seq = ack_num;
+                entry->data_len -= acked;
+                entry->offset += acked;
+                entry->recovery_retx = false;
+                if (entry->retries > 1)
+                {
+                    entry->retries = 1; // Still a retransmission, for Karn's rule
+                }
+                conn->send_base = ack_num;
+                if (!entry->sacked)
+                {
+                    entry->deadline_us = sham_now_us() + (uint64_t)conn->rto_ms * 1000;
+                    sham_timer_push(&conn->rtx_timers, entry->deadline_us, conn->window_start, entry->seq);
+                }
+                sham_log(conn->log_file, "[ACK] Segment acknowledged up to %u\n", ack_num);
+            }
+            break;
+        }
+    }
+
+    // A SACKed segment reaching the head has no deadline armed; give it one
+    // so a lost cumulative ACK still ends in a retransmission
+    if (conn->window_count > 0 && conn->send_window[conn->window_start].sacked &&
+        conn->send_base != prev_send_base)
+    {
+        struct sham_window_entry *head = &conn->send_window[conn->window_start];
+        head->deadline_us = sham_now_us() + (uint64_t)conn->rto_ms * 1000;
+        sham_timer_push(&conn->rtx_timers, head->deadline_us, conn->window_start, head->seq);
+    }
+
+    // One sample per ACK, from the newest segment it covers
+    long rtt_us = 0;
+    if (rtt_entry && !rtt_ambiguous)
+    {
+        rtt_us = sham_elapsed_us(rtt_entry->send_time_us);
+        sham_rtt_sample(conn, rtt_us);
+    }
+    advanced = conn->send_base != prev_send_base;
+
+    // The window only grows outside loss recovery
+    if (advanced && !conn->in_recovery)
+    {
+        conn->cc->on_ack(conn, conn->send_base - prev_send_base, rtt_us);
+    }
+
+    // Mark segments the receiver already holds beyond the cumulative ACK
+    for (i = 0; i < conn->window_count && ack_packet->sack_count > 0; i++)
+    {
+        struct sham_window_entry *entry = &conn->send_window[(conn->window_start + i) % conn->send_window_slots];
+        uint32_t seq = entry->seq;
+        int b;
+
+        for (b = 0; b < ack_packet->sack_count; b++)
+        {
+            if (SHAM_SEQ_GEQ(seq, ack_packet->sack[b].start) &&
+                SHAM_SEQ_LEQ(seq + (uint32_t)entry->data_len, ack_packet->sack[b].end))
+            {
+                entry->sacked = true;
+                break;
+            }
+        }
+    }
+
+    if (advanced)
+    {
+        conn->dupacks = 0;
+        if (conn->in_recovery)
+        {
+            if (SHAM_SEQ_GEQ(ack_num, conn->recover_seq))
+            {
+                conn->in_recovery = false;
+            }
+            else
+            {
+                // Partial ACK: the next hole is at the new head, resend it now
+                return sham_fast_retransmit(conn);
+            }
+        }
+    }
+    else if (conn->window_count > 0 && ack_num == conn->send_base && ack_packet->data_len == 0 &&
+             !(ack_packet->header.flags & SHAM_FIN))
+    {
+        conn->dupacks++;
+        if (conn->dupacks == SHAM_DUPACK_THRESHOLD && !conn->in_recovery)
+        {
+            conn->in_recovery = true;
+            conn->recover_seq = conn->send_seq;
+            for (i = 0; i < conn->window_count; i++)
+            {
+                conn->send_window[(conn->window_start + i) % conn->send_window_slots].recovery_retx = false;
+            }
+            sham_trace(conn, SHAM_TRACE_FAST_RETX, ack_num, (uint32_t)conn->dupacks);
+            conn->cc->on_loss(conn, SHAM_CC_LOSS_FAST);
+            sham_log(conn->log_file, "[CC] Fast loss, cwnd=%u ssthresh=%u\n", conn->cwnd, conn->ssthresh);
+            return sham_fast_retransmit(conn);
+        }
+        if (conn->in_recovery && ack_packet->sack_count > 0)
+        {
+            // New SACK information may expose further holes
+            return sham_fast_retransmit(conn);
+        }
+    }
+
+    // Nothing in flight: bytes held back for coalescing need not wait longer
+    if (conn->window_count == 0 && conn->coalesce_len > 0)
+    {
+        return sham_coalesce_push(conn, false);
+    }
+
+    return 0;
+}
+
+// Resend lost segments without waiting for the RTO: the head of the window,
+// plus (with SACK) every unSACKed segment below the highest SACKed one
+int sham_fast_retransmit(struct sham_connection *conn)
+{
+    uint32_t highest_sacked = conn->send_base;
+    int i;
+
+    for (i = 0; i < conn->window_count; i++)
     {
-        sham_verbose_log(listen_conn, "RCV SYN SEQ=%u\n", syn.header.seq_num);
+        struct sham_window_entry *entry = &conn->send_window[(conn->window_start + i) % conn->send_window_slots];
+        if (entry->sacked)
+        {
+            highest_sacked = entry->seq;
+        }
     }
 
-    // Create new connection for client
-    struct sham_connection *new_conn = sham_create_connection();
-    if (!new_conn)
-    {
-        return NULL;
+    for (i = 0; i < conn->window_count; i++)
+    {
+        int idx = (conn->window_start + i) % conn->send_window_slots;
+        struct sham_window_entry *entry = &conn->send_window[idx];
+        uint32_t seq = entry->seq;
+
+        if (i > 0 && SHAM_SEQ_GEQ(seq, highest_sacked))
+        {
+            break;
+        }
+        if (entry->sacked || entry->recovery_retx)
+        {
+            continue;
+        }
+
+        if (sham_resend_segment(conn, entry) < 0)
+        {
+            return -1;
+        }
+        entry->retries++;
+        entry->recovery_retx = true;
+        entry->send_time_us = sham_now_us();
+        sham_arm_rtx_timer(conn, idx);
+        conn->stats.fast_retransmits++;
+        conn->stats.bytes_retransmitted += entry->data_len;
+
+        sham_log(conn->log_file, "[RETX] Fast retransmit seq=%u, attempt=%d\n", seq, entry->retries);
+        sham_trace(conn, SHAM_TRACE_RETX_DATA, seq, (uint32_t)entry->data_len);
     }
 
-    new_conn->sockfd = listen_conn->sockfd;
-    new_conn->peer_addr = listen_conn->peer_addr; // Copy peer address set by sham_recv_packet
-    new_conn->peer_len = listen_conn->peer_len;   // Copy peer length set by sham_recv_packet
-    new_conn->recv_seq = syn.header.seq_num + 1;
-    new_conn->state = SHAM_SYN_RECEIVED;
+    return 0;
+}
 
-    // Copy loss rate and verbose logging from listening connection
-    new_conn->loss_rate = listen_conn->loss_rate;
-    new_conn->verbose_log_file = listen_conn->verbose_log_file;
+// Feed one round-trip measurement into the RFC 6298 estimator
+void sham_rtt_sample(struct sham_connection *conn, long rtt_us)
+{
+    long rto_us;
 
-    // Send SYN-ACK
-    struct sham_packet syn_ack = sham_create_packet_with_conn(new_conn, new_conn->send_seq, new_conn->recv_seq,
-                                                              SHAM_SYN | SHAM_ACK, NULL, 0);
-    if (sham_send_packet(new_conn, &syn_ack) < 0)
+    if (rtt_us < 0)
     {
-        sham_free_connection(new_conn);
-        return NULL;
+        return;
     }
 
-    sham_log(listen_conn->log_file, "[SERVER] Sent SYN-ACK, seq=%u, ack=%u\n",
-             new_conn->send_seq, new_conn->recv_seq);
-    if (new_conn->verbose_log_file)
+    if (!conn->rtt_valid)
     {
-        sham_verbose_log(new_conn, "SND SYN-ACK SEQ=%u ACK=%u\n",
-                         new_conn->send_seq, new_conn->recv_seq);
+        conn->srtt_us = rtt_us;
+        conn->rttvar_us = rtt_us / 2;
+        conn->rtt_valid = true;
     }
-
-    new_conn->send_seq++;
-
-    // Wait for final ACK
-    struct sham_packet final_ack;
-    if (sham_recv_packet_timeout(new_conn, &final_ack, SHAM_RTO_MS) <= 0)
+    else
     {
-        sham_log(listen_conn->log_file, "[SERVER] Timeout waiting for final ACK\n");
-        sham_free_connection(new_conn);
-        return NULL;
+        long err = rtt_us - conn->srtt_us;
+        conn->rttvar_us += ((err < 0 ? -err : err) - conn->rttvar_us) / 4; // beta = 1/4
+        conn->srtt_us += err / 8;                                          // alpha = 1/8
     }
 
-    if (!(final_ack.header.flags & SHAM_ACK) ||
-        final_ack.header.ack_num != new_conn->send_seq)
+    // A fresh sample also clears any backoff
+    rto_us = conn->srtt_us + 4 * conn->rttvar_us;
+    conn->rto_ms = (int)(rto_us / 1000);
+    if (conn->rto_ms < SHAM_MIN_RTO_MS)
     {
-        sham_log(listen_conn->log_file, "[SERVER] Invalid final ACK\n");
-        sham_free_connection(new_conn);
-        return NULL;
+        conn->rto_ms = SHAM_MIN_RTO_MS;
     }
-
-    sham_log(listen_conn->log_file, "[SERVER] Received final ACK, connection established\n");
-    if (new_conn->verbose_log_file)
+    if (conn->rto_ms > SHAM_MAX_RTO_MS)
     {
-        sham_verbose_log(new_conn, "RCV ACK FOR SYN\n");
+        conn->rto_ms = SHAM_MAX_RTO_MS;
     }
 
-    new_conn->state = SHAM_ESTABLISHED;
-    new_conn->send_base = new_conn->send_seq;
+    sham_log(conn->log_file, "[RTT] sample=%ldus srtt=%ldus rttvar=%ldus rto=%dms\n",
+             rtt_us, conn->srtt_us, conn->rttvar_us, conn->rto_ms);
+}
 
-    return new_conn;
+// Double the RTO after a retransmission timeout
+void sham_rto_backoff(struct sham_connection *conn)
+{
+    conn->rto_ms = (conn->rto_ms > SHAM_MAX_RTO_MS / 2) ? SHAM_MAX_RTO_MS : conn->rto_ms * 2;
 }
 
-// Send data reliably with sliding window
-int sham_send(struct sham_connection *conn, const void *data, size_t len)
+// Handle timeouts and retransmissions; only expired deadlines are visited.
+// Delayed ACKs and path MTU probes are driven from here too.
+int sham_handle_timeout(struct sham_connection *conn)
 {
-    const uint8_t *send_data;
-    size_t bytes_sent;
-    struct sham_packet ack_packet;
-    struct timespec ts;
-    size_t chunk_size;
-    struct sham_packet data_packet;
-    int window_idx;
+    uint64_t now = sham_now_us();
+    uint64_t rto_us = (uint64_t)conn->rto_ms * 1000;
+    bool backed_off = false;
+    const struct sham_timer *top;
 
-    if (conn->state != SHAM_ESTABLISHED)
+    sham_ack_if_due(conn);
+    if (sham_flush_due_packets(conn) < 0 || sham_syn_ack_if_due(conn) < 0 || sham_fin_if_due(conn) < 0 ||
+        sham_pmtu_tick(conn) < 0 || (sham_coalesce_due(conn) && sham_coalesce_push(conn, false) < 0))
     {
         return -1;
     }
 
-    send_data = (const uint8_t *)data;
-    bytes_sent = 0;
-
-    while (bytes_sent < len)
+    while ((top = sham_timer_peek(&conn->rtx_timers)) != NULL && top->deadline_us <= now)
     {
-        // Process any incoming ACKs
-        while (sham_recv_packet_timeout(conn, &ack_packet, 0) > 0)
+        struct sham_timer timer = *top;
+        struct sham_window_entry *entry = &conn->send_window[timer.slot];
+
+        sham_timer_pop(&conn->rtx_timers);
+        if (!sham_rtx_timer_live(conn, &timer))
         {
-            if (ack_packet.header.flags & SHAM_ACK)
-            {
-                sham_process_ack(conn, &ack_packet);
-            }
+            continue;
         }
 
-        // Handle timeouts and retransmissions
-        sham_handle_timeout(conn);
-
-        // Check if packet window is full
-        if (conn->window_count >= SHAM_WINDOW_SIZE)
+        // The RTO grew since this deadline was armed; push it out
+        if (now - entry->send_time_us < rto_us)
         {
-            ts.tv_sec = 0;
-            ts.tv_nsec = 1000000; // 1ms in nanoseconds
-            nanosleep(&ts, NULL);
+            entry->deadline_us = entry->send_time_us + rto_us;
+            sham_timer_push(&conn->rtx_timers, entry->deadline_us, timer.slot, timer.seq);
             continue;
         }
 
-        // Calculate chunk size
-        chunk_size = (len - bytes_sent > SHAM_MAX_DATA_SIZE) ? SHAM_MAX_DATA_SIZE : (len - bytes_sent);
+        if (entry->retries >= SHAM_MAX_RETRIES)
+        {
+            sham_log_warn(conn->log_file, "[TIMEOUT] Max retries exceeded for seq=%u\n",
+                     entry->seq);
 
-        // Check flow control - can we send this much data?
-        if (!sham_can_send_data(conn, chunk_size))
+            // Stay armed so every later call (e.g. from sham_close) fails too
+            sham_timer_push(&conn->rtx_timers, entry->deadline_us, timer.slot, timer.seq);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        sham_trace(conn, SHAM_TRACE_TIMEOUT, entry->seq, 0);
+
+        // Back off once per timeout event, not once per expired segment.
+        // A timeout also ends any fast recovery in progress.
+        if (!backed_off)
         {
-            sham_log(conn->log_file, "[FLOW] Cannot send %zu bytes due to flow control, waiting...\n", chunk_size);
-            ts.tv_sec = 0;
-            ts.tv_nsec = 10000000; // 10ms in nanoseconds
-            nanosleep(&ts, NULL);
-            continue;
+            sham_rto_backoff(conn);
+            conn->in_recovery = false;
+            conn->dupacks = 0;
+            conn->cc->on_loss(conn, SHAM_CC_LOSS_TIMEOUT);
+            sham_log(conn->log_file, "[CC] Timeout, cwnd=%u ssthresh=%u\n", conn->cwnd, conn->ssthresh);
+            backed_off = true;
+            conn->stats.timeouts++;
         }
 
-        // Create data packet with proper window advertisement
-        data_packet = sham_create_packet_with_conn(conn, conn->send_seq, conn->recv_seq, 0,
-                                                   send_data + bytes_sent, chunk_size);
+        // A large segment lost again may not fit the path
+        sham_pmtu_on_timeout(conn, entry->data_len, entry->retries);
 
-        if (sham_send_packet(conn, &data_packet) < 0)
+        // Retransmit
+        if (sham_resend_segment(conn, entry) < 0)
         {
             return -1;
         }
 
-        // Update flow control tracking
-        sham_update_flow_control(conn, chunk_size);
+        entry->retries++;
+        entry->send_time_us = now;
+        sham_arm_rtx_timer(conn, timer.slot);
+        conn->stats.retransmits++;
+        conn->stats.bytes_retransmitted += entry->data_len;
 
-        // Add to sliding window
-        window_idx = (conn->window_start + conn->window_count) % SHAM_WINDOW_SIZE;
-        conn->send_window[window_idx].packet = data_packet;
-        conn->send_window[window_idx].acked = false;
-        conn->send_window[window_idx].retries = 0;
-        gettimeofday(&conn->send_window[window_idx].send_time, NULL);
+        sham_log(conn->log_file, "[RETX] Retransmitting seq=%u, attempt=%d\n",
+                 entry->seq, entry->retries);
+        sham_trace(conn, SHAM_TRACE_RETX_DATA, entry->seq, (uint32_t)entry->data_len);
+    }
 
-        conn->window_count++;
-        conn->send_seq += chunk_size;
-        bytes_sent += chunk_size;
+    return 0;
+}
 
-        sham_log(conn->log_file, "[SEND] Packet sent, seq=%u, len=%zu\n",
-                 conn->send_seq - chunk_size, chunk_size);
-        sham_verbose_log(conn, "SND DATA SEQ=%u LEN=%zu\n",
-                         conn->send_seq - chunk_size, chunk_size);
+// Milliseconds until the earliest retransmission, delayed-ACK, SYN-ACK, FIN,
+// probe or coalescing deadline (all fired by sham_handle_timeout), or the
+// close deadline sham_close acts on, or -1 if none is armed
+int sham_next_timeout_ms(struct sham_connection *conn)
+{
+    const struct sham_timer *top;
+    uint64_t deadline_us;
+    uint64_t probe_us;
+    uint64_t held_us;
+    uint64_t syn_ack_us;
+    uint64_t close_us = 0;
+    uint64_t now;
+
+    // Discard stale entries so the answer is not needlessly early
+    while ((top = sham_timer_peek(&conn->rtx_timers)) != NULL && !sham_rtx_timer_live(conn, top))
+    {
+        sham_timer_pop(&conn->rtx_timers);
     }
 
-    // Wait for all packets to be acknowledged
-    while (conn->window_count > 0)
+    deadline_us = conn->ack_deadline_us;
+    if (top && (deadline_us == 0 || top->deadline_us < deadline_us))
+    {
+        deadline_us = top->deadline_us;
+    }
+    probe_us = sham_pmtu_deadline_us(conn);
+    if (probe_us != 0 && (deadline_us == 0 || probe_us < deadline_us))
+    {
+        deadline_us = probe_us;
+    }
+    held_us = sham_netem_deadline_us(conn);
+    if (held_us != 0 && (deadline_us == 0 || held_us < deadline_us))
+    {
+        deadline_us = held_us;
+    }
+    if (conn->coalesce_len > 0 && (deadline_us == 0 || conn->coalesce_deadline_us < deadline_us))
+    {
+        deadline_us = conn->coalesce_deadline_us;
+    }
+    if (conn->state == SHAM_SYN_RECEIVED)
     {
-        struct sham_packet ack_packet;
-        if (sham_recv_packet_timeout(conn, &ack_packet, SHAM_RTO_MS) > 0)
+        syn_ack_us = conn->syn_ack_time_us + (uint64_t)conn->rto_ms * 1000;
+        if (deadline_us == 0 || syn_ack_us < deadline_us)
         {
-            if (ack_packet.header.flags & SHAM_ACK)
-            {
-                sham_process_ack(conn, &ack_packet);
-            }
+            deadline_us = syn_ack_us;
         }
-        sham_handle_timeout(conn);
+    }
+    if (conn->state == SHAM_FIN_WAIT_1 || conn->state == SHAM_CLOSING || conn->state == SHAM_LAST_ACK)
+    {
+        close_us = conn->fin_time_us + (uint64_t)conn->rto_ms * 1000;
+    }
+    else if (conn->state == SHAM_FIN_WAIT_2 || conn->state == SHAM_TIME_WAIT)
+    {
+        close_us = (uint64_t)conn->close_deadline_ms * 1000;
+    }
+    if (close_us != 0 && (deadline_us == 0 || close_us < deadline_us))
+    {
+        deadline_us = close_us;
+    }
+    if (deadline_us == 0)
+    {
+        return -1;
     }
 
-    sham_log(conn->log_file, "[SEND] All data sent and acknowledged: %zu bytes\n", bytes_sent);
-    return bytes_sent;
+    now = sham_now_us();
+    if (deadline_us <= now)
+    {
+        return 0;
+    }
+    return (int)((deadline_us - now + 999) / 1000);
 }
-// ############## LLM Generated Code Ends ##############
-// Receive data with out-of-order handling
-int sham_recv(struct sham_connection *conn, void *buffer, size_t len)
+
+// Buffer out-of-order packet. Returns 0 when stored, -1 for a duplicate, a
+// segment outside the window, or one whose slot holds a different segment.
+int sham_buffer_ooo_packet(struct sham_connection *conn, const struct sham_packet *packet)
 {
-    if (conn->state != SHAM_ESTABLISHED)
+    uint32_t seq = packet->header.seq_num;
+    uint32_t ahead = seq - conn->recv_seq;
+    struct sham_ooo_entry *entry;
+
+    // An empty ring re-anchors at the delivery point, keeping offsets small,
+    // and takes up the peer's current segment size
+    if (conn->ooo_count == 0)
+    {
+        conn->ooo_base = conn->recv_seq;
+        conn->ooo_unit = conn->rcv_mss;
+    }
+
+    // Old data, or beyond what the ring can index
+    if (ahead == 0 || ahead >= (uint32_t)conn->recv_window_slots * conn->ooo_unit || packet->data_len == 0)
+    {
+        return -1;
+    }
+    if ((seq - conn->ooo_base) / conn->ooo_unit - (conn->recv_seq - conn->ooo_base) / conn->ooo_unit >=
+        (uint32_t)conn->recv_window_slots)
     {
         return -1;
     }
 
-    uint8_t *recv_buffer = (uint8_t *)buffer;
-    size_t bytes_received = 0;
+    entry = &conn->ooo_buffer[sham_ooo_slot(conn, seq)];
+    if (entry->valid)
+    {
+        conn->stats.dup_segments += (entry->seq == seq);
+        return -1; // Duplicate, or a short segment sharing the slot
+    }
 
-    while (bytes_received < len)
+    // File data lands at its offset now. Unless a digest has yet to see it
+    // in order, the entry then only marks it as in.
+    entry->written = false;
+    if (sham_sink_room(conn, 1) > 0 && ahead + packet->data_len <= conn->sink_end - conn->sink_pos)
     {
-        struct sham_packet packet;
-        int result = sham_recv_packet_timeout(conn, &packet, SHAM_RTO_MS);
+        if (sham_sink_write(conn, conn->sink_fd, packet->data, packet->data_len, conn->sink_pos + ahead) < 0)
+        {
+            return -1;
+        }
+        entry->written = true;
+    }
 
-        if (result <= 0)
+    if (entry->written && !conn->sink_digest)
+    {
+        entry->buf = NULL;
+        entry->data = NULL;
+    }
+    // Keep the received datagram itself; only a coalesced one must be copied out
+    else if (packet->buf)
+    {
+        entry->buf = sham_buf_ref(packet->buf);
+        entry->data = packet->data;
+    }
+    else
+    {
+        entry->buf = sham_buf_get(&conn->pool);
+        if (!entry->buf)
         {
-            break; // Timeout or error
+            return -1;
         }
+        memcpy(entry->buf->wire, packet->data, packet->data_len);
+        entry->buf->len = packet->data_len;
+        entry->data = entry->buf->wire;
+    }
+    entry->seq = seq;
+    entry->data_len = packet->data_len;
+    entry->valid = true;
+    conn->ooo_count++;
+    return 0;
+}
 
-        if (packet.data_len > 0)
+// Deliver the contiguous run of buffered segments starting at recv_seq: file
+// data to the sink, the rest to the buffer and then the receive queue.
+// Returns -1 if the sink cannot be written.
+int sham_deliver_ooo_packets(struct sham_connection *conn, uint8_t *buffer,
+                             size_t *buffer_pos, size_t buffer_size)
+{
+    while (conn->ooo_count > 0)
+    {
+        struct sham_ooo_entry *entry = &conn->ooo_buffer[sham_ooo_slot(conn, conn->recv_seq)];
+        size_t sink_len;
+        size_t room;
+
+        if (!entry->valid || entry->seq != conn->recv_seq)
         {
-            if (packet.header.seq_num == conn->recv_seq)
-            {
-                // In-order packet
-                size_t copy_len = (packet.data_len > len - bytes_received) ? (len - bytes_received) : packet.data_len;
+            break;
+        }
+        sink_len = entry->written ? entry->data_len : sham_sink_room(conn, entry->data_len);
+        room = buffer_size - *buffer_pos + (conn->recv_buffer_size - conn->recv_buffer_used);
 
-                memcpy(recv_buffer + bytes_received, packet.data, copy_len);
-                bytes_received += copy_len;
-                conn->recv_seq += packet.data_len;
+        // Leave the segment buffered until the reader has made room for all of it
+        if (entry->data_len - sink_len > room)
+        {
+            break;
+        }
+        if (sham_recv_take(conn, entry->data, entry->data_len, entry->written, buffer, buffer_pos, buffer_size) !=
+            (int)entry->data_len)
+        {
+            return -1;
+        }
 
-                // Update receive buffer usage - data added to buffer
-                sham_update_recv_buffer(conn, (int)packet.data_len);
+        entry->valid = false;
+        sham_buf_put(&conn->pool, entry->buf);
+        entry->buf = NULL;
+        conn->ooo_count--;
 
-                // Check for buffered out-of-order packets
-                sham_deliver_ooo_packets(conn, recv_buffer, &bytes_received, len);
+        sham_log(conn->log_file, "[RECV] Delivered buffered packet, seq=%u\n", entry->seq);
+    }
 
-                // Data copied to application buffer - free from receive buffer
-                sham_update_recv_buffer(conn, -(int)copy_len);
+    return 0;
+}
 
-                sham_log(conn->log_file, "[RECV] In-order packet, seq=%u, len=%zu\n",
-                         packet.header.seq_num, packet.data_len);
-                sham_verbose_log(conn, "RCV DATA SEQ=%u LEN=%zu\n",
-                                 packet.header.seq_num, packet.data_len);
-            }
-            else if (packet.header.seq_num > conn->recv_seq)
-            {
-                // Out-of-order packet - buffer it
-                sham_buffer_ooo_packet(conn, &packet);
-                sham_log(conn->log_file, "[RECV] Out-of-order packet buffered, seq=%u\n",
-                         packet.header.seq_num);
-            }
+// Big-endian integer fields of the file header
+static uint8_t *sham_put_be(uint8_t *p, uint64_t value, int bytes)
+{
+    int i;
 
-            // Send ACK with proper window advertisement
-            struct sham_packet ack = sham_create_packet_with_conn(conn, conn->send_seq, conn->recv_seq, SHAM_ACK, NULL, 0);
-            sham_send_packet(conn, &ack);
-            sham_verbose_log(conn, "SND ACK=%u WIN=%u\n", conn->recv_seq, ntohs(ack.header.window_size));
-        }
+    for (i = bytes - 1; i >= 0; i--)
+    {
+        p[i] = (uint8_t)value;
+        value >>= 8;
     }
+    return p + bytes;
+}
 
-    return bytes_received;
+static const uint8_t *sham_get_be(const uint8_t *p, uint64_t *value, int bytes)
+{
+    int i;
+
+    *value = 0;
+    for (i = 0; i < bytes; i++)
+    {
+        *value = (*value << 8) | p[i];
+    }
+    return p + bytes;
 }
 
-// Process ACK packet
-int sham_process_ack(struct sham_connection *conn, const struct sham_packet *ack_packet)
+// Compressed file data goes out as frames, one behind: each frame's bytes
+// leave with the next frame's header appended, so the receiver always knows
+// how much to read next and never has to take part of a segment
+struct sham_frame_tx
 {
-    uint32_t ack_num = ack_packet->header.ack_num;
-    uint16_t peer_window = ack_packet->header.window_size;
+    struct sham_codec codec;
+    uint8_t *buf[2]; // Header, block, then room for the next header
+    size_t wire[2];
+    int cur;
+    bool started;
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;
+};
+
+static int sham_frame_push(struct sham_connection *conn, struct sham_frame_tx *tx, const uint8_t *data, size_t len)
+{
+    int next = tx->started ? !tx->cur : tx->cur;
+    uint8_t *out = tx->buf[next];
+    size_t wire = sham_codec_compress(&tx->codec, data, len, out + SHAM_FRAME_HEADER_SIZE,
+                                      sham_codec_bound(SHAM_COMPRESS_BLOCK));
+    int result;
 
-    sham_log(conn->log_file, "[ACK] Processing ACK=%u, peer window=%u\n", ack_num, peer_window);
-    sham_verbose_log(conn, "RCV ACK=%u\n", ack_num);
+    if (wire == 0)
+    {
+        memcpy(out + SHAM_FRAME_HEADER_SIZE, data, len);
+        wire = len;
+    }
+    sham_put_be(sham_put_be(out, len, 4), wire, 4);
 
-    // Update peer's advertised window size
-    conn->peer_window_size = peer_window;
+    if (!tx->started)
+    {
+        result = sham_send_stream(conn, out, SHAM_FRAME_HEADER_SIZE);
+    }
+    else
+    {
+        uint8_t *prev = tx->buf[tx->cur] + SHAM_FRAME_HEADER_SIZE;
+        memcpy(prev + tx->wire[tx->cur], out, SHAM_FRAME_HEADER_SIZE);
+        result = sham_send_stream(conn, prev, tx->wire[tx->cur] + SHAM_FRAME_HEADER_SIZE);
+    }
 
-    // Update flow control - bytes acknowledged
-    if (ack_num > conn->last_byte_acked)
+    tx->cur = next;
+    tx->wire[next] = wire;
+    tx->started = true;
+    tx->raw_bytes += len;
+    tx->wire_bytes += wire + SHAM_FRAME_HEADER_SIZE;
+    return result;
+}
+
+// Send the last frame, which has no header after it
+static int sham_frame_finish(struct sham_connection *conn, struct sham_frame_tx *tx)
+{
+    if (!tx->started)
     {
-        uint32_t newly_acked = ack_num - conn->last_byte_acked;
-        conn->last_byte_acked = ack_num;
-        sham_log(conn->log_file, "[FLOW] %u bytes newly acknowledged, last_byte_acked now %u\n",
-                 newly_acked, conn->last_byte_acked);
+        return 0;
     }
+    sham_log_info(conn->log_file, "[FILE] Compressed %llu bytes to %llu\n", (unsigned long long)tx->raw_bytes,
+             (unsigned long long)tx->wire_bytes);
+    return sham_send_stream(conn, tx->buf[tx->cur] + SHAM_FRAME_HEADER_SIZE, tx->wire[tx->cur]);
+}
 
-    // Cumulative acknowledgment
-    while (conn->window_count > 0)
+// Stream length bytes of the file from offset: segments are built straight
+// from a read-only mapping, or from pread chunks where the file cannot be
+// mapped; with compress set, each chunk is a frame. The digest, if any,
+// sees each chunk as it goes out.
+static int sham_send_file_data(struct sham_connection *conn, int fd, uint64_t offset, uint64_t length,
+                               struct sham_digest *digest, int compress)
+{
+    const uint8_t *map = NULL;
+    size_t map_len = 0;
+    size_t map_skip = 0;
+    uint8_t *buffer = NULL;
+    struct sham_frame_tx tx;
+    uint64_t total_sent = 0;
+    int result = 0;
+
+    if (length == 0)
     {
-        struct sham_window_entry *entry = &conn->send_window[conn->window_start];
-        uint32_t packet_end = ntohl(entry->packet.header.seq_num) + entry->packet.data_len;
+        return 0;
+    }
+
+    memset(&tx, 0, sizeof(tx));
+    if (compress != SHAM_COMPRESS_NONE)
+    {
+        size_t frame_size = 2 * SHAM_FRAME_HEADER_SIZE + sham_codec_bound(SHAM_COMPRESS_BLOCK);
 
-        if (packet_end <= ack_num)
+        tx.buf[0] = malloc(frame_size);
+        tx.buf[1] = malloc(frame_size);
+        if (!tx.buf[0] || !tx.buf[1] || sham_codec_init(&tx.codec, compress, false) < 0)
         {
-            entry->acked = true;
-            conn->send_base = packet_end;
-            conn->window_start = (conn->window_start + 1) % SHAM_WINDOW_SIZE;
-            conn->window_count--;
+            free(tx.buf[0]);
+            free(tx.buf[1]);
+            return -1;
+        }
+    }
 
-            sham_log(conn->log_file, "[ACK] Packet acknowledged, seq=%u\n",
-                     ntohl(entry->packet.header.seq_num));
+    // A mapping starts on a page boundary; skip up to the range
+    map_skip = (size_t)(offset % (uint64_t)sysconf(_SC_PAGESIZE));
+    if (length <= SIZE_MAX - map_skip)
+    {
+        void *addr = mmap(NULL, (size_t)length + map_skip, PROT_READ, MAP_PRIVATE, fd, (off_t)(offset - map_skip));
+        if (addr != MAP_FAILED)
+        {
+            map = (const uint8_t *)addr + map_skip;
+            map_len = (size_t)length + map_skip;
+            posix_madvise(addr, map_len, POSIX_MADV_SEQUENTIAL);
         }
-        else
+    }
+    if (!map)
+    {
+        buffer = malloc(SHAM_FILE_READAHEAD);
+        if (!buffer)
+        {
+            return -1;
+        }
+    }
+
+    while (total_sent < length)
+    {
+        size_t chunk = (length - total_sent > SHAM_FILE_READAHEAD) ? SHAM_FILE_READAHEAD
+                                                                    : (size_t)(length - total_sent);
+        const uint8_t *data = map ? map + total_sent : buffer;
+
+        if (!map)
+        {
+            ssize_t n = pread(fd, buffer, chunk, (off_t)(offset + total_sent));
+            if (n <= 0)
+            {
+                fprintf(stderr, "File ended early or could not be read at %llu bytes\n",
+                        (unsigned long long)(offset + total_sent));
+                result = -1;
+                break;
+            }
+            chunk = (size_t)n;
+        }
+
+        if (digest)
         {
+            sham_digest_update(digest, data, chunk);
+        }
+        if ((compress != SHAM_COMPRESS_NONE ? sham_frame_push(conn, &tx, data, chunk)
+                                            : sham_send_stream(conn, data, chunk)) < 0)
+        {
+            result = -1;
             break;
         }
+        total_sent += chunk;
+    }
+    if (result == 0 && compress != SHAM_COMPRESS_NONE && sham_frame_finish(conn, &tx) < 0)
+    {
+        result = -1;
+    }
+
+    if (map)
+    {
+        munmap((void *)(map - map_skip), map_len);
+    }
+    free(buffer);
+    sham_codec_free(&tx.codec);
+    free(tx.buf[0]);
+    free(tx.buf[1]);
+    return result;
+}
+
+// Send file: the header, the contents, then the digest of
+// conn->file_digest's type so the receiver can verify as it goes. Returns 0
+// once the peer has acknowledged all of it.
+int sham_send_file(struct sham_connection *conn, const char *filename)
+{
+    return sham_send_file_stripe(conn, filename, NULL);
+}
+
+// Send one byte range of a file, as a stripe of an upload spread over
+// several connections (NULL: the whole file). The trailer digest covers
+// the range only.
+int sham_send_file_stripe(struct sham_connection *conn, const char *filename, const struct sham_stripe *stripe)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    struct sham_stripe whole;
+    int result;
+
+    if (fd < 0)
+    {
+        perror("Failed to open file");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0)
+    {
+        perror("Failed to stat file");
+        close(fd);
+        return -1;
+    }
+
+    if (!stripe)
+    {
+        memset(&whole, 0, sizeof(whole));
+        whole.count = 1;
+        whole.length = (uint64_t)st.st_size;
+        stripe = &whole;
+    }
+    sham_log_info(conn->log_file, "[FILE] Sending file '%s'\n", filename);
+    result = sham_send_file_range(conn, fd, (uint64_t)st.st_size, stripe);
+    close(fd);
+    if (result < 0)
+    {
+        return -1;
     }
 
-    return 0;
+    // Drain the pipeline at end-of-file
+    return sham_flush(conn);
 }
 
-// Handle timeouts and retransmissions
-int sham_handle_timeout(struct sham_connection *conn)
+// Queue a stripe of an open file: its header, the data and the trailer
+// digest, without waiting for them to be acknowledged
+int sham_send_file_range(struct sham_connection *conn, int fd, uint64_t file_size, const struct sham_stripe *stripe)
 {
-    struct timeval now;
-    int i;
-    gettimeofday(&now, NULL);
+    uint8_t header[SHAM_FILE_HEADER_SIZE];
+    uint8_t *p;
+    struct sham_digest digest;
+    uint8_t trailer[SHAM_DIGEST_MAX_LEN];
+    size_t trailer_len = 0;
+    bool digesting = conn->file_digest != SHAM_DIGEST_NONE;
+    int compress = conn->file_compress;
+    int result;
 
-    for (i = 0; i < conn->window_count; i++)
+    // Compress only for a peer that said it can decode the method
+    if (compress != SHAM_COMPRESS_NONE && !(conn->peer_compress & (1u << compress)))
     {
-        int idx = (conn->window_start + i) % SHAM_WINDOW_SIZE;
-        struct sham_window_entry *entry = &conn->send_window[idx];
-
-        if (!entry->acked && sham_is_timeout(&entry->send_time, SHAM_RTO_MS))
-        {
-            if (entry->retries >= SHAM_MAX_RETRIES)
-            {
-                sham_log(conn->log_file, "[TIMEOUT] Max retries exceeded for seq=%u\n",
-                         ntohl(entry->packet.header.seq_num));
-                return -1;
-            }
+        compress = SHAM_COMPRESS_NONE;
+    }
 
-            sham_verbose_log(conn, "TIMEOUT SEQ=%u\n", ntohl(entry->packet.header.seq_num));
+    if (stripe->count == 0 || stripe->index >= stripe->count || stripe->offset > file_size ||
+        stripe->length > file_size - stripe->offset)
+    {
+        fprintf(stderr, "Stripe %u/%u does not fit in the file\n", stripe->index, stripe->count);
+        errno = EINVAL;
+        return -1;
+    }
 
-            // Retransmit
-            if (sham_send_packet(conn, &entry->packet) < 0)
-            {
-                return -1;
-            }
+    sham_log_info(conn->log_file, "[FILE] Sending size=%llu bytes, stripe %u/%u at %llu+%llu\n",
+             (unsigned long long)file_size, stripe->index, stripe->count, (unsigned long long)stripe->offset,
+             (unsigned long long)stripe->length);
 
-            entry->retries++;
-            entry->send_time = now;
+    if (digesting && sham_digest_init(&digest, conn->file_digest) < 0)
+    {
+        perror("Failed to set up file digest");
+        return -1;
+    }
 
-            sham_log(conn->log_file, "[RETX] Retransmitting seq=%u, attempt=%d\n",
-                     ntohl(entry->packet.header.seq_num), entry->retries);
-            sham_verbose_log(conn, "RETX DATA SEQ=%u LEN=%zu\n",
-                             ntohl(entry->packet.header.seq_num), entry->packet.data_len);
+    // Send the header first; it rides in the same pipeline as the data
+    p = sham_put_be(header, file_size, 8);
+    *p++ = (uint8_t)conn->file_digest;
+    *p++ = (uint8_t)compress;
+    p = sham_put_be(p, stripe->id, 8);
+    p = sham_put_be(p, stripe->index, 2);
+    p = sham_put_be(p, stripe->count, 2);
+    p = sham_put_be(p, stripe->offset, 8);
+    sham_put_be(p, stripe->length, 8);
+
+    result = (sham_send_stream(conn, header, sizeof(header)) < 0 ||
+              sham_send_file_data(conn, fd, stripe->offset, stripe->length, digesting ? &digest : NULL, compress) < 0)
+                 ? -1
+                 : 0;
+    if (digesting)
+    {
+        trailer_len = (result == 0) ? sham_digest_final(&digest, trailer) : 0;
+        sham_digest_free(&digest);
+        if (result == 0 && (trailer_len == 0 || sham_send_stream(conn, trailer, trailer_len) < 0))
+        {
+            result = -1;
         }
     }
+    return result;
+}
 
+// Begin receiving a file; sham_recv_file_continue does the work
+int sham_recv_file_start(struct sham_file_rx *rx, struct sham_connection *conn, const char *filename)
+{
+    memset(rx, 0, sizeof(*rx));
+    rx->conn = conn;
+    rx->filename = filename;
+    rx->fd = -1;
+    rx->last_progress_ms = sham_get_time_ms();
     return 0;
 }
 
-// Buffer out-of-order packet
-int sham_buffer_ooo_packet(struct sham_connection *conn, const struct sham_packet *packet)
+// Detach the file from the connection and close it, reporting a late write error
+static int sham_recv_file_end(struct sham_file_rx *rx, int result)
 {
-    int i;
-    for (i = 0; i < SHAM_WINDOW_SIZE; i++)
+    rx->conn->sink_fd = -1;
+    rx->conn->sink_digest = NULL;
+    sham_digest_free(&rx->digest);
+    sham_codec_free(&rx->codec);
+    free(rx->frame);
+    free(rx->block);
+    rx->frame = NULL;
+    rx->block = NULL;
+    if (rx->fd >= 0 && close(rx->fd) < 0 && result > 0)
+    {
+        perror("Failed to write file");
+        result = -1;
+    }
+    rx->fd = -1;
+    return result;
+}
+
+// Parse the header, size the target and route this stripe's data into it
+static int sham_recv_file_open(struct sham_file_rx *rx)
+{
+    struct sham_connection *conn = rx->conn;
+    struct sham_stripe *stripe = &rx->stripe;
+    const uint8_t *p = rx->header;
+    uint64_t value;
+    int type;
+    int compress;
+    int err = 0;
+
+    p = sham_get_be(p, &rx->file_size, 8);
+    type = *p++;
+    compress = *p++;
+    p = sham_get_be(p, &stripe->id, 8);
+    p = sham_get_be(p, &value, 2);
+    stripe->index = (uint16_t)value;
+    p = sham_get_be(p, &value, 2);
+    stripe->count = (uint16_t)value;
+    p = sham_get_be(p, &stripe->offset, 8);
+    sham_get_be(p, &stripe->length, 8);
+    sham_log_info(conn->log_file, "[FILE] Receiving file '%s', size=%llu bytes, stripe %u/%u at %llu+%llu\n",
+             rx->filename, (unsigned long long)rx->file_size, stripe->index, stripe->count,
+             (unsigned long long)stripe->offset, (unsigned long long)stripe->length);
+
+    if (stripe->count == 0 || stripe->index >= stripe->count || stripe->offset > rx->file_size ||
+        stripe->length > rx->file_size - stripe->offset)
+    {
+        fprintf(stderr, "Bad stripe %u/%u for '%s'\n", stripe->index, stripe->count, rx->filename);
+        return -1;
+    }
+    if (type != SHAM_DIGEST_NONE && (sham_digest_len(type) == 0 || sham_digest_init(&rx->digest, type) < 0))
     {
-        if (!conn->ooo_buffer[i].valid)
+        fprintf(stderr, "Cannot check digest type %d for '%s'\n", type, rx->filename);
+        return -1;
+    }
+    if (compress != SHAM_COMPRESS_NONE)
+    {
+        rx->frame = malloc(2 * SHAM_FRAME_HEADER_SIZE + sham_codec_bound(SHAM_COMPRESS_BLOCK));
+        rx->block = malloc(SHAM_COMPRESS_BLOCK);
+        if (!(SHAM_COMPRESS_SUPPORTED & (1u << compress)) || !rx->frame || !rx->block ||
+            sham_codec_init(&rx->codec, compress, true) < 0)
         {
-            conn->ooo_buffer[i].packet = *packet;
-            conn->ooo_buffer[i].valid = true;
-            return 0;
+            fprintf(stderr, "Cannot decode compression method %d for '%s'\n", compress, rx->filename);
+            return -1;
         }
+        rx->frame_expect = (stripe->length > 0) ? SHAM_FRAME_HEADER_SIZE : 0;
     }
-    return -1; // Buffer full
-}
-
-// Deliver buffered out-of-order packets
-int sham_deliver_ooo_packets(struct sham_connection *conn, uint8_t *buffer,
-                             size_t *buffer_pos, size_t buffer_size)
-{
-    bool delivered = true;
 
-    while (delivered)
+    // The other stripes of an upload write to the same file; keep their bytes
+    rx->fd = open(rx->filename, O_WRONLY | O_CREAT | (stripe->count == 1 && !rx->in_place ? O_TRUNC : 0), 0644);
+    if (rx->fd < 0)
     {
-        int i;
-        delivered = false;
+        perror("Failed to create file");
+        return -1;
+    }
 
-        for (i = 0; i < SHAM_WINDOW_SIZE; i++)
+    // Size the file, then reserve our range's blocks where the filesystem can
+    if (ftruncate(rx->fd, (off_t)rx->file_size) < 0)
+    {
+        err = errno;
+    }
+    else if (stripe->length > 0)
+    {
+        err = posix_fallocate(rx->fd, (off_t)stripe->offset, (off_t)stripe->length);
+        if (err != ENOSPC && err != EFBIG)
         {
-            if (conn->ooo_buffer[i].valid &&
-                conn->ooo_buffer[i].packet.header.seq_num == conn->recv_seq)
-            {
-
-                size_t copy_len = (conn->ooo_buffer[i].packet.data_len > buffer_size - *buffer_pos) ? (buffer_size - *buffer_pos) : conn->ooo_buffer[i].packet.data_len;
-
-                memcpy(buffer + *buffer_pos, conn->ooo_buffer[i].packet.data, copy_len);
-                *buffer_pos += copy_len;
-                conn->recv_seq += conn->ooo_buffer[i].packet.data_len;
-
-                conn->ooo_buffer[i].valid = false;
-                delivered = true;
-
-                sham_log(conn->log_file, "[RECV] Delivered buffered packet, seq=%u\n",
-                         conn->recv_seq - conn->ooo_buffer[i].packet.data_len);
-                break;
-            }
+            err = 0;
         }
     }
+    if (err != 0)
+    {
+        fprintf(stderr, "Failed to allocate %llu bytes for '%s': %s\n",
+                (unsigned long long)rx->file_size, rx->filename, strerror(err));
+        return -1;
+    }
 
+    // Compressed data has to be expanded first; it comes to us in frames
+    conn->sink_fd = (compress == SHAM_COMPRESS_NONE) ? rx->fd : -1;
+    conn->sink_pos = stripe->offset;
+    conn->sink_end = stripe->offset + stripe->length;
+    conn->sink_digest = (type != SHAM_DIGEST_NONE) ? &rx->digest : NULL;
     return 0;
 }
 
-// Send file
-int sham_send_file(struct sham_connection *conn, const char *filename)
+// File offset up to which the stripe has been written
+static uint64_t sham_recv_file_pos(const struct sham_file_rx *rx)
 {
-    FILE *file = fopen(filename, "rb");
-    if (!file)
-    {
-        perror("Failed to open file");
-        return -1;
-    }
-
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    return rx->frame ? rx->stripe.offset + rx->decoded : rx->conn->sink_pos;
+}
 
-    sham_log(conn->log_file, "[FILE] Sending file '%s', size=%ld bytes\n", filename, file_size);
+// Take a frame's lengths from its header and work out how much to read for
+// it: its bytes, plus the next frame's header unless it ends the stripe
+static int sham_recv_frame_header(struct sham_file_rx *rx, const uint8_t *header)
+{
+    uint64_t raw;
+    uint64_t wire;
+    uint64_t left = rx->stripe.length - rx->decoded;
 
-    // Send file size first
-    uint32_t size_net = htonl((uint32_t)file_size);
-    if (sham_send(conn, &size_net, sizeof(size_net)) < 0)
+    sham_get_be(sham_get_be(header, &raw, 4), &wire, 4);
+    if (raw == 0 || raw > SHAM_COMPRESS_BLOCK || raw > left || wire > raw)
     {
-        fclose(file);
+        fprintf(stderr, "[FILE] Bad frame of %llu bytes (%llu on the wire) for '%s'\n", (unsigned long long)raw,
+                (unsigned long long)wire, rx->filename);
         return -1;
     }
+    rx->frame_raw = (uint32_t)raw;
+    rx->frame_wire = (uint32_t)wire;
+    rx->frame_expect = wire + (raw < left ? SHAM_FRAME_HEADER_SIZE : 0);
+    rx->frame_received = 0;
+    return 0;
+}
 
-    // Send file data in chunks
-    uint8_t buffer[SHAM_MAX_DATA_SIZE];
-    size_t total_sent = 0;
+// A whole frame is in: expand it, write it out and digest it, then move on
+// to the next frame's header that came with it
+static int sham_recv_frame(struct sham_file_rx *rx)
+{
+    const uint8_t *data = rx->frame;
 
-    while (total_sent < (size_t)file_size)
+    if (rx->frame_raw == 0)
     {
-        size_t to_read = ((size_t)file_size - total_sent > SHAM_MAX_DATA_SIZE) ? SHAM_MAX_DATA_SIZE : ((size_t)file_size - total_sent);
-
-        size_t read_bytes = fread(buffer, 1, to_read, file);
-        if (read_bytes == 0)
-        {
-            break;
-        }
+        return sham_recv_frame_header(rx, rx->frame); // The first frame's header, sent alone
+    }
 
-        if (sham_send(conn, buffer, read_bytes) < 0)
+    if (rx->frame_wire < rx->frame_raw)
+    {
+        if (sham_codec_decompress(&rx->codec, rx->frame, rx->frame_wire, rx->block, rx->frame_raw) < 0)
         {
-            fclose(file);
+            fprintf(stderr, "[FILE] Corrupt %s frame at %llu in '%s'\n", sham_compress_name(rx->codec.method),
+                    (unsigned long long)sham_recv_file_pos(rx), rx->filename);
             return -1;
         }
+        data = rx->block;
+    }
+    if (sham_sink_write(rx->conn, rx->fd, data, rx->frame_raw, sham_recv_file_pos(rx)) < 0)
+    {
+        return -1;
+    }
+    if (rx->conn->sink_digest)
+    {
+        sham_digest_update(&rx->digest, data, rx->frame_raw);
+    }
+    rx->decoded += rx->frame_raw;
 
-        total_sent += read_bytes;
+    if (rx->decoded == rx->stripe.length)
+    {
+        rx->frame_expect = 0;
+        return 0;
     }
+    return sham_recv_frame_header(rx, rx->frame + rx->frame_wire);
+}
 
-    fclose(file);
-    return total_sent;
+// All bytes are in: compare our digest of them with the sender's
+static int sham_recv_file_verify(struct sham_file_rx *rx)
+{
+    char ours[2 * SHAM_DIGEST_MAX_LEN + 1];
+    char theirs[2 * SHAM_DIGEST_MAX_LEN + 1];
+
+    if (!rx->conn->sink_digest)
+    {
+        return 0;
+    }
+    rx->result_len = sham_digest_final(&rx->digest, rx->result);
+    if (rx->result_len == 0)
+    {
+        fprintf(stderr, "[FILE] Cannot finish the %s digest\n", sham_digest_name(rx->digest.type));
+        return -1;
+    }
+    if (memcmp(rx->result, rx->trailer, rx->result_len) != 0)
+    {
+        sham_digest_hex(rx->result, rx->result_len, ours);
+        sham_digest_hex(rx->trailer, rx->result_len, theirs);
+        fprintf(stderr, "[FILE] %s mismatch for '%s': received %s, sender has %s\n",
+                sham_digest_name(rx->digest.type), rx->filename, ours, theirs);
+        rx->result_len = 0;
+        return -1;
+    }
+    return 0;
 }
 
-// Helper: receive exactly len bytes with an overall timeout (ms). Returns bytes read.
-static int sham_recv_exact(struct sham_connection *conn, uint8_t *out, size_t len, int overall_timeout_ms)
+// Take whatever file data has arrived; it is written in place, and
+// digested, as segments come in. Returns 1 when the file is complete and
+// matches the sender's digest, 0 while more is expected, or -1 on failure
+// or a stall.
+int sham_recv_file_continue(struct sham_file_rx *rx)
 {
-    size_t got;
-    long start_ms;
-    long now_ms;
-    int remaining;
+    struct sham_connection *conn = rx->conn;
+    bool progress;
     int n;
 
-    got = 0;
-    start_ms = sham_get_time_ms();
-
-    while (got < len)
+    for (;;)
     {
-        remaining = (int)(len - got);
-        n = sham_recv(conn, out + got, (size_t)remaining);
-        if (n > 0)
+        if (rx->header_received < sizeof(rx->header))
         {
-            got += (size_t)n;
-            continue;
+            // First the header: file size, digest type and stripe
+            n = sham_recv(conn, rx->header + rx->header_received, sizeof(rx->header) - rx->header_received);
+            progress = n > 0;
+            if (n > 0)
+            {
+                rx->header_received += (size_t)n;
+                if (rx->header_received == sizeof(rx->header) && sham_recv_file_open(rx) < 0)
+                {
+                    return sham_recv_file_end(rx, -1);
+                }
+            }
         }
-        // n <= 0 means timeout or error; check overall deadline
-        if (overall_timeout_ms >= 0)
+        else if (rx->frame_expect > 0)
         {
-            now_ms = sham_get_time_ms();
-            if ((now_ms - start_ms) > overall_timeout_ms)
+            // Compressed data: exactly the rest of the frame, which may end
+            // in the next frame's header
+            n = sham_recv(conn, rx->frame + rx->frame_received, rx->frame_expect - rx->frame_received);
+            if (n < 0)
             {
-                break;
+                return sham_recv_file_end(rx, -1);
+            }
+            rx->frame_received += (size_t)n;
+            if (rx->frame_received == rx->frame_expect && sham_recv_frame(rx) < 0)
+            {
+                return sham_recv_file_end(rx, -1);
+            }
+            progress = n > 0;
+        }
+        else if (sham_recv_file_pos(rx) < rx->stripe.offset + rx->stripe.length ||
+                 rx->trailer_received < sham_digest_len(rx->digest.type))
+        {
+            // File data goes to the sink; only the trailer lands in our
+            // buffer, which has no room for whatever the sender sends next
+            n = sham_recv(conn, rx->trailer + rx->trailer_received,
+                          sham_digest_len(rx->digest.type) - rx->trailer_received);
+            if (n < 0)
+            {
+                return sham_recv_file_end(rx, -1);
             }
+            rx->trailer_received += (size_t)n;
+            progress = n > 0 || conn->sink_pos != rx->last_progress;
+            rx->last_progress = conn->sink_pos;
+        }
+        else
+        {
+            return sham_recv_file_end(rx, (sham_recv_file_verify(rx) < 0) ? -1 : 1);
+        }
+
+        if (progress)
+        {
+            rx->last_progress_ms = sham_get_time_ms();
+            continue;
+        }
+
+        // No data this time; fail only once we have stalled for too long
+        if (sham_get_time_ms() - rx->last_progress_ms <= SHAM_FILE_STALL_MS)
+        {
+            return 0;
+        }
+        if (rx->fd < 0)
+        {
+            fprintf(stderr, "Failed to receive file size (got %zu bytes)\n", rx->header_received);
+        }
+        else
+        {
+            fprintf(stderr, "\n[FILE] Timeout waiting for data; received %llu/%llu bytes\n",
+                    (unsigned long long)(sham_recv_file_pos(rx) - rx->stripe.offset),
+                    (unsigned long long)rx->stripe.length);
         }
+        return sham_recv_file_end(rx, -1);
     }
-    return (int)got;
 }
 
-// Receive file
+// Receive file. Returns 0 once all of it is written and verified.
 int sham_recv_file(struct sham_connection *conn, const char *filename)
 {
-    // First receive file size (4 bytes)
-    uint32_t size_net;
-    int nread;
-    FILE *file;
-    uint8_t buffer[SHAM_MAX_DATA_SIZE];
-    size_t total_received;
-    uint32_t file_size;
-    long last_progress_ms;
-    long start_ms;
-    long now_ms;
-    size_t to_receive;
-    int n;
+    struct sham_file_rx rx;
+    int result;
 
-    nread = sham_recv_exact(conn, (uint8_t *)&size_net, sizeof(size_net), 10000);
-    if (nread != (int)sizeof(size_net))
+    sham_recv_file_start(&rx, conn, filename);
+    while ((result = sham_recv_file_continue(&rx)) == 0)
     {
-        fprintf(stderr, "Failed to receive file size (got %d bytes)\n", nread);
-        return -1;
+        // Each step waits up to recv_timeout_ms for data
     }
 
-    file_size = ntohl(size_net);
-    sham_log(conn->log_file, "[FILE] Receiving file '%s', size=%u bytes\n", filename, file_size);
-
-    file = fopen(filename, "wb");
-    if (!file)
-    {
-        perror("Failed to create file");
-        return -1;
-    }
+    return (result < 0) ? -1 : 0;
+}
 
-    total_received = 0;
-    start_ms = sham_get_time_ms();
-    last_progress_ms = start_ms;
+// How long the peer may stay silent while it retries with backoff from our
+// RTO: every attempt SHAM_MAX_RETRIES allows, each twice the last
+static long sham_close_patience_ms(const struct sham_connection *conn)
+{
+    long rto_ms = conn->rto_ms;
+    long total_ms = 0;
+    int i;
 
-    // Receive file payload with a progress-based timeout.
-    while (total_received < file_size)
+    for (i = 0; i <= SHAM_MAX_RETRIES; i++)
     {
-        to_receive = (file_size - total_received > SHAM_MAX_DATA_SIZE) ? SHAM_MAX_DATA_SIZE : (file_size - total_received);
-
-        n = sham_recv(conn, buffer, to_receive);
-        if (n > 0)
-        {
-            fwrite(buffer, 1, (size_t)n, file);
-            total_received += (size_t)n;
-            last_progress_ms = sham_get_time_ms();
-
-            continue;
-        }
-
-        // No data this iteration; check if we've stalled for too long
-        now_ms = sham_get_time_ms();
-        if ((now_ms - last_progress_ms) > 10000)
-        { // 10s without progress
-            fprintf(stderr, "\n[FILE] Timeout waiting for data; received %zu/%u bytes\n",
-                    total_received, file_size);
-            break;
-        }
-        // Otherwise, keep waiting
+        total_ms += rto_ms;
+        rto_ms = (rto_ms > SHAM_MAX_RTO_MS / 2) ? SHAM_MAX_RTO_MS : rto_ms * 2;
     }
+    return total_ms;
+}
+
+// Both FINs are acknowledged as far as we know. Linger so a FIN the peer
+// resends, because our ACK of it was lost, is answered again: four RTOs
+// cover its first two resends, the second backed off.
+static void sham_enter_time_wait(struct sham_connection *conn)
+{
+    conn->state = SHAM_TIME_WAIT;
+    conn->close_deadline_ms = sham_get_time_ms() + (long)SHAM_TIME_WAIT_RTOS * conn->rto_ms;
+    sham_log(conn->log_file, "[CLOSE] TIME_WAIT for %d ms\n", SHAM_TIME_WAIT_RTOS * conn->rto_ms);
+}
 
-    fclose(file);
+// Milliseconds sham_close may wait for the peer before acting on its own
+static int sham_close_wait_ms(const struct sham_connection *conn)
+{
+    long now_ms = sham_get_time_ms();
+    long deadline_ms = conn->close_deadline_ms;
 
-    if (total_received != file_size)
+    if (conn->state == SHAM_FIN_WAIT_1 || conn->state == SHAM_CLOSING || conn->state == SHAM_LAST_ACK)
     {
-        return -1;
+        deadline_ms = (long)((conn->fin_time_us + (uint64_t)conn->rto_ms * 1000 + 999) / 1000);
     }
-    return (int)total_received;
+    return (deadline_ms > now_ms) ? (int)(deadline_ms - now_ms) : 0;
 }
 
 // Close connection with four-way handshake
 // ############## LLM Generated Code Starts ##############
 int sham_close(struct sham_connection *conn)
 {
-    struct sham_packet fin;
-    int ack_received = 0, fin_received = 0;
+    // A polling connection (recv_timeout_ms 0) returns -1 with errno EAGAIN
+    // while the exchange is in progress; call again to continue it
+    bool polling = (conn->recv_timeout_ms == 0);
 
-    if (conn->state != SHAM_ESTABLISHED)
+    if (conn->state == SHAM_ESTABLISHED || conn->state == SHAM_CLOSE_WAIT)
     {
-        return -1;
-    }
+        // Streamed data must be acknowledged before the FIN goes out, and
+        // so must the peer's data, rather than leave a delayed ACK behind
+        sham_flush(conn);
+        if (conn->ack_deadline_us != 0)
+        {
+            sham_send_ack(conn);
+        }
 
-    sham_log(conn->log_file, "[CLOSE] Initiating connection close\n");
+        sham_log_info(conn->log_file, "[CLOSE] Initiating connection close\n");
+
+        // Send FIN; like the SYN, it is resent with the RTO backed off
+        // until acknowledged
+        conn->send_seq++;
+        conn->fin_retries = 0;
+        if (sham_send_fin(conn) < 0)
+        {
+            conn->send_seq--;
+            return -1;
+        }
 
-    // Send FIN
-    fin = sham_create_packet(conn->send_seq, conn->recv_seq, SHAM_FIN, NULL, 0);
-    if (sham_send_packet(conn, &fin) < 0)
+        // Once the peer has closed too, only the ACK of our FIN is left
+        conn->state = (conn->state == SHAM_CLOSE_WAIT) ? SHAM_LAST_ACK : SHAM_FIN_WAIT_1;
+        sham_log(conn->log_file, "[CLOSE] Sent FIN\n");
+        sham_trace(conn, SHAM_TRACE_SND_FIN, conn->send_seq - 1, 0);
+    }
+    else if (conn->state != SHAM_FIN_WAIT_1 && conn->state != SHAM_FIN_WAIT_2 && conn->state != SHAM_CLOSING &&
+             conn->state != SHAM_LAST_ACK && conn->state != SHAM_TIME_WAIT)
     {
+        errno = ENOTCONN;
         return -1;
     }
 
-    conn->send_seq++;
-    conn->state = SHAM_FIN_WAIT_1;
-    sham_log(conn->log_file, "[CLOSE] Sent FIN\n");
-    sham_verbose_log(conn, "SND FIN SEQ=%u\n", conn->send_seq - 1);
-
-    while ((!ack_received || !fin_received) && conn->state != SHAM_CLOSED)
+    while (conn->state != SHAM_CLOSED)
     {
         struct sham_packet packet;
-        struct sham_packet final_ack;
 
-        if (sham_recv_packet_timeout(conn, &packet, SHAM_RTO_MS) <= 0)
+        if (conn->state == SHAM_TIME_WAIT && sham_get_time_ms() >= conn->close_deadline_ms)
+        {
+            conn->state = SHAM_CLOSED;
+            sham_log_info(conn->log_file, "[CLOSE] Connection closed\n");
+            break;
+        }
+
+        // The peer's FIN may be lost for good; don't wait forever
+        if (conn->state == SHAM_FIN_WAIT_2 && sham_get_time_ms() >= conn->close_deadline_ms)
+        {
+            sham_log_warn(conn->log_file, "[CLOSE] Peer silent, giving up\n");
+            conn->state = SHAM_CLOSED;
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (sham_fin_if_due(conn) < 0)
+        {
+            conn->state = SHAM_CLOSED;
+            return -1;
+        }
+
+        if (sham_next_input(conn, &packet, polling ? 0 : sham_close_wait_ms(conn)) <= 0)
         {
+            if (polling)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
             continue;
         }
+        if (conn->state == SHAM_FIN_WAIT_2)
+        {
+            conn->close_deadline_ms = sham_get_time_ms() + sham_close_patience_ms(conn);
+        }
+
+        // The peer is retransmitting data whose ACK was lost; repeat it
+        if (packet.data_len > 0)
+        {
+            sham_send_ack(conn);
+        }
 
-        if (packet.header.flags & SHAM_ACK && !ack_received)
+        if ((packet.header.flags & SHAM_ACK) && packet.header.ack_num == conn->send_seq)
         {
-            ack_received = 1;
-            conn->state = SHAM_FIN_WAIT_2;
-            sham_log(conn->log_file, "[CLOSE] Received ACK for FIN\n");
+            if (conn->state == SHAM_FIN_WAIT_1)
+            {
+                conn->state = SHAM_FIN_WAIT_2;
+                conn->close_deadline_ms = sham_get_time_ms() + sham_close_patience_ms(conn);
+                sham_log(conn->log_file, "[CLOSE] Received ACK for FIN\n");
+            }
+            else if (conn->state == SHAM_CLOSING)
+            {
+                sham_log(conn->log_file, "[CLOSE] Received ACK for FIN\n");
+                sham_enter_time_wait(conn);
+            }
+            else if (conn->state == SHAM_LAST_ACK)
+            {
+                conn->state = SHAM_CLOSED;
+                sham_log_info(conn->log_file, "[CLOSE] Received ACK for FIN, connection closed\n");
+            }
         }
 
-        if (packet.header.flags & SHAM_FIN && !fin_received)
+        if (packet.header.flags & SHAM_FIN)
         {
-            fin_received = 1;
+            // The peer's FIN again: our ACK of it was lost, so send another,
+            // and give that one the same time to be answered if lost too
+            if (conn->state == SHAM_CLOSING || conn->state == SHAM_LAST_ACK || conn->state == SHAM_TIME_WAIT)
+            {
+                sham_send_control(conn, conn->send_seq, conn->recv_seq, SHAM_ACK, NULL, 0);
+                sham_trace(conn, SHAM_TRACE_SND_ACK_FOR_FIN, 0, 0);
+                if (conn->state == SHAM_TIME_WAIT)
+                {
+                    sham_enter_time_wait(conn);
+                }
+                continue;
+            }
+            if (conn->state != SHAM_FIN_WAIT_1 && conn->state != SHAM_FIN_WAIT_2)
+            {
+                continue;
+            }
+
             conn->recv_seq = packet.header.seq_num + 1;
-            sham_verbose_log(conn, "RCV FIN SEQ=%u\n", packet.header.seq_num);
+            sham_trace(conn, SHAM_TRACE_RCV_FIN, packet.header.seq_num, 0);
 
             // Send final ACK
-            final_ack = sham_create_packet(conn->send_seq, conn->recv_seq, SHAM_ACK, NULL, 0);
-            sham_send_packet(conn, &final_ack);
-            sham_verbose_log(conn, "SND ACK FOR FIN\n");
+            sham_send_control(conn, conn->send_seq, conn->recv_seq, SHAM_ACK, NULL, 0);
+            sham_trace(conn, SHAM_TRACE_SND_ACK_FOR_FIN, 0, 0);
 
-            conn->state = SHAM_CLOSED;
-            sham_log(conn->log_file, "[CLOSE] Connection closed\n");
+            // With our FIN still unacknowledged both ends are closing at once
+            if (conn->state == SHAM_FIN_WAIT_1)
+            {
+                conn->state = SHAM_CLOSING;
+            }
+            else
+            {
+                sham_enter_time_wait(conn);
+            }
         }
     }
 
@@ -970,7 +3689,7 @@ int sham_close(struct sham_connection *conn)
 }
 // ############## LLM Generated Code Ends ##############
 // Utility functions
-void sham_log(FILE *log_file, const char *format, ...)
+void sham_log_write(FILE *log_file, const char *format, ...)
 {
     va_list args;
 
@@ -1003,17 +3722,33 @@ void sham_print_packet(const struct sham_packet *packet)
     printf("WIN=%u DATA_LEN=%zu\n", packet->header.window_size, packet->data_len);
 }
 
+// Each connection draws its own ISN from the kernel, so connections opened in
+// the same second, or from different threads, do not share one. Without
+// /dev/urandom a process-wide counter keeps successive draws apart
 uint32_t sham_generate_isn(void)
 {
-    srand((unsigned int)time(NULL));
-    return rand() % UINT32_MAX;
+    static uint64_t sham_isn_draws;
+    uint32_t isn;
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd < 0 || read(fd, &isn, sizeof(isn)) != (ssize_t)sizeof(isn))
+    {
+        uint64_t seed = sham_now_us() ^ ((uint64_t)getpid() << 32);
+
+        seed += __atomic_fetch_add(&sham_isn_draws, 1, __ATOMIC_RELAXED) * 0x9e3779b97f4a7c15ull;
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        isn = (uint32_t)(seed >> 32);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return isn;
 }
 
 long sham_get_time_ms(void)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    return (long)(sham_now_us() / 1000);
 }
 
 bool sham_is_timeout(const struct timeval *start, int timeout_ms)
@@ -1029,52 +3764,61 @@ bool sham_is_timeout(const struct timeval *start, int timeout_ms)
     return elapsed >= timeout_ms;
 }
 
+long sham_elapsed_us(uint64_t start_us)
+{
+    return (long)(sham_now_us() - start_us);
+}
+
 
 // Calculate advertised window size based on available receive buffer space
-uint16_t sham_calculate_advertised_window(struct sham_connection *conn)
+uint32_t sham_calculate_advertised_window(struct sham_connection *conn)
 {
-    uint16_t available_space = conn->recv_buffer_size - conn->recv_buffer_used;
+    uint32_t available_space = (conn->recv_buffer_used < conn->recv_buffer_size) ? (conn->recv_buffer_size - conn->recv_buffer_used) : 0;
 
-    // Ensure minimum window size to prevent deadlock
-    if (available_space < SHAM_MAX_DATA_SIZE)
+    // Ensure minimum window size to prevent deadlock: room for any segment we accept
+    if (available_space < conn->mss_limit)
     {
-        available_space = SHAM_MAX_DATA_SIZE;
+        available_space = conn->mss_limit;
     }
 
     sham_log(conn->log_file, "[FLOW] Buffer: %u/%u used, advertising %u bytes\n",
              conn->recv_buffer_used, conn->recv_buffer_size, available_space);
 
     // Log window updates when advertised window changes significantly
-    static uint16_t last_advertised_window = 0;
-    int diff = (int)available_space - (int)last_advertised_window;
-    if ((diff > 0 ? diff : -diff) > SHAM_MAX_DATA_SIZE)
+    long diff = (long)available_space - (long)conn->last_advertised_window;
+    if ((diff > 0 ? diff : -diff) > (long)conn->rcv_mss)
     {
-        sham_verbose_log(conn, "FLOW WIN UPDATE=%u\n", available_space);
-        last_advertised_window = available_space;
+        sham_trace(conn, SHAM_TRACE_FLOW_WIN_UPDATE, available_space, 0);
+        conn->last_advertised_window = available_space;
     }
 
     return available_space;
 }
 
-// Check if sender can send data based on flow control
-int sham_can_send_data(struct sham_connection *conn, size_t data_len)
+// Bytes sent but not yet cumulatively acknowledged
+uint32_t sham_bytes_in_flight(struct sham_connection *conn)
 {
     // Fix underflow bug - use signed arithmetic and bounds check
-    uint32_t bytes_in_flight;
-    if (conn->last_byte_sent >= conn->last_byte_acked)
-    {
-        bytes_in_flight = conn->last_byte_sent - conn->last_byte_acked;
-    }
-    else
+    if (SHAM_SEQ_GEQ(conn->last_byte_sent, conn->last_byte_acked))
     {
-        // Handle underflow case - probably means we got an ACK for more than we sent
-        bytes_in_flight = 0;
+        return conn->last_byte_sent - conn->last_byte_acked;
     }
 
-    uint32_t available_window = (conn->peer_window_size > bytes_in_flight) ? (conn->peer_window_size - bytes_in_flight) : 0;
+    // Handle underflow case - probably means we got an ACK for more than we sent
+    return 0;
+}
+
+// Check if sender can send data based on flow and congestion control
+int sham_can_send_data(struct sham_connection *conn, size_t data_len)
+{
+    uint32_t bytes_in_flight = sham_bytes_in_flight(conn);
+
+    // The effective window is the smaller of the peer's and ours
+    uint32_t send_window = (conn->cwnd < conn->peer_window_size) ? conn->cwnd : conn->peer_window_size;
+    uint32_t available_window = (send_window > bytes_in_flight) ? (send_window - bytes_in_flight) : 0;
 
-    sham_log(conn->log_file, "[FLOW] Bytes in flight: %u, peer window: %u, available: %u, want to send: %zu\n",
-             bytes_in_flight, conn->peer_window_size, available_window, data_len);
+    sham_log(conn->log_file, "[FLOW] Bytes in flight: %u, peer window: %u, cwnd: %u, available: %u, want to send: %zu\n",
+             bytes_in_flight, conn->peer_window_size, conn->cwnd, available_window, data_len);
 
     return (data_len <= available_window);
 }
@@ -1088,90 +3832,9 @@ void sham_update_flow_control(struct sham_connection *conn, size_t bytes_sent)
              conn->last_byte_sent, bytes_sent);
 }
 
-// Update receive buffer usage
-void sham_update_recv_buffer(struct sham_connection *conn, int bytes_consumed)
-{
-    if (bytes_consumed > 0)
-    {
-        conn->recv_buffer_used += bytes_consumed;
-        sham_log(conn->log_file, "[FLOW] Added %d bytes to recv buffer, now %u/%u\n",
-                 bytes_consumed, conn->recv_buffer_used, conn->recv_buffer_size);
-    }
-    else if (bytes_consumed < 0)
-    {
-        // Negative means data was delivered to application (buffer freed)
-        int freed = -bytes_consumed;
-        if (conn->recv_buffer_used >= freed)
-        {
-            conn->recv_buffer_used -= freed;
-        }
-        else
-        {
-            conn->recv_buffer_used = 0;
-        }
-        sham_log(conn->log_file, "[FLOW] Freed %d bytes from recv buffer, now %u/%u\n",
-                 freed, conn->recv_buffer_used, conn->recv_buffer_size);
-    }
-}
-
-// Packet loss simulation
-bool sham_should_drop_packet(float loss_rate)
-{
-    if (loss_rate <= 0.0f)
-    {
-        return false;
-    }
-
-    // Generate random number between 0.0 and 1.0
-    float random_val = (float)rand() / (float)RAND_MAX;
-    return random_val < loss_rate;
-}
-
 // Verbose logging functions for evaluation
 bool sham_is_verbose_logging_enabled(void)
 {
     const char *env_var = getenv("RUDP_LOG");
     return (env_var != NULL && strcmp(env_var, "1") == 0);
 }
-
-FILE *sham_open_verbose_log(const char *role)
-{
-    char filename[256];
-
-    if (!sham_is_verbose_logging_enabled())
-    {
-        return NULL;
-    }
-
-    snprintf(filename, sizeof(filename), "%s_log.txt", role);
-    return fopen(filename, "w");
-}
-
-void sham_verbose_log(struct sham_connection *conn, const char *format, ...)
-{
-    char time_buffer[30];
-    struct timeval tv;
-    time_t curtime;
-    va_list args;
-
-    if (!conn || !conn->verbose_log_file)
-    {
-        return;
-    }
-
-    gettimeofday(&tv, NULL);
-    curtime = tv.tv_sec;
-
-    // Format the time part
-    strftime(time_buffer, 30, "%Y-%m-%d %H:%M:%S", localtime(&curtime));
-
-    // Add timestamp and LOG prefix
-    fprintf(conn->verbose_log_file, "[%s.%06ld] [LOG] ", time_buffer, tv.tv_usec);
-
-    // Add the actual log message
-    va_start(args, format);
-    vfprintf(conn->verbose_log_file, format, args);
-    va_end(args);
-
-    fflush(conn->verbose_log_file);
-}
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <openssl/evp.h>
+#include <zlib.h>
 
 // Define bool, true, false for POSIX compatibility
 #ifndef __cplusplus
@@ -34,19 +35,110 @@ typedef enum
 #define SHAM_SYN 0x1
 #define SHAM_ACK 0x2
 #define SHAM_FIN 0x4
+#define SHAM_SACK 0x8 // Selective-ACK extension follows the header
+#define SHAM_PROBE 0x10 // Path MTU probe (padding only); with SHAM_ACK, its answer
+#define SHAM_FEC 0x20   // XOR parity of a block of data segments (sham_fec.c)
+#define SHAM_FEC_TAG_SHIFT 8 // Data segments and parity carry their block's tag (1-255) in the flags' high byte
 
-#define SHAM_MAX_DATA_SIZE 1024
-#define SHAM_WINDOW_SIZE 10
-#define SHAM_RTO_MS 500
+// Sequence number order, modulo 2^32: a transfer past 4 GB wraps around
+#define SHAM_SEQ_LT(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SHAM_SEQ_LEQ(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+#define SHAM_SEQ_GT(a, b) SHAM_SEQ_LT(b, a)
+#define SHAM_SEQ_GEQ(a, b) SHAM_SEQ_LEQ(b, a)
+
+// Segment sizes: payload bytes per datagram, excluding the header
+#define SHAM_BASE_MSS 1024    // Assumed to fit any path; used until a probe confirms more
+#define SHAM_DEFAULT_MSS 8960 // Offered by default: a 9000-byte jumbo MTU less IP, UDP and our header
+#define SHAM_MIN_MSS 256
+#define SHAM_MAX_MSS 65495 // Largest UDP payload less our header
+#define SHAM_WINDOW_SIZE 10       // Default send/receive ring size in segments
+#define SHAM_MAX_WINDOW_SLOTS 65536 // Upper bound for sham_set_window_slots
+#define SHAM_RTO_MS 500      // Initial RTO before the first RTT sample
+#define SHAM_MIN_RTO_MS 50   // Floor for the measured RTO
+#define SHAM_MAX_RTO_MS 60000 // Ceiling for the RTO including backoff
+#define SHAM_TIMER_SLACK 64   // Stale timer entries tolerated before a rebuild
 #define SHAM_MAX_RETRIES 5
+#define SHAM_TIME_WAIT_RTOS 4 // TIME_WAIT lasts this many RTOs after the last FIN exchange
+#define SHAM_DUPACK_THRESHOLD 3 // Duplicate ACKs that trigger fast retransmit
+#define SHAM_INITIAL_CWND_SEGMENTS 10 // Initial congestion window (RFC 6928)
+#define SHAM_MAX_SACK_BLOCKS 4
+#define SHAM_ACK_EVERY 2     // Full-sized segments per delayed ACK
+#define SHAM_ACK_DELAY_MS 20 // Longest an ACK is held back; well under SHAM_MIN_RTO_MS
+#define SHAM_COALESCE_DELAY_MS 10 // Longest a write's partial segment waits for more; under SHAM_ACK_DELAY_MS
 #define SHAM_HEADER_SIZE sizeof(struct sham_header)
-#define SHAM_MAX_PACKET_SIZE (SHAM_HEADER_SIZE + SHAM_MAX_DATA_SIZE)
+#define SHAM_FILE_READAHEAD (64 * 1024) // File bytes handed to sham_send_stream per call
+#define SHAM_FILE_STALL_MS 10000 // A file receive with no progress this long fails
+#define SHAM_IO_BATCH 32 // Datagrams per sendmmsg/recvmmsg call
 
 // Flow control constants
 #define SHAM_DEFAULT_RECV_BUFFER_SIZE (32 * 1024)  // 32KB receive buffer 
                                                     
 #define SHAM_DEFAULT_ADVERTISED_WINDOW (16 * 1024) // 16KB initial window 
                                                     
+#define SHAM_MAX_WSCALE 14 // Largest window-scale shift (as in TCP)
+
+// Handshake options, carried as kind/length/value in the SYN and SYN-ACK payload
+#define SHAM_OPT_END 0
+#define SHAM_OPT_WSCALE 1 // 1-byte shift applied to window_size once established
+#define SHAM_OPT_SACK_PERM 2 // Sender of this option understands SHAM_SACK
+#define SHAM_OPT_MSS 3 // 2-byte largest segment the sender accepts; it also answers probes
+#define SHAM_OPT_COMPRESS 4 // 1-byte mask of the SHAM_COMPRESS_* methods the sender decodes
+#define SHAM_OPT_COOKIE 5 // Fast open cookie; empty in a SYN, it asks the server for one
+#define SHAM_OPT_STREAMS 6 // The connection carries multiplexed stream frames
+#define SHAM_OPT_FEC 7 // Sender of this option rebuilds lost segments from SHAM_FEC parity
+#define SHAM_MAX_SYN_OPTIONS 64
+
+// Fast open: a SYN holding a valid cookie may carry data after its options
+// (ended by SHAM_OPT_END), no more than fits a SHAM_BASE_MSS segment
+#define SHAM_FASTOPEN_COOKIE_LEN 8
+
+// Diagnostic log levels. Calls above SHAM_LOG_LEVEL compile to nothing;
+// build with -DSHAM_LOG_LEVEL=3 to get per-packet debug lines back.
+#define SHAM_LOG_WARN 1  // Failures and the peer misbehaving
+#define SHAM_LOG_INFO 2  // Connection and transfer milestones
+#define SHAM_LOG_DEBUG 3 // Per-packet and per-call detail
+#ifndef SHAM_LOG_LEVEL
+#define SHAM_LOG_LEVEL SHAM_LOG_INFO
+#endif
+#define SHAM_LOG_AT(level, log_file, ...)                                                                    \
+    do                                                                                                       \
+    {                                                                                                        \
+        if ((level) <= SHAM_LOG_LEVEL && (log_file))                                                         \
+        {                                                                                                    \
+            sham_log_write((log_file), __VA_ARGS__);                                                         \
+        }                                                                                                    \
+    } while (0)
+#define sham_log_warn(log_file, ...) SHAM_LOG_AT(SHAM_LOG_WARN, log_file, __VA_ARGS__)
+#define sham_log_info(log_file, ...) SHAM_LOG_AT(SHAM_LOG_INFO, log_file, __VA_ARGS__)
+#define sham_log(log_file, ...) SHAM_LOG_AT(SHAM_LOG_DEBUG, log_file, __VA_ARGS__)
+
+// Verbose trace events (sham_trace); a and b fill the event's format
+#define SHAM_TRACE_DROP_DATA 0         // seq
+#define SHAM_TRACE_SND_ACK_WIN 1       // ack, window
+#define SHAM_TRACE_SND_ACK 2           // ack
+#define SHAM_TRACE_SND_SYN 3           // seq
+#define SHAM_TRACE_RCV_SYN 4           // seq
+#define SHAM_TRACE_SND_SYN_ACK 5       // seq, ack
+#define SHAM_TRACE_RCV_SYN_ACK 6       // seq, ack
+#define SHAM_TRACE_RCV_ACK_FOR_SYN 7
+#define SHAM_TRACE_SND_DATA 8          // seq, len
+#define SHAM_TRACE_RCV_DATA 9          // seq, len
+#define SHAM_TRACE_RCV_ACK 10          // ack
+#define SHAM_TRACE_FAST_RETX 11        // seq, duplicate ACKs
+#define SHAM_TRACE_RETX_DATA 12        // seq, len
+#define SHAM_TRACE_TIMEOUT 13          // seq
+#define SHAM_TRACE_SND_FIN 14          // seq
+#define SHAM_TRACE_RCV_FIN 15          // seq
+#define SHAM_TRACE_SND_ACK_FOR_FIN 16
+#define SHAM_TRACE_FLOW_WIN_UPDATE 17  // window
+#define SHAM_TRACE_PMTU_MSS 18         // mss
+#define SHAM_TRACE_PMTU_PROBE 19       // probe size
+#define SHAM_TRACE_PMTU_PROBE_FAILED 20 // probe size
+#define SHAM_TRACE_RCV_PROBE 21        // probe size
+#define SHAM_TRACE_RETX_SYN 22         // seq
+#define SHAM_TRACE_RETX_SYN_ACK 23     // seq, ack
+#define SHAM_TRACE_RETX_FIN 24         // seq
+#define SHAM_TRACE_EVENTS 25
 
 // Connection states
 typedef enum
@@ -77,28 +169,234 @@ struct sham_header
                           
 };
 
-// S.H.A.M. Packet Structure
+// Selective-ACK block: bytes [start, end) held beyond ack_num
+struct sham_sack_block
+{
+   uint32_t start;
+   uint32_t end;
+};
+
+// SACK extension, sent right after the header when SHAM_SACK is set
+struct sham_sack_option
+{
+   uint8_t count; // Number of blocks that follow
+   uint8_t reserved[3];
+   struct sham_sack_block blocks[SHAM_MAX_SACK_BLOCKS];
+};
+#define SHAM_SACK_OPTION_SIZE(count) (4 + (count) * sizeof(struct sham_sack_block))
+
+// Wire-format packet buffer: header (network order) followed by the payload.
+// Built in place, shared by reference and returned to the pool at refs == 0.
+// Allocated with room for the largest segment its pool was sized for.
+struct sham_buf
+{
+   size_t len;            // Bytes of wire in use
+   size_t size;           // Bytes of wire allocated
+   int refs;              // Window slot, transmit queue, receive batch, reassembly slot
+   struct sham_buf *next; // Free-list link
+   uint8_t wire[];
+};
+#define SHAM_BUF_HEADER(buf) ((struct sham_header *)(buf)->wire)
+#define SHAM_BUF_DATA(buf) ((buf)->wire + SHAM_HEADER_SIZE)
+
+// Free list of packet buffers (sham_pool.c)
+struct sham_buf_pool
+{
+   struct sham_buf *free_list;
+   int free_count;
+   int limit;       // Free buffers kept for reuse; the rest go back to malloc
+   size_t buf_size; // Wire bytes per buffer: a header plus the connection's mss_limit
+};
+
+// Decoded view of a received packet. The payload is not copied: data points
+// into the receive batch and stays valid until the next receive call.
 struct sham_packet
 {
-   struct sham_header header;
-   uint8_t data[SHAM_MAX_DATA_SIZE];
-   size_t data_len; // Actual data length                    
+   struct sham_header header; // Host byte order
+   const uint8_t *data;
+   size_t data_len; // Actual data length
+   struct sham_buf *buf; // Pool buffer holding the datagram, NULL for a coalesced (GRO) one
+   struct sham_sack_block sack[SHAM_MAX_SACK_BLOCKS]; // Decoded SACK blocks (host order)
+   int sack_count;
 };
 
 // Window entry for sliding window
 struct sham_window_entry
 {
-   struct sham_packet packet;
-   struct timeval send_time;
+   struct sham_buf *buf;   // Segment as sent; retransmitted straight from here
+   uint32_t seq;           // Host-order copies of the header fields
+   size_t data_len;
+   size_t offset;          // Leading payload bytes of buf already acknowledged
+   uint64_t send_time_us;  // Last (re)transmission, monotonic clock
+   uint64_t deadline_us;   // Armed retransmission deadline
    int retries;
    bool acked;
+   bool sacked;      // Receiver reported holding this segment
+   bool recovery_retx; // Already resent during the current loss recovery
 };
 
-// Out-of-order buffer entry
+// Out-of-order buffer entry; holds a reference to the received datagram
 struct sham_ooo_entry
 {
-   struct sham_packet packet;
+   struct sham_buf *buf;
+   const uint8_t *data;
+   uint32_t seq;
+   size_t data_len;
    bool valid;
+   bool written; // Payload already in the file sink; no buffer kept
+};
+
+// Retransmission deadline; slot/seq identify the window entry it was armed for
+struct sham_timer
+{
+   uint64_t deadline_us;
+   int slot;
+   uint32_t seq;
+};
+
+// Binary min-heap of deadlines (sham_timer.c)
+struct sham_timer_heap
+{
+   struct sham_timer *items;
+   int count;
+   int capacity;
+};
+
+struct sham_connection;
+
+// Readiness reported by sham_poll
+#define SHAM_POLLIN 0x1  // sham_read has data or end of stream; a plain fd is readable
+#define SHAM_POLLOUT 0x2 // sham_write can queue at least one segment
+#define SHAM_POLLERR 0x4 // The connection failed (retries exhausted or socket error)
+
+// epoll set over connection sockets and plain descriptors, plus a timerfd
+// for retransmission deadlines (sham_poll.c)
+struct sham_poller;
+
+// One ready connection or descriptor
+struct sham_poll_event
+{
+   struct sham_connection *conn; // NULL for a plain descriptor
+   int fd;                       // The plain descriptor, or the connection's socket
+   short revents;
+};
+
+// Batch of datagrams for sendmmsg/recvmmsg (sham_io.c)
+struct sham_io_queue;
+
+// Datagrams routed to a connection on a shared socket (sham_demux.c)
+struct sham_backlog;
+
+// Peer-address table of the connections sharing a listening socket
+struct sham_demux
+{
+   struct sham_connection *listener; // Owns the socket and its receive batch
+   struct sham_connection **buckets; // Chained through sham_connection.demux_next
+   int bucket_count;                 // Power of two
+   int count;
+};
+
+// Multiplexed streams (sham_stream.c). The connection's bytes are frames:
+// stream ID (4 bytes), type, flags, payload length (2 bytes), all in
+// network order, then the payload
+#define SHAM_STREAM_HEADER_SIZE 8
+#define SHAM_STREAM_DATA 0   // Stream bytes; SHAM_STREAM_FLAG_FIN ends the sender's side
+#define SHAM_STREAM_WINDOW 1 // 4 bytes of credit the reader hands back
+#define SHAM_STREAM_RESET 2  // The stream is abandoned both ways
+#define SHAM_STREAM_FLAG_FIN 0x1
+#define SHAM_STREAM_WINDOW_SIZE (256 * 1024) // Credit a stream starts with; also its receive buffer
+#define SHAM_STREAM_FRAME_MAX (16 * 1024)   // Payload per DATA frame, so writers take turns
+#define SHAM_STREAM_OUT_BUFFER (64 * 1024)  // DATA frames queued ahead of the send window
+#define SHAM_MAX_STREAMS 256                // Multiplexed streams open at once on a connection
+
+// Streams over one connection and the frames queued for it
+struct sham_mux;
+
+// Forward error correction (sham_fec.c): parity after every k data segments
+#define SHAM_FEC_MAX_K 32    // Largest block
+#define SHAM_FEC_ADAPTIVE -1 // sham_set_fec: size blocks by the loss rate
+
+// Parity being built and blocks being reassembled
+struct sham_fec;
+
+// Impairments applied to one direction of a connection (sham_netem.c)
+#define SHAM_NETEM_IN 0  // Datagrams as they come off the socket
+#define SHAM_NETEM_OUT 1 // Datagrams as they are queued to send
+
+struct sham_netem_config
+{
+   double loss;      // Loss probability; under Gilbert-Elliott, in the good state
+   double loss_bad;  // Loss probability in the bad state
+   double p_bad;     // Per-datagram chance the good state turns bad; 0 keeps loss Bernoulli
+   double p_good;    // Per-datagram chance the bad state turns good
+   int delay_ms;
+   int jitter_ms;    // Delay varies uniformly by up to this much either way
+   double reorder;   // Chance a datagram skips the delay, overtaking those held
+   double duplicate; // Chance a datagram is sent twice
+   uint64_t rate_bps; // Bandwidth cap in bits per second; 0 for none
+   int limit;        // Datagrams held at most, the rest dropped; 0 for the default
+};
+
+struct sham_netem;
+
+// Loss signals reported to the congestion controller
+enum sham_cc_loss
+{
+   SHAM_CC_LOSS_FAST,   // Duplicate ACKs / SACK detected a hole
+   SHAM_CC_LOSS_TIMEOUT // Retransmission timer fired
+};
+
+// Congestion control algorithm; cwnd and ssthresh live in the connection
+struct sham_cc_ops
+{
+   const char *name;
+   void (*init)(struct sham_connection *conn);
+   void (*on_ack)(struct sham_connection *conn, uint32_t acked_bytes, long rtt_us);
+   void (*on_loss)(struct sham_connection *conn, enum sham_cc_loss type);
+};
+
+// CUBIC per-connection state (window values in segments)
+struct sham_cubic_state
+{
+   double w_max;        // Window before the last reduction
+   double k;            // Time to climb back to w_max (seconds)
+   double origin;       // Plateau of the current cubic curve
+   double w_est;        // Reno-equivalent window for the TCP-friendly region
+   long epoch_start_us; // Start of the current growth epoch, 0 when none
+   long min_rtt_us;
+};
+
+// Per-connection counters, kept on the hot paths, and a snapshot of the
+// estimators and windows filled in by sham_get_stats (sham_stats.c)
+struct sham_stats
+{
+   uint64_t bytes_sent;          // New data sent, retransmissions excluded
+   uint64_t segments_sent;
+   uint64_t bytes_retransmitted;
+   uint64_t retransmits;         // Segments resent when their timer ran out
+   uint64_t fast_retransmits;    // Segments resent on duplicate ACKs or SACK
+   uint64_t timeouts;            // Retransmission timeouts (one per backoff)
+   uint64_t bytes_received;      // New data delivered in order
+   uint64_t segments_received;   // Data segments that arrived, duplicates included
+   uint64_t dup_segments;        // Data segments we already had
+   uint64_t ooo_segments;        // Data segments buffered ahead of a gap
+   uint64_t dropped;             // Datagrams discarded (emulated loss, full queues)
+   uint64_t window_stalls;       // Sends that waited for the flow or congestion window
+   uint64_t stall_us;            // Time spent in those waits, the current one included
+   uint64_t rwnd_stall_us;       // Part of it with the peer's window as the limit
+   uint64_t fec_parity_sent;     // SHAM_FEC parity datagrams sent
+   uint64_t fec_rebuilt;         // Lost segments rebuilt from parity
+
+   // Snapshot
+   sham_state_t state;
+   long srtt_us;   // 0 before the first RTT sample
+   long rttvar_us;
+   int rto_ms;
+   uint32_t cwnd;
+   uint32_t ssthresh;
+   uint32_t peer_window;
+   uint32_t bytes_in_flight;
+   uint32_t mss;
 };
 
 // Connection context
@@ -107,6 +405,18 @@ struct sham_connection
    int sockfd;
    struct sockaddr_in peer_addr;
    socklen_t peer_len;
+   struct sham_io_queue *txq; // Segments waiting for the next sendmmsg
+   struct sham_io_queue *rxq; // Datagrams read by the last recvmmsg
+   bool offload;              // Use UDP GSO/GRO where the kernel supports it (bulk transfers)
+   bool gro_enabled;          // UDP_GRO is on for this socket
+   struct sham_buf_pool pool; // Packet buffers for this connection
+   struct sham_demux *demux;  // Table for a shared listening socket, if any
+   struct sham_connection *demux_next;
+   struct sham_backlog *backlog; // Datagrams other readers routed to us
+   int recv_timeout_ms;          // How long sham_recv waits for a segment; 0 polls
+   int ack_every;                // Segments per delayed ACK; 1 ACKs every segment
+   int ack_delay_ms;             // Longest a delayed ACK is held
+   bool reuseport;               // Listen with SO_REUSEPORT, one socket per worker
 
    // Sequence number management
    uint32_t send_seq;  // Next sequence number to send
@@ -116,89 +426,460 @@ struct sham_connection
    sham_state_t state;
 
    // Sliding window for sender
-   struct sham_window_entry send_window[SHAM_WINDOW_SIZE];
+   struct sham_window_entry *send_window;
+   int send_window_slots; // Ring capacity in segments
    int window_start; // Start index of window
    int window_count; // Number of packets in window
 
+   // Fast retransmit / SACK loss recovery
+   bool sack_enabled;   // Offer SHAM_OPT_SACK_PERM in the handshake
+   bool sack_ok;        // Both sides agreed to use SACK
+   int dupacks;         // Consecutive duplicate ACKs for send_base
+   bool in_recovery;    // Fast recovery in progress
+   uint32_t recover_seq; // send_seq when recovery started
+
+   // Congestion control
+   const struct sham_cc_ops *cc;
+   uint32_t cwnd;     // Congestion window (bytes)
+   uint32_t ssthresh; // Slow-start threshold (bytes)
+   struct sham_cubic_state cubic;
+
+   // Segment size, negotiated in the SYN/SYN-ACK and probed (sham_pmtu.c)
+   uint32_t mss_limit; // Largest segment we send or accept; offered as SHAM_OPT_MSS
+   uint32_t peer_mss;  // Largest the peer accepts, 0 if it sent no SHAM_OPT_MSS
+   uint32_t max_mss;   // Smaller of the two: the ceiling for probing
+   uint32_t mss;       // Size data segments are cut to now
+   uint32_t rcv_mss;   // Largest data segment the peer has sent us
+   bool pmtud;         // Send with DF set and probe upward; otherwise use max_mss outright
+   uint32_t probe_size;   // Probe awaiting its answer, 0 if none
+   int probe_tries;       // Probes of probe_size sent so far
+   uint32_t probe_failed; // Smallest size known not to get through, 0 if none
+   uint64_t pmtu_timer_us; // Probe timeout, or when to probe next; 0 when the search is off
+
+   // Pacing (sham_cc.c)
+   bool pacing;          // Spread each window over the round trip
+   double pace_tokens;   // Bytes the token bucket lets out now
+   uint64_t pace_last_us; // Last refill, 0 before the first
+
+   // Write coalescing (Nagle, RFC 896): while data is in flight, a write's
+   // partial last segment waits for later writes to fill it
+   bool nodelay;              // Send every write at once, for interactive traffic
+   uint8_t *coalesce;         // The waiting bytes, mss_limit big, NULL until needed
+   size_t coalesce_len;
+   uint64_t coalesce_deadline_us; // They go by then even if data is still in flight
+
    // Flow control variables
    uint32_t last_byte_sent;   // Last byte sent by sender
 
    uint32_t last_byte_acked;  // Last byte acknowledged by receiver
                                
-   uint16_t peer_window_size; // Receiver's advertised window size (in bytes)
+   uint32_t peer_window_size; // Receiver's advertised window size (in bytes)
                                
-   uint16_t recv_buffer_size; // Our receive buffer size
+   uint32_t recv_buffer_size; // Our receive buffer size
                                
-   uint16_t recv_buffer_used; // Bytes currently in receive buffer
+   uint32_t recv_buffer_used; // Bytes currently in receive buffer
                                
+   uint8_t *recv_queue;       // Ring of recv_buffer_size: in-order bytes not yet read, NULL until needed
+   uint32_t recv_queue_head;  // Offset of the oldest of them
+   uint32_t last_advertised_window; // Last window logged as a FLOW WIN UPDATE
 
-   // Out-of-order buffer for receiver
-    
-   struct sham_ooo_entry ooo_buffer[SHAM_WINDOW_SIZE];
+   // Delayed ACKs
+   int unacked_segments;     // In-order segments received since our last ACK
+   uint64_t ack_deadline_us; // When the held ACK must go out, 0 if none
+   uint32_t acked_window;    // Window carried by our last ACK
+
+   // Window scaling, negotiated in the SYN/SYN-ACK
+   bool wscale_ok;      // Both sides sent SHAM_OPT_WSCALE
+   uint8_t snd_wscale;  // Shift applied to windows the peer advertises
+   uint8_t rcv_wscale;  // Shift applied to windows we advertise
+
+   // Retransmission timer (RFC 6298 estimator)
+   bool rtt_valid;  // At least one RTT sample taken
+   long srtt_us;    // Smoothed round-trip time
+   long rttvar_us;  // Round-trip time variation
+   int rto_ms;      // Current retransmission timeout, including backoff
+   uint64_t syn_ack_time_us; // When our SYN-ACK last left; it is resent an RTO later
+   uint64_t fin_time_us;     // When our FIN last left; it is resent an RTO later
+   int fin_retries;          // Times our FIN was resent
+   long close_deadline_ms;   // FIN_WAIT_2 gives up, and TIME_WAIT ends, at this
+   struct sham_timer_heap rtx_timers; // Per-segment retransmission deadlines
 
-   // Packet loss simulation
+   // Out-of-order buffer for receiver: a ring indexed by segment offset from
+   // ooo_base, which is moved to recv_seq whenever the ring drains
     
-   float loss_rate; // Probability of dropping incoming packets (0.0-1.0)
-                     
+   struct sham_ooo_entry *ooo_buffer;
+   int recv_window_slots; // Ring capacity in segments
+   uint32_t ooo_base;     // Sequence number of the segment in slot 0
+   uint32_t ooo_unit;     // Bytes per slot: rcv_mss when the ring last re-anchored
+   int ooo_count;         // Segments currently buffered
+
+   // Data segments and FINs that arrived while a sender waited for ACKs,
+   // kept in arrival order for the next read
+   struct sham_packet *held;
+   int held_head;
+   int held_count;
+   struct sham_buf *held_current; // Buffer of the packet last taken, kept until the next one
+
+   // File sink for sham_recv_file: stream bytes from recv_seq on go straight
+   // to sink_fd at their file offsets, out-of-order segments included
+   int sink_fd;       // -1 when no file is being received
+   uint64_t sink_pos; // File offset of the byte at recv_seq
+   uint64_t sink_end; // File size
+   struct sham_digest *sink_digest; // Fed the sink's bytes in stream order, or NULL
+
+   int file_digest; // Checksum sham_send_file appends (SHAM_DIGEST_*)
+   int file_compress;     // Method sham_send_file compresses with, if the peer decodes it
+   uint8_t peer_compress; // Methods the peer decodes, from its SHAM_OPT_COMPRESS
+
+   // Handshake retransmission: the SYN and SYN-ACK are resent with backoff
+   // until answered, and a repeat of the peer's is answered again
+   uint32_t syn_seq;      // Sequence number of our SYN or SYN-ACK
+   uint32_t peer_syn_seq; // Sequence number of the peer's
+   int syn_retries;       // Times ours was resent; no RTT sample after one
+
+   // Fast open (sham_fastopen.c): data in the SYN, vouched for by a cookie
+   // the server issued to the client's address on an earlier connection
+   bool fastopen; // Client: ask for a cookie, and use one; listener: issue and honour them
+   uint8_t fastopen_cookie[SHAM_FASTOPEN_COOKIE_LEN]; // Client: ours; server: the one the client should hold
+   size_t fastopen_cookie_len; // 0 when no cookie is known
+   bool fastopen_offer;        // Server: the SYN-ACK carries the cookie (the client's was missing or stale)
+   uint32_t syn_data_len;      // SYN data bytes taken (server) or sent (client)
+
+   // Multiplexed streams, negotiated in the SYN/SYN-ACK (sham_stream.c)
+   bool streams_enabled; // Client: ask for them; listener: agree when asked
+   bool streams_ok;      // Both sides agreed: the bytes are stream frames
+
+   // Forward error correction, negotiated in the SYN/SYN-ACK (sham_fec.c)
+   bool fec_enabled;     // Offer SHAM_OPT_FEC: rebuild from the peer's parity
+   bool fec_ok;          // Both sides offered it: parity may be sent and is used
+   int fec_k;            // Data segments per parity sent, 0 for none
+   bool fec_adaptive;    // fec_k follows the loss rate
+   struct sham_fec *fec; // NULL until needed
+
+   // Network impairment emulation, NULL when none was configured
+   struct sham_netem *netem;
+
+   // Statistics (sham_stats.c)
+   struct sham_stats stats;
+   uint64_t stall_since_us; // Start of the window wait under way, 0 if none
+   bool stall_rwnd;         // That wait is on the peer's window rather than cwnd
 
    FILE *log_file;
    FILE *verbose_log_file; // Verbose logging for evaluation
                             
 };
 
+// File checksums (sham_digest.c); the type travels in the file header
+#define SHAM_DIGEST_NONE 0
+#define SHAM_DIGEST_MD5 1
+#define SHAM_DIGEST_SHA256 2
+#define SHAM_DIGEST_CRC32C 3
+#define SHAM_DIGEST_MAX_LEN 32
+
+struct sham_digest
+{
+   int type;
+   EVP_MD_CTX *md_ctx; // MD5 and SHA-256
+   uint32_t crc;       // CRC32C
+};
+
+// One connection's share of an upload striped over several; a plain
+// transfer is stripe 0 of 1, covering the whole file
+struct sham_stripe
+{
+   uint64_t id;     // Shared by every stripe of one upload
+   uint16_t index;
+   uint16_t count;
+   uint64_t offset; // Byte range of the file this connection carries
+   uint64_t length;
+};
+
+// File header: 64-bit size, digest type, compression method, then the
+// stripe (id, index, count, offset, length), all in network order
+#define SHAM_FILE_HEADER_SIZE (8 + 1 + 1 + 8 + 2 + 2 + 8 + 8)
+
+// File compression (sham_compress.c). A compressed file travels as frames,
+// each a block's raw and wire lengths (4 bytes each) then its bytes; equal
+// lengths mean the block is stored as is.
+#define SHAM_COMPRESS_NONE 0
+#define SHAM_COMPRESS_DEFLATE 1
+#define SHAM_COMPRESS_SUPPORTED (1u << SHAM_COMPRESS_DEFLATE) // Offered as SHAM_OPT_COMPRESS
+#define SHAM_COMPRESS_BLOCK SHAM_FILE_READAHEAD // File bytes per frame
+#define SHAM_FRAME_HEADER_SIZE 8
+
+struct sham_codec
+{
+   int method;
+   bool decoding;
+   bool ready;        // zs is set up
+   z_stream zs;
+   unsigned skip;     // Blocks still to send stored without trying
+   unsigned backoff;  // Length of the last such pause
+};
+
+// File receive in steps, so one thread can serve several uploads. The
+// filename must stay valid until the transfer finishes.
+struct sham_file_rx
+{
+   struct sham_connection *conn;
+   const char *filename;
+   int fd;                  // Opened once the size header is in, else -1
+   uint8_t header[SHAM_FILE_HEADER_SIZE];
+   size_t header_received;
+   uint64_t file_size;      // Of the whole file, of which this is stripe
+   struct sham_stripe stripe;
+   struct sham_digest digest; // Of the bytes written so far, in order
+   uint8_t trailer[SHAM_DIGEST_MAX_LEN]; // Sender's digest, after the file
+   size_t trailer_received;
+   uint8_t result[SHAM_DIGEST_MAX_LEN]; // Verified digest once the file is complete
+   size_t result_len;       // 0 when the sender sent none
+   uint64_t last_progress;  // File bytes in when progress was last seen
+   long last_progress_ms;   // For the no-progress timeout
+   bool in_place;           // Update an existing file: never truncate it
+   // A compressed file is read a frame at a time, then expanded and written
+   struct sham_codec codec;
+   uint8_t *frame;          // A frame's bytes plus the next frame's header
+   size_t frame_expect;     // Bytes of it to read
+   size_t frame_received;
+   uint32_t frame_raw;      // Lengths of the frame being read
+   uint32_t frame_wire;
+   uint8_t *block;          // Expanded block
+   uint64_t decoded;        // File bytes of the stripe written so far
+};
+
+// Block hashes of the receiver's copy of a file (sham_delta.c), so a
+// sender can skip the blocks it already has. Sent as a header (block size,
+// file size, block count, digest type, in network order), then the hashes.
+#define SHAM_MANIFEST_HEADER_SIZE (4 + 8 + 4 + 1)
+#define SHAM_DELTA_BLOCK_SIZE (64 * 1024) // Smallest block; larger files get larger blocks
+#define SHAM_DELTA_MAX_BLOCKS 65536       // Bounds the manifest at 1 MB of MD5s
+#define SHAM_DELTA_DIGEST SHAM_DIGEST_MD5
+
+struct sham_manifest
+{
+   uint32_t block_size;
+   uint64_t file_size;
+   uint32_t count;
+   int digest_type;
+   uint8_t *hashes;       // count hashes of sham_digest_len(digest_type) bytes
+   int fd;                // Building: the file being hashed, else -1
+   uint32_t hashed;       // Building: blocks hashed so far
+   uint8_t header[SHAM_MANIFEST_HEADER_SIZE];
+   size_t sent;           // Building: bytes of header and hashes queued
+   uint8_t *block;        // Building: read buffer of block_size
+};
+
 // Function declarations
 struct sham_connection *sham_create_connection(void);
 void sham_free_connection(struct sham_connection *conn);
+int sham_set_window_slots(struct sham_connection *conn, int send_slots, int recv_slots);
+int sham_set_mss(struct sham_connection *conn, uint32_t mss_limit);
 
 // Socket operations
 int sham_socket(void);
-int sham_bind(int sockfd, int port);
+int sham_bind(int sockfd, int port, bool reuseport);
 
 // Connection management
 int sham_connect(struct sham_connection *conn, const char *host, int port);
+int sham_connect_data(struct sham_connection *conn, const char *host, int port, const void *data, size_t len);
 int sham_listen(struct sham_connection *conn, int port);
 struct sham_connection *sham_accept(struct sham_connection *listen_conn);
 int sham_close(struct sham_connection *conn);
 
 // Data transfer
 int sham_send(struct sham_connection *conn, const void *data, size_t len);
+int sham_send_stream(struct sham_connection *conn, const void *data, size_t len);
+int sham_flush(struct sham_connection *conn);
 int sham_recv(struct sham_connection *conn, void *buffer, size_t len);
 int sham_send_file(struct sham_connection *conn, const char *filename);
+int sham_send_file_stripe(struct sham_connection *conn, const char *filename, const struct sham_stripe *stripe);
 int sham_recv_file(struct sham_connection *conn, const char *filename);
+int sham_recv_file_start(struct sham_file_rx *rx, struct sham_connection *conn, const char *filename);
+int sham_recv_file_continue(struct sham_file_rx *rx);
+int sham_send_file_range(struct sham_connection *conn, int fd, uint64_t file_size, const struct sham_stripe *stripe);
+
+// Delta transfer (sham_delta.c)
+int sham_manifest_start(struct sham_manifest *manifest, const char *filename);
+int sham_manifest_continue(struct sham_manifest *manifest, struct sham_connection *conn);
+int sham_manifest_recv(struct sham_manifest *manifest, struct sham_connection *conn);
+void sham_manifest_free(struct sham_manifest *manifest);
+int sham_send_file_delta(struct sham_connection *conn, const char *filename, const struct sham_manifest *manifest);
+
+// Non-blocking I/O: -1 with errno EAGAIN instead of waiting
+int sham_write(struct sham_connection *conn, const void *data, size_t len);
+int sham_read(struct sham_connection *conn, void *buffer, size_t len);
+int sham_service(struct sham_connection *conn);
+bool sham_readable(const struct sham_connection *conn);
+bool sham_writable(struct sham_connection *conn);
+
+// Event loop (sham_poll.c)
+struct sham_poller *sham_poller_create(void);
+void sham_poller_free(struct sham_poller *poller);
+int sham_poller_fd(const struct sham_poller *poller);
+int sham_poller_add(struct sham_poller *poller, struct sham_connection *conn, int fd, short events);
+int sham_poller_modify(struct sham_poller *poller, struct sham_connection *conn, int fd, short events);
+int sham_poller_remove(struct sham_poller *poller, struct sham_connection *conn, int fd);
+int sham_poll(struct sham_poller *poller, struct sham_poll_event *events, int max_events, int timeout_ms);
 
 // Packet operations
-struct sham_packet sham_create_packet(uint32_t seq, uint32_t ack, uint16_t flags,
-                                      const void *data, size_t data_len);
-struct sham_packet sham_create_packet_with_conn(struct sham_connection *conn, uint32_t seq, uint32_t ack, uint16_t flags,
-                                                const void *data, size_t data_len);
-int sham_send_packet(struct sham_connection *conn, const struct sham_packet *packet);
+struct sham_buf *sham_build_packet(struct sham_connection *conn, uint32_t seq, uint32_t ack, uint16_t flags,
+                                   const void *data, size_t data_len);
+int sham_send_packet(struct sham_connection *conn, struct sham_buf *buf);
 int sham_recv_packet(struct sham_connection *conn, struct sham_packet *packet);
 
 // Utility functions
-void sham_log(FILE *log_file, const char *format, ...);
+void sham_log_write(FILE *log_file, const char *format, ...);
 void sham_print_packet(const struct sham_packet *packet);
 uint32_t sham_generate_isn(void);
 long sham_get_time_ms(void);
 bool sham_is_timeout(const struct timeval *start, int timeout_ms);
+long sham_elapsed_us(uint64_t start_us);
+void sham_rtt_sample(struct sham_connection *conn, long rtt_us);
+void sham_rto_backoff(struct sham_connection *conn);
 
 // Internal functions
 int sham_process_ack(struct sham_connection *conn, const struct sham_packet *packet);
 int sham_handle_timeout(struct sham_connection *conn);
+int sham_next_timeout_ms(struct sham_connection *conn);
+int sham_fast_retransmit(struct sham_connection *conn);
 int sham_buffer_ooo_packet(struct sham_connection *conn, const struct sham_packet *packet);
 int sham_deliver_ooo_packets(struct sham_connection *conn, uint8_t *buffer, size_t *buffer_pos, size_t buffer_size);
 
 // Flow control functions
-uint16_t sham_calculate_advertised_window(struct sham_connection *conn);
+uint32_t sham_calculate_advertised_window(struct sham_connection *conn);
 int sham_can_send_data(struct sham_connection *conn, size_t data_len);
 void sham_update_flow_control(struct sham_connection *conn, size_t bytes_sent);
-void sham_update_recv_buffer(struct sham_connection *conn, int bytes_consumed);
+uint32_t sham_bytes_in_flight(struct sham_connection *conn);
 
-// Packet loss simulation
-bool sham_should_drop_packet(float loss_rate);
+// Batched I/O (sham_io.c)
+struct sham_io_queue *sham_io_queue_create(void);
+void sham_io_queue_free(struct sham_io_queue *queue, struct sham_buf_pool *pool);
+void sham_io_setup_offload(struct sham_connection *conn);
+int sham_queue_packet(struct sham_connection *conn, struct sham_buf *buf);
+int sham_flush_packets(struct sham_connection *conn);
+int sham_flush_due_packets(struct sham_connection *conn);
+int sham_queued_packets(const struct sham_connection *conn);
+bool sham_has_pending_packets(const struct sham_connection *conn);
+int sham_io_recv(struct sham_connection *conn, const uint8_t **data, struct sham_buf **buf,
+                 struct sockaddr_in *from, socklen_t *from_len, bool blocking);
+
+// Connection demultiplexing (sham_demux.c)
+int sham_demux_init(struct sham_connection *listen_conn);
+struct sham_connection *sham_demux_lookup(const struct sham_demux *demux, const struct sockaddr_in *addr);
+int sham_demux_add(struct sham_demux *demux, struct sham_connection *conn);
+void sham_demux_remove(struct sham_connection *conn);
+int sham_demux_recv(struct sham_connection *conn, const uint8_t **data, struct sham_buf **buf,
+                    struct sockaddr_in *from, socklen_t *from_len, bool blocking);
+int sham_demux_dispatch(struct sham_connection *listen_conn);
+int sham_backlog_count(const struct sham_connection *conn);
+
+// Packet buffer pool (sham_pool.c)
+struct sham_buf *sham_buf_get(struct sham_buf_pool *pool);
+struct sham_buf *sham_buf_ref(struct sham_buf *buf);
+void sham_buf_put(struct sham_buf_pool *pool, struct sham_buf *buf);
+void sham_pool_free(struct sham_buf_pool *pool);
+
+// Timers (sham_timer.c)
+uint64_t sham_now_us(void);
+int sham_timer_push(struct sham_timer_heap *heap, uint64_t deadline_us, int slot, uint32_t seq);
+const struct sham_timer *sham_timer_peek(const struct sham_timer_heap *heap);
+void sham_timer_pop(struct sham_timer_heap *heap);
+void sham_timer_clear(struct sham_timer_heap *heap);
+void sham_timer_free(struct sham_timer_heap *heap);
+
+// Congestion control (sham_cc.c)
+const struct sham_cc_ops *sham_find_congestion_control(const char *name);
+int sham_set_congestion_control(struct sham_connection *conn, const char *name);
+void sham_cc_mss_changed(struct sham_connection *conn, uint32_t old_mss);
+long sham_pace_delay_us(struct sham_connection *conn, size_t len);
+void sham_pace_consume(struct sham_connection *conn, size_t len);
+
+// File checksums (sham_digest.c)
+int sham_digest_init(struct sham_digest *digest, int type);
+void sham_digest_update(struct sham_digest *digest, const void *data, size_t len);
+size_t sham_digest_final(struct sham_digest *digest, uint8_t *out);
+void sham_digest_free(struct sham_digest *digest);
+size_t sham_digest_len(int type);
+const char *sham_digest_name(int type);
+int sham_digest_parse(const char *name);
+void sham_digest_hex(const uint8_t *digest, size_t len, char *hex);
+
+// File compression (sham_compress.c)
+int sham_codec_init(struct sham_codec *codec, int method, bool decoding);
+void sham_codec_free(struct sham_codec *codec);
+size_t sham_codec_bound(size_t len);
+size_t sham_codec_compress(struct sham_codec *codec, const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+int sham_codec_decompress(struct sham_codec *codec, const uint8_t *src, size_t len, uint8_t *dst, size_t raw_len);
+const char *sham_compress_name(int method);
+int sham_compress_parse(const char *name);
+
+// Path MTU discovery (sham_pmtu.c)
+void sham_pmtu_setup_socket(struct sham_connection *conn);
+void sham_pmtu_init(struct sham_connection *conn);
+int sham_pmtu_tick(struct sham_connection *conn);
+uint64_t sham_pmtu_deadline_us(const struct sham_connection *conn);
+void sham_pmtu_input(struct sham_connection *conn, const struct sham_packet *packet);
+void sham_pmtu_too_big(struct sham_connection *conn, size_t datagram_len);
+void sham_pmtu_on_timeout(struct sham_connection *conn, size_t data_len, int retries);
+
+// Network impairment emulation (sham_netem.c)
+int sham_netem_set(struct sham_connection *conn, int direction, const struct sham_netem_config *config);
+int sham_netem_seed(struct sham_connection *conn, uint64_t seed);
+int sham_netem_parse(const char *spec, struct sham_netem_config *config);
+int sham_netem_inherit(struct sham_connection *conn, struct sham_connection *listen_conn);
+void sham_netem_free(struct sham_connection *conn);
+int sham_netem_input(struct sham_connection *conn, const uint8_t *data, struct sham_buf *buf, int len,
+                     const struct sockaddr_in *from, socklen_t from_len);
+int sham_netem_recv(struct sham_connection *conn, const uint8_t **data, struct sham_buf **buf,
+                    struct sockaddr_in *from, socklen_t *from_len);
+bool sham_netem_input_due(const struct sham_connection *conn);
+bool sham_netem_output(struct sham_connection *conn, struct sham_buf *buf);
+bool sham_netem_output_due(const struct sham_connection *conn);
+struct sham_buf *sham_netem_take_output(struct sham_connection *conn);
+uint64_t sham_netem_deadline_us(const struct sham_connection *conn);
+void sham_netem_drain(struct sham_connection *conn);
+
+// Fast open cookies (sham_fastopen.c)
+int sham_fastopen_set_cookie(struct sham_connection *conn, const uint8_t *cookie, size_t len);
+size_t sham_fastopen_get_cookie(const struct sham_connection *conn, uint8_t *cookie);
+void sham_fastopen_cookie(const struct sockaddr_in *addr, uint8_t *cookie);
+bool sham_fastopen_check(const struct sockaddr_in *addr, const uint8_t *cookie, size_t len);
+
+// Multiplexed streams (sham_stream.c)
+struct sham_mux *sham_mux_create(struct sham_connection *conn, bool initiator);
+void sham_mux_free(struct sham_mux *mux);
+int sham_mux_service(struct sham_mux *mux);
+bool sham_mux_eof(const struct sham_mux *mux);
+size_t sham_mux_pending(const struct sham_mux *mux);
+int sham_stream_open(struct sham_mux *mux);
+int sham_stream_accept(struct sham_mux *mux);
+int sham_stream_write(struct sham_mux *mux, uint32_t id, const void *data, size_t len);
+int sham_stream_read(struct sham_mux *mux, uint32_t id, void *buffer, size_t len);
+bool sham_stream_readable(const struct sham_mux *mux, uint32_t id);
+int sham_stream_shutdown(struct sham_mux *mux, uint32_t id);
+int sham_stream_close(struct sham_mux *mux, uint32_t id);
+
+// Forward error correction (sham_fec.c)
+int sham_set_fec(struct sham_connection *conn, int k);
+int sham_fec_parse(const char *spec, int *k);
+void sham_fec_free(struct sham_connection *conn);
+uint16_t sham_fec_data_flags(struct sham_connection *conn);
+int sham_fec_add(struct sham_connection *conn, uint32_t seq, const uint8_t *data, size_t len);
+int sham_fec_flush(struct sham_connection *conn);
+bool sham_fec_input(struct sham_connection *conn, const struct sham_packet *packet, struct sham_packet *rebuilt);
+
+// Connection statistics (sham_stats.c)
+void sham_get_stats(struct sham_connection *conn, struct sham_stats *stats);
+int sham_format_stats(const struct sham_stats *stats, char *out, size_t size);
+void sham_stats_stall_begin(struct sham_connection *conn);
+void sham_stats_stall_end(struct sham_connection *conn);
 
 // Verbose logging for evaluation
-void sham_verbose_log(struct sham_connection *conn, const char *format, ...);
 bool sham_is_verbose_logging_enabled(void);
+
+// Verbose packet trace (sham_trace.c)
 FILE *sham_open_verbose_log(const char *role);
+void sham_close_verbose_log(FILE *file);
+void sham_trace(struct sham_connection *conn, int event, uint32_t a, uint32_t b);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,281 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+#include <math.h>
+
+// Congestion control algorithms. The core calls into the selected
+// algorithm through struct sham_cc_ops; cwnd and ssthresh are in bytes.
+
+#define SHAM_CUBIC_C 0.4     // Scaling constant (RFC 8312)
+#define SHAM_CUBIC_BETA 0.7  // Multiplicative decrease factor
+
+static uint32_t sham_cc_min_ssthresh(const struct sham_connection *conn)
+{
+    return 2 * conn->mss;
+}
+
+static void sham_cc_common_init(struct sham_connection *conn)
+{
+    conn->cwnd = SHAM_INITIAL_CWND_SEGMENTS * conn->mss;
+    conn->ssthresh = UINT32_MAX;
+}
+
+// Slow start: grow by the bytes acknowledged, at most two segments per ACK
+// (RFC 3465 with L = 2), so delayed ACKs do not halve the growth rate
+static uint32_t sham_cc_slow_start(struct sham_connection *conn, uint32_t acked_bytes)
+{
+    uint32_t grow = (acked_bytes > 2 * conn->mss) ? 2 * conn->mss : acked_bytes;
+    conn->cwnd += grow;
+    return acked_bytes - grow;
+}
+
+// Reno (RFC 5681)
+static void sham_reno_on_ack(struct sham_connection *conn, uint32_t acked_bytes, long rtt_us)
+{
+    (void)rtt_us;
+
+    if (conn->cwnd < conn->ssthresh)
+    {
+        sham_cc_slow_start(conn, acked_bytes);
+        return;
+    }
+
+    // Congestion avoidance: about one segment per window of data acknowledged
+    uint32_t grow = (uint32_t)((uint64_t)conn->mss * acked_bytes / conn->cwnd);
+    conn->cwnd += (grow > 0) ? grow : 1;
+}
+
+static void sham_reno_on_loss(struct sham_connection *conn, enum sham_cc_loss type)
+{
+    uint32_t half = sham_bytes_in_flight(conn) / 2;
+
+    conn->ssthresh = (half > sham_cc_min_ssthresh(conn)) ? half : sham_cc_min_ssthresh(conn);
+    conn->cwnd = (type == SHAM_CC_LOSS_TIMEOUT) ? conn->mss : conn->ssthresh;
+}
+
+static const struct sham_cc_ops sham_cc_reno = {
+    "reno",
+    sham_cc_common_init,
+    sham_reno_on_ack,
+    sham_reno_on_loss,
+};
+
+// CUBIC (RFC 8312)
+static void sham_cubic_init(struct sham_connection *conn)
+{
+    sham_cc_common_init(conn);
+    memset(&conn->cubic, 0, sizeof(conn->cubic));
+}
+
+static void sham_cubic_on_ack(struct sham_connection *conn, uint32_t acked_bytes, long rtt_us)
+{
+    struct sham_cubic_state *cs = &conn->cubic;
+    double mss = conn->mss;
+    double cwnd_seg;
+    double t;
+    double target;
+    long now_us;
+
+    if (conn->cwnd < conn->ssthresh)
+    {
+        acked_bytes = sham_cc_slow_start(conn, acked_bytes);
+        if (acked_bytes == 0)
+        {
+            return;
+        }
+    }
+
+    if (rtt_us > 0 && (cs->min_rtt_us == 0 || rtt_us < cs->min_rtt_us))
+    {
+        cs->min_rtt_us = rtt_us;
+    }
+
+    now_us = (long)sham_now_us();
+    cwnd_seg = conn->cwnd / mss;
+
+    // Start a new epoch on the first ACK after a reduction
+    if (cs->epoch_start_us == 0)
+    {
+        cs->epoch_start_us = now_us;
+        cs->w_est = cwnd_seg;
+        if (cwnd_seg < cs->w_max)
+        {
+            cs->k = cbrt((cs->w_max - cwnd_seg) / SHAM_CUBIC_C);
+            cs->origin = cs->w_max;
+        }
+        else
+        {
+            cs->k = 0.0;
+            cs->origin = cwnd_seg;
+        }
+    }
+
+    t = (now_us - cs->epoch_start_us + cs->min_rtt_us) / 1000000.0;
+    target = cs->origin + SHAM_CUBIC_C * (t - cs->k) * (t - cs->k) * (t - cs->k);
+
+    // TCP-friendly region: never grow slower than Reno would
+    cs->w_est += 3.0 * (1.0 - SHAM_CUBIC_BETA) / (1.0 + SHAM_CUBIC_BETA) * (acked_bytes / mss) / cwnd_seg;
+    if (cs->w_est > target)
+    {
+        target = cs->w_est;
+    }
+
+    if (target > cwnd_seg)
+    {
+        // Approach the target over one RTT worth of ACKs
+        double grow = (target - cwnd_seg) / cwnd_seg * acked_bytes;
+        if (grow > acked_bytes)
+        {
+            grow = acked_bytes;
+        }
+        conn->cwnd += (grow >= 1.0) ? (uint32_t)grow : 1;
+    }
+}
+
+static void sham_cubic_on_loss(struct sham_connection *conn, enum sham_cc_loss type)
+{
+    struct sham_cubic_state *cs = &conn->cubic;
+    double cwnd_seg = conn->cwnd / (double)conn->mss;
+    uint32_t reduced;
+
+    // Fast convergence: release bandwidth sooner when w_max keeps shrinking
+    if (cwnd_seg < cs->w_max)
+    {
+        cs->w_max = cwnd_seg * (1.0 + SHAM_CUBIC_BETA) / 2.0;
+    }
+    else
+    {
+        cs->w_max = cwnd_seg;
+    }
+    cs->epoch_start_us = 0;
+
+    reduced = (uint32_t)(conn->cwnd * SHAM_CUBIC_BETA);
+    conn->ssthresh = (reduced > sham_cc_min_ssthresh(conn)) ? reduced : sham_cc_min_ssthresh(conn);
+    conn->cwnd = (type == SHAM_CC_LOSS_TIMEOUT) ? conn->mss : conn->ssthresh;
+}
+
+static const struct sham_cc_ops sham_cc_cubic = {
+    "cubic",
+    sham_cubic_init,
+    sham_cubic_on_ack,
+    sham_cubic_on_loss,
+};
+
+// Rescale what CUBIC counts in segments so it keeps the same byte values
+// under a new segment size, and keep cwnd at two segments or more
+void sham_cc_mss_changed(struct sham_connection *conn, uint32_t old_mss)
+{
+    double scale = (double)old_mss / conn->mss;
+
+    conn->cubic.w_max *= scale;
+    conn->cubic.origin *= scale;
+    conn->cubic.w_est *= scale;
+    if (conn->cwnd < sham_cc_min_ssthresh(conn))
+    {
+        conn->cwnd = sham_cc_min_ssthresh(conn);
+    }
+    if (conn->ssthresh < sham_cc_min_ssthresh(conn))
+    {
+        conn->ssthresh = sham_cc_min_ssthresh(conn);
+    }
+}
+
+// Registry of selectable algorithms
+static const struct sham_cc_ops *const sham_cc_algorithms[] = {
+    &sham_cc_cubic,
+    &sham_cc_reno,
+};
+
+const struct sham_cc_ops *sham_find_congestion_control(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(sham_cc_algorithms) / sizeof(sham_cc_algorithms[0]); i++)
+    {
+        if (strcmp(sham_cc_algorithms[i]->name, name) == 0)
+        {
+            return sham_cc_algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+// Select a congestion control algorithm by name; the first registered one is the default
+int sham_set_congestion_control(struct sham_connection *conn, const char *name)
+{
+    const struct sham_cc_ops *ops = name ? sham_find_congestion_control(name) : sham_cc_algorithms[0];
+    if (!ops)
+    {
+        return -1;
+    }
+
+    conn->cc = ops;
+    conn->cc->init(conn);
+    return 0;
+}
+
+// Pacing. A token bucket refilled at gain * cwnd / srtt spreads each window
+// across the round trip instead of sending it back to back. The bucket holds
+// about SHAM_PACE_BURST_US of data (at least two segments), so segments
+// still leave in batches. Until the first RTT sample nothing is held back.
+
+#define SHAM_PACE_GAIN_SS 2.0   // Slow start: room for the window to double
+#define SHAM_PACE_GAIN_CA 1.2   // Congestion avoidance: a little headroom
+#define SHAM_PACE_BURST_US 1000 // Bucket depth in time at the current rate
+
+// Bytes per microsecond, or 0 when unpaced
+static double sham_pace_rate(const struct sham_connection *conn)
+{
+    double gain;
+
+    if (!conn->pacing || !conn->rtt_valid || conn->srtt_us <= 0)
+    {
+        return 0.0;
+    }
+    gain = (conn->cwnd < conn->ssthresh) ? SHAM_PACE_GAIN_SS : SHAM_PACE_GAIN_CA;
+    return gain * conn->cwnd / (double)conn->srtt_us;
+}
+
+// Microseconds until len more bytes may leave; 0 means now
+long sham_pace_delay_us(struct sham_connection *conn, size_t len)
+{
+    double rate = sham_pace_rate(conn);
+    double depth;
+    uint64_t now;
+
+    if (rate <= 0.0)
+    {
+        return 0;
+    }
+
+    now = sham_now_us();
+    depth = rate * SHAM_PACE_BURST_US;
+    if (depth < 2.0 * conn->mss)
+    {
+        depth = 2.0 * conn->mss;
+    }
+
+    // Refill; a fresh (or long idle) bucket starts full
+    conn->pace_tokens = (conn->pace_last_us == 0) ? depth : conn->pace_tokens + rate * (double)(now - conn->pace_last_us);
+    if (conn->pace_tokens > depth)
+    {
+        conn->pace_tokens = depth;
+    }
+    conn->pace_last_us = now;
+
+    if (conn->pace_tokens >= (double)len)
+    {
+        return 0;
+    }
+    return (long)(((double)len - conn->pace_tokens) / rate) + 1;
+}
+
+// Charge a segment that has been sent to the bucket
+void sham_pace_consume(struct sham_connection *conn, size_t len)
+{
+    if (sham_pace_rate(conn) > 0.0)
+    {
+        conn->pace_tokens -= (double)len;
+    }
+}
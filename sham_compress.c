@@ -0,0 +1,160 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+
+// Block compression for file transfers. Each block of up to
+// SHAM_COMPRESS_BLOCK bytes is compressed on its own (raw deflate, no
+// zlib header or checksum: the file digest covers the data), so a block
+// that does not shrink can go out stored and the receiver decodes every
+// block independently. After a block fails to shrink the sender stops
+// trying for a while, doubling the pause each time, so an incompressible
+// file costs little more than a raw one.
+
+#define SHAM_COMPRESS_LEVEL 1        // Z_BEST_SPEED: wire bytes matter, stalls more so
+#define SHAM_COMPRESS_MIN_SAVING 16  // A block must shrink by 1/16 to go out compressed
+#define SHAM_COMPRESS_MAX_BACKOFF 64 // Longest pause, in blocks, after incompressible ones
+
+int sham_codec_init(struct sham_codec *codec, int method, bool decoding)
+{
+    int err;
+
+    memset(codec, 0, sizeof(*codec));
+    codec->method = method;
+    codec->decoding = decoding;
+    if (method == SHAM_COMPRESS_NONE)
+    {
+        return 0;
+    }
+    if (method != SHAM_COMPRESS_DEFLATE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    err = decoding ? inflateInit2(&codec->zs, -MAX_WBITS)
+                   : deflateInit2(&codec->zs, SHAM_COMPRESS_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    if (err != Z_OK)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    codec->ready = true;
+    return 0;
+}
+
+void sham_codec_free(struct sham_codec *codec)
+{
+    if (codec->ready)
+    {
+        if (codec->decoding)
+        {
+            inflateEnd(&codec->zs);
+        }
+        else
+        {
+            deflateEnd(&codec->zs);
+        }
+        codec->ready = false;
+    }
+}
+
+// Largest compressed form of a block of len bytes
+size_t sham_codec_bound(size_t len)
+{
+    // compressBound's worst case; a block that overflows it just goes out stored
+    return len + (len >> 12) + (len >> 14) + (len >> 25) + 13;
+}
+
+// Compress a block into dst. Returns its compressed length, or 0 when it is
+// better sent stored: it did not shrink enough, or we are pausing after
+// incompressible blocks.
+size_t sham_codec_compress(struct sham_codec *codec, const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    size_t out_len;
+
+    if (!codec->ready || len == 0)
+    {
+        return 0;
+    }
+    if (codec->skip > 0)
+    {
+        codec->skip--;
+        return 0;
+    }
+
+    deflateReset(&codec->zs);
+    codec->zs.next_in = (Bytef *)src;
+    codec->zs.avail_in = (uInt)len;
+    codec->zs.next_out = dst;
+    codec->zs.avail_out = (uInt)cap;
+    if (deflate(&codec->zs, Z_FINISH) != Z_STREAM_END)
+    {
+        out_len = len; // Ran out of room: as good as incompressible
+    }
+    else
+    {
+        out_len = cap - codec->zs.avail_out;
+    }
+
+    if (out_len > len - len / SHAM_COMPRESS_MIN_SAVING)
+    {
+        codec->backoff = codec->backoff ? codec->backoff * 2 : 1;
+        if (codec->backoff > SHAM_COMPRESS_MAX_BACKOFF)
+        {
+            codec->backoff = SHAM_COMPRESS_MAX_BACKOFF;
+        }
+        codec->skip = codec->backoff;
+        return 0;
+    }
+    codec->backoff = 0;
+    return out_len;
+}
+
+// Expand a compressed block that must come to exactly raw_len bytes
+int sham_codec_decompress(struct sham_codec *codec, const uint8_t *src, size_t len, uint8_t *dst, size_t raw_len)
+{
+    if (!codec->ready)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    inflateReset(&codec->zs);
+    codec->zs.next_in = (Bytef *)src;
+    codec->zs.avail_in = (uInt)len;
+    codec->zs.next_out = dst;
+    codec->zs.avail_out = (uInt)raw_len;
+    if (inflate(&codec->zs, Z_FINISH) != Z_STREAM_END || codec->zs.avail_out != 0 || codec->zs.avail_in != 0)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+// Label for logs and errors
+const char *sham_compress_name(int method)
+{
+    switch (method)
+    {
+    case SHAM_COMPRESS_DEFLATE:
+        return "deflate";
+    default:
+        return "none";
+    }
+}
+
+// Method for a name as given on the command line, or -1
+int sham_compress_parse(const char *name)
+{
+    if (strcmp(name, "deflate") == 0)
+    {
+        return SHAM_COMPRESS_DEFLATE;
+    }
+    if (strcmp(name, "none") == 0)
+    {
+        return SHAM_COMPRESS_NONE;
+    }
+    return -1;
+}
@@ -0,0 +1,389 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+#include <sys/stat.h>
+
+// Delta uploads. The receiver hashes its copy of the file in fixed-size
+// blocks and sends the hashes (the manifest); the sender compares them with
+// its own blocks and sends only the runs that differ, each as a stripe of
+// the upload, updating the file in place. A file left partial by a failed
+// transfer resumes the same way: the blocks that made it in match.
+
+#define SHAM_DELTA_HASH_BUDGET (4 * 1024 * 1024) // File bytes hashed per sham_manifest_continue
+
+// Block size for a file: the smallest power of two from SHAM_DELTA_BLOCK_SIZE
+// that keeps the block count within SHAM_DELTA_MAX_BLOCKS
+static uint32_t sham_delta_block_size(uint64_t file_size)
+{
+    uint64_t block_size = SHAM_DELTA_BLOCK_SIZE;
+
+    while (file_size / block_size >= SHAM_DELTA_MAX_BLOCKS)
+    {
+        block_size *= 2;
+    }
+    return (uint32_t)block_size;
+}
+
+static uint32_t sham_delta_block_count(uint64_t file_size, uint32_t block_size)
+{
+    return (uint32_t)((file_size + block_size - 1) / block_size);
+}
+
+// Bytes in block index of a file; the last one may be short
+static size_t sham_delta_block_len(uint64_t file_size, uint32_t block_size, uint32_t index)
+{
+    uint64_t start = (uint64_t)index * block_size;
+    return (file_size - start < block_size) ? (size_t)(file_size - start) : block_size;
+}
+
+// Hash one block of an open file into out
+static int sham_delta_hash_block(int fd, uint64_t file_size, uint32_t block_size, uint32_t index, int type,
+                                 uint8_t *block, uint8_t *out)
+{
+    size_t len = sham_delta_block_len(file_size, block_size, index);
+    size_t got = 0;
+    struct sham_digest digest;
+
+    while (got < len)
+    {
+        ssize_t n = pread(fd, block + got, len - got, (off_t)((uint64_t)index * block_size + got));
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        got += (size_t)n;
+    }
+
+    if (sham_digest_init(&digest, type) < 0)
+    {
+        return -1;
+    }
+    sham_digest_update(&digest, block, len);
+    return (sham_digest_final(&digest, out) == 0) ? -1 : 0;
+}
+
+static void sham_manifest_put32(uint8_t *p, uint32_t value)
+{
+    uint32_t value_net = htonl(value);
+    memcpy(p, &value_net, sizeof(value_net));
+}
+
+static uint32_t sham_manifest_get32(const uint8_t *p)
+{
+    uint32_t value_net;
+    memcpy(&value_net, p, sizeof(value_net));
+    return ntohl(value_net);
+}
+
+static int sham_manifest_alloc(struct sham_manifest *manifest)
+{
+    size_t hash_len = sham_digest_len(manifest->digest_type);
+
+    manifest->hashes = malloc(manifest->count ? (size_t)manifest->count * hash_len : 1);
+    return manifest->hashes ? 0 : -1;
+}
+
+// Begin the manifest of filename for sham_manifest_continue to hash and
+// send. A file that does not exist yet has no blocks.
+int sham_manifest_start(struct sham_manifest *manifest, const char *filename)
+{
+    struct stat st;
+
+    memset(manifest, 0, sizeof(*manifest));
+    manifest->digest_type = SHAM_DELTA_DIGEST;
+    manifest->fd = open(filename, O_RDONLY);
+    if (manifest->fd < 0 && errno != ENOENT)
+    {
+        perror("Failed to open file for its manifest");
+        return -1;
+    }
+    if (manifest->fd >= 0)
+    {
+        if (fstat(manifest->fd, &st) < 0)
+        {
+            perror("Failed to stat file");
+            sham_manifest_free(manifest);
+            return -1;
+        }
+        manifest->file_size = (uint64_t)st.st_size;
+    }
+
+    manifest->block_size = sham_delta_block_size(manifest->file_size);
+    manifest->count = sham_delta_block_count(manifest->file_size, manifest->block_size);
+    if (sham_manifest_alloc(manifest) < 0 || (manifest->block = malloc(manifest->block_size)) == NULL)
+    {
+        sham_manifest_free(manifest);
+        return -1;
+    }
+
+    sham_manifest_put32(manifest->header, manifest->block_size);
+    sham_manifest_put32(manifest->header + 4, (uint32_t)(manifest->file_size >> 32));
+    sham_manifest_put32(manifest->header + 8, (uint32_t)manifest->file_size);
+    sham_manifest_put32(manifest->header + 12, manifest->count);
+    manifest->header[16] = (uint8_t)manifest->digest_type;
+    return 0;
+}
+
+// Hash the next blocks and queue what is ready without blocking, so a
+// server keeps its other transfers moving. Returns 1 once the whole
+// manifest is queued, 0 while there is more, or -1 on failure.
+int sham_manifest_continue(struct sham_manifest *manifest, struct sham_connection *conn)
+{
+    size_t hash_len = sham_digest_len(manifest->digest_type);
+    size_t budget = 0;
+    size_t ready;
+    bool nodelay;
+
+    while (manifest->hashed < manifest->count && budget < SHAM_DELTA_HASH_BUDGET)
+    {
+        if (sham_delta_hash_block(manifest->fd, manifest->file_size, manifest->block_size, manifest->hashed,
+                                  manifest->digest_type, manifest->block,
+                                  manifest->hashes + (size_t)manifest->hashed * hash_len) < 0)
+        {
+            fprintf(stderr, "Failed to hash block %u of the existing file\n", manifest->hashed);
+            return -1;
+        }
+        budget += manifest->block_size;
+        manifest->hashed++;
+    }
+
+    // The header goes in a write of its own: the peer reads it by itself. The
+    // manifest is not sent until its last bytes are, so none may be held back.
+    ready = SHAM_MANIFEST_HEADER_SIZE + (size_t)manifest->hashed * hash_len;
+    nodelay = conn->nodelay;
+    conn->nodelay = true;
+    while (manifest->sent < ready)
+    {
+        const uint8_t *data = (manifest->sent < SHAM_MANIFEST_HEADER_SIZE)
+                                  ? manifest->header + manifest->sent
+                                  : manifest->hashes + (manifest->sent - SHAM_MANIFEST_HEADER_SIZE);
+        size_t len = (manifest->sent < SHAM_MANIFEST_HEADER_SIZE) ? SHAM_MANIFEST_HEADER_SIZE - manifest->sent
+                                                                  : ready - manifest->sent;
+        int queued = sham_write(conn, data, len);
+
+        if (queued < 0)
+        {
+            conn->nodelay = nodelay;
+            return (errno == EAGAIN) ? 0 : -1;
+        }
+        manifest->sent += (size_t)queued;
+    }
+    conn->nodelay = nodelay;
+    return (manifest->hashed == manifest->count) ? 1 : 0;
+}
+
+// Read the peer's manifest, waiting up to SHAM_FILE_STALL_MS for progress
+int sham_manifest_recv(struct sham_manifest *manifest, struct sham_connection *conn)
+{
+    uint8_t header[SHAM_MANIFEST_HEADER_SIZE];
+    size_t header_received = 0;
+    size_t hashes_len = 0;
+    size_t received = 0;
+    long last_progress_ms = sham_get_time_ms();
+
+    memset(manifest, 0, sizeof(*manifest));
+    manifest->fd = -1;
+
+    while (header_received < sizeof(header) || received < hashes_len)
+    {
+        int n;
+
+        if (header_received < sizeof(header))
+        {
+            n = sham_recv(conn, header + header_received, sizeof(header) - header_received);
+        }
+        else
+        {
+            n = sham_recv(conn, manifest->hashes + received, hashes_len - received);
+        }
+        if (n < 0 || (n == 0 && conn->state == SHAM_CLOSE_WAIT))
+        {
+            fprintf(stderr, "Connection lost while receiving the manifest\n");
+            sham_manifest_free(manifest);
+            return -1;
+        }
+        if (n == 0)
+        {
+            if (sham_get_time_ms() - last_progress_ms > SHAM_FILE_STALL_MS)
+            {
+                fprintf(stderr, "Timeout waiting for the manifest\n");
+                sham_manifest_free(manifest);
+                return -1;
+            }
+            continue;
+        }
+        last_progress_ms = sham_get_time_ms();
+
+        if (header_received < sizeof(header))
+        {
+            header_received += (size_t)n;
+            if (header_received < sizeof(header))
+            {
+                continue;
+            }
+
+            manifest->block_size = sham_manifest_get32(header);
+            manifest->file_size = ((uint64_t)sham_manifest_get32(header + 4) << 32) | sham_manifest_get32(header + 8);
+            manifest->count = sham_manifest_get32(header + 12);
+            manifest->digest_type = header[16];
+            if (manifest->block_size == 0 || sham_digest_len(manifest->digest_type) == 0 ||
+                manifest->count > SHAM_DELTA_MAX_BLOCKS ||
+                manifest->count != sham_delta_block_count(manifest->file_size, manifest->block_size))
+            {
+                fprintf(stderr, "Bad manifest: %u blocks of %u bytes\n", manifest->count, manifest->block_size);
+                return -1;
+            }
+            if (sham_manifest_alloc(manifest) < 0)
+            {
+                return -1;
+            }
+            hashes_len = (size_t)manifest->count * sham_digest_len(manifest->digest_type);
+        }
+        else
+        {
+            received += (size_t)n;
+        }
+    }
+
+    sham_log_info(conn->log_file, "[DELTA] Peer has %llu bytes in %u blocks of %u\n",
+             (unsigned long long)manifest->file_size, manifest->count, manifest->block_size);
+    return 0;
+}
+
+void sham_manifest_free(struct sham_manifest *manifest)
+{
+    if (manifest->fd >= 0)
+    {
+        close(manifest->fd);
+        manifest->fd = -1;
+    }
+    free(manifest->hashes);
+    manifest->hashes = NULL;
+    free(manifest->block);
+    manifest->block = NULL;
+}
+
+// Does block index of our file match the peer's copy?
+static bool sham_delta_block_matches(const struct sham_manifest *manifest, int fd, uint64_t file_size,
+                                     uint32_t index, uint8_t *block)
+{
+    uint8_t hash[SHAM_DIGEST_MAX_LEN];
+    size_t hash_len = sham_digest_len(manifest->digest_type);
+
+    if (index >= manifest->count || sham_delta_block_len(file_size, manifest->block_size, index) !=
+                                        sham_delta_block_len(manifest->file_size, manifest->block_size, index))
+    {
+        return false;
+    }
+    return sham_delta_hash_block(fd, file_size, manifest->block_size, index, manifest->digest_type, block, hash) == 0 &&
+           memcmp(hash, manifest->hashes + (size_t)index * hash_len, hash_len) == 0;
+}
+
+// Send the blocks of filename the peer's manifest says it lacks, one stripe
+// per run of changed blocks. An unchanged file still sends one empty stripe,
+// which sets the peer's file size. Returns 0 once the peer has all of it.
+int sham_send_file_delta(struct sham_connection *conn, const char *filename, const struct sham_manifest *manifest)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    uint64_t file_size;
+    uint32_t count;
+    uint32_t block_size = manifest->block_size;
+    uint8_t *changed = NULL;
+    uint8_t *block = NULL;
+    struct sham_stripe stripe;
+    uint64_t delta_bytes = 0;
+    uint32_t runs = 0;
+    uint32_t i;
+    int result;
+
+    if (fd < 0)
+    {
+        perror("Failed to open file");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0)
+    {
+        perror("Failed to stat file");
+        close(fd);
+        return -1;
+    }
+    file_size = (uint64_t)st.st_size;
+    count = sham_delta_block_count(file_size, block_size);
+
+    changed = malloc(count ? count : 1);
+    block = malloc(block_size);
+    if (!changed || !block)
+    {
+        free(changed);
+        free(block);
+        close(fd);
+        return -1;
+    }
+
+    // Mark the blocks to send and count the runs they form
+    for (i = 0; i < count; i++)
+    {
+        changed[i] = !sham_delta_block_matches(manifest, fd, file_size, i, block);
+        if (changed[i])
+        {
+            delta_bytes += sham_delta_block_len(file_size, block_size, i);
+            runs += (i == 0 || !changed[i - 1]);
+        }
+    }
+    if (runs > UINT16_MAX)
+    {
+        // More runs than a stripe count can number; send the file whole
+        memset(changed, 1, count);
+        runs = 1;
+        delta_bytes = file_size;
+    }
+    sham_log_info(conn->log_file, "[DELTA] Sending %llu of %llu bytes in %u runs\n", (unsigned long long)delta_bytes,
+             (unsigned long long)file_size, runs);
+
+    memset(&stripe, 0, sizeof(stripe));
+    stripe.count = (uint16_t)(runs ? runs : 1);
+    if (runs == 0)
+    {
+        stripe.offset = file_size;
+        result = sham_send_file_range(conn, fd, file_size, &stripe);
+    }
+    else
+    {
+        result = 0;
+        for (i = 0; i < count && result == 0; i++)
+        {
+            uint32_t end = i;
+
+            if (!changed[i])
+            {
+                continue;
+            }
+            while (end < count && changed[end])
+            {
+                end++;
+            }
+            stripe.offset = (uint64_t)i * block_size;
+            stripe.length = ((end == count) ? file_size : (uint64_t)end * block_size) - stripe.offset;
+            result = sham_send_file_range(conn, fd, file_size, &stripe);
+            stripe.index++;
+            i = end;
+        }
+    }
+
+    free(changed);
+    free(block);
+    close(fd);
+    if (result < 0)
+    {
+        return -1;
+    }
+
+    // Drain the pipeline at end-of-file
+    return sham_flush(conn);
+}
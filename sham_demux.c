@@ -0,0 +1,371 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+
+// Connection demultiplexing on a shared listening socket. Accepted
+// connections keep the listener's socket, so whichever one reads a batch
+// sees datagrams for all of them. Each datagram is looked up by its source
+// address and parked on the owning connection's backlog; datagrams from
+// unknown peers (new SYNs) go to the listener's.
+
+#define SHAM_DEMUX_INITIAL_BUCKETS 64
+#define SHAM_BACKLOG_LISTEN 32 // Datagrams from unknown peers held for sham_accept
+
+struct sham_backlog_entry
+{
+    struct sham_buf *buf;
+    struct sockaddr_in from;
+};
+
+struct sham_backlog
+{
+    struct sham_buf *current; // Datagram last handed out, kept until the next one
+    int head;
+    int count;
+    int capacity;
+    struct sham_backlog_entry entries[];
+};
+
+static uint32_t sham_demux_hash(const struct sockaddr_in *addr)
+{
+    uint32_t h = addr->sin_addr.s_addr ^ ((uint32_t)addr->sin_port << 16);
+    return h * 2654435761u;
+}
+
+static bool sham_demux_same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static struct sham_backlog *sham_backlog_create(int capacity)
+{
+    struct sham_backlog *bl = calloc(1, sizeof(*bl) + (size_t)capacity * sizeof(bl->entries[0]));
+    if (bl)
+    {
+        bl->capacity = capacity;
+    }
+    return bl;
+}
+
+static void sham_backlog_free(struct sham_connection *conn)
+{
+    struct sham_backlog *bl = conn->backlog;
+
+    if (!bl)
+    {
+        return;
+    }
+    while (bl->count > 0)
+    {
+        sham_buf_put(&conn->pool, bl->entries[bl->head].buf);
+        bl->head = (bl->head + 1) % bl->capacity;
+        bl->count--;
+    }
+    sham_buf_put(&conn->pool, bl->current);
+    free(bl);
+    conn->backlog = NULL;
+}
+
+// Park a datagram for conn. A full backlog drops it, as a full socket buffer would.
+static void sham_backlog_push(struct sham_connection *conn, const uint8_t *data, struct sham_buf *buf,
+                              int len, const struct sockaddr_in *from)
+{
+    struct sham_backlog *bl = conn->backlog;
+    struct sham_backlog_entry *entry;
+
+    if (bl->count == bl->capacity)
+    {
+        sham_log_warn(conn->log_file, "[DEMUX] Backlog full, dropping datagram\n");
+        conn->stats.dropped++;
+        return;
+    }
+    if ((size_t)len > conn->pool.buf_size)
+    {
+        return; // Larger than conn accepts
+    }
+
+    entry = &bl->entries[(bl->head + bl->count) % bl->capacity];
+    if (buf)
+    {
+        entry->buf = sham_buf_ref(buf);
+    }
+    else
+    {
+        // Segment of a coalesced receive; it needs a buffer of its own
+        entry->buf = sham_buf_get(&conn->pool);
+        if (!entry->buf)
+        {
+            return;
+        }
+        memcpy(entry->buf->wire, data, (size_t)len);
+        entry->buf->len = (size_t)len;
+    }
+    entry->from = *from;
+    bl->count++;
+}
+
+int sham_backlog_count(const struct sham_connection *conn)
+{
+    return conn->backlog ? conn->backlog->count : 0;
+}
+
+// Set up the connection table for a listening connection
+int sham_demux_init(struct sham_connection *listen_conn)
+{
+    struct sham_demux *demux = calloc(1, sizeof(*demux));
+
+    if (!demux)
+    {
+        return -1;
+    }
+    demux->buckets = calloc(SHAM_DEMUX_INITIAL_BUCKETS, sizeof(*demux->buckets));
+    listen_conn->backlog = sham_backlog_create(SHAM_BACKLOG_LISTEN);
+    if (!demux->buckets || !listen_conn->backlog)
+    {
+        free(demux->buckets);
+        free(demux);
+        sham_backlog_free(listen_conn);
+        return -1;
+    }
+    demux->bucket_count = SHAM_DEMUX_INITIAL_BUCKETS;
+    demux->listener = listen_conn;
+    listen_conn->demux = demux;
+    return 0;
+}
+
+// Connection for a peer address, or NULL if none is registered
+struct sham_connection *sham_demux_lookup(const struct sham_demux *demux, const struct sockaddr_in *addr)
+{
+    struct sham_connection *conn = demux->buckets[sham_demux_hash(addr) & (uint32_t)(demux->bucket_count - 1)];
+
+    while (conn && !sham_demux_same_peer(&conn->peer_addr, addr))
+    {
+        conn = conn->demux_next;
+    }
+    return conn;
+}
+
+// Double the bucket array once the table averages one connection per bucket
+static void sham_demux_grow(struct sham_demux *demux)
+{
+    int count = demux->bucket_count * 2;
+    struct sham_connection **buckets = calloc((size_t)count, sizeof(*buckets));
+    int i;
+
+    if (!buckets)
+    {
+        return; // Keep the longer chains
+    }
+    for (i = 0; i < demux->bucket_count; i++)
+    {
+        while (demux->buckets[i])
+        {
+            struct sham_connection *conn = demux->buckets[i];
+            uint32_t b = sham_demux_hash(&conn->peer_addr) & (uint32_t)(count - 1);
+
+            demux->buckets[i] = conn->demux_next;
+            conn->demux_next = buckets[b];
+            buckets[b] = conn;
+        }
+    }
+    free(demux->buckets);
+    demux->buckets = buckets;
+    demux->bucket_count = count;
+}
+
+// Move the peer's datagrams waiting on the listener's backlog (a SYN it
+// repeated before the first was accepted) to conn's, keeping the others in order
+static void sham_backlog_claim(struct sham_connection *listen_conn, struct sham_connection *conn)
+{
+    struct sham_backlog *bl = listen_conn->backlog;
+    int kept = 0;
+    int i;
+
+    for (i = 0; i < bl->count; i++)
+    {
+        struct sham_backlog_entry entry = bl->entries[(bl->head + i) % bl->capacity];
+
+        if (sham_demux_same_peer(&entry.from, &conn->peer_addr))
+        {
+            sham_backlog_push(conn, entry.buf->wire, entry.buf, (int)entry.buf->len, &entry.from);
+            sham_buf_put(&listen_conn->pool, entry.buf);
+        }
+        else
+        {
+            bl->entries[(bl->head + kept++) % bl->capacity] = entry;
+        }
+    }
+    bl->count = kept;
+}
+
+// The shared socket queues every connection's window, not just one; ask for
+// a receive buffer that holds them all, plus the listener's for new SYNs.
+// Best effort, like sham_size_socket_buffers: the kernel clamps it.
+static void sham_demux_size_rcvbuf(struct sham_demux *demux)
+{
+    struct sham_connection *listener = demux->listener;
+    int rcvbuf = (demux->count + 1) * listener->recv_window_slots * (int)listener->pool.buf_size * 2;
+
+    setsockopt(listener->sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+}
+
+// Route the peer's datagrams to conn from now on
+int sham_demux_add(struct sham_demux *demux, struct sham_connection *conn)
+{
+    uint32_t b;
+
+    if (sham_demux_lookup(demux, &conn->peer_addr))
+    {
+        return -1;
+    }
+    conn->backlog = sham_backlog_create(conn->recv_window_slots + 2 * SHAM_IO_BATCH);
+    if (!conn->backlog)
+    {
+        return -1;
+    }
+    if (demux->count >= demux->bucket_count)
+    {
+        sham_demux_grow(demux);
+    }
+
+    b = sham_demux_hash(&conn->peer_addr) & (uint32_t)(demux->bucket_count - 1);
+    conn->demux_next = demux->buckets[b];
+    demux->buckets[b] = conn;
+    conn->demux = demux;
+    demux->count++;
+    sham_demux_size_rcvbuf(demux);
+    sham_backlog_claim(demux->listener, conn);
+    return 0;
+}
+
+// Unregister a connection (or tear down the table, for the listener)
+void sham_demux_remove(struct sham_connection *conn)
+{
+    struct sham_demux *demux = conn->demux;
+    int i;
+
+    if (!demux)
+    {
+        sham_backlog_free(conn);
+        return;
+    }
+
+    if (conn == demux->listener)
+    {
+        // Connections still registered lose the socket along with the table
+        for (i = 0; i < demux->bucket_count; i++)
+        {
+            struct sham_connection *c;
+            for (c = demux->buckets[i]; c; c = c->demux_next)
+            {
+                c->demux = NULL;
+                c->sockfd = -1;
+            }
+        }
+        free(demux->buckets);
+        free(demux);
+    }
+    else
+    {
+        struct sham_connection **link = &demux->buckets[sham_demux_hash(&conn->peer_addr) &
+                                                         (uint32_t)(demux->bucket_count - 1)];
+        while (*link && *link != conn)
+        {
+            link = &(*link)->demux_next;
+        }
+        if (*link)
+        {
+            *link = conn->demux_next;
+            demux->count--;
+        }
+    }
+
+    conn->demux = NULL;
+    conn->demux_next = NULL;
+    sham_backlog_free(conn);
+}
+
+// Connection a datagram from addr belongs to; unknown peers go to the listener
+static struct sham_connection *sham_demux_route(struct sham_demux *demux, const struct sockaddr_in *addr)
+{
+    struct sham_connection *conn = sham_demux_lookup(demux, addr);
+    return conn ? conn : demux->listener;
+}
+
+// sham_io_recv for a connection on a shared socket: its backlog first, then
+// the socket, parking whatever belongs to other connections. When blocking,
+// reads until a datagram for conn arrives.
+int sham_demux_recv(struct sham_connection *conn, const uint8_t **data, struct sham_buf **buf,
+                    struct sockaddr_in *from, socklen_t *from_len, bool blocking)
+{
+    struct sham_demux *demux = conn->demux;
+    struct sham_backlog *bl = conn->backlog;
+
+    for (;;)
+    {
+        struct sham_connection *target;
+        int len;
+
+        if (bl->count > 0)
+        {
+            struct sham_backlog_entry *entry = &bl->entries[bl->head];
+
+            sham_buf_put(&conn->pool, bl->current);
+            bl->current = entry->buf;
+            bl->head = (bl->head + 1) % bl->capacity;
+            bl->count--;
+
+            *data = bl->current->wire;
+            *buf = bl->current;
+            *from = entry->from;
+            *from_len = sizeof(entry->from);
+            return (int)bl->current->len;
+        }
+
+        len = sham_io_recv(demux->listener, data, buf, from, from_len, blocking);
+        if (len <= 0)
+        {
+            return len;
+        }
+
+        target = sham_demux_route(demux, from);
+        if (target == conn)
+        {
+            return len;
+        }
+        sham_backlog_push(target, *data, *buf, len, from);
+    }
+}
+
+// Read everything waiting on the listening socket into the backlogs.
+// Returns the number of datagrams routed, or -1 on a socket error.
+int sham_demux_dispatch(struct sham_connection *listen_conn)
+{
+    struct sham_demux *demux = listen_conn->demux;
+    int routed = 0;
+
+    for (;;)
+    {
+        const uint8_t *data;
+        struct sham_buf *buf;
+        struct sockaddr_in from;
+        socklen_t from_len;
+        int len = sham_io_recv(listen_conn, &data, &buf, &from, &from_len, false);
+
+        if (len < 0)
+        {
+            if (errno == EBADF || errno == ENOTSOCK)
+            {
+                listen_conn->sockfd = -1;
+            }
+            return -1;
+        }
+        if (len == 0)
+        {
+            return routed;
+        }
+        sham_backlog_push(sham_demux_route(demux, &from), data, buf, len, &from);
+        routed++;
+    }
+}
@@ -0,0 +1,229 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+#include <pthread.h>
+
+// File checksums, computed as bytes stream past rather than by reading the
+// file back. MD5 and SHA-256 come from OpenSSL's EVP interface; CRC32C
+// (Castagnoli) uses the SSE4.2 crc32 instruction when the CPU has it and a
+// lookup table otherwise.
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define SHAM_CRC32C_HW 1
+#endif
+
+#define SHAM_CRC32C_POLY 0x82f63b78u // Reflected Castagnoli polynomial
+
+static uint32_t sham_crc32c_table[256];
+static pthread_once_t sham_crc32c_once = PTHREAD_ONCE_INIT;
+
+static void sham_crc32c_init_table(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        int bit;
+
+        for (bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ SHAM_CRC32C_POLY : crc >> 1;
+        }
+        sham_crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t sham_crc32c_sw(uint32_t crc, const uint8_t *data, size_t len)
+{
+    pthread_once(&sham_crc32c_once, sham_crc32c_init_table);
+    while (len-- > 0)
+    {
+        crc = sham_crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef SHAM_CRC32C_HW
+__attribute__((target("sse4.2"))) static uint32_t sham_crc32c_hw(uint32_t crc, const uint8_t *data, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while (len > 0 && ((uintptr_t)data & 7) != 0)
+    {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+        len--;
+    }
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+    {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+    }
+    return (uint32_t)crc64;
+}
+#endif
+
+static uint32_t sham_crc32c_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+#ifdef SHAM_CRC32C_HW
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return sham_crc32c_hw(crc, data, len);
+    }
+#endif
+    return sham_crc32c_sw(crc, data, len);
+}
+
+static const EVP_MD *sham_digest_md(int type)
+{
+    switch (type)
+    {
+    case SHAM_DIGEST_MD5:
+        return EVP_md5();
+    case SHAM_DIGEST_SHA256:
+        return EVP_sha256();
+    default:
+        return NULL;
+    }
+}
+
+// Digest length in bytes, or 0 for SHAM_DIGEST_NONE and unknown types
+size_t sham_digest_len(int type)
+{
+    switch (type)
+    {
+    case SHAM_DIGEST_MD5:
+        return 16;
+    case SHAM_DIGEST_SHA256:
+        return 32;
+    case SHAM_DIGEST_CRC32C:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+// Label for printing a digest ("MD5: ...")
+const char *sham_digest_name(int type)
+{
+    switch (type)
+    {
+    case SHAM_DIGEST_MD5:
+        return "MD5";
+    case SHAM_DIGEST_SHA256:
+        return "SHA256";
+    case SHAM_DIGEST_CRC32C:
+        return "CRC32C";
+    default:
+        return "none";
+    }
+}
+
+// Digest type for a name as given on the command line, or -1
+int sham_digest_parse(const char *name)
+{
+    if (strcmp(name, "md5") == 0)
+    {
+        return SHAM_DIGEST_MD5;
+    }
+    if (strcmp(name, "sha256") == 0)
+    {
+        return SHAM_DIGEST_SHA256;
+    }
+    if (strcmp(name, "crc32c") == 0)
+    {
+        return SHAM_DIGEST_CRC32C;
+    }
+    if (strcmp(name, "none") == 0)
+    {
+        return SHAM_DIGEST_NONE;
+    }
+    return -1;
+}
+
+int sham_digest_init(struct sham_digest *digest, int type)
+{
+    const EVP_MD *md = sham_digest_md(type);
+
+    memset(digest, 0, sizeof(*digest));
+    digest->type = type;
+    if (type == SHAM_DIGEST_CRC32C)
+    {
+        digest->crc = 0xffffffffu;
+        return 0;
+    }
+    if (!md)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    digest->md_ctx = EVP_MD_CTX_new();
+    if (!digest->md_ctx || EVP_DigestInit_ex(digest->md_ctx, md, NULL) != 1)
+    {
+        sham_digest_free(digest);
+        return -1;
+    }
+    return 0;
+}
+
+void sham_digest_update(struct sham_digest *digest, const void *data, size_t len)
+{
+    if (digest->type == SHAM_DIGEST_CRC32C)
+    {
+        digest->crc = sham_crc32c_update(digest->crc, data, len);
+    }
+    else if (digest->md_ctx)
+    {
+        EVP_DigestUpdate(digest->md_ctx, data, len);
+    }
+}
+
+// Write the digest to out (sham_digest_len bytes, network order for CRC32C)
+// and release the context. Returns its length, or 0 on failure.
+size_t sham_digest_final(struct sham_digest *digest, uint8_t *out)
+{
+    size_t len = sham_digest_len(digest->type);
+
+    if (digest->type == SHAM_DIGEST_CRC32C)
+    {
+        uint32_t crc_net = htonl(digest->crc ^ 0xffffffffu);
+        memcpy(out, &crc_net, sizeof(crc_net));
+    }
+    else if (!digest->md_ctx || EVP_DigestFinal_ex(digest->md_ctx, out, NULL) != 1)
+    {
+        len = 0;
+    }
+    sham_digest_free(digest);
+    return len;
+}
+
+void sham_digest_free(struct sham_digest *digest)
+{
+    if (digest->md_ctx)
+    {
+        EVP_MD_CTX_free(digest->md_ctx);
+        digest->md_ctx = NULL;
+    }
+}
+
+// Lowercase hex of a digest; hex needs 2 * len + 1 bytes
+void sham_digest_hex(const uint8_t *digest, size_t len, char *hex)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+    hex[2 * len] = '\0';
+}
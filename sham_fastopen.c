@@ -0,0 +1,100 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Fast open cookies. A server hands each client address a cookie in its
+// SYN-ACK; a client that presents it in a later SYN has shown it can receive
+// at that address, so the data after the SYN's options is taken at once
+// instead of a round trip later.
+//
+// A cookie is the leading bytes of SHA-256 over a secret and the client's
+// IPv4 address, so the server keeps no per-client state. The secret is made
+// once per process and shared by every listener in it: SO_REUSEPORT workers
+// each see a client on a different socket from one connection to the next.
+
+#define SHAM_FASTOPEN_KEY_LEN 16
+
+static uint8_t sham_fastopen_key[SHAM_FASTOPEN_KEY_LEN];
+static pthread_once_t sham_fastopen_once = PTHREAD_ONCE_INIT;
+
+static void sham_fastopen_init_key(void)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd < 0 || read(fd, sham_fastopen_key, sizeof(sham_fastopen_key)) != (ssize_t)sizeof(sham_fastopen_key))
+    {
+        uint64_t seed = sham_now_us() ^ ((uint64_t)getpid() << 32);
+        size_t i;
+
+        for (i = 0; i < sizeof(sham_fastopen_key); i++)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            sham_fastopen_key[i] = (uint8_t)(seed >> 56);
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+// The cookie this process issues to a client address
+void sham_fastopen_cookie(const struct sockaddr_in *addr, uint8_t *cookie)
+{
+    struct sham_digest digest;
+    uint8_t hash[SHAM_DIGEST_MAX_LEN];
+
+    pthread_once(&sham_fastopen_once, sham_fastopen_init_key);
+    memset(hash, 0, sizeof(hash));
+    if (sham_digest_init(&digest, SHAM_DIGEST_SHA256) == 0)
+    {
+        sham_digest_update(&digest, sham_fastopen_key, sizeof(sham_fastopen_key));
+        sham_digest_update(&digest, &addr->sin_addr, sizeof(addr->sin_addr));
+        sham_digest_final(&digest, hash);
+        sham_digest_free(&digest);
+    }
+    memcpy(cookie, hash, SHAM_FASTOPEN_COOKIE_LEN);
+}
+
+// Is this the cookie we issued to the address?
+bool sham_fastopen_check(const struct sockaddr_in *addr, const uint8_t *cookie, size_t len)
+{
+    uint8_t expected[SHAM_FASTOPEN_COOKIE_LEN];
+
+    if (len != SHAM_FASTOPEN_COOKIE_LEN)
+    {
+        return false;
+    }
+    sham_fastopen_cookie(addr, expected);
+    return memcmp(expected, cookie, SHAM_FASTOPEN_COOKIE_LEN) == 0;
+}
+
+// Give a client the cookie it was issued before (kept by the application
+// between runs) and turn fast open on. A NULL cookie only asks for one.
+int sham_fastopen_set_cookie(struct sham_connection *conn, const uint8_t *cookie, size_t len)
+{
+    if (conn->state != SHAM_CLOSED || (cookie && len != SHAM_FASTOPEN_COOKIE_LEN))
+    {
+        return -1;
+    }
+
+    conn->fastopen = true;
+    conn->fastopen_cookie_len = cookie ? len : 0;
+    if (cookie)
+    {
+        memcpy(conn->fastopen_cookie, cookie, len);
+    }
+    return 0;
+}
+
+// The cookie a client holds once connected: the one it sent, or a fresh one
+// from the server. Returns its length, 0 if there is none.
+size_t sham_fastopen_get_cookie(const struct sham_connection *conn, uint8_t *cookie)
+{
+    memcpy(cookie, conn->fastopen_cookie, conn->fastopen_cookie_len);
+    return conn->fastopen_cookie_len;
+}
@@ -0,0 +1,410 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+
+// Forward error correction. Once both ends agree on SHAM_OPT_FEC, a sender
+// with fec_k set groups its new data segments into blocks of that many and
+// follows each block with a SHAM_FEC datagram: the XOR of the block's
+// segments, each zero-padded to the longest. The parity header carries the
+// block's [start, end) range in seq_num and ack_num and its segment count
+// in window_size. Every segment of a block, retransmissions sent straight
+// from the window included, carries the block's tag in the high byte of its
+// flags; resent pieces of a cut segment are untagged.
+//
+// The receiver XORs each tagged segment into its block as it arrives (so
+// segments already delivered still count) and the parity on top. With all
+// but one segment in, what is left is the missing one; its range is the gap
+// the others leave in the block. It is handed to the reader like any other
+// segment, a round trip before a retransmission could arrive. A block that
+// lost two or more segments is left to the usual recovery.
+//
+// Parity is not retransmitted and is not in the send window. An adaptive
+// sender (SHAM_FEC_ADAPTIVE) sets the block size from the share of
+// segments it had to resend: roughly one parity per 1/(4 * loss) segments,
+// so two losses in one block stay unlikely, and none on a clean path.
+
+#define SHAM_FEC_SLOTS 32           // Blocks being reassembled at once
+#define SHAM_FEC_ADAPT_SEGMENTS 64 // New segments between block size updates
+#define SHAM_FEC_INITIAL_K 8        // Adaptive block size before the first update
+
+// One block at the receiver
+struct sham_fec_block
+{
+    uint8_t tag;        // 0 while unused
+    bool parity;        // Its parity has arrived
+    bool done;          // Complete, rebuilt, or beyond repair
+    uint32_t first_seq; // Lowest sequence number seen in it
+    uint32_t start;     // Range and segment count, from the parity
+    uint32_t end;
+    int count;
+    int have; // Distinct segments seen
+    uint32_t seqs[SHAM_FEC_MAX_K];
+    uint32_t lens[SHAM_FEC_MAX_K];
+    size_t xor_len;
+    uint8_t *xor; // mss_limit bytes
+};
+
+struct sham_fec
+{
+    // Encoder: the block being sent
+    uint8_t tag;
+    int k;           // Segments per block now, 0 for no parity
+    int count;       // Segments in the block so far
+    uint32_t start;  // Its first sequence number
+    size_t xor_len;  // Its longest segment
+    uint8_t *xor;
+
+    // Loss seen at the last block size update
+    uint64_t adapt_sent;
+    uint64_t adapt_resent;
+    double loss;
+
+    // Decoder
+    struct sham_fec_block blocks[SHAM_FEC_SLOTS];
+};
+
+// Send parity after every k new data segments; 0 for none, or
+// SHAM_FEC_ADAPTIVE to follow the loss rate. Takes effect with the next
+// block, on connections where the peer offered SHAM_OPT_FEC.
+int sham_set_fec(struct sham_connection *conn, int k)
+{
+    if (k != SHAM_FEC_ADAPTIVE && (k < 0 || k > SHAM_FEC_MAX_K))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    conn->fec_adaptive = (k == SHAM_FEC_ADAPTIVE);
+    conn->fec_k = conn->fec_adaptive ? SHAM_FEC_INITIAL_K : k;
+    return 0;
+}
+
+// Parse a block size for sham_set_fec: a count of segments, or "auto"
+int sham_fec_parse(const char *spec, int *k)
+{
+    char *end;
+    long n;
+
+    if (strcmp(spec, "auto") == 0)
+    {
+        *k = SHAM_FEC_ADAPTIVE;
+        return 0;
+    }
+    n = strtol(spec, &end, 10);
+    if (*spec == '\0' || *end != '\0' || n < 0 || n > SHAM_FEC_MAX_K)
+    {
+        return -1;
+    }
+    *k = (int)n;
+    return 0;
+}
+
+static struct sham_fec *sham_fec_state(struct sham_connection *conn)
+{
+    if (!conn->fec)
+    {
+        conn->fec = calloc(1, sizeof(struct sham_fec));
+    }
+    return conn->fec;
+}
+
+void sham_fec_free(struct sham_connection *conn)
+{
+    int i;
+
+    if (!conn->fec)
+    {
+        return;
+    }
+    for (i = 0; i < SHAM_FEC_SLOTS; i++)
+    {
+        free(conn->fec->blocks[i].xor);
+    }
+    free(conn->fec->xor);
+    free(conn->fec);
+    conn->fec = NULL;
+}
+
+static void sham_fec_xor(uint8_t *acc, size_t *acc_len, const uint8_t *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        acc[i] ^= data[i];
+    }
+    if (len > *acc_len)
+    {
+        *acc_len = len;
+    }
+}
+
+// Block size from the share of new segments resent since the last update
+static void sham_fec_adapt(struct sham_connection *conn, struct sham_fec *fec)
+{
+    uint64_t sent = conn->stats.segments_sent - fec->adapt_sent;
+    uint64_t resent = conn->stats.retransmits + conn->stats.fast_retransmits - fec->adapt_resent;
+    double k;
+
+    if (sent < SHAM_FEC_ADAPT_SEGMENTS)
+    {
+        return;
+    }
+    // The first sample stands alone; later ones are smoothed in
+    fec->loss = (fec->adapt_sent == 0) ? (double)resent / (double)sent
+                                       : (3 * fec->loss + (double)resent / (double)sent) / 4;
+    fec->adapt_sent = conn->stats.segments_sent;
+    fec->adapt_resent = conn->stats.retransmits + conn->stats.fast_retransmits;
+
+    // Loss too rare to be worth even the largest blocks turns parity off
+    k = (fec->loss > 0) ? 1 / (4 * fec->loss) : 0;
+    if (k <= 0 || k > 2 * SHAM_FEC_MAX_K)
+    {
+        conn->fec_k = 0;
+    }
+    else
+    {
+        conn->fec_k = (k > SHAM_FEC_MAX_K) ? SHAM_FEC_MAX_K : (k < 1) ? 1 : (int)k;
+    }
+}
+
+// Send the parity of the block so far, which ends at end, and start the next
+static int sham_fec_emit(struct sham_connection *conn, struct sham_fec *fec, uint32_t end)
+{
+    struct sham_buf *buf;
+    int queued = 0;
+
+    // A block cut before the segment size dropped would not fit; skip it
+    if (fec->xor_len <= conn->mss)
+    {
+        buf = sham_build_packet(conn, fec->start, end, (uint16_t)(SHAM_FEC | (fec->tag << SHAM_FEC_TAG_SHIFT)),
+                                fec->xor, fec->xor_len);
+        if (!buf)
+        {
+            return -1;
+        }
+        SHAM_BUF_HEADER(buf)->window_size = htons((uint16_t)fec->count);
+        queued = sham_queue_packet(conn, buf);
+        sham_buf_put(&conn->pool, buf);
+        if (queued < 0)
+        {
+            return -1;
+        }
+        sham_pace_consume(conn, fec->xor_len);
+        conn->stats.fec_parity_sent++;
+        sham_log(conn->log_file, "[FEC] Parity for %d segments [%u, %u)\n", fec->count, fec->start, end);
+    }
+
+    memset(fec->xor, 0, fec->xor_len);
+    fec->count = 0;
+    fec->xor_len = 0;
+    fec->tag = (fec->tag == 0xFF) ? 1 : fec->tag + 1;
+    return 0;
+}
+
+// Flags for the next new data segment: its block's tag, or 0 when no
+// parity is being sent
+uint16_t sham_fec_data_flags(struct sham_connection *conn)
+{
+    struct sham_fec *fec;
+
+    if (!conn->fec_ok || (conn->fec_k == 0 && !conn->fec_adaptive) || !(fec = sham_fec_state(conn)))
+    {
+        return 0;
+    }
+    if (!fec->xor && !(fec->xor = calloc(1, conn->mss_limit)))
+    {
+        return 0;
+    }
+    if (fec->count == 0)
+    {
+        if (conn->fec_adaptive)
+        {
+            sham_fec_adapt(conn, fec);
+        }
+        fec->k = conn->fec_k;
+        if (fec->tag == 0)
+        {
+            fec->tag = 1;
+        }
+    }
+    return (fec->k > 0) ? (uint16_t)(fec->tag << SHAM_FEC_TAG_SHIFT) : 0;
+}
+
+// Add a new data segment, sent with sham_fec_data_flags, to its block. It
+// is queued already; the parity goes behind it once the block is full.
+int sham_fec_add(struct sham_connection *conn, uint32_t seq, const uint8_t *data, size_t len)
+{
+    struct sham_fec *fec = conn->fec;
+
+    if (fec->count == 0)
+    {
+        fec->start = seq;
+    }
+    sham_fec_xor(fec->xor, &fec->xor_len, data, len);
+    fec->count++;
+
+    return (fec->count >= fec->k) ? sham_fec_emit(conn, fec, seq + (uint32_t)len) : 0;
+}
+
+// Send the parity of a block cut short: the sender has no more to send for now
+int sham_fec_flush(struct sham_connection *conn)
+{
+    if (!conn->fec || conn->fec->count == 0)
+    {
+        return 0;
+    }
+    return sham_fec_emit(conn, conn->fec, conn->send_seq);
+}
+
+// Find the block a tagged segment or parity at seq belongs to, taking the
+// slot over from an older block. NULL for one too old to matter.
+static struct sham_fec_block *sham_fec_block(struct sham_connection *conn, struct sham_fec *fec, uint8_t tag,
+                                             uint32_t seq)
+{
+    struct sham_fec_block *block = &fec->blocks[tag % SHAM_FEC_SLOTS];
+    uint32_t span = (uint32_t)SHAM_FEC_MAX_K * conn->mss_limit;
+
+    if (block->tag == tag && seq - block->first_seq < span)
+    {
+        return block;
+    }
+    if (block->tag == tag && block->first_seq - seq < span)
+    {
+        block->first_seq = seq;
+        return block;
+    }
+    if (block->tag != 0 && SHAM_SEQ_LT(seq, block->first_seq))
+    {
+        return NULL;
+    }
+
+    if (!block->xor && !(block->xor = calloc(1, conn->mss_limit)))
+    {
+        return NULL;
+    }
+    memset(block->xor, 0, block->xor_len);
+    block->xor_len = 0;
+    block->tag = tag;
+    block->parity = false;
+    block->done = false;
+    block->first_seq = seq;
+    block->have = 0;
+    return block;
+}
+
+// With one segment missing and the parity in, rebuild it into *rebuilt
+static bool sham_fec_rebuild(struct sham_connection *conn, struct sham_fec_block *block, struct sham_packet *rebuilt)
+{
+    uint32_t pos = block->start;
+    uint32_t gap_len;
+    uint32_t total = 0;
+    size_t i;
+    int j;
+
+    if (!block->parity || block->done || block->have < block->count - 1)
+    {
+        return false;
+    }
+    block->done = true;
+    if (block->have >= block->count)
+    {
+        return false;
+    }
+
+    // The gap the others leave; they must all lie in the parity's range
+    for (j = 0; j < block->have; j++)
+    {
+        if (SHAM_SEQ_LT(block->seqs[j], block->start) ||
+            SHAM_SEQ_GT(block->seqs[j] + block->lens[j], block->end))
+        {
+            return false;
+        }
+        total += block->lens[j];
+    }
+    for (j = 0; j < block->have;)
+    {
+        if (block->seqs[j] == pos)
+        {
+            pos += block->lens[j];
+            j = 0;
+            continue;
+        }
+        j++;
+    }
+    gap_len = (block->end - block->start) - total;
+    if (gap_len == 0 || gap_len > block->xor_len || SHAM_SEQ_LEQ(pos + gap_len, conn->recv_seq))
+    {
+        return false;
+    }
+
+    // Padding past the segment must have cancelled out
+    for (i = gap_len; i < block->xor_len; i++)
+    {
+        if (block->xor[i] != 0)
+        {
+            return false;
+        }
+    }
+
+    memset(rebuilt, 0, sizeof(*rebuilt));
+    rebuilt->header.seq_num = pos;
+    rebuilt->data = block->xor;
+    rebuilt->data_len = gap_len;
+    conn->stats.fec_rebuilt++;
+    sham_log(conn->log_file, "[FEC] Rebuilt seq=%u, len=%u\n", pos, gap_len);
+    return true;
+}
+
+// Take in a received parity datagram or tagged data segment. Returns true
+// with the block's missing segment in *rebuilt (its data valid until the
+// next call) once it can be rebuilt.
+bool sham_fec_input(struct sham_connection *conn, const struct sham_packet *packet, struct sham_packet *rebuilt)
+{
+    uint8_t tag = (uint8_t)(packet->header.flags >> SHAM_FEC_TAG_SHIFT);
+    bool parity = (packet->header.flags & SHAM_FEC) != 0;
+    struct sham_fec_block *block;
+    struct sham_fec *fec;
+    int j;
+
+    if (!conn->fec_ok || tag == 0 || packet->data_len == 0 || packet->data_len > conn->mss_limit ||
+        !(fec = sham_fec_state(conn)) || !(block = sham_fec_block(conn, fec, tag, packet->header.seq_num)) ||
+        block->done)
+    {
+        return false;
+    }
+
+    if (parity)
+    {
+        if (block->parity || packet->header.window_size == 0 || packet->header.window_size > SHAM_FEC_MAX_K)
+        {
+            return false;
+        }
+        block->parity = true;
+        block->start = packet->header.seq_num;
+        block->end = packet->header.ack_num;
+        block->count = packet->header.window_size;
+    }
+    else
+    {
+        // A segment counts once, however often it is resent
+        for (j = 0; j < block->have; j++)
+        {
+            if (block->seqs[j] == packet->header.seq_num)
+            {
+                return false;
+            }
+        }
+        if (block->have == SHAM_FEC_MAX_K)
+        {
+            block->done = true;
+            return false;
+        }
+        block->seqs[block->have] = packet->header.seq_num;
+        block->lens[block->have] = (uint32_t)packet->data_len;
+        block->have++;
+    }
+    sham_fec_xor(block->xor, &block->xor_len, packet->data, packet->data_len);
+
+    return sham_fec_rebuild(conn, block, rebuilt);
+}
@@ -0,0 +1,418 @@
+#define _GNU_SOURCE // sendmmsg, recvmmsg, MSG_WAITFORONE, UDP_SEGMENT, UDP_GRO
+#include "sham.h"
+#include <sys/uio.h>
+#include <netinet/udp.h>
+
+// Batched datagram I/O. Outgoing segments are queued by reference to their
+// pool buffers and leave in one sendmmsg; incoming datagrams are pulled into
+// pool buffers with one recvmmsg and handed out one at a time through
+// sham_recv_packet.
+//
+// With offload enabled, runs of equal-sized queued segments go out as one
+// UDP_SEGMENT (GSO) send, and UDP_GRO lets the kernel hand us several
+// segments in one buffer, which is split again here.
+//
+// Sockets send with DF set (sham_pmtu.c); a datagram the kernel knows is
+// too big for the path fails with EMSGSIZE and is treated as lost.
+
+#define SHAM_IO_GRO_BATCH 8           // Coalesced buffers per recvmmsg
+#define SHAM_IO_GRO_BUFFER_SIZE 65536 // Largest coalesced receive
+#define SHAM_IO_GSO_MAX_SEGMENTS 64   // Kernel limit (UDP_MAX_SEGMENTS)
+#define SHAM_IO_GSO_MAX_BYTES 65507   // A GSO send is one UDP datagram to the kernel
+
+struct sham_io_queue
+{
+    struct mmsghdr msgs[SHAM_IO_BATCH];
+    struct sockaddr_in addrs[SHAM_IO_BATCH];
+    union
+    {
+        size_t align; // cmsghdr alignment
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl[SHAM_IO_BATCH];
+
+    // Send side: one iovec per queued datagram; a GSO message spans a run of them
+    struct sham_buf *tx_bufs[SHAM_IO_BATCH];
+    struct iovec tx_iov[SHAM_IO_BATCH];
+    int count;       // Datagrams queued (send) or messages received (receive)
+    bool gso_failed; // Kernel rejected UDP_SEGMENT; one datagram per message
+
+    // Receive side: a pool buffer per message, or large buffers while GRO is on
+    struct sham_buf *rx_slots[SHAM_IO_BATCH];
+    struct iovec rx_iov[SHAM_IO_BATCH];
+    uint8_t *gro_bufs;
+    int seg_size[SHAM_IO_BATCH]; // Segment length within each received message
+    int next;                    // Message being handed out
+    int next_off;                // Offset of its next segment
+};
+
+struct sham_io_queue *sham_io_queue_create(void)
+{
+    return calloc(1, sizeof(struct sham_io_queue));
+}
+
+void sham_io_queue_free(struct sham_io_queue *queue, struct sham_buf_pool *pool)
+{
+    int i;
+
+    if (!queue)
+    {
+        return;
+    }
+    for (i = 0; i < queue->count && queue->tx_bufs[i]; i++)
+    {
+        sham_buf_put(pool, queue->tx_bufs[i]);
+    }
+    for (i = 0; i < SHAM_IO_BATCH; i++)
+    {
+        sham_buf_put(pool, queue->rx_slots[i]);
+    }
+    free(queue->gro_bufs);
+    free(queue);
+}
+
+// Turn on UDP_GRO for an offload connection; GSO is requested per send
+void sham_io_setup_offload(struct sham_connection *conn)
+{
+    int on = 1;
+
+    conn->gro_enabled = false;
+    if (!conn->offload || conn->sockfd < 0)
+    {
+        return;
+    }
+    if (setsockopt(conn->sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0)
+    {
+        conn->gro_enabled = true;
+    }
+    sham_log_info(conn->log_file, "[IO] Offload requested, GRO %s\n", conn->gro_enabled ? "on" : "unsupported");
+}
+
+// Queue a packet for the next batch, holding a reference until it is sent.
+// A full batch is flushed first. The impairment emulator may take it
+// instead, to lose it or send it later.
+int sham_queue_packet(struct sham_connection *conn, struct sham_buf *buf)
+{
+    struct sham_io_queue *txq = conn->txq;
+
+    if (sham_netem_output(conn, buf))
+    {
+        return (int)buf->len;
+    }
+    if (txq->count == SHAM_IO_BATCH && sham_flush_packets(conn) < 0)
+    {
+        return -1;
+    }
+
+    txq->tx_bufs[txq->count] = sham_buf_ref(buf);
+    txq->tx_iov[txq->count].iov_base = buf->wire;
+    txq->tx_iov[txq->count].iov_len = buf->len;
+    txq->count++;
+
+    return (int)buf->len;
+}
+
+// Group queued datagrams into messages. Under GSO one message gathers a run
+// of segments the size of its first, of which only the last may be shorter.
+static int sham_io_build_tx(struct sham_connection *conn, bool gso)
+{
+    struct sham_io_queue *txq = conn->txq;
+    int msgs = 0;
+    int i = 0;
+
+    while (i < txq->count)
+    {
+        struct msghdr *hdr = &txq->msgs[msgs].msg_hdr;
+        size_t seg_size = txq->tx_iov[i].iov_len;
+        size_t total = seg_size;
+        int run = 1;
+
+        while (gso && i + run < txq->count && run < SHAM_IO_GSO_MAX_SEGMENTS &&
+               txq->tx_iov[i + run - 1].iov_len == seg_size && txq->tx_iov[i + run].iov_len <= seg_size &&
+               total + txq->tx_iov[i + run].iov_len <= SHAM_IO_GSO_MAX_BYTES)
+        {
+            total += txq->tx_iov[i + run].iov_len;
+            run++;
+        }
+
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->msg_name = &conn->peer_addr;
+        hdr->msg_namelen = conn->peer_len;
+        hdr->msg_iov = &txq->tx_iov[i];
+        hdr->msg_iovlen = (size_t)run;
+
+        if (run > 1)
+        {
+            struct cmsghdr *cm;
+            uint16_t gso_size = (uint16_t)seg_size;
+
+            hdr->msg_control = txq->ctrl[msgs].buf;
+            hdr->msg_controllen = CMSG_SPACE(sizeof(gso_size));
+            cm = CMSG_FIRSTHDR(hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(gso_size));
+            memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+        }
+
+        i += run;
+        msgs++;
+    }
+
+    return msgs;
+}
+
+// Send every queued packet to the peer, along with those the impairment
+// emulator held that are now due
+int sham_flush_packets(struct sham_connection *conn)
+{
+    struct sham_io_queue *txq = conn->txq;
+    int queued;
+    bool gso = conn->offload && !txq->gso_failed;
+    struct sham_buf *due = NULL;
+    int msgs;
+    int sent = 0;
+    int i;
+
+    while (txq->count < SHAM_IO_BATCH && (due = sham_netem_take_output(conn)) != NULL)
+    {
+        txq->tx_bufs[txq->count] = due;
+        txq->tx_iov[txq->count].iov_base = due->wire;
+        txq->tx_iov[txq->count].iov_len = due->len;
+        txq->count++;
+    }
+
+    queued = txq->count;
+    if (queued == 0)
+    {
+        return 0;
+    }
+
+    msgs = sham_io_build_tx(conn, gso);
+
+    // sendmmsg may stop short of the batch; resend the remainder
+    while (sent < msgs)
+    {
+        int n = sendmmsg(conn->sockfd, txq->msgs + sent, (unsigned int)(msgs - sent), 0);
+        if (n < 0)
+        {
+            if (gso && sent == 0 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT))
+            {
+                // No segmentation offload on this path; fall back for good
+                sham_log_warn(conn->log_file, "[IO] UDP_SEGMENT rejected, disabling GSO\n");
+                txq->gso_failed = true;
+                gso = false;
+                msgs = sham_io_build_tx(conn, false);
+                continue;
+            }
+            if (errno == EMSGSIZE)
+            {
+                // Larger than the path takes with DF set: as good as lost
+                sham_pmtu_too_big(conn, txq->msgs[sent].msg_hdr.msg_iov[0].iov_len);
+                sent++;
+                continue;
+            }
+            perror("sendmmsg failed");
+            queued = -1;
+            break;
+        }
+        sent += n;
+    }
+
+    for (i = 0; i < txq->count; i++)
+    {
+        sham_buf_put(&conn->pool, txq->tx_bufs[i]);
+        txq->tx_bufs[i] = NULL;
+    }
+    txq->count = 0;
+
+    // The batch filled up with due datagrams; more may be waiting
+    if (due && queued > 0)
+    {
+        int more = sham_flush_packets(conn);
+        return (more < 0) ? -1 : queued + more;
+    }
+    return queued;
+}
+
+// Send the datagrams the impairment emulator held that are now due. Other
+// queued segments go too, but only then, so a batch is not cut short.
+int sham_flush_due_packets(struct sham_connection *conn)
+{
+    return sham_netem_output_due(conn) ? sham_flush_packets(conn) : 0;
+}
+
+int sham_queued_packets(const struct sham_connection *conn)
+{
+    return conn->txq->count;
+}
+
+static bool sham_io_rx_pending(const struct sham_io_queue *rxq)
+{
+    return rxq->next < rxq->count;
+}
+
+bool sham_has_pending_packets(const struct sham_connection *conn)
+{
+    // On a shared socket the listener's batch may hold datagrams for conn too
+    const struct sham_io_queue *rxq = conn->demux ? conn->demux->listener->rxq : conn->rxq;
+
+    return sham_backlog_count(conn) > 0 || sham_io_rx_pending(rxq) || sham_netem_input_due(conn);
+}
+
+// Refill the receive batch. flags is MSG_WAITFORONE to block for the first
+// datagram, or MSG_DONTWAIT to take only what is already queued.
+static int sham_io_fill(struct sham_connection *conn, int flags)
+{
+    struct sham_io_queue *rxq = conn->rxq;
+    int batch = conn->gro_enabled ? SHAM_IO_GRO_BATCH : SHAM_IO_BATCH;
+    int n;
+    int i;
+
+    if (conn->gro_enabled && !rxq->gro_bufs)
+    {
+        rxq->gro_bufs = malloc((size_t)SHAM_IO_GRO_BATCH * SHAM_IO_GRO_BUFFER_SIZE);
+        if (!rxq->gro_bufs)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    for (i = 0; i < batch; i++)
+    {
+        struct msghdr *hdr = &rxq->msgs[i].msg_hdr;
+
+        if (conn->gro_enabled)
+        {
+            rxq->rx_iov[i].iov_base = rxq->gro_bufs + (size_t)i * SHAM_IO_GRO_BUFFER_SIZE;
+            rxq->rx_iov[i].iov_len = SHAM_IO_GRO_BUFFER_SIZE;
+        }
+        else
+        {
+            // A segment kept for reassembly still owns its buffer, and one
+            // sized before sham_set_mss is too small; take a fresh one
+            if (rxq->rx_slots[i] && (rxq->rx_slots[i]->refs > 1 || rxq->rx_slots[i]->size != conn->pool.buf_size))
+            {
+                sham_buf_put(&conn->pool, rxq->rx_slots[i]);
+                rxq->rx_slots[i] = NULL;
+            }
+            if (!rxq->rx_slots[i] && !(rxq->rx_slots[i] = sham_buf_get(&conn->pool)))
+            {
+                errno = ENOMEM;
+                return -1;
+            }
+            rxq->rx_iov[i].iov_base = rxq->rx_slots[i]->wire;
+            rxq->rx_iov[i].iov_len = rxq->rx_slots[i]->size;
+        }
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->msg_name = &rxq->addrs[i];
+        hdr->msg_namelen = sizeof(rxq->addrs[i]);
+        hdr->msg_iov = &rxq->rx_iov[i];
+        hdr->msg_iovlen = 1;
+        if (conn->gro_enabled)
+        {
+            hdr->msg_control = rxq->ctrl[i].buf;
+            hdr->msg_controllen = sizeof(rxq->ctrl[i].buf);
+        }
+    }
+
+    rxq->count = 0;
+    rxq->next = 0;
+    rxq->next_off = 0;
+    n = recvmmsg(conn->sockfd, rxq->msgs, (unsigned int)batch, flags, NULL);
+    if (n < 0)
+    {
+        return -1;
+    }
+
+    // A coalesced message carries its segment size; otherwise it is one datagram
+    for (i = 0; i < n; i++)
+    {
+        struct msghdr *hdr = &rxq->msgs[i].msg_hdr;
+        struct cmsghdr *cm;
+
+        rxq->seg_size[i] = (int)rxq->msgs[i].msg_len;
+        if (hdr->msg_flags & MSG_TRUNC)
+        {
+            rxq->seg_size[i] = 0; // Larger than we accept; sham_io_recv skips it
+            continue;
+        }
+        if (!conn->gro_enabled)
+        {
+            rxq->rx_slots[i]->len = rxq->msgs[i].msg_len;
+            continue;
+        }
+        for (cm = CMSG_FIRSTHDR(hdr); cm; cm = CMSG_NXTHDR(hdr, cm))
+        {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+            {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+                if (gso_size > 0)
+                {
+                    rxq->seg_size[i] = gso_size;
+                }
+            }
+        }
+    }
+
+    rxq->count = n;
+    return n;
+}
+
+// Take the next received datagram, reading a new batch when none is left.
+// Returns its length with *data pointing into the batch and *buf set to its
+// pool buffer (NULL when it came out of a coalesced message), 0 if nothing
+// is waiting (non-blocking only), or -1 on error with errno set.
+int sham_io_recv(struct sham_connection *conn, const uint8_t **data, struct sham_buf **buf,
+                 struct sockaddr_in *from, socklen_t *from_len, bool blocking)
+{
+    struct sham_io_queue *rxq = conn->rxq;
+    struct mmsghdr *msg;
+    int len;
+
+    for (;;)
+    {
+        if (!sham_io_rx_pending(rxq))
+        {
+            int n = sham_io_fill(conn, blocking ? MSG_WAITFORONE : MSG_DONTWAIT);
+            if (n < 0)
+            {
+                return (!blocking && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+            }
+            if (n == 0)
+            {
+                return 0;
+            }
+        }
+
+        msg = &rxq->msgs[rxq->next];
+        len = (int)msg->msg_len - rxq->next_off;
+        if (len > rxq->seg_size[rxq->next])
+        {
+            len = rxq->seg_size[rxq->next];
+        }
+        if (len > 0)
+        {
+            break;
+        }
+
+        // Empty or truncated; drop it
+        rxq->next++;
+        rxq->next_off = 0;
+    }
+    *data = (const uint8_t *)rxq->rx_iov[rxq->next].iov_base + rxq->next_off;
+    *buf = conn->gro_enabled ? NULL : rxq->rx_slots[rxq->next];
+    *from = rxq->addrs[rxq->next];
+    *from_len = msg->msg_hdr.msg_namelen;
+
+    // Step to the next segment of a coalesced message, or to the next message
+    rxq->next_off += len;
+    if (rxq->next_off >= (int)msg->msg_len)
+    {
+        rxq->next++;
+        rxq->next_off = 0;
+    }
+
+    return len;
+}
@@ -0,0 +1,652 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+
+// Network impairment emulator. Each direction of a connection can lose,
+// delay, reorder, duplicate and rate-limit its datagrams. Decisions come
+// from a per-connection generator seeded by sham_netem_seed, so a run with
+// the same seed and the same traffic makes the same decisions, and
+// connections on different threads never share state.
+//
+// Incoming datagrams are judged as they come off the socket, outgoing ones
+// as they are queued for sendmmsg. A datagram that is delayed waits here
+// until its release time: sham_has_pending_packets reports an incoming one
+// once it is due, sham_flush_packets sends an outgoing one, and
+// sham_next_timeout_ms includes the earliest release so waits end on time.
+
+#define SHAM_NETEM_SEED 1        // Used until sham_netem_seed is called
+#define SHAM_NETEM_LIMIT 1000    // Datagrams held per direction by default
+#define SHAM_NETEM_SPEC_MAX 256
+
+// A datagram held until its release time
+struct sham_netem_packet
+{
+    uint64_t release_us;
+    struct sham_buf *buf;
+    struct sockaddr_in from; // Incoming only
+    socklen_t from_len;
+    struct sham_netem_packet *next;
+};
+
+// One direction: its settings, generator and the datagrams it holds in
+// release order
+struct sham_netem_link
+{
+    struct sham_netem_config config;
+    uint64_t rng;
+    bool bad;               // Gilbert-Elliott channel state
+    uint64_t busy_until_us; // When a rate-capped link has sent what it was given
+    struct sham_netem_packet *head;
+    struct sham_netem_packet *tail;
+    int count;
+};
+
+struct sham_netem
+{
+    uint64_t seed;
+    uint32_t children;        // Connections accepted from this listener so far
+    struct sham_buf *current; // Incoming datagram last handed out, kept until the next one
+    struct sham_netem_link links[2];
+};
+
+// splitmix64: spreads a seed over the generator's state
+static uint64_t sham_netem_mix(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Uniform in [0, 1) from xorshift64*
+static double sham_netem_uniform(struct sham_netem_link *link)
+{
+    uint64_t x = link->rng;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    link->rng = x;
+    return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+static bool sham_netem_chance(struct sham_netem_link *link, double p)
+{
+    return p > 0.0 && sham_netem_uniform(link) < p;
+}
+
+// Each direction draws from its own sequence, so the decisions made for
+// one do not depend on how its traffic interleaves with the other's
+static void sham_netem_reseed(struct sham_netem *em)
+{
+    int dir;
+
+    for (dir = 0; dir < 2; dir++)
+    {
+        em->links[dir].rng = sham_netem_mix(em->seed + (uint64_t)dir);
+        if (em->links[dir].rng == 0)
+        {
+            em->links[dir].rng = 1; // xorshift never leaves zero
+        }
+        em->links[dir].bad = false;
+    }
+}
+
+static struct sham_netem *sham_netem_get(struct sham_connection *conn)
+{
+    if (!conn->netem)
+    {
+        conn->netem = calloc(1, sizeof(*conn->netem));
+        if (!conn->netem)
+        {
+            return NULL;
+        }
+        conn->netem->seed = SHAM_NETEM_SEED;
+        sham_netem_reseed(conn->netem);
+    }
+    return conn->netem;
+}
+
+static bool sham_netem_config_active(const struct sham_netem_config *config)
+{
+    return config->loss > 0.0 || config->p_bad > 0.0 || config->delay_ms > 0 || config->jitter_ms > 0 ||
+           config->reorder > 0.0 || config->duplicate > 0.0 || config->rate_bps > 0;
+}
+
+static bool sham_netem_probability(double p)
+{
+    return p >= 0.0 && p <= 1.0;
+}
+
+// Impair one direction (SHAM_NETEM_IN or SHAM_NETEM_OUT); a zeroed config
+// turns it off. Datagrams already held keep their release times.
+int sham_netem_set(struct sham_connection *conn, int direction, const struct sham_netem_config *config)
+{
+    struct sham_netem *em;
+
+    if ((direction != SHAM_NETEM_IN && direction != SHAM_NETEM_OUT) || !sham_netem_probability(config->loss) ||
+        !sham_netem_probability(config->loss_bad) || !sham_netem_probability(config->p_bad) ||
+        !sham_netem_probability(config->p_good) || !sham_netem_probability(config->reorder) ||
+        !sham_netem_probability(config->duplicate) || config->delay_ms < 0 || config->jitter_ms < 0 ||
+        config->limit < 0)
+    {
+        return -1;
+    }
+    if (!conn->netem && !sham_netem_config_active(config))
+    {
+        return 0;
+    }
+    if (!(em = sham_netem_get(conn)))
+    {
+        return -1;
+    }
+    em->links[direction].config = *config;
+    return 0;
+}
+
+// Restart both directions' generators from seed
+int sham_netem_seed(struct sham_connection *conn, uint64_t seed)
+{
+    struct sham_netem *em = sham_netem_get(conn);
+
+    if (!em)
+    {
+        return -1;
+    }
+    em->seed = seed;
+    sham_netem_reseed(em);
+    return 0;
+}
+
+// An accepted connection is impaired like its listener, with a seed of its
+// own derived from the listener's and its place in the accept order
+int sham_netem_inherit(struct sham_connection *conn, struct sham_connection *listen_conn)
+{
+    struct sham_netem *parent = listen_conn->netem;
+    int dir;
+
+    if (!parent)
+    {
+        return 0;
+    }
+    parent->children++;
+    if (sham_netem_seed(conn, sham_netem_mix(parent->seed ^ ((uint64_t)parent->children << 32))) < 0)
+    {
+        return -1;
+    }
+    for (dir = 0; dir < 2; dir++)
+    {
+        conn->netem->links[dir].config = parent->links[dir].config;
+    }
+    return 0;
+}
+
+void sham_netem_free(struct sham_connection *conn)
+{
+    struct sham_netem *em = conn->netem;
+    int dir;
+
+    if (!em)
+    {
+        return;
+    }
+    for (dir = 0; dir < 2; dir++)
+    {
+        while (em->links[dir].head)
+        {
+            struct sham_netem_packet *packet = em->links[dir].head;
+            em->links[dir].head = packet->next;
+            sham_buf_put(&conn->pool, packet->buf);
+            free(packet);
+        }
+    }
+    sham_buf_put(&conn->pool, em->current);
+    free(em);
+    conn->netem = NULL;
+}
+
+// Does the link lose this datagram? Under Gilbert-Elliott the channel
+// first moves between its good and bad states, then loses with that
+// state's probability; with p_bad at 0 it stays good and loss is Bernoulli.
+static bool sham_netem_lose(struct sham_netem_link *link)
+{
+    const struct sham_netem_config *config = &link->config;
+
+    if (config->p_bad > 0.0)
+    {
+        if (link->bad ? sham_netem_chance(link, config->p_good) : sham_netem_chance(link, config->p_bad))
+        {
+            link->bad = !link->bad;
+        }
+    }
+    return sham_netem_chance(link, link->bad ? config->loss_bad : config->loss);
+}
+
+// When a datagram of len bytes handed to the link at now_us comes out.
+// A rate cap serialises datagrams one after another; the delay (with its
+// jitter) follows, unless the datagram is picked to jump the queue.
+static uint64_t sham_netem_release_time(struct sham_netem_link *link, size_t len, uint64_t now_us)
+{
+    const struct sham_netem_config *config = &link->config;
+    uint64_t depart_us = now_us;
+    int64_t delay_us;
+
+    if (config->rate_bps > 0)
+    {
+        if (link->busy_until_us > depart_us)
+        {
+            depart_us = link->busy_until_us;
+        }
+        depart_us += (uint64_t)len * 8 * 1000000 / config->rate_bps;
+        link->busy_until_us = depart_us;
+    }
+
+    if (sham_netem_chance(link, config->reorder))
+    {
+        return depart_us;
+    }
+
+    delay_us = (int64_t)config->delay_ms * 1000;
+    if (config->jitter_ms > 0)
+    {
+        delay_us += (int64_t)((sham_netem_uniform(link) * 2.0 - 1.0) * config->jitter_ms * 1000);
+    }
+    return (delay_us > 0) ? depart_us + (uint64_t)delay_us : depart_us;
+}
+
+// Hold buf (taking a reference) until release_us. Datagrams due at the
+// same time leave in the order they came.
+static int sham_netem_hold(struct sham_netem_link *link, struct sham_buf *buf, uint64_t release_us,
+                           const struct sockaddr_in *from, socklen_t from_len)
+{
+    struct sham_netem_packet *packet = malloc(sizeof(*packet));
+    struct sham_netem_packet **pos;
+
+    if (!packet)
+    {
+        return -1;
+    }
+    packet->release_us = release_us;
+    packet->buf = sham_buf_ref(buf);
+    if (from)
+    {
+        packet->from = *from;
+    }
+    packet->from_len = from_len;
+
+    if (!link->tail || link->tail->release_us <= release_us)
+    {
+        pos = link->tail ? &link->tail->next : &link->head;
+    }
+    else
+    {
+        pos = &link->head;
+        while ((*pos)->release_us <= release_us)
+        {
+            pos = &(*pos)->next;
+        }
+    }
+    packet->next = *pos;
+    *pos = packet;
+    if (!packet->next)
+    {
+        link->tail = packet;
+    }
+    link->count++;
+    return 0;
+}
+
+static void sham_netem_drop(struct sham_connection *conn, const uint8_t *wire)
+{
+    struct sham_header header;
+
+    memcpy(&header, wire, SHAM_HEADER_SIZE);
+    sham_trace(conn, SHAM_TRACE_DROP_DATA, ntohl(header.seq_num), 0);
+    conn->stats.dropped++;
+}
+
+// Pass one datagram through a link. Returns 0 when it goes through now
+// untouched, 1 when it was lost or is held (copies included).
+static int sham_netem_apply(struct sham_connection *conn, int direction, struct sham_buf *buf,
+                            const struct sockaddr_in *from, socklen_t from_len)
+{
+    struct sham_netem_link *link = &conn->netem->links[direction];
+    uint64_t now_us = sham_now_us();
+    int copies = sham_netem_chance(link, link->config.duplicate) ? 2 : 1;
+    int limit = link->config.limit > 0 ? link->config.limit : SHAM_NETEM_LIMIT;
+    int i;
+
+    if (sham_netem_lose(link))
+    {
+        sham_netem_drop(conn, buf->wire);
+        return 1;
+    }
+
+    for (i = 0; i < copies; i++)
+    {
+        uint64_t release_us = sham_netem_release_time(link, buf->len, now_us);
+
+        // Nothing ahead of it and no wait: the original needs no copy
+        if (i == 0 && copies == 1 && release_us <= now_us && !link->head)
+        {
+            return 0;
+        }
+        if (link->count >= limit || sham_netem_hold(link, buf, release_us, from, from_len) < 0)
+        {
+            sham_netem_drop(conn, buf->wire); // Queue full: tail drop
+        }
+    }
+    return 1;
+}
+
+static bool sham_netem_active(const struct sham_connection *conn, int direction)
+{
+    return conn->netem && sham_netem_config_active(&conn->netem->links[direction].config);
+}
+
+// Judge an incoming datagram; buf is its pool buffer, or NULL for a segment
+// of a coalesced receive, which is copied if it has to be held. Returns 0
+// to take it now, 1 if it was lost or is held for later.
+int sham_netem_input(struct sham_connection *conn, const uint8_t *data, struct sham_buf *buf, int len,
+                     const struct sockaddr_in *from, socklen_t from_len)
+{
+    struct sham_buf *copy = NULL;
+    int result;
+
+    if (!sham_netem_active(conn, SHAM_NETEM_IN))
+    {
+        return 0;
+    }
+    if (!buf)
+    {
+        if (!(copy = sham_buf_get(&conn->pool)))
+        {
+            return 1;
+        }
+        memcpy(copy->wire, data, (size_t)len);
+        copy->len = (size_t)len;
+        buf = copy;
+    }
+    result = sham_netem_apply(conn, SHAM_NETEM_IN, buf, from, from_len);
+    sham_buf_put(&conn->pool, copy);
+    return result;
+}
+
+// Hand out the next held incoming datagram that is due, as sham_io_recv
+// does. Returns its length, or 0 if none is due.
+int sham_netem_recv(struct sham_connection *conn, const uint8_t **data, struct sham_buf **buf,
+                    struct sockaddr_in *from, socklen_t *from_len)
+{
+    struct sham_netem_link *link;
+    struct sham_netem_packet *packet;
+
+    if (!conn->netem)
+    {
+        return 0;
+    }
+    link = &conn->netem->links[SHAM_NETEM_IN];
+    packet = link->head;
+    if (!packet || packet->release_us > sham_now_us())
+    {
+        return 0;
+    }
+
+    link->head = packet->next;
+    if (!link->head)
+    {
+        link->tail = NULL;
+    }
+    link->count--;
+
+    sham_buf_put(&conn->pool, conn->netem->current);
+    conn->netem->current = packet->buf;
+    *data = packet->buf->wire;
+    *buf = packet->buf;
+    *from = packet->from;
+    *from_len = packet->from_len;
+    free(packet);
+    return (int)conn->netem->current->len;
+}
+
+bool sham_netem_input_due(const struct sham_connection *conn)
+{
+    const struct sham_netem_packet *head = conn->netem ? conn->netem->links[SHAM_NETEM_IN].head : NULL;
+
+    return head && head->release_us <= sham_now_us();
+}
+
+// Judge an outgoing datagram about to be queued. Returns true if the
+// emulator took it (lost or held); the caller's reference is untouched.
+bool sham_netem_output(struct sham_connection *conn, struct sham_buf *buf)
+{
+    if (!sham_netem_active(conn, SHAM_NETEM_OUT))
+    {
+        return false;
+    }
+    return sham_netem_apply(conn, SHAM_NETEM_OUT, buf, NULL, 0) != 0;
+}
+
+bool sham_netem_output_due(const struct sham_connection *conn)
+{
+    const struct sham_netem_packet *head = conn->netem ? conn->netem->links[SHAM_NETEM_OUT].head : NULL;
+
+    return head && head->release_us <= sham_now_us();
+}
+
+// Next held outgoing datagram that is due, its reference passing to the
+// caller; NULL if none is
+struct sham_buf *sham_netem_take_output(struct sham_connection *conn)
+{
+    struct sham_netem_link *link;
+    struct sham_netem_packet *packet;
+    struct sham_buf *buf;
+
+    if (!conn->netem)
+    {
+        return NULL;
+    }
+    link = &conn->netem->links[SHAM_NETEM_OUT];
+    packet = link->head;
+    if (!packet || packet->release_us > sham_now_us())
+    {
+        return NULL;
+    }
+
+    link->head = packet->next;
+    if (!link->head)
+    {
+        link->tail = NULL;
+    }
+    link->count--;
+    buf = packet->buf;
+    free(packet);
+    return buf;
+}
+
+// Earliest release time of a held datagram either way, 0 if none is held
+uint64_t sham_netem_deadline_us(const struct sham_connection *conn)
+{
+    uint64_t deadline_us = 0;
+    int dir;
+
+    if (!conn->netem)
+    {
+        return 0;
+    }
+    for (dir = 0; dir < 2; dir++)
+    {
+        const struct sham_netem_packet *head = conn->netem->links[dir].head;
+        if (head && (deadline_us == 0 || head->release_us < deadline_us))
+        {
+            deadline_us = head->release_us;
+        }
+    }
+    return deadline_us;
+}
+
+// Send every held outgoing datagram at its time: they are on the emulated
+// wire already, and would reach the peer after we are gone
+void sham_netem_drain(struct sham_connection *conn)
+{
+    while (conn->netem && conn->netem->links[SHAM_NETEM_OUT].head && conn->sockfd >= 0)
+    {
+        uint64_t release_us = conn->netem->links[SHAM_NETEM_OUT].head->release_us;
+        uint64_t now_us = sham_now_us();
+
+        if (release_us > now_us)
+        {
+            struct timespec ts;
+            ts.tv_sec = (time_t)((release_us - now_us) / 1000000);
+            ts.tv_nsec = (long)((release_us - now_us) % 1000000) * 1000;
+            nanosleep(&ts, NULL);
+        }
+        if (sham_flush_packets(conn) < 0)
+        {
+            return;
+        }
+    }
+}
+
+static int sham_netem_parse_probability(const char *value, double *out)
+{
+    char *end;
+    double p = strtod(value, &end);
+
+    if (end == value || *end != '\0' || !sham_netem_probability(p))
+    {
+        return -1;
+    }
+    *out = p;
+    return 0;
+}
+
+static int sham_netem_parse_int(const char *value, int *out)
+{
+    char *end;
+    long v = strtol(value, &end, 10);
+
+    if (end == value || *end != '\0' || v < 0 || v > 3600000)
+    {
+        return -1;
+    }
+    *out = (int)v;
+    return 0;
+}
+
+// Bits per second, with an optional k, M or G suffix
+static int sham_netem_parse_rate(const char *value, uint64_t *out)
+{
+    char *end;
+    double rate = strtod(value, &end);
+
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        rate *= 1e3;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        rate *= 1e6;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        rate *= 1e9;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (end == value || *end != '\0' || rate < 0.0 || rate > 1e12)
+    {
+        return -1;
+    }
+    *out = (uint64_t)rate;
+    return 0;
+}
+
+// Fill config from a spec such as "loss=0.01,delay=20,jitter=5,rate=10M".
+// Keys: loss, loss_bad, p_bad and p_good (Gilbert-Elliott), delay and
+// jitter (ms), reorder, dup, rate (bit/s) and limit (datagrams held).
+// Keys not given are zero. Returns -1 on an unknown key or bad value.
+int sham_netem_parse(const char *spec, struct sham_netem_config *config)
+{
+    char copy[SHAM_NETEM_SPEC_MAX];
+    char *item;
+    char *next;
+
+    memset(config, 0, sizeof(*config));
+    if (strlen(spec) >= sizeof(copy))
+    {
+        return -1;
+    }
+    strcpy(copy, spec);
+
+    for (item = copy; item && *item; item = next)
+    {
+        char *value;
+        int bad = -1;
+
+        next = strchr(item, ',');
+        if (next)
+        {
+            *next++ = '\0';
+        }
+        value = strchr(item, '=');
+        if (!value)
+        {
+            return -1;
+        }
+        *value++ = '\0';
+
+        if (strcmp(item, "loss") == 0)
+        {
+            bad = sham_netem_parse_probability(value, &config->loss);
+        }
+        else if (strcmp(item, "loss_bad") == 0)
+        {
+            bad = sham_netem_parse_probability(value, &config->loss_bad);
+        }
+        else if (strcmp(item, "p_bad") == 0)
+        {
+            bad = sham_netem_parse_probability(value, &config->p_bad);
+        }
+        else if (strcmp(item, "p_good") == 0)
+        {
+            bad = sham_netem_parse_probability(value, &config->p_good);
+        }
+        else if (strcmp(item, "delay") == 0)
+        {
+            bad = sham_netem_parse_int(value, &config->delay_ms);
+        }
+        else if (strcmp(item, "jitter") == 0)
+        {
+            bad = sham_netem_parse_int(value, &config->jitter_ms);
+        }
+        else if (strcmp(item, "reorder") == 0)
+        {
+            bad = sham_netem_parse_probability(value, &config->reorder);
+        }
+        else if (strcmp(item, "dup") == 0)
+        {
+            bad = sham_netem_parse_probability(value, &config->duplicate);
+        }
+        else if (strcmp(item, "rate") == 0)
+        {
+            bad = sham_netem_parse_rate(value, &config->rate_bps);
+        }
+        else if (strcmp(item, "limit") == 0)
+        {
+            bad = sham_netem_parse_int(value, &config->limit);
+        }
+
+        if (bad < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,267 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+
+// Path MTU discovery, after packetization-layer PMTUD (RFC 8899). Both
+// ends offer their largest segment in the handshake (SHAM_OPT_MSS); data
+// starts at SHAM_BASE_MSS, and a sender with data in flight probes upward
+// with padding-only SHAM_PROBE datagrams sent with DF set. The peer answers
+// each with the size it got, which confirms that size for data. Probes are
+// separate from data, so a lost probe costs no retransmission.
+//
+// The search tries the negotiated ceiling first (a jumbo-frame path usually
+// carries it), then halves the gap between the confirmed size and the
+// smallest failure. The segment size drops back to SHAM_BASE_MSS when the
+// kernel refuses a datagram as too big or a large segment keeps timing
+// out (a black hole), and the search starts over.
+
+#define SHAM_PMTU_PROBES 3              // Unanswered probes before a size counts as failed
+#define SHAM_PMTU_STEP 64               // Search stops once the gap is this small
+#define SHAM_PMTU_BLACKHOLE_RETRIES 3   // Timeouts of a large segment that suggest a black hole
+#define SHAM_PMTU_RAISE_MS (600 * 1000) // Search again after this long (PMTU_RAISE_TIMER)
+
+// Set DF on the socket when probing; otherwise let IP fragment as before
+void sham_pmtu_setup_socket(struct sham_connection *conn)
+{
+    int mode = conn->pmtud ? IP_PMTUDISC_DO : IP_PMTUDISC_DONT;
+
+    if (setsockopt(conn->sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode)) < 0)
+    {
+        sham_log_warn(conn->log_file, "[PMTU] IP_MTU_DISCOVER failed: %s\n", strerror(errno));
+    }
+}
+
+static uint32_t sham_pmtu_min(uint32_t a, uint32_t b)
+{
+    return (a < b) ? a : b;
+}
+
+static void sham_pmtu_set_mss(struct sham_connection *conn, uint32_t mss)
+{
+    uint32_t old_mss = conn->mss;
+
+    conn->mss = mss;
+    sham_cc_mss_changed(conn, old_mss);
+    sham_log_info(conn->log_file, "[PMTU] Segment size %u -> %u\n", old_mss, mss);
+    sham_trace(conn, SHAM_TRACE_PMTU_MSS, mss, 0);
+}
+
+// Settle the segment size once the handshake is done. A peer that sent no
+// SHAM_OPT_MSS gets the size it always did, and is never probed.
+void sham_pmtu_init(struct sham_connection *conn)
+{
+    conn->max_mss = sham_pmtu_min(conn->mss_limit, conn->peer_mss ? conn->peer_mss : SHAM_BASE_MSS);
+    conn->mss = conn->pmtud ? sham_pmtu_min(SHAM_BASE_MSS, conn->max_mss) : conn->max_mss;
+    conn->probe_size = 0;
+    conn->probe_tries = 0;
+    conn->probe_failed = 0;
+    conn->pmtu_timer_us = (conn->pmtud && conn->peer_mss && conn->mss < conn->max_mss) ? sham_now_us() : 0;
+
+    // The initial window is counted in segments of the size now in use
+    conn->cc->init(conn);
+    sham_log_info(conn->log_file, "[PMTU] Peer accepts %u, starting at %u of %u\n", conn->peer_mss, conn->mss, conn->max_mss);
+}
+
+// When sham_pmtu_tick next has work, or 0. Probing waits for data in flight.
+uint64_t sham_pmtu_deadline_us(const struct sham_connection *conn)
+{
+    if (conn->pmtu_timer_us == 0 || conn->window_count == 0 ||
+        (conn->state != SHAM_ESTABLISHED && conn->state != SHAM_CLOSE_WAIT))
+    {
+        return 0;
+    }
+    if (conn->probe_size == 0 && conn->mss >= conn->max_mss)
+    {
+        return 0;
+    }
+    return conn->pmtu_timer_us;
+}
+
+// Next size to try, or 0 when the confirmed size is close enough
+static uint32_t sham_pmtu_next_size(const struct sham_connection *conn)
+{
+    if (conn->probe_failed == 0)
+    {
+        return (conn->max_mss > conn->mss) ? conn->max_mss : 0;
+    }
+    if (conn->probe_failed <= conn->mss + SHAM_PMTU_STEP)
+    {
+        return 0;
+    }
+    return conn->mss + (conn->probe_failed - conn->mss) / 2;
+}
+
+static void sham_pmtu_probe_failed(struct sham_connection *conn, uint32_t size)
+{
+    if (conn->probe_failed == 0 || size < conn->probe_failed)
+    {
+        conn->probe_failed = size;
+    }
+    if (conn->probe_size >= size)
+    {
+        conn->probe_size = 0;
+    }
+    conn->pmtu_timer_us = sham_now_us();
+    sham_trace(conn, SHAM_TRACE_PMTU_PROBE_FAILED, size, 0);
+}
+
+static int sham_pmtu_send_probe(struct sham_connection *conn, uint32_t size)
+{
+    struct sham_buf *buf = sham_build_packet(conn, conn->send_seq, conn->recv_seq, SHAM_PROBE, NULL, 0);
+    int sent;
+
+    if (!buf)
+    {
+        return -1;
+    }
+    memset(SHAM_BUF_DATA(buf), 0, size);
+    buf->len += size;
+
+    sham_trace(conn, SHAM_TRACE_PMTU_PROBE, size, 0);
+    sent = sham_send_packet(conn, buf);
+    sham_buf_put(&conn->pool, buf);
+    return sent;
+}
+
+// Send the next probe, repeat an unanswered one, or give up on its size.
+// Called from sham_handle_timeout.
+int sham_pmtu_tick(struct sham_connection *conn)
+{
+    uint64_t deadline_us = sham_pmtu_deadline_us(conn);
+    uint64_t now = sham_now_us();
+
+    if (deadline_us == 0 || now < deadline_us)
+    {
+        return 0;
+    }
+
+    if (conn->probe_size != 0 && conn->probe_tries >= SHAM_PMTU_PROBES)
+    {
+        sham_pmtu_probe_failed(conn, conn->probe_size);
+    }
+
+    if (conn->probe_size == 0)
+    {
+        uint32_t size = sham_pmtu_next_size(conn);
+        if (size == 0)
+        {
+            // Close enough; look again later in case the path has changed
+            conn->probe_failed = 0;
+            conn->pmtu_timer_us = now + (uint64_t)SHAM_PMTU_RAISE_MS * 1000;
+            sham_log_info(conn->log_file, "[PMTU] Search done at %u\n", conn->mss);
+            return 0;
+        }
+        conn->probe_size = size;
+        conn->probe_tries = 0;
+    }
+
+    conn->probe_tries++;
+    conn->pmtu_timer_us = now + (uint64_t)conn->rto_ms * 1000;
+    return (sham_pmtu_send_probe(conn, conn->probe_size) < 0) ? -1 : 0;
+}
+
+// Handle a SHAM_PROBE datagram: answer the peer's probe with its size, or
+// take the answer to ours as proof that size gets through
+void sham_pmtu_input(struct sham_connection *conn, const struct sham_packet *packet)
+{
+    uint32_t size;
+
+    if (!(packet->header.flags & SHAM_ACK))
+    {
+        uint32_t size_net = htonl((uint32_t)packet->data_len);
+        struct sham_buf *answer;
+
+        if (conn->state == SHAM_CLOSED || conn->state == SHAM_LISTEN || conn->state == SHAM_SYN_SENT)
+        {
+            return;
+        }
+        sham_trace(conn, SHAM_TRACE_RCV_PROBE, (uint32_t)packet->data_len, 0);
+        answer = sham_build_packet(conn, conn->send_seq, conn->recv_seq, SHAM_ACK | SHAM_PROBE,
+                                   &size_net, sizeof(size_net));
+        if (answer)
+        {
+            sham_send_packet(conn, answer);
+            sham_buf_put(&conn->pool, answer);
+        }
+        return;
+    }
+
+    if (packet->data_len < sizeof(size))
+    {
+        return;
+    }
+    memcpy(&size, packet->data, sizeof(size));
+    size = ntohl(size);
+
+    // A late answer for a size already confirmed, or one we never probed
+    if (size <= conn->mss || size > conn->max_mss)
+    {
+        return;
+    }
+
+    sham_pmtu_set_mss(conn, size);
+    if (conn->probe_failed != 0 && size >= conn->probe_failed)
+    {
+        conn->probe_failed = 0;
+    }
+    if (size >= conn->probe_size)
+    {
+        conn->probe_size = 0;
+        conn->pmtu_timer_us = sham_now_us(); // Keep searching
+    }
+}
+
+// Go back to a size every path carries (or below it, for a datagram that
+// small failing) and search again
+static void sham_pmtu_fall_back(struct sham_connection *conn, uint32_t failed_size)
+{
+    uint32_t mss = (failed_size > SHAM_BASE_MSS) ? SHAM_BASE_MSS : failed_size / 2;
+
+    if (mss < SHAM_MIN_MSS)
+    {
+        mss = SHAM_MIN_MSS;
+    }
+    if (conn->probe_failed == 0 || failed_size < conn->probe_failed)
+    {
+        conn->probe_failed = failed_size;
+    }
+    if (mss < conn->mss)
+    {
+        sham_pmtu_set_mss(conn, mss);
+    }
+    if (conn->pmtud && conn->peer_mss)
+    {
+        conn->pmtu_timer_us = sham_now_us();
+    }
+}
+
+// The kernel refused a datagram with EMSGSIZE: it knows the path MTU (from
+// the interface or an ICMP "fragmentation needed") and DF forbids splitting
+void sham_pmtu_too_big(struct sham_connection *conn, size_t datagram_len)
+{
+    uint32_t size = (datagram_len > SHAM_HEADER_SIZE) ? (uint32_t)(datagram_len - SHAM_HEADER_SIZE) : 0;
+
+    sham_log_warn(conn->log_file, "[PMTU] %zu-byte datagram too big for the path\n", datagram_len);
+    if (size != 0 && size == conn->probe_size)
+    {
+        sham_pmtu_probe_failed(conn, size);
+    }
+    else if (size > SHAM_MIN_MSS && size <= conn->mss)
+    {
+        sham_pmtu_fall_back(conn, size);
+    }
+}
+
+// A data segment timed out again. A large segment lost this often may be
+// one the path silently drops; stop sending that size until a probe
+// confirms it, which costs one round trip if it was only bad luck.
+void sham_pmtu_on_timeout(struct sham_connection *conn, size_t data_len, int retries)
+{
+    if (conn->pmtud && retries + 1 >= SHAM_PMTU_BLACKHOLE_RETRIES && data_len > SHAM_BASE_MSS &&
+        conn->mss > SHAM_BASE_MSS)
+    {
+        sham_log_warn(conn->log_file, "[PMTU] %zu-byte segment keeps timing out, suspecting a black hole\n", data_len);
+        sham_pmtu_fall_back(conn, (uint32_t)data_len);
+    }
+}
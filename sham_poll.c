@@ -0,0 +1,369 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+// Event loop over connections and plain descriptors. Each round services
+// every connection (applies arrived ACKs, fires due retransmissions) and
+// reports what became ready; with nothing ready it sleeps in epoll_wait
+// until a socket or descriptor is readable or the timerfd, armed for the
+// earliest retransmission deadline, fires. Since the timer is part of the
+// epoll set, sham_poller_fd can be nested in another event loop.
+
+#define SHAM_POLL_INITIAL_ENTRIES 8
+#define SHAM_POLL_MAX_WAKEUPS 16 // epoll events taken per epoll_wait
+
+struct sham_poll_entry
+{
+    struct sham_connection *conn; // NULL for a plain descriptor
+    int fd;                       // Socket as registered; conns may share one
+    short events;
+    bool always_ready;            // Regular file: epoll refuses it and reads never block
+};
+
+struct sham_poller
+{
+    int epfd;
+    int timerfd;
+    struct sham_poll_entry *entries;
+    int count;
+    int capacity;
+};
+
+struct sham_poller *sham_poller_create(void)
+{
+    struct sham_poller *poller = calloc(1, sizeof(*poller));
+    struct epoll_event ev;
+
+    if (!poller)
+    {
+        return NULL;
+    }
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    poller->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = poller->timerfd;
+    if (poller->epfd < 0 || poller->timerfd < 0 ||
+        epoll_ctl(poller->epfd, EPOLL_CTL_ADD, poller->timerfd, &ev) < 0)
+    {
+        perror("sham_poller_create");
+        sham_poller_free(poller);
+        return NULL;
+    }
+    return poller;
+}
+
+// Registered connections and descriptors are left open
+void sham_poller_free(struct sham_poller *poller)
+{
+    if (!poller)
+    {
+        return;
+    }
+    if (poller->epfd >= 0)
+    {
+        close(poller->epfd);
+    }
+    if (poller->timerfd >= 0)
+    {
+        close(poller->timerfd);
+    }
+    free(poller->entries);
+    free(poller);
+}
+
+// Readable whenever sham_poll has work to do
+int sham_poller_fd(const struct sham_poller *poller)
+{
+    return poller->epfd;
+}
+
+static int sham_poll_find(const struct sham_poller *poller, const struct sham_connection *conn, int fd)
+{
+    int i;
+
+    for (i = 0; i < poller->count; i++)
+    {
+        const struct sham_poll_entry *entry = &poller->entries[i];
+        if (conn ? entry->conn == conn : (!entry->conn && entry->fd == fd))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Is a socket registered for some connection other than entry `skip`?
+static bool sham_poll_socket_shared(const struct sham_poller *poller, int fd, int skip)
+{
+    int i;
+
+    for (i = 0; i < poller->count; i++)
+    {
+        if (i != skip && poller->entries[i].conn && poller->entries[i].fd == fd)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Watch a connection (fd ignored) or, with conn NULL, a plain descriptor.
+// A connection's socket is always watched: ACKs matter even when only
+// SHAM_POLLOUT is wanted.
+int sham_poller_add(struct sham_poller *poller, struct sham_connection *conn, int fd, short events)
+{
+    struct sham_poll_entry *entry;
+    struct epoll_event ev;
+
+    if (conn)
+    {
+        fd = conn->sockfd;
+    }
+    if (fd < 0 || sham_poll_find(poller, conn, fd) >= 0)
+    {
+        errno = (fd < 0) ? EBADF : EEXIST;
+        return -1;
+    }
+
+    if (poller->count == poller->capacity)
+    {
+        int capacity = poller->capacity ? poller->capacity * 2 : SHAM_POLL_INITIAL_ENTRIES;
+        struct sham_poll_entry *entries = realloc(poller->entries, (size_t)capacity * sizeof(*entries));
+        if (!entries)
+        {
+            return -1;
+        }
+        poller->entries = entries;
+        poller->capacity = capacity;
+    }
+
+    entry = &poller->entries[poller->count];
+    entry->conn = conn;
+    entry->fd = fd;
+    entry->events = events;
+    entry->always_ready = false;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (conn || (events & SHAM_POLLIN)) ? EPOLLIN : 0;
+    ev.data.fd = fd;
+    if ((!conn || !sham_poll_socket_shared(poller, fd, -1)) && epoll_ctl(poller->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        if (conn || errno != EPERM)
+        {
+            return -1;
+        }
+        entry->always_ready = true;
+    }
+
+    poller->count++;
+    return 0;
+}
+
+// Change what a registered connection or descriptor reports
+int sham_poller_modify(struct sham_poller *poller, struct sham_connection *conn, int fd, short events)
+{
+    int i = sham_poll_find(poller, conn, fd);
+    struct sham_poll_entry *entry;
+    struct epoll_event ev;
+
+    if (i < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    entry = &poller->entries[i];
+    entry->events = events;
+    if (!conn && !entry->always_ready)
+    {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = (events & SHAM_POLLIN) ? EPOLLIN : 0;
+        ev.data.fd = entry->fd;
+        return epoll_ctl(poller->epfd, EPOLL_CTL_MOD, entry->fd, &ev);
+    }
+    return 0;
+}
+
+int sham_poller_remove(struct sham_poller *poller, struct sham_connection *conn, int fd)
+{
+    int i = sham_poll_find(poller, conn, fd);
+    struct sham_poll_entry *entry;
+
+    if (i < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // The socket may already be closed; nothing to undo then
+    entry = &poller->entries[i];
+    if (!entry->always_ready && (!conn || !sham_poll_socket_shared(poller, entry->fd, i)))
+    {
+        epoll_ctl(poller->epfd, EPOLL_CTL_DEL, entry->fd, NULL);
+    }
+
+    memmove(entry, entry + 1, (size_t)(poller->count - i - 1) * sizeof(*entry));
+    poller->count--;
+    return 0;
+}
+
+// Fire the timerfd at the earliest deadline, or disarm it for -1
+static void sham_poll_arm_timer(struct sham_poller *poller, int timeout_ms)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (timeout_ms >= 0)
+    {
+        // A zero it_value would disarm; a due deadline fires after 1 ms
+        if (timeout_ms == 0)
+        {
+            timeout_ms = 1;
+        }
+        its.it_value.tv_sec = timeout_ms / 1000;
+        its.it_value.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+    }
+    timerfd_settime(poller->timerfd, 0, &its, NULL);
+}
+
+static void sham_poll_report(struct sham_poll_event *events, int max_events, int *ready,
+                             const struct sham_poll_entry *entry, short revents)
+{
+    if (revents && *ready < max_events)
+    {
+        events[*ready].conn = entry->conn;
+        events[*ready].fd = entry->fd;
+        events[*ready].revents = revents;
+        (*ready)++;
+    }
+}
+
+// Wait up to timeout_ms (-1 forever, 0 to only check) for registered
+// connections or descriptors to become ready. Returns the number of events
+// filled in, 0 on timeout, or -1 with errno set (EINTR included).
+int sham_poll(struct sham_poller *poller, struct sham_poll_event *events, int max_events, int timeout_ms)
+{
+    uint64_t deadline_us = (timeout_ms > 0) ? sham_now_us() + (uint64_t)timeout_ms * 1000 : 0;
+
+    for (;;)
+    {
+        struct epoll_event wakeups[SHAM_POLL_MAX_WAKEUPS];
+        int ready = 0;
+        int next_ms = -1;
+        bool pending = false;
+        int wait_ms;
+        int n;
+        int i;
+
+        for (i = 0; i < poller->count; i++)
+        {
+            const struct sham_poll_entry *entry = &poller->entries[i];
+            struct sham_connection *conn = entry->conn;
+            short revents = 0;
+            int t;
+
+            if (!conn)
+            {
+                if (entry->always_ready && (entry->events & SHAM_POLLIN))
+                {
+                    revents = SHAM_POLLIN;
+                }
+                sham_poll_report(events, max_events, &ready, entry, revents);
+                continue;
+            }
+
+            if (sham_service(conn) < 0)
+            {
+                revents |= SHAM_POLLERR;
+            }
+            if ((entry->events & SHAM_POLLIN) && sham_readable(conn))
+            {
+                revents |= SHAM_POLLIN;
+            }
+            if ((entry->events & SHAM_POLLOUT) && sham_writable(conn))
+            {
+                revents |= SHAM_POLLOUT;
+            }
+            sham_poll_report(events, max_events, &ready, entry, revents);
+
+            // Datagrams left in a batch do not wake epoll
+            pending = pending || sham_has_pending_packets(conn);
+            t = sham_next_timeout_ms(conn);
+            if (t >= 0 && (next_ms < 0 || t < next_ms))
+            {
+                next_ms = t;
+            }
+
+            // A writer held back only by pacing wakes when the bucket refills
+            if ((entry->events & SHAM_POLLOUT) && !(revents & SHAM_POLLOUT))
+            {
+                long pace_us = sham_pace_delay_us(conn, conn->mss);
+                if (pace_us > 0)
+                {
+                    t = (int)((pace_us + 999) / 1000);
+                    if (next_ms < 0 || t < next_ms)
+                    {
+                        next_ms = t;
+                    }
+                }
+            }
+        }
+
+        if (ready > 0 || pending || timeout_ms == 0)
+        {
+            wait_ms = 0;
+        }
+        else if (timeout_ms < 0)
+        {
+            wait_ms = -1;
+        }
+        else
+        {
+            uint64_t now_us = sham_now_us();
+            if (now_us >= deadline_us)
+            {
+                return 0;
+            }
+            wait_ms = (int)((deadline_us - now_us + 999) / 1000);
+        }
+        sham_poll_arm_timer(poller, next_ms);
+
+        n = epoll_wait(poller->epfd, wakeups, SHAM_POLL_MAX_WAKEUPS, wait_ms);
+        if (n < 0)
+        {
+            return (ready > 0) ? ready : -1;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            int fd = wakeups[i].data.fd;
+            int j;
+
+            if (fd == poller->timerfd)
+            {
+                uint64_t expirations;
+                ssize_t r = read(poller->timerfd, &expirations, sizeof(expirations));
+                (void)r; // Only clears the readiness
+                continue;
+            }
+
+            // Hang-ups and errors are readable too, so the reader sees them
+            j = sham_poll_find(poller, NULL, fd);
+            if (j >= 0 && (poller->entries[j].events & SHAM_POLLIN))
+            {
+                sham_poll_report(events, max_events, &ready, &poller->entries[j], SHAM_POLLIN);
+            }
+        }
+
+        if (ready > 0 || (n == 0 && !pending && timeout_ms == 0))
+        {
+            return ready;
+        }
+        // A socket or the timer woke us: service the connections again
+    }
+}
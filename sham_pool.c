@@ -0,0 +1,76 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+
+// Packet buffer pool. Segments are built directly in pool buffers, kept in
+// the retransmit window by reference and sent from there, so a payload is
+// copied once on the way in and once on the way out. Released buffers go
+// onto a free list (up to pool->limit) instead of back to malloc. Buffers
+// are sized at runtime from pool->buf_size; one of another size (sized for
+// a different pool, or before a resize) is never cached.
+
+// Take a buffer with one reference held by the caller
+struct sham_buf *sham_buf_get(struct sham_buf_pool *pool)
+{
+    struct sham_buf *buf = pool->free_list;
+
+    if (buf)
+    {
+        pool->free_list = buf->next;
+        pool->free_count--;
+    }
+    else
+    {
+        buf = malloc(sizeof(*buf) + pool->buf_size);
+        if (!buf)
+        {
+            return NULL;
+        }
+        buf->size = pool->buf_size;
+    }
+
+    buf->len = 0;
+    buf->refs = 1;
+    buf->next = NULL;
+    return buf;
+}
+
+// Add a reference; returns buf for convenience
+struct sham_buf *sham_buf_ref(struct sham_buf *buf)
+{
+    buf->refs++;
+    return buf;
+}
+
+// Drop a reference; the last one returns the buffer to the pool
+void sham_buf_put(struct sham_buf_pool *pool, struct sham_buf *buf)
+{
+    if (!buf || --buf->refs > 0)
+    {
+        return;
+    }
+
+    if (pool->free_count < pool->limit && buf->size == pool->buf_size)
+    {
+        buf->next = pool->free_list;
+        pool->free_list = buf;
+        pool->free_count++;
+    }
+    else
+    {
+        free(buf);
+    }
+}
+
+// Release every free buffer; buffers still referenced must be put first
+void sham_pool_free(struct sham_buf_pool *pool)
+{
+    while (pool->free_list)
+    {
+        struct sham_buf *buf = pool->free_list;
+        pool->free_list = buf->next;
+        free(buf);
+    }
+    pool->free_count = 0;
+}
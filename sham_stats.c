@@ -0,0 +1,117 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+
+// Connection statistics. The counters in conn->stats are bumped where the
+// events happen; sham_get_stats copies them out with the current estimators
+// and windows, so a monitor can read a connection without tracing it.
+
+static const char *sham_state_name(sham_state_t state)
+{
+    switch (state)
+    {
+    case SHAM_CLOSED:
+        return "CLOSED";
+    case SHAM_LISTEN:
+        return "LISTEN";
+    case SHAM_SYN_SENT:
+        return "SYN_SENT";
+    case SHAM_SYN_RECEIVED:
+        return "SYN_RECEIVED";
+    case SHAM_ESTABLISHED:
+        return "ESTABLISHED";
+    case SHAM_FIN_WAIT_1:
+        return "FIN_WAIT_1";
+    case SHAM_FIN_WAIT_2:
+        return "FIN_WAIT_2";
+    case SHAM_CLOSE_WAIT:
+        return "CLOSE_WAIT";
+    case SHAM_CLOSING:
+        return "CLOSING";
+    case SHAM_LAST_ACK:
+        return "LAST_ACK";
+    case SHAM_TIME_WAIT:
+        return "TIME_WAIT";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+// A send found the window too small for its next segment
+void sham_stats_stall_begin(struct sham_connection *conn)
+{
+    if (conn->stall_since_us != 0)
+    {
+        return;
+    }
+    conn->stall_since_us = sham_now_us();
+    conn->stall_rwnd = conn->peer_window_size < conn->cwnd;
+    conn->stats.window_stalls++;
+}
+
+// The window opened again
+void sham_stats_stall_end(struct sham_connection *conn)
+{
+    uint64_t waited;
+
+    if (conn->stall_since_us == 0)
+    {
+        return;
+    }
+    waited = sham_now_us() - conn->stall_since_us;
+    conn->stats.stall_us += waited;
+    if (conn->stall_rwnd)
+    {
+        conn->stats.rwnd_stall_us += waited;
+    }
+    conn->stall_since_us = 0;
+}
+
+void sham_get_stats(struct sham_connection *conn, struct sham_stats *stats)
+{
+    *stats = conn->stats;
+
+    // A wait still under way counts up to now
+    if (conn->stall_since_us != 0)
+    {
+        uint64_t waited = sham_now_us() - conn->stall_since_us;
+        stats->stall_us += waited;
+        if (conn->stall_rwnd)
+        {
+            stats->rwnd_stall_us += waited;
+        }
+    }
+
+    stats->state = conn->state;
+    stats->srtt_us = conn->rtt_valid ? conn->srtt_us : 0;
+    stats->rttvar_us = conn->rtt_valid ? conn->rttvar_us : 0;
+    stats->rto_ms = conn->rto_ms;
+    stats->cwnd = conn->cwnd;
+    stats->ssthresh = conn->ssthresh;
+    stats->peer_window = conn->peer_window_size;
+    stats->bytes_in_flight = sham_bytes_in_flight(conn);
+    stats->mss = conn->mss;
+}
+
+// One line of key=value pairs, for logs and metric scrapers. Returns the
+// length snprintf would have written.
+int sham_format_stats(const struct sham_stats *stats, char *out, size_t size)
+{
+    return snprintf(out, size,
+                    "state=%s sent=%llu segs_sent=%llu retx=%llu fast_retx=%llu retx_bytes=%llu timeouts=%llu "
+                    "received=%llu segs_received=%llu dup=%llu ooo=%llu dropped=%llu "
+                    "stalls=%llu stall_ms=%llu rwnd_stall_ms=%llu fec_parity=%llu fec_rebuilt=%llu "
+                    "srtt_us=%ld rttvar_us=%ld rto_ms=%d cwnd=%u ssthresh=%u peer_window=%u in_flight=%u mss=%u",
+                    sham_state_name(stats->state), (unsigned long long)stats->bytes_sent,
+                    (unsigned long long)stats->segments_sent, (unsigned long long)stats->retransmits,
+                    (unsigned long long)stats->fast_retransmits, (unsigned long long)stats->bytes_retransmitted,
+                    (unsigned long long)stats->timeouts, (unsigned long long)stats->bytes_received,
+                    (unsigned long long)stats->segments_received, (unsigned long long)stats->dup_segments,
+                    (unsigned long long)stats->ooo_segments, (unsigned long long)stats->dropped,
+                    (unsigned long long)stats->window_stalls, (unsigned long long)(stats->stall_us / 1000),
+                    (unsigned long long)(stats->rwnd_stall_us / 1000), (unsigned long long)stats->fec_parity_sent,
+                    (unsigned long long)stats->fec_rebuilt, stats->srtt_us, stats->rttvar_us,
+                    stats->rto_ms, stats->cwnd, stats->ssthresh, stats->peer_window, stats->bytes_in_flight,
+                    stats->mss);
+}
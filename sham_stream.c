@@ -0,0 +1,629 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+
+// Multiplexed streams. Once both ends agree on SHAM_OPT_STREAMS, the
+// connection's byte stream is a run of frames, each tagged with the stream
+// it belongs to, so one handshake, congestion window and RTT estimate carry
+// every stream. Frames are taken off the connection as they arrive and
+// reassembled into a receive buffer per stream, and each stream has its own
+// credit: a sender may have no more unread bytes at the receiver than the
+// credit allows, so a stream whose reader falls behind stops its own sender
+// and never the connection.
+//
+// The initiator opens odd stream IDs and the other end even ones; a DATA
+// frame for an ID the peer has not used yet opens that stream.
+
+// One stream; freed once the application has closed it
+struct sham_stream
+{
+    uint32_t id;
+    bool accepted;     // Handed to the application; always true for ours
+    bool fin_sent;
+    bool fin_received; // Everything the peer will send is in rx
+    bool reset;        // The peer abandoned the stream
+    uint32_t credit;   // Bytes we may still send
+    uint8_t *rx;       // Ring of SHAM_STREAM_WINDOW_SIZE received bytes
+    size_t rx_head;
+    size_t rx_len;
+    uint32_t consumed; // Bytes read since credit was last granted back
+};
+
+struct sham_mux
+{
+    struct sham_connection *conn;
+    uint32_t next_id;     // Next ID we open
+    uint32_t peer_max_id; // Highest ID the peer has opened
+    struct sham_stream **streams;
+    int count;
+
+    // Frames queued for the connection; data frames stop at SHAM_STREAM_OUT_BUFFER
+    uint8_t *out;
+    size_t out_len;
+    size_t out_cap;
+
+    // Frame being read: its header (and WINDOW payload), then the DATA
+    // payload still to come, for data_stream or to be dropped if NULL
+    uint8_t frame[SHAM_STREAM_HEADER_SIZE + 4];
+    size_t frame_len;
+    uint32_t data_left;
+    struct sham_stream *data_stream;
+    bool data_fin;
+
+    bool eof;    // The peer closed the connection
+    bool failed; // The connection failed or the peer broke the framing
+};
+
+static bool sham_stream_ours(const struct sham_mux *mux, uint32_t id)
+{
+    return (id & 1) == (mux->next_id & 1);
+}
+
+static struct sham_stream *sham_stream_find(const struct sham_mux *mux, uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < mux->count; i++)
+    {
+        if (mux->streams[i]->id == id)
+        {
+            return mux->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static struct sham_stream *sham_stream_new(struct sham_mux *mux, uint32_t id)
+{
+    struct sham_stream *stream;
+
+    if (mux->count >= SHAM_MAX_STREAMS)
+    {
+        return NULL;
+    }
+    stream = calloc(1, sizeof(*stream));
+    if (!stream || !(stream->rx = malloc(SHAM_STREAM_WINDOW_SIZE)))
+    {
+        free(stream);
+        return NULL;
+    }
+    stream->id = id;
+    stream->credit = SHAM_STREAM_WINDOW_SIZE;
+    mux->streams[mux->count++] = stream;
+    return stream;
+}
+
+static void sham_stream_remove(struct sham_mux *mux, struct sham_stream *stream)
+{
+    int i;
+
+    for (i = 0; i < mux->count; i++)
+    {
+        if (mux->streams[i] == stream)
+        {
+            mux->streams[i] = mux->streams[--mux->count];
+            break;
+        }
+    }
+    if (mux->data_stream == stream)
+    {
+        mux->data_stream = NULL;
+    }
+    free(stream->rx);
+    free(stream);
+}
+
+// Queue a frame. Control frames are always taken; data frames only while
+// the queue is under SHAM_STREAM_OUT_BUFFER.
+static int sham_mux_queue(struct sham_mux *mux, uint32_t id, uint8_t type, uint8_t flags,
+                          const void *payload, size_t len)
+{
+    size_t need = mux->out_len + SHAM_STREAM_HEADER_SIZE + len;
+    uint32_t id_net = htonl(id);
+    uint16_t len_net = htons((uint16_t)len);
+
+    if (need > mux->out_cap)
+    {
+        size_t cap = mux->out_cap * 2;
+        uint8_t *out;
+
+        while (cap < need)
+        {
+            cap *= 2;
+        }
+        out = realloc(mux->out, cap);
+        if (!out)
+        {
+            return -1;
+        }
+        mux->out = out;
+        mux->out_cap = cap;
+    }
+
+    memcpy(mux->out + mux->out_len, &id_net, 4);
+    mux->out[mux->out_len + 4] = type;
+    mux->out[mux->out_len + 5] = flags;
+    memcpy(mux->out + mux->out_len + 6, &len_net, 2);
+    memcpy(mux->out + mux->out_len + SHAM_STREAM_HEADER_SIZE, payload, len);
+    mux->out_len = need;
+    return 0;
+}
+
+// Hand queued frames to the connection as far as its windows allow
+static int sham_mux_flush(struct sham_mux *mux)
+{
+    size_t sent = 0;
+
+    while (sent < mux->out_len)
+    {
+        int n = sham_write(mux->conn, mux->out + sent, mux->out_len - sent);
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                break;
+            }
+            mux->failed = true;
+            return -1;
+        }
+        sent += (size_t)n;
+    }
+    memmove(mux->out, mux->out + sent, mux->out_len - sent);
+    mux->out_len -= sent;
+    return 0;
+}
+
+// Apply a complete frame header (and WINDOW payload)
+static int sham_mux_frame(struct sham_mux *mux)
+{
+    uint32_t id;
+    uint16_t len;
+    uint8_t type = mux->frame[4];
+    uint8_t flags = mux->frame[5];
+    struct sham_stream *stream;
+
+    memcpy(&id, mux->frame, 4);
+    memcpy(&len, mux->frame + 6, 2);
+    id = ntohl(id);
+    len = ntohs(len);
+
+    stream = sham_stream_find(mux, id);
+    if (!stream && type == SHAM_STREAM_DATA && !sham_stream_ours(mux, id) && id > mux->peer_max_id)
+    {
+        // A new stream from the peer; refuse it if we hold too many
+        mux->peer_max_id = id;
+        stream = sham_stream_new(mux, id);
+        if (!stream)
+        {
+            sham_log_warn(mux->conn->log_file, "[STREAM] Refused stream %u\n", id);
+            if (sham_mux_queue(mux, id, SHAM_STREAM_RESET, 0, NULL, 0) < 0)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            sham_log(mux->conn->log_file, "[STREAM] Peer opened stream %u\n", id);
+        }
+    }
+
+    // Frames for a stream already closed here are dropped
+    switch (type)
+    {
+    case SHAM_STREAM_DATA:
+        if (len > SHAM_STREAM_FRAME_MAX || (stream && stream->fin_received))
+        {
+            return -1;
+        }
+        mux->data_stream = stream;
+        mux->data_left = len;
+        mux->data_fin = (flags & SHAM_STREAM_FLAG_FIN) != 0;
+        if (len == 0 && stream)
+        {
+            stream->fin_received = mux->data_fin;
+        }
+        return 0;
+
+    case SHAM_STREAM_WINDOW:
+        if (stream)
+        {
+            uint32_t credit;
+
+            memcpy(&credit, mux->frame + SHAM_STREAM_HEADER_SIZE, 4);
+            stream->credit += ntohl(credit);
+        }
+        return 0;
+
+    case SHAM_STREAM_RESET:
+        if (stream)
+        {
+            sham_log_info(mux->conn->log_file, "[STREAM] Peer reset stream %u\n", id);
+            stream->reset = true;
+        }
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+// Take bytes off the connection: reassemble frame headers and sort the
+// payloads into their streams' receive buffers
+static int sham_mux_input(struct sham_mux *mux, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t need;
+        size_t take;
+
+        if (mux->data_left > 0)
+        {
+            struct sham_stream *stream = mux->data_stream;
+
+            take = (len < mux->data_left) ? len : mux->data_left;
+            if (stream)
+            {
+                size_t tail = (stream->rx_head + stream->rx_len) % SHAM_STREAM_WINDOW_SIZE;
+                size_t first = SHAM_STREAM_WINDOW_SIZE - tail;
+
+                // The peer may not send past the credit we granted
+                if (stream->rx_len + take > SHAM_STREAM_WINDOW_SIZE)
+                {
+                    sham_log_warn(mux->conn->log_file, "[STREAM] Stream %u overran its window\n", stream->id);
+                    return -1;
+                }
+                if (first > take)
+                {
+                    first = take;
+                }
+                memcpy(stream->rx + tail, data, first);
+                memcpy(stream->rx, data + first, take - first);
+                stream->rx_len += take;
+            }
+            data += take;
+            len -= take;
+            mux->data_left -= (uint32_t)take;
+            if (mux->data_left == 0 && stream)
+            {
+                stream->fin_received = mux->data_fin;
+            }
+            continue;
+        }
+
+        // A WINDOW frame's credit is read along with its header
+        need = SHAM_STREAM_HEADER_SIZE;
+        if (mux->frame_len >= SHAM_STREAM_HEADER_SIZE && mux->frame[4] == SHAM_STREAM_WINDOW)
+        {
+            need += 4;
+        }
+        take = (len < need - mux->frame_len) ? len : need - mux->frame_len;
+        memcpy(mux->frame + mux->frame_len, data, take);
+        mux->frame_len += take;
+        data += take;
+        len -= take;
+
+        if (mux->frame_len == SHAM_STREAM_HEADER_SIZE && mux->frame[4] == SHAM_STREAM_WINDOW)
+        {
+            continue;
+        }
+        if (mux->frame_len == need)
+        {
+            mux->frame_len = 0;
+            if (sham_mux_frame(mux) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Frame a connection that agreed on SHAM_OPT_STREAMS. The end that opened
+// the connection passes initiator, so the two never pick the same ID.
+struct sham_mux *sham_mux_create(struct sham_connection *conn, bool initiator)
+{
+    struct sham_mux *mux;
+
+    if (!conn->streams_ok)
+    {
+        errno = EPROTONOSUPPORT;
+        return NULL;
+    }
+
+    mux = calloc(1, sizeof(*mux));
+    if (!mux)
+    {
+        return NULL;
+    }
+    mux->streams = calloc(SHAM_MAX_STREAMS, sizeof(*mux->streams));
+    mux->out_cap = SHAM_STREAM_OUT_BUFFER;
+    mux->out = malloc(mux->out_cap);
+    if (!mux->streams || !mux->out)
+    {
+        sham_mux_free(mux);
+        return NULL;
+    }
+    mux->conn = conn;
+    mux->next_id = initiator ? 1 : 2;
+    return mux;
+}
+
+// Frees the streams; the connection is left to the caller
+void sham_mux_free(struct sham_mux *mux)
+{
+    if (!mux)
+    {
+        return;
+    }
+    while (mux->count > 0)
+    {
+        sham_stream_remove(mux, mux->streams[0]);
+    }
+    free(mux->streams);
+    free(mux->out);
+    free(mux);
+}
+
+// Send queued frames and sort what has arrived into the streams, without
+// waiting. Returns -1 once the connection has failed.
+int sham_mux_service(struct sham_mux *mux)
+{
+    uint8_t buffer[SHAM_STREAM_FRAME_MAX];
+    int reads = SHAM_STREAM_WINDOW_SIZE / SHAM_STREAM_FRAME_MAX * 4; // Bound the work per call
+
+    if (mux->failed || sham_mux_flush(mux) < 0)
+    {
+        return -1;
+    }
+
+    while (!mux->eof && reads-- > 0)
+    {
+        int n = sham_read(mux->conn, buffer, sizeof(buffer));
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                break;
+            }
+            mux->failed = true;
+            return -1;
+        }
+        if (n == 0)
+        {
+            mux->eof = true;
+            break;
+        }
+        if (sham_mux_input(mux, buffer, (size_t)n) < 0)
+        {
+            sham_log_warn(mux->conn->log_file, "[STREAM] Malformed frame from the peer\n");
+            mux->failed = true;
+            errno = EPROTO;
+            return -1;
+        }
+    }
+
+    // Credit and FINs granted while reading
+    return sham_mux_flush(mux);
+}
+
+// Has the peer closed the connection?
+bool sham_mux_eof(const struct sham_mux *mux)
+{
+    return mux->eof;
+}
+
+// Frame bytes still waiting for the connection's send window
+size_t sham_mux_pending(const struct sham_mux *mux)
+{
+    return mux->out_len;
+}
+
+// Open a stream. Returns its ID, or -1 with errno EMFILE if too many are open.
+int sham_stream_open(struct sham_mux *mux)
+{
+    struct sham_stream *stream;
+
+    if (mux->failed || mux->eof)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+    stream = sham_stream_new(mux, mux->next_id);
+    if (!stream)
+    {
+        errno = EMFILE;
+        return -1;
+    }
+    stream->accepted = true;
+    mux->next_id += 2;
+    return (int)stream->id;
+}
+
+// A stream the peer opened that the application has not seen yet. Returns
+// its ID, or -1 with errno EAGAIN when there is none.
+int sham_stream_accept(struct sham_mux *mux)
+{
+    int i;
+
+    for (i = 0; i < mux->count; i++)
+    {
+        if (!mux->streams[i]->accepted)
+        {
+            mux->streams[i]->accepted = true;
+            return (int)mux->streams[i]->id;
+        }
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+// Queue as much of data as the stream's credit and the frame queue allow,
+// in one frame so that writers to different streams take turns. Returns
+// bytes taken, or -1 with errno EAGAIN when nothing fits yet.
+int sham_stream_write(struct sham_mux *mux, uint32_t id, const void *data, size_t len)
+{
+    struct sham_stream *stream = sham_stream_find(mux, id);
+    size_t room;
+
+    if (!stream || stream->fin_sent)
+    {
+        errno = stream ? EPIPE : EBADF;
+        return -1;
+    }
+    if (stream->reset || mux->failed)
+    {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+    if (sham_mux_flush(mux) < 0)
+    {
+        return -1;
+    }
+
+    room = (mux->out_len + SHAM_STREAM_HEADER_SIZE < SHAM_STREAM_OUT_BUFFER)
+               ? SHAM_STREAM_OUT_BUFFER - mux->out_len - SHAM_STREAM_HEADER_SIZE
+               : 0;
+    if (len > room)
+    {
+        len = room;
+    }
+    if (len > stream->credit)
+    {
+        len = stream->credit;
+    }
+    if (len > SHAM_STREAM_FRAME_MAX)
+    {
+        len = SHAM_STREAM_FRAME_MAX;
+    }
+    if (len == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (sham_mux_queue(mux, id, SHAM_STREAM_DATA, 0, data, len) < 0)
+    {
+        return -1;
+    }
+    stream->credit -= (uint32_t)len;
+    if (sham_mux_flush(mux) < 0)
+    {
+        return -1;
+    }
+    return (int)len;
+}
+
+// Copy out what the stream has received. Returns bytes read, 0 once the
+// peer's FIN is reached, or -1 with errno EAGAIN when nothing is ready, or
+// ECONNRESET if the peer reset the stream or closed the connection first.
+int sham_stream_read(struct sham_mux *mux, uint32_t id, void *buffer, size_t len)
+{
+    struct sham_stream *stream = sham_stream_find(mux, id);
+    size_t first;
+
+    if (!stream)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (stream->rx_len == 0)
+    {
+        if (stream->fin_received)
+        {
+            return 0;
+        }
+        errno = (stream->reset || mux->eof || mux->failed) ? ECONNRESET : EAGAIN;
+        return -1;
+    }
+
+    if (len > stream->rx_len)
+    {
+        len = stream->rx_len;
+    }
+    first = SHAM_STREAM_WINDOW_SIZE - stream->rx_head;
+    if (first > len)
+    {
+        first = len;
+    }
+    memcpy(buffer, stream->rx + stream->rx_head, first);
+    memcpy((uint8_t *)buffer + first, stream->rx, len - first);
+    stream->rx_head = (stream->rx_head + len) % SHAM_STREAM_WINDOW_SIZE;
+    stream->rx_len -= len;
+
+    // Grant the room back once half the buffer is free, unless nothing more is coming
+    stream->consumed += (uint32_t)len;
+    if (stream->consumed >= SHAM_STREAM_WINDOW_SIZE / 2 && !stream->fin_received && !stream->reset)
+    {
+        uint32_t credit = htonl(stream->consumed);
+
+        if (sham_mux_queue(mux, id, SHAM_STREAM_WINDOW, 0, &credit, sizeof(credit)) < 0)
+        {
+            return -1;
+        }
+        stream->consumed = 0;
+    }
+    return (int)len;
+}
+
+// Would sham_stream_read return something other than EAGAIN?
+bool sham_stream_readable(const struct sham_mux *mux, uint32_t id)
+{
+    const struct sham_stream *stream = sham_stream_find(mux, id);
+
+    return !stream || stream->rx_len > 0 || stream->fin_received || stream->reset || mux->eof || mux->failed;
+}
+
+// End our side of the stream once the data written so far has gone; the
+// peer may still send
+int sham_stream_shutdown(struct sham_mux *mux, uint32_t id)
+{
+    struct sham_stream *stream = sham_stream_find(mux, id);
+
+    if (!stream)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (stream->fin_sent || stream->reset)
+    {
+        return 0;
+    }
+    if (sham_mux_queue(mux, id, SHAM_STREAM_DATA, SHAM_STREAM_FLAG_FIN, NULL, 0) < 0)
+    {
+        return -1;
+    }
+    stream->fin_sent = true;
+    return sham_mux_flush(mux);
+}
+
+// Done with the stream. It ends with a FIN if the peer has finished too, and
+// is reset otherwise, so the peer stops sending what nobody will read.
+int sham_stream_close(struct sham_mux *mux, uint32_t id)
+{
+    struct sham_stream *stream = sham_stream_find(mux, id);
+    int result = 0;
+
+    if (!stream)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (!stream->reset)
+    {
+        if (stream->fin_received)
+        {
+            result = sham_stream_shutdown(mux, id);
+        }
+        else if (sham_mux_queue(mux, id, SHAM_STREAM_RESET, 0, NULL, 0) < 0 || sham_mux_flush(mux) < 0)
+        {
+            result = -1;
+        }
+    }
+    sham_stream_remove(mux, stream);
+    return result;
+}
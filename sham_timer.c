@@ -0,0 +1,114 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+
+// Deadline min-heap. Entries are never removed early: owners validate a
+// popped entry against their own state and drop it if it went stale.
+
+#define SHAM_TIMER_INITIAL_CAPACITY 16
+
+// Monotonic clock in microseconds; unaffected by wall-clock adjustments
+uint64_t sham_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static void sham_timer_swap(struct sham_timer *a, struct sham_timer *b)
+{
+    struct sham_timer tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+int sham_timer_push(struct sham_timer_heap *heap, uint64_t deadline_us, int slot, uint32_t seq)
+{
+    int i;
+
+    if (heap->count == heap->capacity)
+    {
+        int capacity = heap->capacity ? heap->capacity * 2 : SHAM_TIMER_INITIAL_CAPACITY;
+        struct sham_timer *items = realloc(heap->items, (size_t)capacity * sizeof(*items));
+        if (!items)
+        {
+            return -1;
+        }
+        heap->items = items;
+        heap->capacity = capacity;
+    }
+
+    i = heap->count++;
+    heap->items[i].deadline_us = deadline_us;
+    heap->items[i].slot = slot;
+    heap->items[i].seq = seq;
+
+    // Sift up
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (heap->items[parent].deadline_us <= heap->items[i].deadline_us)
+        {
+            break;
+        }
+        sham_timer_swap(&heap->items[parent], &heap->items[i]);
+        i = parent;
+    }
+
+    return 0;
+}
+
+const struct sham_timer *sham_timer_peek(const struct sham_timer_heap *heap)
+{
+    return heap->count > 0 ? &heap->items[0] : NULL;
+}
+
+void sham_timer_pop(struct sham_timer_heap *heap)
+{
+    int i = 0;
+
+    if (heap->count == 0)
+    {
+        return;
+    }
+
+    heap->items[0] = heap->items[--heap->count];
+
+    // Sift down
+    while (1)
+    {
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int smallest = i;
+
+        if (left < heap->count && heap->items[left].deadline_us < heap->items[smallest].deadline_us)
+        {
+            smallest = left;
+        }
+        if (right < heap->count && heap->items[right].deadline_us < heap->items[smallest].deadline_us)
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            break;
+        }
+        sham_timer_swap(&heap->items[i], &heap->items[smallest]);
+        i = smallest;
+    }
+}
+
+void sham_timer_clear(struct sham_timer_heap *heap)
+{
+    heap->count = 0;
+}
+
+void sham_timer_free(struct sham_timer_heap *heap)
+{
+    free(heap->items);
+    heap->items = NULL;
+    heap->count = 0;
+    heap->capacity = 0;
+}
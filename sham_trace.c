@@ -0,0 +1,252 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "sham.h"
+#include <pthread.h>
+
+// Verbose packet trace (RUDP_LOG=1). Recording an event only stamps the
+// time and copies a few integers into a fixed-size ring; a background
+// thread turns them into the text lines of the evaluation log, in the
+// order they were recorded. Producers never block or take a lock: each
+// claims a slot with a compare-and-swap and publishes it with a per-slot
+// sequence number (a bounded MPMC queue after Vyukov). A full ring drops
+// events and the writer reports how many.
+
+#define SHAM_TRACE_SLOTS 65536       // Power of two
+#define SHAM_TRACE_DRAIN_US 2000     // Writer sleep between drains
+
+struct sham_trace_slot
+{
+    uint64_t seq; // Slot index when free, index + 1 once an event is in it
+    uint64_t time_us;
+    FILE *file;
+    uint32_t a;
+    uint32_t b;
+    uint16_t event;
+};
+
+static const char *const sham_trace_formats[SHAM_TRACE_EVENTS] = {
+    [SHAM_TRACE_DROP_DATA] = "DROP DATA SEQ=%u\n",
+    [SHAM_TRACE_SND_ACK_WIN] = "SND ACK=%u WIN=%u\n",
+    [SHAM_TRACE_SND_ACK] = "SND ACK=%u\n",
+    [SHAM_TRACE_SND_SYN] = "SND SYN SEQ=%u\n",
+    [SHAM_TRACE_RCV_SYN] = "RCV SYN SEQ=%u\n",
+    [SHAM_TRACE_SND_SYN_ACK] = "SND SYN-ACK SEQ=%u ACK=%u\n",
+    [SHAM_TRACE_RCV_SYN_ACK] = "RCV SYN-ACK SEQ=%u ACK=%u\n",
+    [SHAM_TRACE_RCV_ACK_FOR_SYN] = "RCV ACK FOR SYN\n",
+    [SHAM_TRACE_SND_DATA] = "SND DATA SEQ=%u LEN=%u\n",
+    [SHAM_TRACE_RCV_DATA] = "RCV DATA SEQ=%u LEN=%u\n",
+    [SHAM_TRACE_RCV_ACK] = "RCV ACK=%u\n",
+    [SHAM_TRACE_FAST_RETX] = "FAST RETX SEQ=%u DUPACKS=%u\n",
+    [SHAM_TRACE_RETX_DATA] = "RETX DATA SEQ=%u LEN=%u\n",
+    [SHAM_TRACE_TIMEOUT] = "TIMEOUT SEQ=%u\n",
+    [SHAM_TRACE_SND_FIN] = "SND FIN SEQ=%u\n",
+    [SHAM_TRACE_RCV_FIN] = "RCV FIN SEQ=%u\n",
+    [SHAM_TRACE_SND_ACK_FOR_FIN] = "SND ACK FOR FIN\n",
+    [SHAM_TRACE_FLOW_WIN_UPDATE] = "FLOW WIN UPDATE=%u\n",
+    [SHAM_TRACE_PMTU_MSS] = "PMTU MSS=%u\n",
+    [SHAM_TRACE_PMTU_PROBE] = "PMTU PROBE SIZE=%u\n",
+    [SHAM_TRACE_PMTU_PROBE_FAILED] = "PMTU PROBE FAILED SIZE=%u\n",
+    [SHAM_TRACE_RCV_PROBE] = "RCV PROBE SIZE=%u\n",
+    [SHAM_TRACE_RETX_SYN] = "RETX SYN SEQ=%u\n",
+    [SHAM_TRACE_RETX_SYN_ACK] = "RETX SYN-ACK SEQ=%u ACK=%u\n",
+    [SHAM_TRACE_RETX_FIN] = "RETX FIN SEQ=%u\n",
+};
+
+static struct sham_trace_slot *sham_trace_ring;
+static uint64_t sham_trace_head; // Next slot to claim
+static uint64_t sham_trace_tail; // Next slot to write out; under sham_trace_lock
+static uint64_t sham_trace_dropped;
+static pthread_mutex_t sham_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t sham_trace_once = PTHREAD_ONCE_INIT;
+
+void sham_trace(struct sham_connection *conn, int event, uint32_t a, uint32_t b)
+{
+    struct sham_trace_slot *slot;
+    struct timespec ts;
+    uint64_t pos;
+
+    if (!conn || !conn->verbose_log_file || !sham_trace_ring)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    pos = __atomic_load_n(&sham_trace_head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        int64_t diff;
+
+        slot = &sham_trace_ring[pos & (SHAM_TRACE_SLOTS - 1)];
+        diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&sham_trace_head, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            __atomic_fetch_add(&sham_trace_dropped, 1, __ATOMIC_RELAXED); // Writer is a lap behind
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&sham_trace_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->time_us = (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+    slot->file = conn->verbose_log_file;
+    slot->a = a;
+    slot->b = b;
+    slot->event = (uint16_t)event;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Write out every event recorded so far. Returns how many.
+static int sham_trace_drain(void)
+{
+    time_t last_sec = (time_t)-1;
+    char time_buffer[30] = "";
+    FILE *last_file = NULL;
+    uint64_t dropped;
+    int written = 0;
+
+    pthread_mutex_lock(&sham_trace_lock);
+    for (;;)
+    {
+        struct sham_trace_slot *slot = &sham_trace_ring[sham_trace_tail & (SHAM_TRACE_SLOTS - 1)];
+        time_t sec;
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != sham_trace_tail + 1)
+        {
+            break;
+        }
+
+        // Events come in time order, so the date is formatted once a second
+        sec = (time_t)(slot->time_us / 1000000);
+        if (sec != last_sec)
+        {
+            struct tm tm;
+            strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", localtime_r(&sec, &tm));
+            last_sec = sec;
+        }
+        if (last_file && slot->file != last_file)
+        {
+            fflush(last_file);
+        }
+        fprintf(slot->file, "[%s.%06ld] [LOG] ", time_buffer, (long)(slot->time_us % 1000000));
+        fprintf(slot->file, sham_trace_formats[slot->event], slot->a, slot->b);
+        last_file = slot->file;
+
+        __atomic_store_n(&slot->seq, sham_trace_tail + SHAM_TRACE_SLOTS, __ATOMIC_RELEASE);
+        sham_trace_tail++;
+        written++;
+    }
+
+    dropped = __atomic_exchange_n(&sham_trace_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0 && last_file)
+    {
+        fprintf(last_file, "[%s] [LOG] TRACE DROPPED %llu EVENTS\n", time_buffer, (unsigned long long)dropped);
+    }
+    else if (dropped > 0)
+    {
+        __atomic_fetch_add(&sham_trace_dropped, dropped, __ATOMIC_RELAXED); // Report with the next event
+    }
+    if (last_file)
+    {
+        fflush(last_file);
+    }
+    pthread_mutex_unlock(&sham_trace_lock);
+    return written;
+}
+
+static void *sham_trace_writer(void *arg)
+{
+    struct timespec pause = {0, SHAM_TRACE_DRAIN_US * 1000L};
+
+    (void)arg;
+    for (;;)
+    {
+        if (sham_trace_drain() == 0)
+        {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+static void sham_trace_atexit(void)
+{
+    sham_trace_drain();
+}
+
+static void sham_trace_init(void)
+{
+    struct sham_trace_slot *ring = calloc(SHAM_TRACE_SLOTS, sizeof(*ring));
+    pthread_attr_t attr;
+    pthread_t thread;
+    uint64_t i;
+
+    if (!ring)
+    {
+        return;
+    }
+    for (i = 0; i < SHAM_TRACE_SLOTS; i++)
+    {
+        ring[i].seq = i;
+    }
+    sham_trace_ring = ring;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, sham_trace_writer, NULL) != 0)
+    {
+        sham_trace_ring = NULL;
+        free(ring);
+    }
+    else
+    {
+        atexit(sham_trace_atexit);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Open the evaluation log for a role ("client", "server") when RUDP_LOG=1,
+// starting the trace writer on first use; NULL when logging is off
+FILE *sham_open_verbose_log(const char *role)
+{
+    char filename[256];
+    FILE *file;
+
+    if (!sham_is_verbose_logging_enabled())
+    {
+        return NULL;
+    }
+
+    pthread_once(&sham_trace_once, sham_trace_init);
+    if (!sham_trace_ring)
+    {
+        return NULL;
+    }
+    snprintf(filename, sizeof(filename), "%s_log.txt", role);
+    file = fopen(filename, "w");
+    return file;
+}
+
+// Write out the events still in the ring, then close the log
+void sham_close_verbose_log(FILE *file)
+{
+    if (!file)
+    {
+        return;
+    }
+    if (sham_trace_ring)
+    {
+        sham_trace_drain();
+    }
+    fclose(file);
+}